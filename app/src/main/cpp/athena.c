@@ -20,16 +20,60 @@
 #include "athena.h"
 
 int loglevel = ANDROID_LOG_WARN;
-static int current_tun_fd = -1;  // Global TUN file descriptor
-
-
-
-jclass clsPacket;
-jclass clsRR;
+JavaVM *jvm; // workers attach their threads
+
+
+
+// Resolved once in JNI_OnLoad, the class reference keeps the method IDs valid
+jclass clsTunnelManager;
+jclass clsString; // the element class of the names passed with a batch
+jmethodID midTcpPacketReceived;
+jmethodID midUdpPacketReceived;
+jmethodID midIcmpPacketReceived;
+jmethodID midPacketReceived; // optional
+jmethodID midGetUidQ; // optional
+jmethodID midFlowsReceived; // optional
+
+static jmethodID get_packet_method(JNIEnv *env, const char *name, const char *signature, int optional) {
+    jmethodID mid = (*env)->GetMethodID(env, clsTunnelManager, name, signature);
+    if ((*env)->ExceptionCheck(env))
+        (*env)->ExceptionClear(env);
+    if (mid == NULL && !optional)
+        log_android(ANDROID_LOG_ERROR, "Method %s%s not found", name, signature);
+    return mid;
+}
 
 jint JNI_OnLoad(JavaVM *vm, void *reserved) {
     JNIEnv *env;
     if ((*vm)->GetEnv(vm, (void **) &env, JNI_VERSION_1_6) != JNI_OK) return -1;
+    jvm = vm;
+
+    jclass cls = (*env)->FindClass(env, "com/kin/athena/service/vpn/service/TunnelManager");
+    if (cls == NULL) {
+        // Filter callbacks are skipped and packets allowed
+        (*env)->ExceptionClear(env);
+        log_android(ANDROID_LOG_ERROR, "TunnelManager class not found");
+    } else {
+        clsTunnelManager = (jclass) (*env)->NewGlobalRef(env, cls);
+        (*env)->DeleteLocalRef(env, cls);
+
+        midTcpPacketReceived = get_packet_method(env, "onTcpPacketReceived", "(IILjava/lang/String;)Z", 0);
+        midUdpPacketReceived = get_packet_method(env, "onUdpPacketReceived", "(IILjava/lang/String;)Z", 0);
+        midIcmpPacketReceived = get_packet_method(env, "onIcmpPacketReceived", "(II)Z", 0);
+        midPacketReceived = get_packet_method(env, "onPacketReceived", "(II)V", 1);
+        midGetUidQ = get_packet_method(env, "getUidQ", "(IILjava/lang/String;ILjava/lang/String;I)I", 1);
+        midFlowsReceived = get_packet_method(env, "onFlowsReceived", "(I[I[Ljava/lang/String;[Z)V", 1);
+    }
+
+    cls = (*env)->FindClass(env, "java/lang/String");
+    if (cls == NULL)
+        (*env)->ExceptionClear(env);
+    else {
+        clsString = (jclass) (*env)->NewGlobalRef(env, cls);
+        (*env)->DeleteLocalRef(env, cls);
+    }
+
+    checksum_init();
 
     struct rlimit rlim;
 
@@ -44,8 +88,10 @@ jint JNI_OnLoad(JavaVM *vm, void *reserved) {
 void JNI_OnUnload(JavaVM *vm, void *reserved) {
     JNIEnv *env;
     if ((*vm)->GetEnv(vm, (void **) &env, JNI_VERSION_1_6) == JNI_OK) {
-        (*env)->DeleteGlobalRef(env, clsPacket);
-        (*env)->DeleteGlobalRef(env, clsRR);
+        if (clsTunnelManager != NULL)
+            (*env)->DeleteGlobalRef(env, clsTunnelManager);
+        if (clsString != NULL)
+            (*env)->DeleteGlobalRef(env, clsString);
     }
 }
 
@@ -53,19 +99,47 @@ JNIEXPORT jlong JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jn
     struct context *ctx = ng_calloc(1, sizeof(struct context), "init");
     ctx->sdk = sdk;
     if (pthread_mutex_init(&ctx->lock, NULL)) log_android(ANDROID_LOG_ERROR, "pthread_mutex_init failed");
+    if (pthread_rwlock_init(&ctx->rule_lock, NULL)) log_android(ANDROID_LOG_ERROR, "pthread_rwlock_init failed");
+    ctx->rule_state = RULE_NET_WIFI;
+    ctx->rule_generation = 1;
     if (pipe(ctx->pipefds)) log_android(ANDROID_LOG_ERROR, "Create pipe error %d: %s", errno, strerror(errno));
+    // Control calls never block on a loop that is not reading
+    else if (fcntl(ctx->pipefds[1], F_SETFL, fcntl(ctx->pipefds[1], F_GETFL) | O_NONBLOCK))
+        log_android(ANDROID_LOG_ERROR, "Pipe fcntl error %d: %s", errno, strerror(errno));
+    if (pthread_mutex_init(&ctx->java_lock, NULL)) log_android(ANDROID_LOG_ERROR, "pthread_mutex_init failed");
+    if (pthread_mutex_init(&ctx->uid_lock, NULL)) log_android(ANDROID_LOG_ERROR, "pthread_mutex_init failed");
+    for (int i = 0; i < WORKERS_MAX; i++) {
+        struct worker *w = &ctx->workers[i];
+        w->index = i;
+        w->epoll_fd = -1;
+        w->wake_fd = -1;
+        if (pthread_mutex_init(&w->lock, NULL)) log_android(ANDROID_LOG_ERROR, "pthread_mutex_init failed");
+        if (pthread_mutex_init(&w->traffic.lock, NULL)) log_android(ANDROID_LOG_ERROR, "pthread_mutex_init failed");
+        flow_init(&w->flows);
+        timer_init(&w->timers, time(NULL));
+        slab_init(&w->session_slab, sizeof(struct ng_session), SLAB_SESSIONS, "sessions");
+        slab_init(&w->segment_slab, sizeof(struct segment), SLAB_SEGMENTS, "segments");
+    }
+    ctx->worker_count = 1;
+    dns_mux_init(ctx);
+    inet_pton(AF_INET, DNS_FALLBACK_V4, &ctx->dns_server_v4);
+    inet_pton(AF_INET6, DNS_FALLBACK_V6, &ctx->dns_server_v6);
+    ctx->uid_socket = -1;
     return (jlong) ctx;
 }
 
-JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1start(JNIEnv *env, jobject instance, jlong context, jint loglevel_) {
+JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1start(JNIEnv *env, jobject instance, jlong context, jint loglevel_, jint workers) {
 struct context *ctx = (struct context *) context;
 loglevel = loglevel_;
+ctx->worker_count = (workers < 1 ? 1 : workers > WORKERS_MAX ? WORKERS_MAX : workers);
+if (ctx->worker_count != workers)
+    log_android(ANDROID_LOG_INFO, "Requested %d workers, using %d", workers, ctx->worker_count);
 ctx->stopping = 0;
+log_android(ANDROID_LOG_INFO, "Starting with %d workers", ctx->worker_count);
 }
 
 JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1run(JNIEnv *env, jobject instance, jlong context, jint tun, jboolean fwd53, jint rcode) {
 struct context *ctx = (struct context *) context;
-current_tun_fd = tun;  // Store TUN file descriptor globally
 struct arguments *args = ng_malloc(sizeof(struct arguments), "arguments");
 args->env = env;
 args->instance = instance;
@@ -73,6 +147,7 @@ args->tun = tun;
 args->fwd53 = fwd53;
 args->rcode = rcode;
 args->ctx = ctx;
+args->worker = NULL;
 handle_events(args);
 }
 
@@ -88,8 +163,29 @@ JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni
     struct context *ctx = (struct context *) context;
     if (ctx == NULL) return;
     
+    free_commands(ctx);
+    inject_free(ctx);
     clear(ctx);
+    for (int i = 0; i < WORKERS_MAX; i++) {
+        struct worker *w = &ctx->workers[i];
+        flow_free(&w->flows);
+        slab_destroy(&w->session_slab);
+        slab_destroy(&w->segment_slab);
+        traffic_free(w);
+        pthread_mutex_destroy(&w->traffic.lock);
+        pthread_mutex_destroy(&w->lock);
+    }
+    ng_pool_drain();
+    rule_free(ctx);
+    domain_free(ctx);
+    uid_free(ctx);
+    pthread_mutex_destroy(&ctx->uid_lock);
+    pthread_rwlock_destroy(&ctx->rule_lock);
+    if (ctx->packet_buffer != NULL)
+        (*env)->DeleteGlobalRef(env, ctx->packet_buffer);
     
+    pthread_mutex_destroy(&ctx->java_lock);
+
     // Only destroy mutex if it was initialized
     if (pthread_mutex_destroy(&ctx->lock) != 0) {
         // Mutex was already destroyed or not initialized, continue cleanup
@@ -119,23 +215,13 @@ JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni
     struct context *ctx = (struct context *) context;
     if (ctx == NULL) return;
 
-    // Lock the context to prevent race conditions during session clearing
-    if (pthread_mutex_lock(&ctx->lock) != 0) {
-        log_android(ANDROID_LOG_ERROR, "Failed to lock context for session clearing");
+    // The event loop clears between rounds, the caller does not wait for it
+    struct command *cmd = ng_malloc(sizeof(struct command), "command");
+    if (cmd == NULL)
         return;
-    }
-
+    cmd->type = COMMAND_CLEAR;
+    command_push(ctx, cmd);
     log_android(ANDROID_LOG_INFO, "Clearing all active sessions");
-
-    // Clear all sessions
-    clear(ctx);
-
-    log_android(ANDROID_LOG_INFO, "All sessions cleared successfully");
-
-    // Unlock the context
-    if (pthread_mutex_unlock(&ctx->lock) != 0) {
-        log_android(ANDROID_LOG_ERROR, "Failed to unlock context after session clearing");
-    }
 }
 
 JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1set_1dns_1servers(JNIEnv *env, jobject instance, jlong context, jstring dnsV4, jstring dnsV6) {
@@ -144,23 +230,154 @@ JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni
     struct context *ctx = (struct context *) context;
     if (ctx == NULL) return;
 
+    struct command *cmd = ng_malloc(sizeof(struct command), "command");
+    if (cmd == NULL)
+        return;
+    cmd->type = COMMAND_DNS;
+
     // Get UTF strings from Java
     const char *dns_v4_str = (*env)->GetStringUTFChars(env, dnsV4, 0);
     const char *dns_v6_str = (*env)->GetStringUTFChars(env, dnsV6, 0);
 
-    if (dns_v4_str != NULL) {
-        strncpy(ctx->dns_server_v4, dns_v4_str, INET_ADDRSTRLEN - 1);
-        ctx->dns_server_v4[INET_ADDRSTRLEN - 1] = '\0';
-        log_android(ANDROID_LOG_INFO, "DNS IPv4 server set to: %s", ctx->dns_server_v4);
-        (*env)->ReleaseStringUTFChars(env, dnsV4, dns_v4_str);
+    // Parsed once, redirected queries and the upstream sockets use the addresses
+    if (dns_v4_str != NULL && inet_pton(AF_INET, dns_v4_str, &cmd->dns_v4) == 1)
+        log_android(ANDROID_LOG_INFO, "DNS IPv4 server set to: %s", dns_v4_str);
+    else {
+        inet_pton(AF_INET, DNS_FALLBACK_V4, &cmd->dns_v4);
+        log_android(ANDROID_LOG_WARN, "Failed to parse DNS IPv4 %s, using fallback: %s",
+                    dns_v4_str == NULL ? "null" : dns_v4_str, DNS_FALLBACK_V4);
     }
+    if (dns_v4_str != NULL)
+        (*env)->ReleaseStringUTFChars(env, dnsV4, dns_v4_str);
 
-    if (dns_v6_str != NULL) {
-        strncpy(ctx->dns_server_v6, dns_v6_str, INET6_ADDRSTRLEN - 1);
-        ctx->dns_server_v6[INET6_ADDRSTRLEN - 1] = '\0';
-        log_android(ANDROID_LOG_INFO, "DNS IPv6 server set to: %s", ctx->dns_server_v6);
+    if (dns_v6_str != NULL && inet_pton(AF_INET6, dns_v6_str, &cmd->dns_v6) == 1)
+        log_android(ANDROID_LOG_INFO, "DNS IPv6 server set to: %s", dns_v6_str);
+    else {
+        inet_pton(AF_INET6, DNS_FALLBACK_V6, &cmd->dns_v6);
+        log_android(ANDROID_LOG_WARN, "Failed to parse DNS IPv6 %s, using fallback: %s",
+                    dns_v6_str == NULL ? "null" : dns_v6_str, DNS_FALLBACK_V6);
+    }
+    if (dns_v6_str != NULL)
         (*env)->ReleaseStringUTFChars(env, dnsV6, dns_v6_str);
+
+    // Applied by the event loop, with the cache and upstream sockets of the previous servers
+    command_push(ctx, cmd);
+}
+
+JNIEXPORT jlongArray JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1get_1dns_1cache_1stats(JNIEnv *env, jobject instance, jlong context) {
+    if (context == 0) return NULL;
+
+    struct context *ctx = (struct context *) context;
+    struct dns_cache_stats stats;
+    if (pthread_mutex_lock(&ctx->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    dns_cache_get_stats(ctx, &stats);
+    if (pthread_mutex_unlock(&ctx->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+
+    // Layout must match DnsCacheStats.kt
+    jlong values[6] = {
+            (jlong) stats.hits, (jlong) stats.misses, (jlong) stats.stored,
+            (jlong) stats.evicted, (jlong) stats.entries, (jlong) stats.bytes
+    };
+    jlongArray result = (*env)->NewLongArray(env, 6);
+    if (result != NULL)
+        (*env)->SetLongArrayRegion(env, result, 0, 6, values);
+    return result;
+}
+
+JNIEXPORT jlongArray JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1get_1traffic_1stats(JNIEnv *env, jobject instance, jlong context) {
+    if (context == 0) return NULL;
+
+    struct context *ctx = (struct context *) context;
+    struct traffic_entry *entries;
+    int count = traffic_snapshot(ctx, &entries);
+    if (count < 0)
+        return NULL;
+
+    // Layout must match AppTrafficStats.kt
+    jlongArray result = (*env)->NewLongArray(env, count * TRAFFIC_STRIDE);
+    if (result != NULL)
+        for (int i = 0; i < count; i++) {
+            const struct traffic_entry *e = &entries[i];
+            jlong values[TRAFFIC_STRIDE] = {
+                    (jlong) e->uid, (jlong) e->traffic.sent_bytes, (jlong) e->traffic.received_bytes,
+                    (jlong) e->traffic.sent_packets, (jlong) e->traffic.received_packets,
+                    (jlong) e->flows, (jlong) e->blocked
+            };
+            (*env)->SetLongArrayRegion(env, result, i * TRAFFIC_STRIDE, TRAFFIC_STRIDE, values);
+        }
+    ng_free(entries, __FILE__, __LINE__);
+    return result;
+}
+
+JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1set_1packet_1buffer(JNIEnv *env, jobject instance, jlong context, jobject buffer) {
+    if (context == 0) return;
+
+    struct context *ctx = (struct context *) context;
+
+    uint8_t *data = (*env)->GetDirectBufferAddress(env, buffer);
+    jlong capacity = (*env)->GetDirectBufferCapacity(env, buffer);
+    if (data == NULL || capacity <= 0) {
+        log_android(ANDROID_LOG_ERROR, "Packet buffer is not a direct buffer");
+        return;
+    }
+
+    if (ctx->packet_buffer != NULL)
+        (*env)->DeleteGlobalRef(env, ctx->packet_buffer);
+    ctx->packet_buffer = (*env)->NewGlobalRef(env, buffer);
+    ctx->packet_data = data;
+    ctx->packet_capacity = (size_t) capacity;
+}
+
+JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1set_1rules(JNIEnv *env, jobject instance, jlong context, jintArray rules, jint flags) {
+    if (context == 0) return;
+
+    struct context *ctx = (struct context *) context;
+
+    jsize length = (*env)->GetArrayLength(env, rules);
+    if (length % RULE_STRIDE) {
+        log_android(ANDROID_LOG_ERROR, "Rules length %d invalid", length);
+        return;
     }
+
+    jint *data = (*env)->GetIntArrayElements(env, rules, NULL);
+    if (data == NULL)
+        return;
+
+    struct rule_table *table = rule_compile(data, (size_t) (length / RULE_STRIDE), flags);
+    (*env)->ReleaseIntArrayElements(env, rules, data, JNI_ABORT);
+
+    // Keep the previous table when compiling failed, Java still decides unknown cases
+    if (table != NULL)
+        rule_set(ctx, table);
+}
+
+JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1set_1rule_1state(JNIEnv *env, jobject instance, jlong context, jint state) {
+    if (context == 0) return;
+
+    struct context *ctx = (struct context *) context;
+    rule_set_state(ctx, state);
+}
+
+JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1invalidate_1verdicts(JNIEnv *env, jobject instance, jlong context) {
+    if (context == 0) return;
+
+    struct context *ctx = (struct context *) context;
+    rule_invalidate(ctx);
+}
+
+JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1set_1domains(JNIEnv *env, jobject instance, jlong context, jint list, jstring path_) {
+    if (context == 0) return;
+
+    struct context *ctx = (struct context *) context;
+
+    // No path is an empty list; a list that cannot be mapped leaves the names to Java
+    const char *path = (path_ == NULL ? NULL : (*env)->GetStringUTFChars(env, path_, NULL));
+    struct domain_table *table = domain_open(path);
+    if (path != NULL)
+        (*env)->ReleaseStringUTFChars(env, path_, path);
+    domain_set(ctx, list, table);
 }
 
 JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1send_1complete_1packet(JNIEnv *env, jobject instance, jlong context, jbyteArray packetData) {
@@ -169,41 +386,44 @@ JNIEXPORT void JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni
     struct context *ctx = (struct context *) context;
     if (ctx == NULL) return;
 
-    // Get complete packet data from Java byte array
-    jbyte *packet_bytes = (*env)->GetByteArrayElements(env, packetData, NULL);
-    jsize packet_length = (*env)->GetArrayLength(env, packetData);
-    
-    if (packet_bytes == NULL || packet_length <= 0) {
-        log_android(ANDROID_LOG_ERROR, "Complete packet: Invalid packet data");
+    jsize length = (*env)->GetArrayLength(env, packetData);
+    if (length <= 0 || length > get_mtu()) {
+        log_android(ANDROID_LOG_ERROR, "Complete packet: invalid length %d", length);
         return;
     }
 
-    // Log the complete packet details
-    log_android(ANDROID_LOG_DEBUG, "Complete packet details:");
-    log_android(ANDROID_LOG_DEBUG, "  Packet size: %zd bytes", (size_t) packet_length);
-    log_android(ANDROID_LOG_DEBUG, "  TUN fd: %d", current_tun_fd);
-    
-    // Log first 64 bytes of complete packet in hex
-    char hex_buffer[512];
-    int hex_len = 0;
-    int bytes_to_log = packet_length < 64 ? packet_length : 64;
-    for (int i = 0; i < bytes_to_log; i++) {
-        hex_len += snprintf(hex_buffer + hex_len, sizeof(hex_buffer) - hex_len, 
-                           "%02x ", (unsigned char)packet_bytes[i]);
+    // Copied for the event loop, which writes it to the tun between rounds
+    struct command *cmd = ng_malloc(sizeof(struct command) + (size_t) length, "inject");
+    if (cmd == NULL)
+        return;
+    cmd->type = COMMAND_INJECT;
+    cmd->length = (size_t) length;
+    (*env)->GetByteArrayRegion(env, packetData, 0, length, (jbyte *) cmd->data);
+    if ((*env)->ExceptionCheck(env)) {
+        (*env)->ExceptionClear(env);
+        ng_free(cmd, __FILE__, __LINE__);
+        return;
     }
-    log_android(ANDROID_LOG_DEBUG, "  Packet data (first %d bytes): %s", bytes_to_log, hex_buffer);
 
-    // Write complete packet directly to TUN interface
-    ssize_t written = write(current_tun_fd, packet_bytes, packet_length);
-    
-    if (written > 0) {
-        log_android(ANDROID_LOG_DEBUG, "Complete packet sent successfully: %zd bytes written to TUN interface", written);
-    } else {
-        log_android(ANDROID_LOG_ERROR, "Failed to send complete packet: %zd (TUN fd: %d, errno: %d)", written, current_tun_fd, errno);
-    }
+    log_android(ANDROID_LOG_DEBUG, "Complete packet of %d bytes queued", length);
+    command_push(ctx, cmd);
+}
+
+JNIEXPORT jobject JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1get_1inject_1buffer(JNIEnv *env, jobject instance, jlong context) {
+    if (context == 0) return NULL;
+
+    struct context *ctx = (struct context *) context;
+    uint8_t *data = inject_buffer(ctx);
+    if (data == NULL)
+        return NULL;
+    return (*env)->NewDirectByteBuffer(env, data, INJECT_RING_BYTES);
+}
 
-    // Release Java byte array
-    (*env)->ReleaseByteArrayElements(env, packetData, packet_bytes, JNI_ABORT);
+JNIEXPORT jint JNICALL Java_com_kin_athena_service_vpn_service_TunnelManager_jni_1inject(JNIEnv *env, jobject instance, jlong context, jint head) {
+    if (context == 0) return head;
+
+    struct context *ctx = (struct context *) context;
+    return (jint) inject_publish(ctx, (uint32_t) head);
 }
 
 void ng_delete_alloc(void *ptr, const char *file, int line) {
@@ -236,160 +456,188 @@ void ng_delete_alloc(void *ptr, const char *file, int line) {
 #endif
 }
 
-void log_packet_hex(const struct arguments *args, const uint8_t *data, size_t length, const char *direction) {
-    if (args == NULL || args->env == NULL || args->instance == NULL || data == NULL) {
-        return;
-    }
-    
-    JNIEnv *env = args->env;
-    
-    jclass cls = (*env)->GetObjectClass(env, args->instance);
-    if (cls == NULL) return;
-    
-    jmethodID methodID = (*env)->GetMethodID(env, cls, "onPacketReceived", "([BILjava/lang/String;)V");
-    if (methodID == NULL) {
-        (*env)->DeleteLocalRef(env, cls);
-        return;
-    }
-    
-    jbyteArray dataArray = (*env)->NewByteArray(env, (jsize)length);
-    if (dataArray == NULL) {
-        (*env)->DeleteLocalRef(env, cls);
-        return;
-    }
-    
-    (*env)->SetByteArrayRegion(env, dataArray, 0, (jsize)length, (const jbyte*)data);
-    
-    jstring directionStr = (*env)->NewStringUTF(env, direction);
-    if (directionStr == NULL) {
-        (*env)->DeleteLocalRef(env, dataArray);
-        (*env)->DeleteLocalRef(env, cls);
-        return;
-    }
-    
-    (*env)->CallVoidMethod(env, args->instance, methodID, dataArray, (jint)length, directionStr);
-    
-    (*env)->DeleteLocalRef(env, dataArray);
-    (*env)->DeleteLocalRef(env, directionStr);
-    (*env)->DeleteLocalRef(env, cls);
-}
-
-jboolean filter_tcp_packet(const struct arguments *args, const uint8_t *data, size_t length, const char *direction) {
-    if (args == NULL || args->env == NULL || args->instance == NULL || data == NULL) {
+static jboolean call_packet_method(const struct arguments *args, jmethodID mid, jboolean is_void,
+                                   const uint8_t *data, size_t length, int direction,
+                                   const char *name) {
+    struct context *ctx = args->ctx;
+    if (args->env == NULL || args->instance == NULL || data == NULL || mid == NULL)
         return JNI_TRUE; // Allow packet if arguments are invalid
-    }
-    
-    JNIEnv *env = args->env;
-    
-    jclass cls = (*env)->GetObjectClass(env, args->instance);
-    if (cls == NULL) return JNI_TRUE;
-    
-    jmethodID methodID = (*env)->GetMethodID(env, cls, "onTcpPacketReceived", "([BILjava/lang/String;)Z");
-    if (methodID == NULL) {
-        (*env)->DeleteLocalRef(env, cls);
+
+    if (ctx->packet_data == NULL || length > ctx->packet_capacity) {
+        log_android(ANDROID_LOG_WARN, "Packet buffer %p capacity %zu too small for %zu",
+                    ctx->packet_data, ctx->packet_capacity, length);
         return JNI_TRUE;
     }
-    
-    jbyteArray dataArray = (*env)->NewByteArray(env, (jsize)length);
-    if (dataArray == NULL) {
-        (*env)->DeleteLocalRef(env, cls);
+
+    // The workers share the buffer, one callback at a time
+    if (pthread_mutex_lock(&ctx->java_lock))
         return JNI_TRUE;
+
+    JNIEnv *env = args->env;
+    memcpy(ctx->packet_data, data, length);
+
+    // The name of a flow goes to the methods that take one, null when it is not known
+    jstring jname = NULL;
+    if (name != NULL && *name != 0) {
+        jname = (*env)->NewStringUTF(env, name);
+        if (jname == NULL)
+            (*env)->ExceptionClear(env);
     }
-    
-    (*env)->SetByteArrayRegion(env, dataArray, 0, (jsize)length, (const jbyte*)data);
-    
-    jstring directionStr = (*env)->NewStringUTF(env, direction);
-    if (directionStr == NULL) {
-        (*env)->DeleteLocalRef(env, dataArray);
-        (*env)->DeleteLocalRef(env, cls);
-        return JNI_TRUE;
+
+    jboolean result = JNI_TRUE;
+    if (is_void)
+        (*env)->CallVoidMethod(env, args->instance, mid, (jint) length, (jint) direction);
+    else if (name != NULL)
+        result = (*env)->CallBooleanMethod(env, args->instance, mid, (jint) length, (jint) direction, jname);
+    else
+        result = (*env)->CallBooleanMethod(env, args->instance, mid, (jint) length, (jint) direction);
+
+    if (jname != NULL)
+        (*env)->DeleteLocalRef(env, jname);
+
+    if ((*env)->ExceptionCheck(env)) {
+        (*env)->ExceptionDescribe(env);
+        (*env)->ExceptionClear(env);
+        result = JNI_TRUE;
     }
-    
-    jboolean result = (*env)->CallBooleanMethod(env, args->instance, methodID, dataArray, (jint)length, directionStr);
-    
-    (*env)->DeleteLocalRef(env, dataArray);
-    (*env)->DeleteLocalRef(env, directionStr);
-    (*env)->DeleteLocalRef(env, cls);
-    
+
+    if (pthread_mutex_unlock(&ctx->java_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
     return result;
 }
 
-jboolean filter_udp_packet(const struct arguments *args, const uint8_t *data, size_t length, const char *direction) {
-    if (args == NULL || args->env == NULL || args->instance == NULL || data == NULL) {
-        return JNI_TRUE; // Allow packet if arguments are invalid
-    }
-    
+void log_packet_hex(const struct arguments *args, const uint8_t *data, size_t length, int direction) {
+    call_packet_method(args, midPacketReceived, JNI_TRUE, data, length, direction, NULL);
+}
+
+jboolean filter_tcp_packet(const struct arguments *args, const uint8_t *data, size_t length, int direction,
+                           const char *name) {
+    return call_packet_method(args, midTcpPacketReceived, JNI_FALSE, data, length, direction, name);
+}
+
+jboolean filter_udp_packet(const struct arguments *args, const uint8_t *data, size_t length, int direction,
+                           const char *name) {
+    return call_packet_method(args, midUdpPacketReceived, JNI_FALSE, data, length, direction, name);
+}
+
+jboolean filter_icmp_packet(const struct arguments *args, const uint8_t *data, size_t length, int direction) {
+    return call_packet_method(args, midIcmpPacketReceived, JNI_FALSE, data, length, direction, NULL);
+}
+
+int filter_flows(const struct arguments *args, const jint *flows, const char **names, int count,
+                 jboolean *verdicts) {
+    // Returns -1 when Java could not be asked, the flows are then asked for one by one
+    if (args->env == NULL || args->instance == NULL || midFlowsReceived == NULL || clsString == NULL)
+        return -1;
+
     JNIEnv *env = args->env;
-    
-    jclass cls = (*env)->GetObjectClass(env, args->instance);
-    if (cls == NULL) return JNI_TRUE;
-    
-    jmethodID methodID = (*env)->GetMethodID(env, cls, "onUdpPacketReceived", "([BILjava/lang/String;)Z");
-    if (methodID == NULL) {
-        (*env)->DeleteLocalRef(env, cls);
-        return JNI_TRUE;
-    }
-    
-    jbyteArray dataArray = (*env)->NewByteArray(env, (jsize)length);
-    if (dataArray == NULL) {
-        (*env)->DeleteLocalRef(env, cls);
-        return JNI_TRUE;
-    }
-    
-    (*env)->SetByteArrayRegion(env, dataArray, 0, (jsize)length, (const jbyte*)data);
-    
-    jstring directionStr = (*env)->NewStringUTF(env, direction);
-    if (directionStr == NULL) {
-        (*env)->DeleteLocalRef(env, dataArray);
-        (*env)->DeleteLocalRef(env, cls);
-        return JNI_TRUE;
-    }
-    
-    jboolean result = (*env)->CallBooleanMethod(env, args->instance, methodID, dataArray, (jint)length, directionStr);
-    
-    (*env)->DeleteLocalRef(env, dataArray);
-    (*env)->DeleteLocalRef(env, directionStr);
-    (*env)->DeleteLocalRef(env, cls);
-    
+    jintArray jflows = (*env)->NewIntArray(env, count * FLOW_STRIDE);
+    jobjectArray jnames = (*env)->NewObjectArray(env, count, clsString, NULL);
+    jbooleanArray jverdicts = (*env)->NewBooleanArray(env, count);
+    int result = -1;
+    if (jflows != NULL && jnames != NULL && jverdicts != NULL) {
+        (*env)->SetIntArrayRegion(env, jflows, 0, count * FLOW_STRIDE, flows);
+        for (int i = 0; i < count; i++)
+            if (*names[i] != 0) {
+                jstring jname = (*env)->NewStringUTF(env, names[i]);
+                if (jname == NULL) {
+                    (*env)->ExceptionClear(env);
+                    continue;
+                }
+                (*env)->SetObjectArrayElement(env, jnames, i, jname);
+                (*env)->DeleteLocalRef(env, jname);
+            }
+
+        // The rules of Java are called one thread at a time
+        if (pthread_mutex_lock(&args->ctx->java_lock) == 0) {
+            (*env)->CallVoidMethod(env, args->instance, midFlowsReceived, (jint) count, jflows, jnames, jverdicts);
+            if ((*env)->ExceptionCheck(env)) {
+                (*env)->ExceptionDescribe(env);
+                (*env)->ExceptionClear(env);
+            } else {
+                (*env)->GetBooleanArrayRegion(env, jverdicts, 0, count, verdicts);
+                result = 0;
+            }
+            if (pthread_mutex_unlock(&args->ctx->java_lock))
+                log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+        }
+    } else
+        (*env)->ExceptionClear(env);
+
+    if (jflows != NULL)
+        (*env)->DeleteLocalRef(env, jflows);
+    if (jnames != NULL)
+        (*env)->DeleteLocalRef(env, jnames);
+    if (jverdicts != NULL)
+        (*env)->DeleteLocalRef(env, jverdicts);
     return result;
 }
 
-jboolean filter_icmp_packet(const struct arguments *args, const uint8_t *data, size_t length, const char *direction) {
-    if (args == NULL || args->env == NULL || args->instance == NULL || data == NULL) {
-        return JNI_TRUE; // Allow packet if arguments are invalid
-    }
-    
+jint get_uid_q(const struct arguments *args, int version, int protocol,
+               const char *source, uint16_t sport, const char *dest, uint16_t dport) {
+    if (args->env == NULL || args->instance == NULL || midGetUidQ == NULL)
+        return -1;
+
     JNIEnv *env = args->env;
-    
-    jclass cls = (*env)->GetObjectClass(env, args->instance);
-    if (cls == NULL) return JNI_TRUE;
-    
-    jmethodID methodID = (*env)->GetMethodID(env, cls, "onIcmpPacketReceived", "([BILjava/lang/String;)Z");
-    if (methodID == NULL) {
-        (*env)->DeleteLocalRef(env, cls);
-        return JNI_TRUE;
+    jstring jsource = (*env)->NewStringUTF(env, source);
+    jstring jdest = (*env)->NewStringUTF(env, dest);
+    if (jsource == NULL || jdest == NULL) {
+        (*env)->ExceptionClear(env);
+        return -1;
     }
-    
-    jbyteArray dataArray = (*env)->NewByteArray(env, (jsize)length);
-    if (dataArray == NULL) {
-        (*env)->DeleteLocalRef(env, cls);
-        return JNI_TRUE;
-    }
-    
-    (*env)->SetByteArrayRegion(env, dataArray, 0, (jsize)length, (const jbyte*)data);
-    
-    jstring directionStr = (*env)->NewStringUTF(env, direction);
-    if (directionStr == NULL) {
-        (*env)->DeleteLocalRef(env, dataArray);
-        (*env)->DeleteLocalRef(env, cls);
-        return JNI_TRUE;
+
+    jint uid = (*env)->CallIntMethod(env, args->instance, midGetUidQ,
+                                     version, protocol, jsource, sport, jdest, dport);
+    if ((*env)->ExceptionCheck(env)) {
+        (*env)->ExceptionDescribe(env);
+        (*env)->ExceptionClear(env);
+        uid = -1;
     }
-    
-    jboolean result = (*env)->CallBooleanMethod(env, args->instance, methodID, dataArray, (jint)length, directionStr);
-    
-    (*env)->DeleteLocalRef(env, dataArray);
-    (*env)->DeleteLocalRef(env, directionStr);
-    (*env)->DeleteLocalRef(env, cls);
-    
-    return result;
-}
\ No newline at end of file
+
+    (*env)->DeleteLocalRef(env, jsource);
+    (*env)->DeleteLocalRef(env, jdest);
+    return uid;
+}
+
+// Compiled domain lists, used by Java for the names it still evaluates
+
+JNIEXPORT jboolean JNICALL Java_com_kin_athena_service_firewall_model_NativeDomainList_jni_1compile(JNIEnv *env, jclass type, jstring source_path_, jstring path_, jboolean complete, jlong source) {
+    const char *source_path = (*env)->GetStringUTFChars(env, source_path_, NULL);
+    const char *path = (*env)->GetStringUTFChars(env, path_, NULL);
+    int rc = domain_compile(source_path, path, complete, (uint64_t) source);
+    (*env)->ReleaseStringUTFChars(env, source_path_, source_path);
+    (*env)->ReleaseStringUTFChars(env, path_, path);
+    return (jboolean) (rc == 0);
+}
+
+JNIEXPORT jlong JNICALL Java_com_kin_athena_service_firewall_model_NativeDomainList_jni_1open(JNIEnv *env, jclass type, jstring path_) {
+    const char *path = (*env)->GetStringUTFChars(env, path_, NULL);
+    struct domain_table *table = domain_open(path);
+    (*env)->ReleaseStringUTFChars(env, path_, path);
+    return (jlong) table;
+}
+
+JNIEXPORT void JNICALL Java_com_kin_athena_service_firewall_model_NativeDomainList_jni_1close(JNIEnv *env, jclass type, jlong handle) {
+    domain_close((struct domain_table *) handle);
+}
+
+JNIEXPORT jint JNICALL Java_com_kin_athena_service_firewall_model_NativeDomainList_jni_1lookup(JNIEnv *env, jclass type, jlong handle, jstring name_) {
+    if (handle == 0) return VERDICT_UNKNOWN;
+
+    const char *name = (*env)->GetStringUTFChars(env, name_, NULL);
+    int verdict = domain_lookup((struct domain_table *) handle, name);
+    (*env)->ReleaseStringUTFChars(env, name_, name);
+    return verdict;
+}
+
+JNIEXPORT jint JNICALL Java_com_kin_athena_service_firewall_model_NativeDomainList_jni_1count(JNIEnv *env, jclass type, jlong handle) {
+    return (handle == 0 ? 0 : (jint) ((struct domain_table *) handle)->count);
+}
+
+JNIEXPORT jboolean JNICALL Java_com_kin_athena_service_firewall_model_NativeDomainList_jni_1complete(JNIEnv *env, jclass type, jlong handle) {
+    return (jboolean) (handle != 0 && ((struct domain_table *) handle)->complete);
+}
+
+JNIEXPORT jlong JNICALL Java_com_kin_athena_service_firewall_model_NativeDomainList_jni_1source(JNIEnv *env, jclass type, jlong handle) {
+    return (handle == 0 ? 0 : (jlong) ((struct domain_table *) handle)->source);
+}
@@ -1 +1,1310 @@
-/*    This file is part of NetGuard.    NetGuard is free software: you can redistribute it and/or modify    it under the terms of the GNU General Public License as published by    the Free Software Foundation, either version 3 of the License, or    (at your option) any later version.    NetGuard is distributed in the hope that it will be useful,    but WITHOUT ANY WARRANTY; without even the implied warranty of    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    GNU General Public License for more details.    You should have received a copy of the GNU General Public License    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.    Copyright 2015-2024 by Marcel Bokhorst (M66B)*/#include <jni.h>#include <stdio.h>#include <stdlib.h>#include <string.h>#include <ctype.h>#include <time.h>#include <unistd.h>#include <pthread.h>#include <setjmp.h>#include <errno.h>#include <fcntl.h>#include <dirent.h>#include <poll.h>#include <sys/types.h>#include <sys/ioctl.h>#include <sys/socket.h>#include <sys/epoll.h>#include <dlfcn.h>#include <sys/stat.h>#include <sys/resource.h>#include <netdb.h>#include <arpa/inet.h>#include <netinet/in.h>#include <netinet/in6.h>#include <netinet/ip.h>#include <netinet/ip6.h>#include <netinet/udp.h>#include <netinet/tcp.h>#include <netinet/ip_icmp.h>#include <netinet/icmp6.h>#include <android/log.h>#include <sys/system_properties.h>#define TAG "NetGuard.JNI"#define EPOLL_TIMEOUT 3600#define EPOLL_EVENTS 20#define EPOLL_MIN_CHECK 100#define TUN_YIELD 10 // packets#define ICMP4_MAXMSG (IP_MAXPACKET - 20 - 8) // bytes (socket)#define ICMP6_MAXMSG (IPV6_MAXPACKET - 40 - 8) // bytes (socket)#define UDP4_MAXMSG (IP_MAXPACKET - 20 - 8) // bytes (socket)#define UDP6_MAXMSG (IPV6_MAXPACKET - 40 - 8) // bytes (socket)#define ICMP_TIMEOUT 5 // seconds#define UDP_TIMEOUT_53 15 // seconds#define UDP_TIMEOUT_ANY 300 // seconds#define UDP_KEEP_TIMEOUT 60 // seconds#define UDP_YIELD 10 // packets#define TCP_INIT_TIMEOUT 20 // seconds ~net.inet.tcp.keepinit#define TCP_IDLE_TIMEOUT 3600 // seconds ~net.inet.tcp.keepidle#define TCP_CLOSE_TIMEOUT 20 // seconds#define TCP_KEEP_TIMEOUT 300 // seconds#define SESSION_LIMIT 40 // percent#define SESSION_MAX (1024 * SESSION_LIMIT / 100) // number#define SEND_BUF_DEFAULT 163840 // bytes#define SOCKS5_NONE 1#define SOCKS5_HELLO 2#define SOCKS5_AUTH 3#define SOCKS5_CONNECT 4#define SOCKS5_CONNECTED 5struct context {    pthread_mutex_t lock;    int pipefds[2];    int stopping;    int sdk;    struct ng_session *ng_session;    char dns_server_v4[INET_ADDRSTRLEN];    char dns_server_v6[INET6_ADDRSTRLEN];};struct arguments {    JNIEnv *env;    jobject instance;    int tun;    jboolean fwd53;    jint rcode;    struct context *ctx;};struct allowed {    char raddr[INET6_ADDRSTRLEN + 1];    uint16_t rport; // host notation};struct segment {    uint32_t seq;    uint16_t len;    uint16_t sent;    int psh;    uint8_t *data;    struct segment *next;};struct icmp_session {    time_t time;    jint uid;    int version;    union {        __be32 ip4; // network notation        struct in6_addr ip6;    } saddr;    union {        __be32 ip4; // network notation        struct in6_addr ip6;    } daddr;    uint16_t id;    uint8_t stop;};#define UDP_ACTIVE 0#define UDP_FINISHING 1#define UDP_CLOSED 2struct udp_session {    time_t time;    jint uid;    int version;    uint16_t mss;    uint64_t sent;    uint64_t received;    union {        __be32 ip4; // network notation        struct in6_addr ip6;    } saddr;    __be16 source; // network notation    union {        __be32 ip4; // network notation        struct in6_addr ip6;    } daddr;    __be16 dest; // network notation    uint8_t state;};struct tcp_session {    jint uid;    time_t time;    int version;    uint16_t mss;    uint8_t recv_scale;    uint8_t send_scale;    uint32_t recv_window; // host notation, scaled    uint32_t send_window; // host notation, scaled    uint16_t unconfirmed; // packets    uint32_t remote_seq; // confirmed bytes received, host notation    uint32_t local_seq; // confirmed bytes sent, host notation    uint32_t remote_start;    uint32_t local_start;    uint32_t acked; // host notation    long long last_keep_alive;    uint64_t sent;    uint64_t received;    union {        __be32 ip4; // network notation        struct in6_addr ip6;    } saddr;    __be16 source; // network notation    union {        __be32 ip4; // network notation        struct in6_addr ip6;    } daddr;    __be16 dest; // network notation    uint8_t state;    uint8_t socks5;    struct segment *forward;};struct ng_session {    uint8_t protocol;    union {        struct icmp_session icmp;        struct udp_session udp;        struct tcp_session tcp;    };    jint socket;    struct epoll_event ev;    struct ng_session *next;};// IPv6struct ip6_hdr_pseudo {    struct in6_addr ip6ph_src;    struct in6_addr ip6ph_dst;    u_int32_t ip6ph_len;    u_int8_t ip6ph_zero[3];    u_int8_t ip6ph_nxt;} __packed;#define LINKTYPE_RAW 101// TLS#define TLS_SNI_LENGTH 255typedef struct dns_rr {    __be16 qname_ptr;    __be16 qtype;    __be16 qclass;    __be32 ttl;    __be16 rdlength;} __packed dns_rr;// DHCP#define DHCP_OPTION_MAGIC_NUMBER (0x63825363)typedef struct dhcp_packet {    uint8_t opcode;    uint8_t htype;    uint8_t hlen;    uint8_t hops;    uint32_t xid;    uint16_t secs;    uint16_t flags;    uint32_t ciaddr;    uint32_t yiaddr;    uint32_t siaddr;    uint32_t giaddr;    uint8_t chaddr[16];    uint8_t sname[64];    uint8_t file[128];    uint32_t option_format;} __packed dhcp_packet;typedef struct dhcp_option {    uint8_t code;    uint8_t length;} __packed dhcp_option;void *handle_events(void *a);void clear(struct context *ctx);int check_icmp_session(const struct arguments *args,                       struct ng_session *s,                       int sessions, int maxsessions);int check_udp_session(const struct arguments *args,                      struct ng_session *s,                      int sessions, int maxsessions);int check_tcp_session(const struct arguments *args,                      struct ng_session *s,                      int sessions, int maxsessions);int monitor_tcp_session(const struct arguments *args, struct ng_session *s, int epoll_fd);int get_icmp_timeout(const struct icmp_session *u, int sessions, int maxsessions);int get_udp_timeout(const struct udp_session *u, int sessions, int maxsessions);int get_tcp_timeout(const struct tcp_session *t, int sessions, int maxsessions);uint16_t get_mtu();uint16_t get_default_mss(int version);int check_tun(const struct arguments *args,              const struct epoll_event *ev,              const int epoll_fd,              int sessions, int maxsessions);void check_icmp_socket(const struct arguments *args, const struct epoll_event *ev);void check_udp_socket(const struct arguments *args, const struct epoll_event *ev);uint32_t get_send_window(const struct tcp_session *cur);uint32_t get_receive_buffer(const struct ng_session *cur);uint32_t get_receive_window(const struct ng_session *cur);void check_tcp_socket(const struct arguments *args,                      const struct epoll_event *ev,                      const int epoll_fd);int is_lower_layer(int protocol);int is_upper_layer(int protocol);void handle_ip(const struct arguments *args,               const uint8_t *buffer, size_t length,               const int epoll_fd,               int sessions, int maxsessions);jboolean handle_icmp(const struct arguments *args,                     const uint8_t *pkt, size_t length,                     const uint8_t *payload,                     int uid,                     const int epoll_fd);int has_udp_session(const struct arguments *args, const uint8_t *pkt, const uint8_t *payload);jboolean handle_udp(const struct arguments *args,                    const uint8_t *pkt, size_t length,                    const uint8_t *payload,                    int uid, struct allowed *redirect,                    const int epoll_fd);void clear_tcp_data(struct tcp_session *cur);jboolean handle_tcp(const struct arguments *args,                    const uint8_t *pkt, size_t length,                    const uint8_t *payload,                    int uid, int allowed, struct allowed *redirect,                    const int epoll_fd);void queue_tcp(const struct arguments *args,               const struct tcphdr *tcphdr,               const char *session, struct tcp_session *cur,               const uint8_t *data, uint16_t datalen);int open_icmp_socket(const struct arguments *args, const struct icmp_session *cur);int open_udp_socket(const struct arguments *args,                    const struct udp_session *cur, const struct allowed *redirect);int open_tcp_socket(const struct arguments *args,                    const struct tcp_session *cur, const struct allowed *redirect);int write_syn_ack(const struct arguments *args, struct tcp_session *cur);int write_ack(const struct arguments *args, struct tcp_session *cur);int write_data(const struct arguments *args, struct tcp_session *cur,               const uint8_t *buffer, size_t length);int write_fin_ack(const struct arguments *args, struct tcp_session *cur);void write_rst(const struct arguments *args, struct tcp_session *cur);ssize_t write_icmp(const struct arguments *args, const struct icmp_session *cur,                   uint8_t *data, size_t datalen);ssize_t write_udp(const struct arguments *args, const struct udp_session *cur,                  uint8_t *data, size_t datalen);ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur,                  const uint8_t *data, size_t datalen,                  int syn, int ack, int fin, int rst);uint16_t calc_checksum(uint16_t start, const uint8_t *buffer, size_t length);void log_android(int prio, const char *fmt, ...);int compare_u32(uint32_t seq1, uint32_t seq2);char *hex(const u_int8_t *data, const size_t len);int is_readable(int fd);long long get_ms();void ng_add_alloc(void *ptr, const char *tag);void ng_delete_alloc(void *ptr, const char *file, int line);void *ng_malloc(size_t __byte_count, const char *tag);void *ng_calloc(size_t __item_count, size_t __item_size, const char *tag);void ng_free(void *__ptr, const char *file, int line);void log_packet_hex(const struct arguments *args, const uint8_t *data, size_t length, const char *direction);jboolean filter_tcp_packet(const struct arguments *args, const uint8_t *data, size_t length, const char *direction);jboolean filter_udp_packet(const struct arguments *args, const uint8_t *data, size_t length, const char *direction);jboolean filter_icmp_packet(const struct arguments *args, const uint8_t *data, size_t length, const char *direction);
\ No newline at end of file
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include <jni.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
+
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+#include <linux/sockios.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+
+#include <android/log.h>
+#include <sys/system_properties.h>
+
+#define TAG "NetGuard.JNI"
+
+// #define PROFILE_MEMORY
+
+#define EPOLL_TIMEOUT 3600 // seconds
+#define EPOLL_EVENTS 20
+#define EPOLL_MIN_CHECK 100 // milliseconds
+
+#define TUN_YIELD 10 // packets
+
+#define WORKERS_MAX 8 // event loop threads
+#define WORKER_QUEUE 256 // packets, power of two
+
+#define ICMP4_MAXMSG (IP_MAXPACKET - 20 - 8) // bytes (socket)
+#define ICMP6_MAXMSG (IPV6_MAXPACKET - 40 - 8) // bytes (socket)
+#define UDP4_MAXMSG (IP_MAXPACKET - 20 - 8) // bytes (socket)
+#define UDP6_MAXMSG (IPV6_MAXPACKET - 40 - 8) // bytes (socket)
+
+#define ICMP_TIMEOUT 5 // seconds
+
+#define UDP_TIMEOUT_53 15 // seconds
+#define UDP_TIMEOUT_ANY 300 // seconds
+#define UDP_KEEP_TIMEOUT 60 // seconds
+#define UDP_YIELD 10 // packets
+#define UDP_BATCH 16 // datagrams per recvmmsg and sendmmsg
+
+#define TCP_INIT_TIMEOUT 20 // seconds ~net.inet.tcp.keepinit
+#define TCP_IDLE_TIMEOUT 3600 // seconds ~net.inet.tcp.keepidle
+#define TCP_CLOSE_TIMEOUT 20 // seconds
+#define TCP_KEEP_TIMEOUT 300 // seconds
+// https://en.wikipedia.org/wiki/Maximum_segment_lifetime
+
+#define SESSION_LIMIT 40 // percent
+#define SESSION_MAX (1024 * SESSION_LIMIT / 100) // number
+#define SESSION_LOAD_STEP 10 // percent of maxsessions, armed deadlines shrink when the load crosses one
+
+#define SEND_BUF_DEFAULT 163840 // bytes
+
+#define SOCKS5_NONE 1
+#define SOCKS5_HELLO 2
+#define SOCKS5_AUTH 3
+#define SOCKS5_CONNECT 4
+#define SOCKS5_CONNECTED 5
+
+#define TLS_SNI_LENGTH 255
+
+#define NAME_PENDING 0 // no data seen yet
+#define NAME_COLLECTING 1 // the ClientHello continues in the next segments
+#define NAME_DONE 2
+#define NAME_SEGMENTS 4 // a ClientHello may span, including the first
+#define NAME_HELLO_MAX 8192 // bytes kept of a ClientHello
+
+#define NAME_NONE 0 // parser results
+#define NAME_FOUND 1
+#define NAME_MORE 2
+
+#define QUIC_V1 0x00000001
+#define QUIC_V2 0x6b3343cf
+#define QUIC_CID_MAX 20
+
+#define SHA256_LENGTH 32
+#define AES128_ROUND_KEYS 176
+
+#define DNS_QCLASS_IN 1
+#define DNS_QTYPE_A 1
+#define DNS_QTYPE_AAAA 28
+#define DNS_QNAME_MAX 255
+#define DNS_RESPONSE_MAX 512 // bytes
+#define DNS_BLOCK_TTL 5 // seconds, as the SOA answer Java used to send
+#define DNS_QTYPE_SOA 6
+#define DNS_QTYPE_OPT 41
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_CACHE_BUCKETS 1024 // power of two
+#define DNS_CACHE_ENTRIES 2048 // number
+#define DNS_CACHE_BYTES (256 * 1024) // bytes, including the entries
+#define DNS_CACHE_RESPONSE_MAX 2048 // bytes, larger answers are not cached
+#define DNS_CACHE_RECORDS 32 // resource records, answers with more are not cached
+#define DNS_CACHE_TTL_MAX 3600 // seconds
+#define DNS_CACHE_NEGATIVE_TTL_MAX 300 // seconds
+
+#define DNS_MUX_SOCKETS 2 // upstream sockets per address family
+#define DNS_FALLBACK_V4 "9.9.9.9" // until Java sets a server, or when it does not parse
+#define DNS_FALLBACK_V6 "2620:fe::fe"
+#define DNS_MUX_PENDING 1024 // outstanding queries, power of two
+#define DNS_MUX_IDS 65536 // transaction ids
+#define DNS_MUX_ID_TRIES 8 // random ids drawn before the query falls back to a session
+#define DNS_MUX_ROTATE_QUERIES 256 // sent on an upstream socket before it is replaced
+#define DNS_MUX_ROTATE_TIME 60 // seconds, the same
+
+#define DNS_NAMES_BUCKETS 2048 // power of two
+#define DNS_NAMES_ENTRIES 8192
+#define DNS_NAMES_TTL_MIN 300 // seconds, connections often start after a short TTL ran out
+#define DNS_NAMES_TTL_MAX 86400 // seconds
+
+#define UID_PROC_TABLES 4 // tcp, tcp6, udp, udp6
+#define UID_PROC_REFRESH 1000 // milliseconds, before a /proc/net table is read again
+#define UID_DIAG_TIMEOUT 100 // milliseconds, for the answer of sock_diag
+
+#define TRAFFIC_TABLE_MIN 64 // apps, power of two
+#define TRAFFIC_LOAD_MAX 70 // percent
+#define TRAFFIC_INTERVAL 1000 // milliseconds, between folds of the session counters
+#define TRAFFIC_STRIDE 7 // longs per app passed to Java, the layout must match AppTrafficStats.kt
+
+#define DIRECTION_TUN_IN 0 // packet direction passed to Java callbacks
+#define DIRECTION_TUN_OUT 1
+
+#define POOL_CLASSES 5
+
+struct pool_stats {
+    uint64_t hits; // allocations served from a free list
+    uint64_t misses; // allocations that went to the heap
+    uint64_t recycled; // frees kept for reuse
+    uint64_t released; // frees returned to the heap
+    int cached; // buffers currently held
+};
+
+#define FLOW_TABLE_MIN 256 // slots, power of two
+#define FLOW_LOAD_MAX 70 // percent, including deleted slots
+
+struct flow_key {
+    uint8_t protocol;
+    uint8_t version;
+    __be16 source; // network notation
+    __be16 dest; // network notation
+
+    union {
+        __be32 ip4; // network notation
+        struct in6_addr ip6;
+    } saddr;
+
+    union {
+        __be32 ip4; // network notation
+        struct in6_addr ip6;
+    } daddr;
+};
+
+struct flow_table {
+    struct ng_session **slots;
+    uint32_t *hashes;
+    uint32_t size; // power of two
+    uint32_t count; // live flows
+    uint32_t used; // live flows and deleted slots
+    uint32_t seed;
+};
+
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS) // per level
+#define TIMER_LEVELS 3
+
+struct timer_wheel {
+    time_t current; // seconds, earlier slots have been expired
+    int pending;
+    struct ng_session *slots[TIMER_LEVELS * TIMER_SLOTS];
+};
+
+#define SLAB_SESSIONS 64 // objects per chunk
+#define SLAB_SEGMENTS 256 // objects per chunk
+
+struct slab {
+    const char *tag;
+    size_t size; // object size, 16 byte aligned
+    size_t per_chunk;
+    size_t chunk_count;
+    size_t used;
+    size_t peak;
+    struct slab_chunk *chunks;
+    struct slab_free *free;
+};
+
+// Pushed onto by many threads, emptied by one, see stack.c
+struct lf_stack {
+    _Atomic(void *) top; // newest first
+};
+
+#define RULE_STRIDE 12 // ints per rule pushed from Java
+#define RULE_ANY_UID -1
+
+// Conditions a rule applies under, matched against the current state
+#define RULE_NET_WIFI 1
+#define RULE_NET_MOBILE 2
+#define RULE_NET_OTHER 4
+#define RULE_NET_ANY (RULE_NET_WIFI | RULE_NET_MOBILE | RULE_NET_OTHER)
+#define RULE_SCREEN_OFF 8 // rule only applies while the screen is off
+
+#define RULE_FLAG_ALLOW_LOCAL 1 // accept private IPv4 destinations
+#define RULE_FLAG_LOG 2 // packets are logged by Java, keep calling back
+
+#define VERDICT_BLOCK 0
+#define VERDICT_ALLOW 1
+#define VERDICT_UNKNOWN -1 // ask Java
+#define VERDICT_PENDING -2 // Java was asked, the packet is parked
+
+struct rule {
+    int32_t uid; // RULE_ANY_UID for all
+    uint8_t protocol; // 0 for all
+    uint8_t version; // 0 for all
+    uint8_t prefix;
+    uint8_t conditions;
+    uint16_t port_low; // host notation
+    uint16_t port_high;
+    uint8_t verdict;
+    uint32_t addr[4]; // host notation words
+};
+
+struct rule_table {
+    int flags;
+    uint32_t count;
+    uint32_t generic; // rules without uid come first, in push order
+    uint32_t with_uid; // rules with uid follow, sorted by uid
+    struct rule rules[];
+};
+
+#define DOMAIN_LISTS 2
+#define DOMAIN_LIST_HOSTS 0 // hosts files of the DNS rule
+#define DOMAIN_LIST_CUSTOM 1 // custom blocklist
+
+#define DOMAIN_EXACT 1 // the name itself is blocked
+#define DOMAIN_SUBDOMAINS 2 // names below it are blocked
+#define DOMAIN_WHITELIST 4 // the name is never blocked by this list
+
+#define DOMAIN_FILE_MAGIC 0x4c445441 // "ATDL"
+#define DOMAIN_FILE_VERSION 1
+
+// Compiled list: header, records sorted by name, names
+struct domain_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count; // records
+    uint32_t complete; // no rules were left to Java
+    uint64_t source; // fingerprint of the lists it was compiled from
+    uint64_t names_size; // bytes
+};
+
+struct domain_record {
+    uint32_t offset; // into the names
+    uint8_t length;
+    uint8_t flags; // DOMAIN_*
+    uint16_t reserved;
+};
+
+struct domain_table {
+    uint32_t count;
+    int complete;
+    uint64_t source;
+    const struct domain_record *records;
+    const char *names; // labels reversed, "com.example.ads"
+    uint64_t names_size;
+    void *map; // NULL for an empty list
+    size_t map_size;
+};
+
+struct dns_cache_entry {
+    struct dns_cache_entry *hash_next;
+    struct dns_cache_entry *lru_prev; // towards the most recently used
+    struct dns_cache_entry *lru_next;
+    uint32_t hash;
+    time_t stored;
+    time_t expires;
+    uint16_t key_length; // question without the id, lowercased, and the key flags
+    uint16_t length; // response
+    uint8_t records; // TTL fields to age
+    uint16_t ttl[DNS_CACHE_RECORDS]; // offsets of the TTL fields in the response
+    uint8_t data[]; // key, then the response
+};
+
+struct dns_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stored;
+    uint64_t evicted; // to stay within the bounds, expired entries not included
+    uint32_t entries;
+    size_t bytes;
+};
+
+struct dns_cache {
+    struct dns_cache_entry **buckets; // allocated on first use
+    struct dns_cache_entry *lru_head;
+    struct dns_cache_entry *lru_tail;
+    struct dns_cache_stats stats;
+};
+
+// Addresses of DNS answers and the names they were asked for
+struct dns_name {
+    struct dns_name *hash_next;
+    struct dns_name *lru_prev; // towards the most recently used
+    struct dns_name *lru_next;
+    uint32_t hash;
+    time_t expires;
+    jint uid; // that asked, -1 when unknown
+    uint8_t version;
+    uint8_t addr[16];
+    char name[];
+};
+
+struct dns_names {
+    struct dns_name **buckets; // allocated on first use
+    struct dns_name *lru_head;
+    struct dns_name *lru_tail;
+    uint32_t entries;
+};
+
+// The IP header of the packets written back to a flow, built when the flow is
+// created; only the lengths and the checksums change between packets
+struct packet_template {
+    uint16_t ip_sum; // of the IPv4 header without length and checksum
+    uint16_t pseudo_sum; // of the pseudo header without length
+    uint8_t header[40] __attribute__((aligned(4))); // IPv4 or IPv6, length zero
+};
+
+// Headers of a written packet, IPv6 with TCP and the options of a SYN
+#define PACKET_HEADER_MAX (40 + 20 + 8)
+
+// Packets are written with their headers and payload gathered, one syscall each
+struct tun_stats {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_bytes;
+    uint64_t written_bytes;
+    uint64_t errors; // failed or short writes
+};
+
+#define UDP_ACTIVE 0
+#define UDP_FINISHING 1
+#define UDP_CLOSED 2
+#define UDP_BLOCKED 3
+
+struct udp_session {
+    time_t time;
+    jint uid;
+    int version;
+    uint16_t mss;
+
+    uint64_t sent;
+    uint64_t received;
+
+    union {
+        __be32 ip4; // network notation
+        struct in6_addr ip6;
+    } saddr;
+    __be16 source; // network notation
+
+    union {
+        __be32 ip4; // network notation
+        struct in6_addr ip6;
+    } daddr;
+    __be16 dest; // network notation
+
+    uint8_t state;
+    uint8_t dns; // query redirected to the configured server, the answer is cached
+    uint8_t connected; // to its destination, not broadcast or multicast
+    struct packet_template tpl;
+};
+
+// Datagrams of the tun packets read in one round, sent with sendmmsg per socket
+// after the round; the packets they are in are kept until then
+struct udp_send_queue {
+    int count;
+    struct ng_session *session[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    uint8_t *packet[UDP_BATCH]; // NULL until check_tun hands it over
+    uint8_t parked[UDP_BATCH]; // the packet is a parked copy, from the pool of the worker
+};
+
+// Message vectors of recvmmsg, the buffers are allocated on first use per run
+struct udp_recv_batch {
+    uint8_t *buffers; // UDP_BATCH of UDP4_MAXMSG, mostly never touched
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+};
+
+struct dns_upstream {
+    int socket; // -1 until the first query
+    int version;
+    struct epoll_event ev;
+    time_t opened;
+    uint32_t queries; // sent since opened
+    time_t retired; // no new queries since, 0 while in use
+};
+
+// A query sent upstream, found back through the id it was sent with
+struct dns_pending {
+    uint8_t active;
+    uint8_t upstream; // index of the socket it was sent on
+    uint16_t id; // sent upstream
+    uint16_t client_id; // of the query
+    uint32_t question; // hash of the lowercased question
+    time_t expires;
+    struct udp_session reply; // the tuple of the query
+};
+
+struct dns_mux_stats {
+    uint64_t queries;
+    uint64_t answers;
+    uint64_t expired; // never answered
+    uint64_t unmatched; // answers without a query
+    uint64_t rotated; // upstream sockets replaced
+};
+
+struct dns_mux {
+    struct dns_upstream upstream[2 * DNS_MUX_SOCKETS]; // IPv4 first
+    struct dns_pending *pending; // allocated on first use
+    uint16_t *slots; // by id, the pending slot or DNS_MUX_PENDING when free
+    uint32_t cursor; // next slot to try
+    uint32_t next; // upstream socket of the next query
+    struct dns_mux_stats stats;
+};
+
+struct uid_proc_entry {
+    uint32_t saddr[4]; // network notation
+    uint32_t daddr[4]; // network notation
+    uint16_t sport; // host notation
+    uint16_t dport; // host notation
+    int uid;
+};
+
+struct uid_proc_table {
+    struct uid_proc_entry *entries;
+    uint32_t count;
+    uint32_t capacity;
+    long long refreshed; // milliseconds
+};
+
+#define COMMAND_CLEAR 1 // close all sessions
+#define COMMAND_DNS 2 // other DNS servers
+#define COMMAND_INJECT 3 // write a packet built by Java to the tun
+
+// A control call of Java, run by the thread reading the pipe
+struct command {
+    struct command *next;
+    int type;
+    struct in_addr dns_v4;
+    struct in6_addr dns_v6;
+    size_t length;
+    uint8_t data[]; // the packet to inject
+};
+
+#define INJECT_RING_BYTES (256 * 1024) // power of two
+
+// Packets built by Java, written into native memory it maps as a direct buffer.
+// Java publishes what it wrote by moving head, the event loop moves tail.
+struct inject_ring {
+    uint8_t *data; // NULL until Java asks for the buffer
+    _Atomic uint32_t head; // bytes published, including padding
+    _Atomic uint32_t tail; // bytes written to the tun
+    _Atomic int wake; // the loop was woken and did not drain yet
+    uint64_t packets; // of the loop
+    uint64_t errors;
+};
+
+// Payload moved for an app, without the headers of the tun packets
+struct traffic {
+    uint64_t sent_bytes; // app to network
+    uint64_t received_bytes;
+    uint64_t sent_packets;
+    uint64_t received_packets;
+};
+
+struct traffic_entry {
+    jint uid; // -1 for flows of an unknown owner
+    uint8_t used;
+    uint64_t flows; // sessions opened
+    uint64_t blocked; // new flows, queries and names refused
+    struct traffic traffic;
+};
+
+// Per app totals of a worker, open addressing by uid. Written by the worker,
+// the lock is only contended by a snapshot for Java.
+struct traffic_table {
+    pthread_mutex_t lock;
+    struct traffic_entry *entries;
+    uint32_t size; // power of two
+    uint32_t count;
+};
+
+// A shard of the flows, with its own event loop thread when there are several.
+// The dispatcher reads the tun and hands each packet to the worker of its
+// flow through the worker's ring, which has one producer and one consumer.
+struct packet_ring {
+    _Atomic uint32_t head; // written by the dispatcher
+    _Atomic uint32_t tail; // written by the worker
+    struct {
+        uint8_t *buffer;
+        size_t length;
+    } slot[WORKER_QUEUE];
+    uint64_t dropped; // of the dispatcher, the ring was full
+    // The buffers the worker is done with, back to the pool of the dispatcher
+    _Atomic uint32_t free_head; // written by the worker
+    _Atomic uint32_t free_tail; // written by the dispatcher
+    uint8_t *returned[WORKER_QUEUE];
+};
+
+#define VERDICT_PENDING_MAX 256 // parked flows per worker
+#define VERDICT_PACKETS 8 // parked packets per flow
+#define VERDICT_TIMEOUT 10 // seconds
+#define VERDICT_BATCH 64 // flows per call into Java
+
+#define VERDICT_OWNER 1 // the verdict thread looks up the uid first
+#define VERDICT_RULES 2 // and evaluates the native rules with it
+
+// A new flow as passed to Java, the layout must match NativeFlow.kt.
+// Addresses are in host notation, IPv4 in the first word.
+#define FLOW_VERSION 0
+#define FLOW_PROTOCOL 1
+#define FLOW_SOURCE_PORT 2
+#define FLOW_DEST_PORT 3
+#define FLOW_UID 4
+#define FLOW_SOURCE 5
+#define FLOW_DEST 9
+#define FLOW_STRIDE 13
+
+// A question for Java, answered on the verdict thread. The request carries
+// a copy of the packet and comes back to its worker as the completion.
+struct verdict_request {
+    struct verdict_request *next;
+    int worker;
+    uint32_t id;
+    uint8_t protocol;
+    int flow; // described by its key, else Java gets the packet
+    struct flow_key key;
+    jint uid;
+    int owner; // VERDICT_OWNER and VERDICT_RULES
+    int verdict;
+    char name[TLS_SNI_LENGTH + 1];
+    size_t length;
+    uint8_t packet[];
+};
+
+// A flow waiting for its verdict, with the packets that came meanwhile
+struct pending_verdict {
+    struct pending_verdict *next;
+    uint32_t id;
+    time_t time;
+    int refresh; // of an existing session, nothing is parked
+    int cacheable; // packets of the same flow join the entry
+    uint32_t generation;
+    struct flow_key key;
+    jint uid;
+    int owner; // the uid came from the verdict thread, also when it is -1
+    int verdict;
+    int count;
+    uint8_t *packet[VERDICT_PACKETS]; // pool buffers
+    size_t length[VERDICT_PACKETS];
+};
+
+struct verdict_stats {
+    uint64_t parked;
+    uint64_t refreshed;
+    uint64_t expired;
+    uint64_t dropped;
+};
+
+// The requests of all workers, for the one thread calling the filter methods
+struct verdict_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct verdict_request *head;
+    struct verdict_request *tail;
+    int running;
+    int stopping;
+    pthread_t thread;
+    uint64_t batches; // calls of the batch method, by the thread
+    uint64_t flows; // answered in batches
+    uint64_t packets; // answered one at a time
+    uint64_t owners; // uids looked up for the workers
+};
+
+struct worker {
+    int index;
+    pthread_t thread;
+    pthread_mutex_t lock; // held by the loop while it handles a batch
+    int epoll_fd;
+    int wake_fd; // eventfd, packets were queued or verdicts answered
+    _Atomic int clear; // close all sessions before the next round
+    int maxsessions;
+    struct packet_ring ring;
+    struct ng_session *ng_session;
+    struct flow_table flows;
+    struct timer_wheel timers;
+    struct ng_session *dirty; // sessions touched since the last check
+    int sessions; // active, maintained by account_session
+    int load_step; // of the load the armed deadlines were computed for
+    struct slab session_slab;
+    struct slab segment_slab;
+    struct tun_stats tun_stats;
+    struct udp_send_queue udp_send;
+    struct udp_recv_batch udp_recv;
+    struct pending_verdict *pending; // newest first
+    int pending_count;
+    uint32_t pending_id;
+    struct pending_verdict *replay; // its packets are handled again
+    struct verdict_request *requests; // of this round, queued after it
+    struct verdict_request *requests_tail;
+    struct lf_stack verdicts; // of struct verdict_request, answered
+    struct verdict_stats verdict_stats;
+    struct traffic_table traffic;
+    long long traffic_time; // of the last fold, milliseconds
+};
+
+struct context {
+    pthread_mutex_t lock;
+    pthread_rwlock_t rule_lock;
+    struct rule_table *rules; // NULL until Java pushes a table
+    struct domain_table *domains[DOMAIN_LISTS]; // NULL until Java pushes the list
+    int rule_state; // current RULE_NET_* and RULE_SCREEN_OFF
+    uint32_t rule_generation; // bumped whenever cached verdicts become stale
+    int pipefds[2];
+    struct lf_stack commands; // of struct command, pushed by Java
+    struct inject_ring inject;
+    _Atomic int stopping; // read by every worker
+    int sdk;
+    struct worker workers[WORKERS_MAX];
+    int worker_count; // set by jni_start
+    pthread_mutex_t java_lock; // the callbacks share the packet buffer
+    struct verdict_queue verdict_queue;
+    jobject packet_buffer; // direct buffer shared with Java for filter callbacks
+    uint8_t *packet_data;
+    size_t packet_capacity;
+    struct in_addr dns_server_v4; // parsed once, a fallback until Java sets it
+    struct in6_addr dns_server_v6;
+    struct dns_cache dns_cache; // guarded by lock
+    struct dns_mux dns_mux; // guarded by lock
+    struct dns_names dns_names; // guarded by lock
+    pthread_mutex_t uid_lock; // the sock_diag socket and the /proc/net tables
+    int uid_socket; // sock_diag, -1 until the first lookup
+    uint32_t uid_seq; // of the last sock_diag request
+    struct uid_proc_table uid_proc[UID_PROC_TABLES];
+};
+
+struct arguments {
+    JNIEnv *env;
+    jobject instance;
+    int tun;
+    jboolean fwd53;
+    jint rcode;
+    struct context *ctx;
+    struct worker *worker;
+};
+
+struct allowed {
+    char raddr[INET6_ADDRSTRLEN + 1];
+    uint16_t rport; // host notation
+};
+
+struct segment {
+    uint32_t seq;
+    uint16_t len;
+    uint16_t sent;
+    int psh;
+    uint8_t *data;
+    struct segment *next;
+};
+
+struct icmp_session {
+    time_t time;
+    jint uid;
+    int version;
+
+    union {
+        __be32 ip4; // network notation
+        struct in6_addr ip6;
+    } saddr;
+
+    union {
+        __be32 ip4; // network notation
+        struct in6_addr ip6;
+    } daddr;
+
+    uint16_t id;
+
+    uint8_t stop;
+    struct packet_template tpl;
+};
+
+struct tcp_session {
+    jint uid;
+    time_t time;
+    int version;
+    uint16_t mss;
+    uint8_t recv_scale;
+    uint8_t send_scale;
+    uint32_t recv_window; // host notation, scaled
+    uint32_t send_window; // host notation, scaled
+    uint16_t unconfirmed; // packets
+
+    uint32_t remote_seq; // confirmed bytes received, host notation
+    uint32_t local_seq; // confirmed bytes sent, host notation
+    uint32_t remote_start;
+    uint32_t local_start;
+
+    uint32_t acked; // host notation
+    long long last_keep_alive;
+
+    uint64_t sent;
+    uint64_t received;
+
+    union {
+        __be32 ip4; // network notation
+        struct in6_addr ip6;
+    } saddr;
+    __be16 source; // network notation
+
+    union {
+        __be32 ip4; // network notation
+        struct in6_addr ip6;
+    } daddr;
+    __be16 dest; // network notation
+
+    uint8_t state;
+    uint8_t socks5;
+    struct segment *forward;
+    struct packet_template tpl;
+};
+
+// Start of a ClientHello split over segments, or over QUIC Initial packets
+struct name_probe {
+    uint32_t seq; // of the next segment, host notation
+    uint16_t length; // contiguous from the start
+    uint16_t size;
+    uint8_t segments; // or datagrams
+    uint8_t data[]; // QUIC: followed by a bitmap of the bytes received
+};
+
+struct aes128 {
+    uint8_t rk[AES128_ROUND_KEYS];
+};
+
+struct ng_session {
+    uint8_t protocol;
+    union {
+        struct icmp_session icmp;
+        struct udp_session udp;
+        struct tcp_session tcp;
+    };
+    jint socket;
+    struct epoll_event ev;
+    struct ng_session *next;
+    struct ng_session *prev;
+
+    time_t timer_expires;
+    int16_t timer_slot; // -1 when not scheduled
+    struct ng_session *timer_next;
+    struct ng_session *timer_prev;
+
+    struct ng_session *dirty_next;
+    uint8_t dirty;
+    uint8_t active;
+
+    int8_t verdict; // VERDICT_*, valid while verdict_generation is current
+    uint32_t verdict_generation;
+
+    char *server_name; // SNI or HTTP Host, NULL while unknown
+    uint8_t name_state; // NAME_*
+    struct name_probe *probe;
+
+    struct traffic traffic; // not yet folded into the table of the worker
+};
+
+// DNS
+
+struct dns_header {
+    uint16_t id; // identification number
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    uint16_t rd :1; // recursion desired
+    uint16_t tc :1; // truncated message
+    uint16_t aa :1; // authoritative answer
+    uint16_t opcode :4; // purpose of message
+    uint16_t qr :1; // query/response flag
+    uint16_t rcode :4; // response code
+    uint16_t cd :1; // checking disabled
+    uint16_t ad :1; // authenticated data
+    uint16_t z :1; // reserved
+    uint16_t ra :1; // recursion available
+#elif __BYTE_ORDER == __BIG_ENDIAN
+    uint16_t qr :1; // query/response flag
+    uint16_t opcode :4; // purpose of message
+    uint16_t aa :1; // authoritative answer
+    uint16_t tc :1; // truncated message
+    uint16_t rd :1; // recursion desired
+    uint16_t ra :1; // recursion available
+    uint16_t z :1; // reserved
+    uint16_t ad :1; // authenticated data
+    uint16_t cd :1; // checking disabled
+    uint16_t rcode :4; // response code
+#else
+# error "Adjust your <bits/endian.h> defines"
+#endif
+    uint16_t q_count; // number of question entries
+    uint16_t ans_count; // number of answer entries
+    uint16_t auth_count; // number of authority entries
+    uint16_t add_count; // number of resource entries
+} __packed;
+
+// IPv6
+
+struct ip6_hdr_pseudo {
+    struct in6_addr ip6ph_src;
+    struct in6_addr ip6ph_dst;
+    u_int32_t ip6ph_len;
+    u_int8_t ip6ph_zero[3];
+    u_int8_t ip6ph_nxt;
+} __packed;
+
+#define LINKTYPE_RAW 101
+
+typedef struct dns_rr {
+    __be16 qname_ptr;
+    __be16 qtype;
+    __be16 qclass;
+    __be32 ttl;
+    __be16 rdlength;
+} __packed dns_rr;
+
+// DHCP
+
+#define DHCP_OPTION_MAGIC_NUMBER (0x63825363)
+
+typedef struct dhcp_packet {
+    uint8_t opcode;
+    uint8_t htype;
+    uint8_t hlen;
+    uint8_t hops;
+    uint32_t xid;
+    uint16_t secs;
+    uint16_t flags;
+    uint32_t ciaddr;
+    uint32_t yiaddr;
+    uint32_t siaddr;
+    uint32_t giaddr;
+    uint8_t chaddr[16];
+    uint8_t sname[64];
+    uint8_t file[128];
+    uint32_t option_format;
+} __packed dhcp_packet;
+
+typedef struct dhcp_option {
+    uint8_t code;
+    uint8_t length;
+} __packed dhcp_option;
+
+#ifdef PROFILE_MEMORY
+struct alloc_record {
+    const char *tag;
+    time_t time;
+    void *ptr;
+};
+
+extern pthread_mutex_t *alock;
+extern struct alloc_record *alloc;
+extern int allocs;
+extern int balance;
+#endif
+
+// Prototypes
+
+void clear(struct context *ctx);
+
+void add_session(struct worker *worker, struct ng_session *s);
+
+void delete_session(struct worker *worker, struct ng_session *s);
+
+void touch_session(struct worker *worker, struct ng_session *s);
+
+void account_session(struct worker *worker, struct ng_session *s);
+
+void command_push(struct context *ctx, struct command *cmd);
+
+void run_commands(const struct arguments *args);
+
+void free_commands(struct context *ctx);
+
+uint8_t *inject_buffer(struct context *ctx);
+
+uint32_t inject_publish(struct context *ctx, uint32_t head);
+
+void drain_injections(const struct arguments *args);
+
+void inject_free(struct context *ctx);
+
+time_t get_session_deadline(const struct ng_session *s, time_t now, int sessions, int maxsessions);
+
+void *handle_events(void *a);
+
+void free_tun_buffer(const struct arguments *args, uint8_t *buffer);
+
+void timer_init(struct timer_wheel *wheel, time_t now);
+
+void timer_schedule(struct timer_wheel *wheel, struct ng_session *s, time_t expires);
+
+void timer_cancel(struct timer_wheel *wheel, struct ng_session *s);
+
+struct ng_session *timer_expire(struct timer_wheel *wheel, time_t now);
+
+time_t timer_next(const struct timer_wheel *wheel);
+
+void flow_init(struct flow_table *table);
+
+void flow_free(struct flow_table *table);
+
+void flow_clear(struct flow_table *table);
+
+void flow_key_packet(const uint8_t *pkt, const uint8_t *payload, uint8_t protocol, struct flow_key *key);
+
+void flow_key_session(const struct ng_session *s, struct flow_key *key);
+
+struct ng_session *flow_lookup(const struct flow_table *table, const struct flow_key *key);
+
+int flow_insert(struct flow_table *table, struct ng_session *s);
+
+void flow_remove(struct flow_table *table, const struct ng_session *s);
+
+int flow_shard(const uint8_t *pkt, size_t length, int shards);
+
+uint16_t get_mtu();
+
+uint16_t get_default_mss(int version);
+
+int check_tun(const struct arguments *args,
+              const struct epoll_event *ev,
+              const int epoll_fd,
+              int sessions, int maxsessions);
+
+int is_lower_layer(int protocol);
+
+int is_upper_layer(int protocol);
+
+uint8_t get_ip6_protocol(const uint8_t *pkt, size_t length, size_t *off);
+
+void handle_tun_packet(const struct arguments *args, uint8_t *buffer, size_t length,
+                       const int epoll_fd, int sessions, int maxsessions);
+
+void handle_ip(const struct arguments *args,
+               const uint8_t *buffer, size_t length,
+               const int epoll_fd,
+               int sessions, int maxsessions);
+
+void init_template(struct packet_template *tpl, int version, uint8_t protocol,
+                   const void *saddr, const void *daddr);
+
+size_t apply_template(const struct packet_template *tpl, int version,
+                      uint8_t *buffer, size_t l4len, uint16_t *csum);
+
+ssize_t write_packet(const struct arguments *args, const uint8_t *header, size_t hlen,
+                     const uint8_t *data, size_t datalen);
+
+int get_icmp_timeout(const struct icmp_session *u, int sessions, int maxsessions);
+
+int check_icmp_session(const struct arguments *args,
+                       struct ng_session *s,
+                       int sessions, int maxsessions);
+
+void check_icmp_socket(const struct arguments *args, const struct epoll_event *ev);
+
+jboolean handle_icmp(const struct arguments *args,
+                     const uint8_t *pkt, size_t length,
+                     const uint8_t *payload,
+                     int uid,
+                     const int epoll_fd);
+
+int open_icmp_socket(const struct arguments *args, const struct icmp_session *cur);
+
+ssize_t write_icmp(const struct arguments *args, const struct icmp_session *cur,
+                   uint8_t *data, size_t datalen);
+
+int get_udp_timeout(const struct udp_session *u, int sessions, int maxsessions);
+
+int check_udp_session(const struct arguments *args,
+                      struct ng_session *s,
+                      int sessions, int maxsessions);
+
+void check_udp_socket(const struct arguments *args, const struct epoll_event *ev);
+
+jboolean handle_udp(const struct arguments *args,
+                    const uint8_t *pkt, size_t length,
+                    const uint8_t *payload,
+                    int uid,
+                    struct allowed *redirect,
+                    const int epoll_fd);
+
+int open_udp_socket(const struct arguments *args,
+                    struct udp_session *cur, const struct allowed *redirect);
+
+void flush_udp(const struct arguments *args);
+
+void free_udp_batch(struct worker *worker);
+
+ssize_t write_udp(const struct arguments *args, const struct udp_session *cur,
+                  uint8_t *data, size_t datalen);
+
+void clear_tcp_data(struct worker *worker, struct tcp_session *cur);
+
+int get_tcp_timeout(const struct tcp_session *t, int sessions, int maxsessions);
+
+int check_tcp_session(const struct arguments *args,
+                      struct ng_session *s,
+                      int sessions, int maxsessions);
+
+int monitor_tcp_session(const struct arguments *args, struct ng_session *s, int epoll_fd);
+
+void check_tcp_socket(const struct arguments *args,
+                      const struct epoll_event *ev,
+                      const int epoll_fd);
+
+jboolean handle_tcp(const struct arguments *args,
+                    const uint8_t *pkt, size_t length,
+                    const uint8_t *payload,
+                    int uid, int allowed, struct allowed *redirect,
+                    const int epoll_fd);
+
+void queue_tcp(const struct arguments *args,
+               const struct tcphdr *tcphdr,
+               const char *session, struct tcp_session *cur,
+               const uint8_t *data, uint16_t datalen);
+
+int open_tcp_socket(const struct arguments *args,
+                    const struct tcp_session *cur, const struct allowed *redirect);
+
+int write_syn_ack(const struct arguments *args, struct tcp_session *cur);
+
+int write_ack(const struct arguments *args, struct tcp_session *cur);
+
+int write_data(const struct arguments *args, struct tcp_session *cur,
+               const uint8_t *buffer, size_t length);
+
+int write_fin_ack(const struct arguments *args, struct tcp_session *cur);
+
+void write_rst(const struct arguments *args, struct tcp_session *cur);
+
+ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur,
+                  const uint8_t *data, size_t datalen,
+                  int syn, int ack, int fin, int rst);
+
+uint32_t get_send_window(const struct tcp_session *cur);
+
+uint32_t get_receive_buffer(const struct ng_session *cur);
+
+uint32_t get_receive_window(const struct ng_session *cur);
+
+void log_packet_hex(const struct arguments *args, const uint8_t *data, size_t length, int direction);
+
+int get_client_hello_sni(const uint8_t *hello, size_t len, char *server_name);
+
+int get_sni(const uint8_t *data, size_t datalen, char *server_name);
+
+int get_http_host(const uint8_t *data, size_t datalen, char *server_name);
+
+void session_set_name(struct ng_session *s, const char *name);
+
+void session_free_name(struct ng_session *s);
+
+int inspect_server_name(const struct arguments *args, struct ng_session *s,
+                        const uint8_t *data, size_t datalen, uint32_t seq);
+
+int inspect_quic_name(const struct arguments *args, struct ng_session *s,
+                      const uint8_t *data, size_t datalen);
+
+void hkdf_extract(const uint8_t *salt, size_t saltlen,
+                  const uint8_t *ikm, size_t ikmlen, uint8_t *prk);
+
+void hkdf_expand_label(const uint8_t *secret, const char *label, uint8_t *out, size_t outlen);
+
+void aes128_init(struct aes128 *aes, const uint8_t *key);
+
+void aes128_encrypt(const struct aes128 *aes, const uint8_t *in, uint8_t *out);
+
+int aes128_gcm_open(const uint8_t *key, const uint8_t *iv,
+                    const uint8_t *aad, size_t aadlen,
+                    const uint8_t *in, size_t len, const uint8_t *tag,
+                    uint8_t *out);
+
+int uid_deferred(const struct arguments *args);
+
+jint get_uid(const struct arguments *args, const uint8_t *pkt, const uint8_t *payload, uint8_t protocol);
+
+jint get_flow_uid(const struct arguments *args, const struct flow_key *key);
+
+jint get_uid_q(const struct arguments *args, int version, int protocol,
+               const char *source, uint16_t sport, const char *dest, uint16_t dport);
+
+void uid_free(struct context *ctx);
+
+jboolean filter_tcp_packet(const struct arguments *args, const uint8_t *data, size_t length, int direction,
+                           const char *name);
+
+jboolean filter_udp_packet(const struct arguments *args, const uint8_t *data, size_t length, int direction,
+                           const char *name);
+
+jboolean filter_icmp_packet(const struct arguments *args, const uint8_t *data, size_t length, int direction);
+
+int filter_flows(const struct arguments *args, const jint *flows, const char **names, int count,
+                 jboolean *verdicts);
+
+struct rule_table *rule_compile(const jint *data, size_t count, int flags);
+
+void rule_set(struct context *ctx, struct rule_table *table);
+
+void rule_set_state(struct context *ctx, int state);
+
+void rule_free(struct context *ctx);
+
+void rule_invalidate(struct context *ctx);
+
+uint32_t rule_generation(struct context *ctx);
+
+int rule_evaluate(struct context *ctx,
+                  const uint8_t *pkt, uint8_t protocol, uint16_t dport, int syn, int uid);
+
+int domain_compile(const char *source_path, const char *path, int complete, uint64_t source);
+
+struct domain_table *domain_open(const char *path);
+
+void domain_close(struct domain_table *table);
+
+int domain_lookup(const struct domain_table *table, const char *name);
+
+void domain_set(struct context *ctx, int list, struct domain_table *table);
+
+void domain_free(struct context *ctx);
+
+int domain_evaluate(struct context *ctx, const char *name);
+
+int verdict_request(const struct arguments *args, const uint8_t *pkt, size_t length,
+                    const uint8_t *payload, uint8_t protocol, jint uid, const char *name,
+                    struct ng_session *cur, int cacheable, int owner);
+
+void verdict_flush(const struct arguments *args);
+
+void verdict_complete(const struct arguments *args, int epoll_fd, int maxsessions);
+
+void verdict_expire(struct worker *w, time_t now);
+
+void verdict_clear(struct worker *w);
+
+void verdict_start(const struct arguments *args, jobject instance);
+
+void verdict_stop(struct context *ctx);
+
+void traffic_fold(struct worker *worker, struct ng_session *s);
+
+void traffic_flush(struct worker *worker);
+
+void traffic_flow(struct worker *worker, const struct ng_session *s);
+
+void traffic_block(struct worker *worker, jint uid);
+
+int traffic_snapshot(struct context *ctx, struct traffic_entry **entries);
+
+void traffic_free(struct worker *worker);
+
+int get_dns_query(const uint8_t *data, size_t datalen,
+                  char *qname, uint16_t *qtype, uint16_t *qclass, size_t *qend);
+
+int handle_dns_query(const struct arguments *args,
+                     const uint8_t *pkt, size_t length,
+                     const uint8_t *payload);
+
+size_t dns_question_end(const uint8_t *data, size_t datalen);
+
+uint32_t dns_question_hash(const uint8_t *data, size_t qend);
+
+void dns_reply_session(const uint8_t *pkt, const uint8_t *payload, struct udp_session *reply);
+
+int is_dns_redirect(const uint8_t *pkt, const uint8_t *payload);
+
+size_t dns_skip_name(const uint8_t *data, size_t datalen, size_t off);
+
+int dns_cache_answer(const struct arguments *args,
+                     const uint8_t *pkt, size_t length,
+                     const uint8_t *payload, jint uid);
+
+void dns_cache_store(struct context *ctx, const uint8_t *data, size_t datalen);
+
+void dns_cache_clear(struct context *ctx);
+
+void dns_cache_get_stats(struct context *ctx, struct dns_cache_stats *stats);
+
+void dns_names_store(struct context *ctx, const uint8_t *data, size_t datalen, jint uid);
+
+int dns_names_lookup(struct context *ctx, int version, const void *addr, jint uid, char *name);
+
+void dns_names_clear(struct context *ctx);
+
+void dns_mux_init(struct context *ctx);
+
+int dns_mux_query(const struct arguments *args,
+                  const uint8_t *pkt, size_t length,
+                  const uint8_t *payload, jint uid, int epoll_fd);
+
+int is_dns_upstream(const struct context *ctx, const void *ptr);
+
+void check_dns_upstream(const struct arguments *args, const struct epoll_event *ev);
+
+void dns_mux_close(struct context *ctx);
+
+uint16_t calc_checksum(uint16_t start, const uint8_t *buffer, size_t length);
+
+void checksum_init();
+
+uint16_t checksum_update16(uint16_t check, uint16_t from, uint16_t to);
+
+uint16_t checksum_update32(uint16_t check, uint32_t from, uint32_t to);
+
+uint16_t checksum_update(uint16_t check, const void *from, const void *to, size_t length);
+
+int compare_u32(uint32_t seq1, uint32_t seq2);
+
+void log_android(int prio, const char *fmt, ...);
+
+char *hex(const u_int8_t *data, const size_t len);
+
+int is_event(int fd, short event);
+
+int is_readable(int fd);
+
+long long get_ms();
+
+void *ng_malloc(size_t __byte_count, const char *tag);
+
+void *ng_calloc(size_t __item_count, size_t __item_size, const char *tag);
+
+void ng_add_alloc(void *ptr, const char *tag);
+
+void ng_delete_alloc(void *ptr, const char *file, int line);
+
+void ng_free(void *__ptr, const char *file, int line);
+
+void *ng_pool_alloc(size_t size, const char *tag);
+
+void ng_pool_free(void *ptr, const char *file, int line);
+
+void ng_pool_drain();
+
+void ng_pool_get_stats(struct pool_stats *stats);
+
+void slab_init(struct slab *slab, size_t size, size_t per_chunk, const char *tag);
+
+void *slab_alloc(struct slab *slab);
+
+void slab_free(struct slab *slab, void *obj);
+
+void slab_reset(struct slab *slab);
+
+void slab_destroy(struct slab *slab);
+
+void slab_log_stats(const struct slab *slab);
+
+int lf_stack_push(struct lf_stack *stack, void *node, size_t link);
+
+void *lf_stack_take(struct lf_stack *stack, size_t link);
@@ -0,0 +1,433 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// Domain lists are written by Java as text, see RuleDatabase.kt and
+// CustomDomainRule.kt. Each line is a kind, a space and a domain:
+//   B  block the name
+//   a  unblock the name, undoes an earlier B
+//   S  block the name and all names below it
+//   D  block the names below it only (*.name)
+//   W  never block the name
+// The text is compiled once into a read-only file holding the names with
+// their labels reversed and sorted, so the name and each of its parents is
+// found with a binary search. The file is mapped, not read: opening it costs
+// nothing, and only the pages lookups touch become resident, shared by
+// every mapping of the file.
+//
+// A list is complete when Java kept no rules the engine cannot evaluate
+// (regular expressions, wildcards other than *.name); only then is a name
+// that is not listed allowed without asking Java.
+
+struct domain_build {
+    const char *name;
+    uint32_t order; // line number, orders the lines of a name
+    uint8_t length;
+    char kind;
+};
+
+static size_t domain_reverse(const char *name, size_t len, char *out) {
+    // ads.example.com -> com.example.ads
+    size_t o = 0;
+    size_t end = len;
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && name[start - 1] != '.')
+            start--;
+        if (o)
+            out[o++] = '.';
+        for (size_t i = start; i < end; i++)
+            out[o++] = (char) tolower((unsigned char) name[i]);
+        end = (start > 0 ? start - 1 : 0);
+    }
+    return o;
+}
+
+static int domain_compare(const char *n1, size_t l1, const char *n2, size_t l2) {
+    int c = memcmp(n1, n2, l1 < l2 ? l1 : l2);
+    if (c)
+        return c;
+    return (l1 < l2 ? -1 : (l1 > l2 ? 1 : 0));
+}
+
+static int domain_sort(const void *a, const void *b) {
+    const struct domain_build *e1 = a;
+    const struct domain_build *e2 = b;
+    int c = domain_compare(e1->name, e1->length, e2->name, e2->length);
+    if (c)
+        return c;
+    return (e1->order < e2->order ? -1 : (e1->order > e2->order ? 1 : 0));
+}
+
+static char *read_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_android(ANDROID_LOG_ERROR, "Domains open %s error %d: %s", path, errno, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        log_android(ANDROID_LOG_ERROR, "Domains fstat error %d: %s", errno, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    char *data = ng_malloc((size_t) st.st_size + 1, "domains file");
+    if (data == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t total = 0;
+    while (total < (size_t) st.st_size) {
+        ssize_t n = read(fd, data + total, (size_t) st.st_size - total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            log_android(ANDROID_LOG_ERROR, "Domains read error %d: %s", errno, strerror(errno));
+            ng_free(data, __FILE__, __LINE__);
+            close(fd);
+            return NULL;
+        }
+        total += (size_t) n;
+    }
+    close(fd);
+
+    data[total] = 0;
+    *size = total;
+    return data;
+}
+
+static int write_all(int fd, const void *data, size_t length) {
+    const uint8_t *p = data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        length -= (size_t) n;
+    }
+    return 0;
+}
+
+int domain_compile(const char *source_path, const char *path, int complete, uint64_t source) {
+    size_t size = 0;
+    char *data = read_file(source_path, &size);
+    if (data == NULL)
+        return -1;
+
+    // A line takes at least a kind, a space, one character and a line end
+    size_t lines = size / 4 + 1;
+    struct domain_build *entries = ng_malloc(lines * sizeof(struct domain_build), "domain build");
+    struct domain_record *records = ng_malloc(lines * sizeof(struct domain_record), "domain records");
+    char *reversed = ng_malloc(size + 1, "domain build names");
+    char *names = ng_malloc(size + 1, "domain names");
+    if (entries == NULL || records == NULL || reversed == NULL || names == NULL) {
+        if (entries != NULL)
+            ng_free(entries, __FILE__, __LINE__);
+        if (records != NULL)
+            ng_free(records, __FILE__, __LINE__);
+        if (reversed != NULL)
+            ng_free(reversed, __FILE__, __LINE__);
+        if (names != NULL)
+            ng_free(names, __FILE__, __LINE__);
+        ng_free(data, __FILE__, __LINE__);
+        return -1;
+    }
+
+    uint32_t count = 0;
+    size_t used = 0;
+    uint32_t order = 0;
+    char *line = data;
+    while (line != NULL && *line) {
+        char *eol = strchr(line, '\n');
+        size_t len = (eol == NULL ? strlen(line) : (size_t) (eol - line));
+        if (len > 0 && line[len - 1] == '\r')
+            len--;
+        char *name = line + 2;
+        size_t nlen = (len > 2 ? len - 2 : 0);
+        if (nlen > 0 && name[nlen - 1] == '.')
+            nlen--;
+
+        char kind = line[0];
+        if (nlen > 0 && nlen <= DNS_QNAME_MAX && line[1] == ' ' &&
+            (kind == 'B' || kind == 'a' || kind == 'S' || kind == 'D' || kind == 'W')) {
+            struct domain_build *e = &entries[count++];
+            e->name = reversed + used;
+            e->length = (uint8_t) domain_reverse(name, nlen, reversed + used);
+            e->order = order;
+            e->kind = kind;
+            used += e->length;
+        }
+
+        order++;
+        line = (eol == NULL ? NULL : eol + 1);
+    }
+    ng_free(data, __FILE__, __LINE__);
+
+    qsort(entries, count, sizeof(struct domain_build), domain_sort);
+
+    // Fold the lines of a name into one record, in file order;
+    // names are stored in record order so neighbours share pages
+    uint32_t records_count = 0;
+    uint64_t names_size = 0;
+    for (uint32_t i = 0; i < count;) {
+        uint32_t j = i;
+        uint8_t flags = 0;
+        for (; j < count && !domain_compare(entries[i].name, entries[i].length,
+                                            entries[j].name, entries[j].length); j++)
+            switch (entries[j].kind) {
+                case 'B':
+                    flags |= DOMAIN_EXACT;
+                    break;
+                case 'a':
+                    flags &= ~DOMAIN_EXACT;
+                    break;
+                case 'S':
+                    flags |= DOMAIN_EXACT | DOMAIN_SUBDOMAINS;
+                    break;
+                case 'D':
+                    flags |= DOMAIN_SUBDOMAINS;
+                    break;
+                case 'W':
+                    flags |= DOMAIN_WHITELIST;
+                    break;
+            }
+
+        if (flags) {
+            struct domain_record *r = &records[records_count++];
+            r->offset = (uint32_t) names_size;
+            r->length = entries[i].length;
+            r->flags = flags;
+            r->reserved = 0;
+            memcpy(names + names_size, entries[i].name, entries[i].length);
+            names_size += entries[i].length;
+        }
+        i = j;
+    }
+    ng_free(entries, __FILE__, __LINE__);
+    ng_free(reversed, __FILE__, __LINE__);
+
+    struct domain_file_header header;
+    memset(&header, 0, sizeof(struct domain_file_header));
+    header.magic = DOMAIN_FILE_MAGIC;
+    header.version = DOMAIN_FILE_VERSION;
+    header.count = records_count;
+    header.complete = (uint32_t) (complete ? 1 : 0);
+    header.source = source;
+    header.names_size = names_size;
+
+    // Written aside and renamed, so mappings of the previous file stay valid
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int ok = (fd >= 0 &&
+              !write_all(fd, &header, sizeof(struct domain_file_header)) &&
+              !write_all(fd, records, records_count * sizeof(struct domain_record)) &&
+              !write_all(fd, names, names_size));
+    if (fd >= 0 && close(fd) < 0)
+        ok = 0;
+    if (ok && rename(tmp, path) < 0)
+        ok = 0;
+
+    if (ok)
+        log_android(ANDROID_LOG_WARN, "Domains compiled %u names %llu bytes complete %d",
+                    records_count, (unsigned long long) names_size, complete);
+    else {
+        log_android(ANDROID_LOG_ERROR, "Domains compile %s error %d: %s", path, errno, strerror(errno));
+        unlink(tmp);
+    }
+
+    ng_free(records, __FILE__, __LINE__);
+    ng_free(names, __FILE__, __LINE__);
+    return (ok ? 0 : -1);
+}
+
+struct domain_table *domain_open(const char *path) {
+    struct domain_table *table = ng_calloc(1, sizeof(struct domain_table), "domains");
+    if (table == NULL)
+        return NULL;
+
+    // No file is an empty list
+    table->complete = 1;
+    if (path == NULL)
+        return table;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_android(ANDROID_LOG_ERROR, "Domains open %s error %d: %s", path, errno, strerror(errno));
+        ng_free(table, __FILE__, __LINE__);
+        return NULL;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(struct domain_file_header))
+        map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_android(ANDROID_LOG_ERROR, "Domains map %s error %d: %s", path, errno, strerror(errno));
+        ng_free(table, __FILE__, __LINE__);
+        return NULL;
+    }
+
+    // Only the header is checked, records are bounds checked when used
+    const struct domain_file_header *header = map;
+    uint64_t expected = sizeof(struct domain_file_header) +
+                        (uint64_t) header->count * sizeof(struct domain_record) +
+                        header->names_size;
+    if (header->magic != DOMAIN_FILE_MAGIC || header->version != DOMAIN_FILE_VERSION ||
+        header->names_size > (uint64_t) st.st_size || expected != (uint64_t) st.st_size) {
+        log_android(ANDROID_LOG_WARN, "Domains %s version %u size %lld not usable",
+                    path, header->version, (long long) st.st_size);
+        munmap(map, (size_t) st.st_size);
+        ng_free(table, __FILE__, __LINE__);
+        return NULL;
+    }
+
+    // Lookups jump around, read ahead would only fill memory
+    madvise(map, (size_t) st.st_size, MADV_RANDOM);
+
+    table->count = header->count;
+    table->complete = (header->complete != 0);
+    table->source = header->source;
+    table->records = (const struct domain_record *) (header + 1);
+    table->names = (const char *) (table->records + header->count);
+    table->names_size = header->names_size;
+    table->map = map;
+    table->map_size = (size_t) st.st_size;
+    return table;
+}
+
+void domain_close(struct domain_table *table) {
+    if (table == NULL)
+        return;
+    if (table->map != NULL)
+        munmap(table->map, table->map_size);
+    ng_free(table, __FILE__, __LINE__);
+}
+
+void domain_set(struct context *ctx, int list, struct domain_table *table) {
+    if (list < 0 || list >= DOMAIN_LISTS) {
+        domain_close(table);
+        return;
+    }
+
+    if (pthread_rwlock_wrlock(&ctx->rule_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_rwlock_wrlock failed");
+    struct domain_table *old = ctx->domains[list];
+    ctx->domains[list] = table;
+    if (pthread_rwlock_unlock(&ctx->rule_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_rwlock_unlock failed");
+
+    domain_close(old);
+}
+
+void domain_free(struct context *ctx) {
+    for (int list = 0; list < DOMAIN_LISTS; list++)
+        domain_set(ctx, list, NULL);
+}
+
+static const struct domain_record *domain_find(const struct domain_table *table,
+                                               const char *name, size_t len) {
+    uint32_t low = 0;
+    uint32_t high = table->count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        const struct domain_record *r = &table->records[mid];
+        if ((uint64_t) r->offset + r->length > table->names_size)
+            return NULL;
+        int c = domain_compare(table->names + r->offset, r->length, name, len);
+        if (c == 0)
+            return r;
+        if (c < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return NULL;
+}
+
+static int domain_match(const struct domain_table *table, const char *name, size_t len) {
+    const struct domain_record *r = domain_find(table, name, len);
+    if (r != NULL) {
+        if (r->flags & DOMAIN_WHITELIST)
+            return VERDICT_ALLOW;
+        if (r->flags & DOMAIN_EXACT)
+            return VERDICT_BLOCK;
+    }
+
+    // Parents are the prefixes of the reversed name ending at a label
+    for (size_t i = len; i > 0; i--)
+        if (name[i - 1] == '.') {
+            r = domain_find(table, name, i - 1);
+            if (r != NULL && (r->flags & DOMAIN_SUBDOMAINS))
+                return VERDICT_BLOCK;
+        }
+
+    return VERDICT_UNKNOWN;
+}
+
+int domain_lookup(const struct domain_table *table, const char *name) {
+    char reversed[DNS_QNAME_MAX + 1];
+    size_t len = strlen(name);
+    if (len > 0 && name[len - 1] == '.')
+        len--;
+    if (len == 0 || len > DNS_QNAME_MAX)
+        return VERDICT_UNKNOWN;
+    len = domain_reverse(name, len, reversed);
+    return domain_match(table, reversed, len);
+}
+
+int domain_evaluate(struct context *ctx, const char *name) {
+    if (pthread_rwlock_rdlock(&ctx->rule_lock)) {
+        log_android(ANDROID_LOG_ERROR, "pthread_rwlock_rdlock failed");
+        return VERDICT_UNKNOWN;
+    }
+
+    int verdict = VERDICT_ALLOW;
+    if (ctx->rules == NULL || (ctx->rules->flags & RULE_FLAG_LOG))
+        verdict = VERDICT_UNKNOWN;
+    else
+        for (int list = 0; list < DOMAIN_LISTS; list++) {
+            const struct domain_table *table = ctx->domains[list];
+            if (table == NULL) {
+                verdict = VERDICT_UNKNOWN;
+                continue;
+            }
+
+            // A whitelisted name is allowed by its own list only
+            int v = domain_lookup(table, name);
+            if (v == VERDICT_BLOCK) {
+                verdict = VERDICT_BLOCK;
+                break;
+            }
+            if (v == VERDICT_UNKNOWN && !table->complete)
+                verdict = VERDICT_UNKNOWN;
+        }
+
+    if (pthread_rwlock_unlock(&ctx->rule_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_rwlock_unlock failed");
+
+    return verdict;
+}
@@ -0,0 +1,233 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// Rules are compiled by Java into a flat int array, see NativeRuleSet.kt.
+// Rules without uid are checked first, in order, the first match wins.
+// Rules with uid are sorted by uid so the packet owner is found with a
+// binary search. Whatever cannot be decided here goes to Java.
+//
+// Verdicts are cached on sessions together with the rule generation they
+// were made under; any change of rules or state bumps the generation.
+
+struct rule_table *rule_compile(const jint *data, size_t count, int flags) {
+    struct rule_table *table = ng_malloc(sizeof(struct rule_table) + count * sizeof(struct rule), "rules");
+    if (table == NULL)
+        return NULL;
+
+    table->flags = flags;
+    table->count = (uint32_t) count;
+    table->generic = 0;
+    table->with_uid = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const jint *r = data + i * RULE_STRIDE;
+        struct rule *rule = &table->rules[i];
+        rule->uid = r[0];
+        rule->protocol = (uint8_t) r[1];
+        rule->port_low = (uint16_t) r[2];
+        rule->port_high = (uint16_t) r[3];
+        rule->conditions = (uint8_t) r[4];
+        rule->verdict = (uint8_t) (r[5] ? VERDICT_ALLOW : VERDICT_BLOCK);
+        rule->version = (uint8_t) r[6];
+        rule->prefix = (uint8_t) r[7];
+        for (int w = 0; w < 4; w++)
+            rule->addr[w] = (uint32_t) r[8 + w];
+
+        if (rule->version != 0 && rule->version != 4 && rule->version != 6) {
+            log_android(ANDROID_LOG_ERROR, "Rule %zu invalid version %d", i, rule->version);
+            ng_free(table, __FILE__, __LINE__);
+            return NULL;
+        }
+        if (rule->prefix > (rule->version == 4 ? 32 : 128))
+            rule->prefix = (uint8_t) (rule->version == 4 ? 32 : 128);
+
+        if (rule->uid == RULE_ANY_UID) {
+            if (table->with_uid) {
+                log_android(ANDROID_LOG_ERROR, "Rule %zu without uid after uid rules", i);
+                ng_free(table, __FILE__, __LINE__);
+                return NULL;
+            }
+            table->generic++;
+        } else {
+            if (table->with_uid && table->rules[i - 1].uid > rule->uid) {
+                log_android(ANDROID_LOG_ERROR, "Rule %zu uid %d not sorted", i, rule->uid);
+                ng_free(table, __FILE__, __LINE__);
+                return NULL;
+            }
+            table->with_uid++;
+        }
+    }
+
+    return table;
+}
+
+void rule_set(struct context *ctx, struct rule_table *table) {
+    if (pthread_rwlock_wrlock(&ctx->rule_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_rwlock_wrlock failed");
+    struct rule_table *old = ctx->rules;
+    ctx->rules = table;
+    rule_invalidate(ctx);
+    if (pthread_rwlock_unlock(&ctx->rule_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_rwlock_unlock failed");
+
+    if (old != NULL)
+        ng_free(old, __FILE__, __LINE__);
+
+    if (table != NULL)
+        log_android(ANDROID_LOG_WARN, "Rules set generic %u uid %u flags %d",
+                    table->generic, table->with_uid, table->flags);
+}
+
+void rule_set_state(struct context *ctx, int state) {
+    if (pthread_rwlock_wrlock(&ctx->rule_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_rwlock_wrlock failed");
+    if (ctx->rule_state != state) {
+        ctx->rule_state = state;
+        rule_invalidate(ctx);
+    }
+    if (pthread_rwlock_unlock(&ctx->rule_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_rwlock_unlock failed");
+}
+
+void rule_free(struct context *ctx) {
+    rule_set(ctx, NULL);
+}
+
+void rule_invalidate(struct context *ctx) {
+    // Zero is reserved for sessions without a verdict
+    if (__atomic_add_fetch(&ctx->rule_generation, 1, __ATOMIC_RELEASE) == 0)
+        __atomic_add_fetch(&ctx->rule_generation, 1, __ATOMIC_RELEASE);
+}
+
+uint32_t rule_generation(struct context *ctx) {
+    return __atomic_load_n(&ctx->rule_generation, __ATOMIC_ACQUIRE);
+}
+
+static int is_local_ip4(uint32_t daddr) {
+    return ((daddr >> 24) == 10 ||
+            (daddr >> 20) == ((172 << 4) | 1) ||
+            (daddr >> 16) == ((192 << 8) | 168) ||
+            (daddr >> 16) == ((169 << 8) | 254) ||
+            (daddr >> 24) == 127);
+}
+
+static int rule_match(const struct rule *rule, int state,
+                      uint8_t version, const uint32_t *daddr,
+                      uint8_t protocol, uint16_t dport) {
+    if (!(rule->conditions & state & RULE_NET_ANY))
+        return 0;
+    if ((rule->conditions & RULE_SCREEN_OFF) && !(state & RULE_SCREEN_OFF))
+        return 0;
+    if (rule->protocol && rule->protocol != protocol)
+        return 0;
+    if (dport < rule->port_low || dport > rule->port_high)
+        return 0;
+
+    if (rule->version) {
+        if (rule->version != version)
+            return 0;
+        int bits = rule->prefix;
+        for (int w = 0; bits > 0; w++, bits -= 32) {
+            uint32_t mask = (bits >= 32 ? 0xFFFFFFFF : ~(0xFFFFFFFF >> bits));
+            if ((daddr[w] & mask) != (rule->addr[w] & mask))
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+int rule_evaluate(struct context *ctx,
+                  const uint8_t *pkt, uint8_t protocol, uint16_t dport, int syn, int uid) {
+    // Only connection attempts of TCP were ever filtered
+    if (protocol == IPPROTO_TCP && !syn)
+        return VERDICT_ALLOW;
+
+    uint8_t version = (*pkt) >> 4;
+    uint32_t daddr[4];
+    if (version == 4) {
+        daddr[0] = ntohl(((const struct iphdr *) pkt)->daddr);
+        daddr[1] = daddr[2] = daddr[3] = 0;
+    } else {
+        const uint32_t *d = (const uint32_t *) &((const struct ip6_hdr *) pkt)->ip6_dst;
+        for (int w = 0; w < 4; w++)
+            daddr[w] = ntohl(d[w]);
+    }
+
+    if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6)
+        dport = 0;
+
+    int verdict = VERDICT_ALLOW;
+    if (pthread_rwlock_rdlock(&ctx->rule_lock)) {
+        log_android(ANDROID_LOG_ERROR, "pthread_rwlock_rdlock failed");
+        return VERDICT_UNKNOWN;
+    }
+
+    const struct rule_table *table = ctx->rules;
+    int state = ctx->rule_state;
+
+    if (table == NULL)
+        verdict = VERDICT_UNKNOWN;
+    else if ((table->flags & RULE_FLAG_ALLOW_LOCAL) && version == 4 && is_local_ip4(daddr[0]) &&
+             !(protocol == IPPROTO_UDP && dport == 53)) // DNS was never exempted
+        verdict = VERDICT_ALLOW;
+    else if (table->flags & RULE_FLAG_LOG)
+        verdict = VERDICT_UNKNOWN;
+    else {
+        int decided = 0;
+        for (uint32_t i = 0; i < table->generic; i++)
+            if (rule_match(&table->rules[i], state, version, daddr, protocol, dport)) {
+                verdict = table->rules[i].verdict;
+                decided = 1;
+                break;
+            }
+
+        const struct rule *first = table->rules + table->generic;
+        const struct rule *last = first + table->with_uid;
+        if (!decided && uid < 0) {
+            // Owner unknown: only Java can resolve it when a uid rule could apply
+            for (const struct rule *r = first; r < last; r++)
+                if (rule_match(r, state, version, daddr, protocol, dport)) {
+                    verdict = VERDICT_UNKNOWN;
+                    break;
+                }
+        } else if (!decided) {
+            while (first < last) {
+                const struct rule *mid = first + (last - first) / 2;
+                if (mid->uid < uid)
+                    first = mid + 1;
+                else
+                    last = mid;
+            }
+            last = table->rules + table->count;
+            for (const struct rule *r = first; r < last && r->uid == uid; r++)
+                if (rule_match(r, state, version, daddr, protocol, dport)) {
+                    verdict = r->verdict;
+                    break;
+                }
+        }
+    }
+
+    if (pthread_rwlock_unlock(&ctx->rule_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_rwlock_unlock failed");
+
+    return verdict;
+}
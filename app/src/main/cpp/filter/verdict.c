@@ -0,0 +1,449 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+extern JavaVM *jvm;
+
+// The filter methods of Java are called on a thread of their own, so a slow
+// decision holds up only the flow it is about. The packet opening a flow is
+// parked on its worker with the packets of the flow that follow it; the
+// answer comes back on a stack of the worker, which then handles the parked
+// packets again with the verdict. A flow that has a session keeps its verdict
+// while a new one is asked for. When the thread is not running or a worker
+// has too many flows waiting, Java is called on the worker as before.
+//
+// A worker queues the requests of a round together. The thread takes what
+// is queued, up to VERDICT_BATCH, and passes the flows to Java as an array
+// of descriptors in one call. DNS queries are judged by their question, so
+// Java gets their packets one at a time, as it does for all requests when
+// it has no batch method.
+//
+// On Android 10 and later the owner of a new flow is asked of
+// ConnectivityManager, a Binder call. The worker parks such a flow with an
+// unknown owner, the thread looks the owner up first, then evaluates the
+// native rules with it, and only asks Java when they do not decide.
+
+void verdict_flush(const struct arguments *args) {
+    struct worker *w = args->worker;
+    if (w->requests == NULL)
+        return;
+
+    struct verdict_queue *queue = &args->ctx->verdict_queue;
+    if (pthread_mutex_lock(&queue->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    if (queue->tail == NULL)
+        queue->head = w->requests;
+    else
+        queue->tail->next = w->requests;
+    queue->tail = w->requests_tail;
+    pthread_cond_signal(&queue->cond);
+    if (pthread_mutex_unlock(&queue->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+
+    w->requests = NULL;
+    w->requests_tail = NULL;
+}
+
+static int park_packet(struct worker *w, struct pending_verdict *e, const uint8_t *pkt, size_t length) {
+    if (e->count >= VERDICT_PACKETS) {
+        w->verdict_stats.dropped++;
+        return 0;
+    }
+    uint8_t *buffer = ng_pool_alloc(length, "parked packet");
+    if (buffer == NULL) {
+        w->verdict_stats.dropped++;
+        return 0;
+    }
+    memcpy(buffer, pkt, length);
+    e->packet[e->count] = buffer;
+    e->length[e->count] = length;
+    e->count++;
+    return 1;
+}
+
+static void free_pending(struct pending_verdict *e) {
+    for (int i = 0; i < e->count; i++)
+        ng_pool_free(e->packet[i], __FILE__, __LINE__);
+    ng_free(e, __FILE__, __LINE__);
+}
+
+int verdict_request(const struct arguments *args, const uint8_t *pkt, size_t length,
+                    const uint8_t *payload, uint8_t protocol, jint uid, const char *name,
+                    struct ng_session *cur, int cacheable, int owner) {
+    struct context *ctx = args->ctx;
+    struct worker *w = args->worker;
+    if (!ctx->verdict_queue.running)
+        return VERDICT_UNKNOWN;
+
+    struct flow_key key;
+    flow_key_packet(pkt, payload, protocol, &key);
+    int refresh = (cur != NULL && cacheable && cur->verdict != VERDICT_UNKNOWN);
+
+    // Later packets of a new flow wait with the first one
+    if (cacheable && !refresh)
+        for (struct pending_verdict *e = w->pending; e != NULL; e = e->next)
+            if (e->cacheable && !e->refresh && memcmp(&e->key, &key, sizeof(struct flow_key)) == 0) {
+                park_packet(w, e, pkt, length);
+                return VERDICT_PENDING;
+            }
+
+    if (w->pending_count >= VERDICT_PENDING_MAX)
+        return VERDICT_UNKNOWN;
+
+    struct pending_verdict *e = ng_calloc(1, sizeof(struct pending_verdict), "pending verdict");
+    struct verdict_request *r = ng_malloc(sizeof(struct verdict_request) + length, "verdict request");
+    if (e == NULL || r == NULL) {
+        ng_free(e, __FILE__, __LINE__);
+        ng_free(r, __FILE__, __LINE__);
+        return VERDICT_UNKNOWN;
+    }
+
+    e->id = ++w->pending_id;
+    e->time = time(NULL);
+    e->refresh = refresh;
+    e->cacheable = cacheable;
+    e->generation = rule_generation(ctx);
+    e->key = key;
+    e->uid = uid;
+    e->owner = (owner != 0);
+    e->verdict = VERDICT_UNKNOWN;
+    if (!refresh && !park_packet(w, e, pkt, length)) {
+        ng_free(e, __FILE__, __LINE__);
+        ng_free(r, __FILE__, __LINE__);
+        return VERDICT_UNKNOWN;
+    }
+
+    r->next = NULL;
+    r->worker = w->index;
+    r->id = e->id;
+    r->protocol = protocol;
+    r->flow = cacheable;
+    r->key = key;
+    r->uid = uid;
+    r->owner = owner;
+    r->verdict = VERDICT_UNKNOWN;
+    strcpy(r->name, name);
+    r->length = length;
+    memcpy(r->packet, pkt, length);
+
+    e->next = w->pending;
+    w->pending = e;
+    w->pending_count++;
+    if (w->requests_tail == NULL)
+        w->requests = r;
+    else
+        w->requests_tail->next = r;
+    w->requests_tail = r;
+
+    if (refresh) {
+        w->verdict_stats.refreshed++;
+        return cur->verdict;
+    }
+    w->verdict_stats.parked++;
+    return VERDICT_PENDING;
+}
+
+static struct verdict_request *take_verdicts(struct worker *w) {
+    return lf_stack_take(&w->verdicts, offsetof(struct verdict_request, next));
+}
+
+void verdict_complete(const struct arguments *args, int epoll_fd, int maxsessions) {
+    struct worker *w = args->worker;
+    struct verdict_request *r = take_verdicts(w);
+    while (r != NULL) {
+        struct verdict_request *next = r->next;
+
+        // Gone when it expired or the sessions were cleared
+        struct pending_verdict **p = &w->pending;
+        while (*p != NULL && (*p)->id != r->id)
+            p = &(*p)->next;
+        struct pending_verdict *e = *p;
+        if (e != NULL) {
+            *p = e->next;
+            w->pending_count--;
+
+            if (e->refresh) {
+                // Unless the rules changed again while Java was deciding
+                struct ng_session *s = flow_lookup(&w->flows, &e->key);
+                if (s != NULL && s->verdict_generation == e->generation)
+                    s->verdict = (int8_t) r->verdict;
+            } else {
+                // The sessions the packets open get the owner the thread found
+                if (e->owner)
+                    e->uid = r->uid;
+                e->verdict = r->verdict;
+                w->replay = e;
+                for (int i = 0; i < e->count; i++)
+                    if (args->ctx->stopping)
+                        ng_pool_free(e->packet[i], __FILE__, __LINE__);
+                    else
+                        handle_tun_packet(args, e->packet[i], e->length[i], epoll_fd, w->sessions, maxsessions);
+                w->replay = NULL;
+                e->count = 0;
+            }
+            free_pending(e);
+        }
+
+        ng_free(r, __FILE__, __LINE__);
+        r = next;
+    }
+    flush_udp(args);
+}
+
+void verdict_expire(struct worker *w, time_t now) {
+    // Java did not answer, the senders retransmit
+    struct pending_verdict **p = &w->pending;
+    while (*p != NULL) {
+        struct pending_verdict *e = *p;
+        if (e->time + VERDICT_TIMEOUT <= now) {
+            log_android(ANDROID_LOG_WARN, "Worker %d verdict %u expired with %d packets",
+                        w->index, e->id, e->count);
+            *p = e->next;
+            w->pending_count--;
+            w->verdict_stats.expired++;
+            free_pending(e);
+        } else
+            p = &e->next;
+    }
+}
+
+void verdict_clear(struct worker *w) {
+    struct pending_verdict *e = w->pending;
+    while (e != NULL) {
+        struct pending_verdict *next = e->next;
+        free_pending(e);
+        e = next;
+    }
+    w->pending = NULL;
+    w->pending_count = 0;
+    w->replay = NULL;
+
+    struct verdict_request *r = w->requests;
+    while (r != NULL) {
+        struct verdict_request *next = r->next;
+        ng_free(r, __FILE__, __LINE__);
+        r = next;
+    }
+    w->requests = NULL;
+    w->requests_tail = NULL;
+}
+
+static void complete_request(struct context *ctx, struct verdict_request *r) {
+    struct worker *w = &ctx->workers[r->worker];
+    // The first of a batch wakes the worker, it takes the others with it
+    if (lf_stack_push(&w->verdicts, r, offsetof(struct verdict_request, next))) {
+        uint64_t one = 1;
+        if (write(w->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            log_android(ANDROID_LOG_ERROR, "Verdict wake error %d: %s", errno, strerror(errno));
+    }
+}
+
+static void describe_flow(const struct verdict_request *r, jint *flow) {
+    const struct flow_key *key = &r->key;
+    memset(flow, 0, FLOW_STRIDE * sizeof(jint));
+    flow[FLOW_VERSION] = key->version;
+    flow[FLOW_PROTOCOL] = key->protocol;
+    flow[FLOW_SOURCE_PORT] = ntohs(key->source);
+    flow[FLOW_DEST_PORT] = ntohs(key->dest);
+    flow[FLOW_UID] = r->uid;
+    if (key->version == 4) {
+        flow[FLOW_SOURCE] = (jint) ntohl(key->saddr.ip4);
+        flow[FLOW_DEST] = (jint) ntohl(key->daddr.ip4);
+    } else
+        for (int i = 0; i < 4; i++) {
+            flow[FLOW_SOURCE + i] = (jint) ntohl(key->saddr.ip6.s6_addr32[i]);
+            flow[FLOW_DEST + i] = (jint) ntohl(key->daddr.ip6.s6_addr32[i]);
+        }
+}
+
+static void find_owner(const struct arguments *args, struct verdict_request *r) {
+    // Parked by its worker with an unknown owner
+    struct context *ctx = args->ctx;
+    uint16_t dport = ntohs(r->key.dest);
+    r->uid = get_flow_uid(args, &r->key);
+    ctx->verdict_queue.owners++;
+
+    // The name the owner looked up, rather than the last one any app did
+    if (r->uid >= 0 && r->flow && dport != 53) {
+        if (pthread_mutex_lock(&ctx->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+        dns_names_lookup(ctx, r->key.version, &r->key.daddr, r->uid, r->name);
+        if (pthread_mutex_unlock(&ctx->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+    }
+
+    // Only connection attempts are parked, so a TCP packet here is a SYN
+    if (r->owner & VERDICT_RULES)
+        r->verdict = rule_evaluate(ctx, r->packet, r->protocol, dport, 1, r->uid);
+}
+
+static void judge_flows(const struct arguments *args, struct verdict_request **batch, int count) {
+    // The verdicts of the flows in the batch, the others are left unknown
+    struct verdict_queue *queue = &args->ctx->verdict_queue;
+    jint flows[VERDICT_BATCH * FLOW_STRIDE];
+    const char *names[VERDICT_BATCH];
+    jboolean verdicts[VERDICT_BATCH];
+    int index[VERDICT_BATCH];
+    int n = 0;
+    for (int i = 0; i < count; i++)
+        if (batch[i]->flow && batch[i]->verdict == VERDICT_UNKNOWN) {
+            describe_flow(batch[i], flows + n * FLOW_STRIDE);
+            names[n] = batch[i]->name;
+            index[n++] = i;
+        }
+    if (n == 0 || filter_flows(args, flows, names, n, verdicts) < 0)
+        return;
+
+    for (int i = 0; i < n; i++)
+        batch[index[i]]->verdict = (verdicts[i] ? VERDICT_ALLOW : VERDICT_BLOCK);
+    queue->batches++;
+    queue->flows += (uint64_t) n;
+}
+
+static void *verdict_thread(void *a) {
+    struct arguments *args = (struct arguments *) a;
+    struct context *ctx = args->ctx;
+    struct verdict_queue *queue = &ctx->verdict_queue;
+
+    JNIEnv *env = NULL;
+    if (jvm != NULL && (*jvm)->AttachCurrentThread(jvm, &env, NULL) != JNI_OK) {
+        log_android(ANDROID_LOG_ERROR, "Verdict thread attach failed");
+        env = NULL;
+    }
+    args->env = env;
+
+    while (1) {
+        if (pthread_mutex_lock(&queue->lock))
+            break;
+        while (!queue->stopping && queue->head == NULL)
+            pthread_cond_wait(&queue->cond, &queue->lock);
+        struct verdict_request *batch[VERDICT_BATCH];
+        int count = 0;
+        while (!queue->stopping && queue->head != NULL && count < VERDICT_BATCH) {
+            batch[count++] = queue->head;
+            queue->head = queue->head->next;
+        }
+        if (queue->head == NULL)
+            queue->tail = NULL;
+        if (pthread_mutex_unlock(&queue->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+        if (count == 0)
+            break;
+
+        for (int i = 0; i < count; i++)
+            if (batch[i]->owner)
+                find_owner(args, batch[i]);
+        judge_flows(args, batch, count);
+        for (int i = 0; i < count; i++) {
+            struct verdict_request *r = batch[i];
+            if (r->verdict == VERDICT_UNKNOWN) {
+                jboolean allow;
+                if (r->protocol == IPPROTO_ICMP || r->protocol == IPPROTO_ICMPV6)
+                    allow = filter_icmp_packet(args, r->packet, r->length, DIRECTION_TUN_IN);
+                else if (r->protocol == IPPROTO_UDP)
+                    allow = filter_udp_packet(args, r->packet, r->length, DIRECTION_TUN_IN, r->name);
+                else
+                    allow = filter_tcp_packet(args, r->packet, r->length, DIRECTION_TUN_IN, r->name);
+                r->verdict = (allow ? VERDICT_ALLOW : VERDICT_BLOCK);
+                queue->packets++;
+            }
+            complete_request(ctx, r);
+        }
+    }
+
+    if (env != NULL)
+        (*jvm)->DetachCurrentThread(jvm);
+    ng_free(args, __FILE__, __LINE__);
+    return NULL;
+}
+
+void verdict_start(const struct arguments *args, jobject instance) {
+    struct context *ctx = args->ctx;
+    struct verdict_queue *queue = &ctx->verdict_queue;
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->stopping = 0;
+    queue->running = 0;
+    queue->batches = 0;
+    queue->flows = 0;
+    queue->packets = 0;
+    queue->owners = 0;
+
+    struct arguments *vargs = ng_malloc(sizeof(struct arguments), "verdict arguments");
+    if (vargs == NULL)
+        return;
+    memcpy(vargs, args, sizeof(struct arguments));
+    vargs->instance = instance;
+    vargs->worker = NULL;
+
+    if (pthread_mutex_init(&queue->lock, NULL) || pthread_cond_init(&queue->cond, NULL)) {
+        log_android(ANDROID_LOG_ERROR, "Verdict queue init failed");
+        ng_free(vargs, __FILE__, __LINE__);
+        return;
+    }
+    if (pthread_create(&queue->thread, NULL, verdict_thread, vargs)) {
+        log_android(ANDROID_LOG_ERROR, "Verdict thread error");
+        pthread_cond_destroy(&queue->cond);
+        pthread_mutex_destroy(&queue->lock);
+        ng_free(vargs, __FILE__, __LINE__);
+        return;
+    }
+    queue->running = 1;
+}
+
+void verdict_stop(struct context *ctx) {
+    // After the workers, before their wake descriptors are closed
+    struct verdict_queue *queue = &ctx->verdict_queue;
+    if (!queue->running)
+        return;
+
+    if (pthread_mutex_lock(&queue->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    queue->stopping = 1;
+    pthread_cond_broadcast(&queue->cond);
+    if (pthread_mutex_unlock(&queue->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+    pthread_join(queue->thread, NULL);
+    queue->running = 0;
+    log_android(ANDROID_LOG_INFO, "Verdict batches %llu flows %llu packets %llu owners %llu",
+                (unsigned long long) queue->batches, (unsigned long long) queue->flows,
+                (unsigned long long) queue->packets, (unsigned long long) queue->owners);
+
+    struct verdict_request *r = queue->head;
+    while (r != NULL) {
+        struct verdict_request *next = r->next;
+        ng_free(r, __FILE__, __LINE__);
+        r = next;
+    }
+    queue->head = NULL;
+    queue->tail = NULL;
+
+    for (int i = 0; i < WORKERS_MAX; i++) {
+        r = take_verdicts(&ctx->workers[i]);
+        while (r != NULL) {
+            struct verdict_request *next = r->next;
+            ng_free(r, __FILE__, __LINE__);
+            r = next;
+        }
+    }
+
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->lock);
+}
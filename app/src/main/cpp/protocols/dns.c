@@ -0,0 +1,221 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+int get_dns_query(const uint8_t *data, size_t datalen,
+                  char *qname, uint16_t *qtype, uint16_t *qclass, size_t *qend) {
+    if (datalen < sizeof(struct dns_header))
+        return -1;
+
+    const struct dns_header *dns = (const struct dns_header *) data;
+    if (dns->qr || dns->opcode != 0 || ntohs(dns->q_count) != 1)
+        return -1;
+
+    size_t off = sizeof(struct dns_header);
+    size_t len = 0;
+    while (1) {
+        if (off >= datalen)
+            return -1;
+        uint8_t noctets = data[off++];
+        if (noctets == 0)
+            break;
+        // Compression is not used in the question of a query
+        if (noctets & 0xC0)
+            return -1;
+        // With the root label still to come, as dns_question_end
+        if (off + noctets > datalen || off + noctets - sizeof(struct dns_header) >= DNS_QNAME_MAX)
+            return -1;
+
+        if (len)
+            qname[len++] = '.';
+        for (uint8_t i = 0; i < noctets; i++) {
+            uint8_t c = data[off + i];
+            if (c == 0 || c == '.')
+                return -1;
+            qname[len++] = (char) tolower(c);
+        }
+        off += noctets;
+    }
+
+    if (len == 0 || off + 4 > datalen)
+        return -1;
+
+    qname[len] = 0;
+    *qtype = (uint16_t) ((data[off] << 8) | data[off + 1]);
+    *qclass = (uint16_t) ((data[off + 2] << 8) | data[off + 3]);
+    *qend = off + 4;
+    return 0;
+}
+
+// End of the single question, which is never compressed,
+// 0 when malformed or when its name is longer than RFC 1035 allows
+size_t dns_question_end(const uint8_t *data, size_t datalen) {
+    const struct dns_header *dns = (const struct dns_header *) data;
+    if (ntohs(dns->q_count) != 1)
+        return 0;
+
+    size_t off = sizeof(struct dns_header);
+    while (1) {
+        if (off >= datalen)
+            return 0;
+        uint8_t noctets = data[off++];
+        if (noctets == 0)
+            break;
+        if (noctets & 0xC0)
+            return 0;
+        off += noctets;
+        // With the root label still to come
+        if (off - sizeof(struct dns_header) >= DNS_QNAME_MAX)
+            return 0;
+    }
+
+    if (off == sizeof(struct dns_header) + 1 || off + 4 > datalen)
+        return 0;
+    return off + 4;
+}
+
+// Offset after a name of a record, which can end in a pointer, or 0
+size_t dns_skip_name(const uint8_t *data, size_t datalen, size_t off) {
+    while (1) {
+        if (off >= datalen)
+            return 0;
+        uint8_t noctets = data[off];
+        if (noctets == 0)
+            return off + 1;
+        if ((noctets & 0xC0) == 0xC0)
+            return (off + 2 <= datalen ? off + 2 : 0);
+        if (noctets & 0xC0)
+            return 0;
+        off += 1 + noctets;
+    }
+}
+
+uint32_t dns_question_hash(const uint8_t *data, size_t qend) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = sizeof(struct dns_header); i < qend; i++) {
+        hash ^= (uint8_t) tolower(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void dns_reply_session(const uint8_t *pkt, const uint8_t *payload, struct udp_session *reply) {
+    const struct udphdr *udphdr = (const struct udphdr *) payload;
+    memset(reply, 0, sizeof(struct udp_session));
+    reply->version = (*pkt) >> 4;
+    if (reply->version == 4) {
+        const struct iphdr *ip4 = (const struct iphdr *) pkt;
+        reply->saddr.ip4 = (__be32) ip4->saddr;
+        reply->daddr.ip4 = (__be32) ip4->daddr;
+        init_template(&reply->tpl, reply->version, IPPROTO_UDP, &ip4->daddr, &ip4->saddr);
+    } else {
+        const struct ip6_hdr *ip6 = (const struct ip6_hdr *) pkt;
+        memcpy(&reply->saddr.ip6, &ip6->ip6_src, 16);
+        memcpy(&reply->daddr.ip6, &ip6->ip6_dst, 16);
+        init_template(&reply->tpl, reply->version, IPPROTO_UDP, &ip6->ip6_dst, &ip6->ip6_src);
+    }
+    reply->source = udphdr->source;
+    reply->dest = udphdr->dest;
+}
+
+int is_dns_redirect(const uint8_t *pkt, const uint8_t *payload) {
+    // 198.18.0.1 and fd00::53, the resolvers the tunnel announces
+    static const uint8_t redirect6[16] = {0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x53};
+    const struct udphdr *udphdr = (const struct udphdr *) payload;
+    if (ntohs(udphdr->dest) != 53)
+        return 0;
+    if (((*pkt) >> 4) == 4)
+        return (((const struct iphdr *) pkt)->daddr == htonl(0xC6120001));
+    return (memcmp(&((const struct ip6_hdr *) pkt)->ip6_dst, redirect6, 16) == 0);
+}
+
+static void write_dns_block(const struct arguments *args,
+                            const uint8_t *pkt, const uint8_t *payload,
+                            const uint8_t *query, size_t qend,
+                            uint16_t qtype, uint16_t qclass) {
+    uint8_t response[DNS_RESPONSE_MAX];
+    if (qend + 28 > sizeof(response))
+        return;
+
+    // Echo the question, answer with the configured rcode or the unspecified address
+    memcpy(response, query, qend);
+    struct dns_header *dns = (struct dns_header *) response;
+    dns->qr = 1;
+    dns->aa = 0;
+    dns->tc = 0;
+    dns->ra = 1;
+    dns->z = 0;
+    dns->ad = 0;
+    dns->cd = 0;
+    dns->rcode = (uint16_t) args->rcode;
+    dns->q_count = htons(1);
+    dns->ans_count = 0;
+    dns->auth_count = 0;
+    dns->add_count = 0;
+
+    size_t len = qend;
+    if (args->rcode == 0 && qclass == DNS_QCLASS_IN &&
+        (qtype == DNS_QTYPE_A || qtype == DNS_QTYPE_AAAA)) {
+        uint16_t rdlength = (uint16_t) (qtype == DNS_QTYPE_A ? 4 : 16);
+        response[len++] = 0xC0; // pointer to the name in the question
+        response[len++] = sizeof(struct dns_header);
+        response[len++] = (uint8_t) (qtype >> 8);
+        response[len++] = (uint8_t) qtype;
+        response[len++] = 0;
+        response[len++] = DNS_QCLASS_IN;
+        response[len++] = 0;
+        response[len++] = 0;
+        response[len++] = 0;
+        response[len++] = DNS_BLOCK_TTL;
+        response[len++] = 0;
+        response[len++] = (uint8_t) rdlength;
+        memset(response + len, 0, rdlength);
+        len += rdlength;
+        dns->ans_count = htons(1);
+    }
+
+    // Reply as the server the query was sent to, without a session
+    struct udp_session reply;
+    dns_reply_session(pkt, payload, &reply);
+
+    if (write_udp(args, &reply, response, len) < 0)
+        log_android(ANDROID_LOG_WARN, "DNS block response write failed");
+}
+
+int handle_dns_query(const struct arguments *args,
+                     const uint8_t *pkt, size_t length,
+                     const uint8_t *payload) {
+    const uint8_t *query = payload + sizeof(struct udphdr);
+    size_t querylen = length - (query - pkt);
+
+    char qname[DNS_QNAME_MAX + 1];
+    uint16_t qtype;
+    uint16_t qclass;
+    size_t qend;
+    if (get_dns_query(query, querylen, qname, &qtype, &qclass, &qend))
+        return VERDICT_UNKNOWN;
+
+    int verdict = domain_evaluate(args->ctx, qname);
+    if (verdict == VERDICT_BLOCK) {
+        log_android(ANDROID_LOG_INFO, "DNS blocked %s qtype %d", qname, qtype);
+        write_dns_block(args, pkt, payload, query, qend, qtype, qclass);
+    }
+    return verdict;
+}
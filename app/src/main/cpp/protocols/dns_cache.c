@@ -0,0 +1,332 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// Answers of the configured resolver, for queries sent to the redirect
+// addresses only. Entries are keyed by the question, lowercased, with the
+// CD and DO bits since those change what the resolver returns, and with
+// whether EDNS was used: an OPT record must not reach a client that sent
+// none (RFC 6891 section 7). Hits are
+// answered with the id and the letter case of the query and with aged TTLs.
+// The cache belongs to the event loop and is guarded by the context lock.
+
+#define DNS_KEY_CD 1 // checking disabled
+#define DNS_KEY_DO 2 // DNSSEC OK
+#define DNS_KEY_EDNS 4 // query with an OPT record, the response has one too
+#define DNS_KEY_MAX (DNS_QNAME_MAX + 1 + 4 + 1) // name, type and class, flags
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static void put32(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t) (value >> 24);
+    p[1] = (uint8_t) (value >> 16);
+    p[2] = (uint8_t) (value >> 8);
+    p[3] = (uint8_t) value;
+}
+
+static size_t make_key(const uint8_t *data, size_t qend, int flags, uint8_t *key) {
+    // Length octets are below 'A', lowering every byte only touches the labels
+    size_t len = 0;
+    for (size_t i = sizeof(struct dns_header); i < qend; i++)
+        key[len++] = (uint8_t) tolower(data[i]);
+    key[len++] = (uint8_t) flags;
+    return len;
+}
+
+static uint32_t hash_key(const uint8_t *key, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct dns_cache_entry **find_slot(struct dns_cache *cache,
+                                          const uint8_t *key, size_t len, uint32_t hash) {
+    struct dns_cache_entry **slot = &cache->buckets[hash & (DNS_CACHE_BUCKETS - 1)];
+    while (*slot != NULL) {
+        struct dns_cache_entry *e = *slot;
+        if (e->hash == hash && e->key_length == len && memcmp(e->data, key, len) == 0)
+            break;
+        slot = &e->hash_next;
+    }
+    return slot;
+}
+
+static size_t entry_size(const struct dns_cache_entry *e) {
+    return sizeof(struct dns_cache_entry) + e->key_length + e->length;
+}
+
+static void lru_unlink(struct dns_cache *cache, struct dns_cache_entry *e) {
+    if (e->lru_prev == NULL)
+        cache->lru_head = e->lru_next;
+    else
+        e->lru_prev->lru_next = e->lru_next;
+    if (e->lru_next == NULL)
+        cache->lru_tail = e->lru_prev;
+    else
+        e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(struct dns_cache *cache, struct dns_cache_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = e;
+    cache->lru_head = e;
+    if (cache->lru_tail == NULL)
+        cache->lru_tail = e;
+}
+
+static void remove_entry(struct dns_cache *cache, struct dns_cache_entry *e) {
+    struct dns_cache_entry **slot = &cache->buckets[e->hash & (DNS_CACHE_BUCKETS - 1)];
+    while (*slot != e)
+        slot = &(*slot)->hash_next;
+    *slot = e->hash_next;
+
+    lru_unlink(cache, e);
+    cache->stats.entries--;
+    cache->stats.bytes -= entry_size(e);
+    ng_free(e, __FILE__, __LINE__);
+}
+
+int dns_cache_answer(const struct arguments *args,
+                     const uint8_t *pkt, size_t length,
+                     const uint8_t *payload, jint uid) {
+    if (!is_dns_redirect(pkt, payload))
+        return 0;
+
+    const uint8_t *query = payload + sizeof(struct udphdr);
+    size_t querylen = length - (query - pkt);
+    if (querylen < sizeof(struct dns_header))
+        return 0;
+
+    const struct dns_header *dns = (const struct dns_header *) query;
+    if (dns->qr || dns->opcode != 0)
+        return 0;
+    size_t qend = dns_question_end(query, querylen);
+    if (qend == 0)
+        return 0;
+
+    // Without EDNS the client cannot take more than 512 bytes
+    int flags = (dns->cd ? DNS_KEY_CD : 0);
+    size_t udp_max = DNS_RESPONSE_MAX;
+    if (ntohs(dns->add_count) == 1 && qend + 11 <= querylen &&
+        query[qend] == 0 && get16(query + qend + 1) == DNS_QTYPE_OPT) {
+        uint16_t size = get16(query + qend + 3);
+        if (size > udp_max)
+            udp_max = size;
+        flags |= DNS_KEY_EDNS;
+        if (query[qend + 7] & 0x80)
+            flags |= DNS_KEY_DO;
+    }
+
+    struct dns_cache *cache = &args->ctx->dns_cache;
+    uint8_t key[DNS_KEY_MAX];
+    size_t keylen = make_key(query, qend, flags, key);
+    struct dns_cache_entry *e = NULL;
+    time_t now = time(NULL);
+
+    if (cache->buckets != NULL) {
+        e = *find_slot(cache, key, keylen, hash_key(key, keylen));
+        if (e != NULL && e->expires <= now) {
+            remove_entry(cache, e);
+            e = NULL;
+        }
+    }
+
+    if (e == NULL || e->length > udp_max) {
+        cache->stats.misses++;
+        return 0;
+    }
+
+    // Same question, so only the id, the letter case and the TTLs differ
+    uint8_t *response = ng_pool_alloc(e->length, "dns cache");
+    if (response == NULL)
+        return 0;
+
+    cache->stats.hits++;
+    lru_unlink(cache, e);
+    lru_push(cache, e);
+
+    memcpy(response, e->data + e->key_length, e->length);
+    memcpy(response, query, sizeof(uint16_t));
+    memcpy(response + sizeof(struct dns_header), query + sizeof(struct dns_header),
+           qend - sizeof(struct dns_header));
+
+    uint32_t age = (uint32_t) (now - e->stored);
+    for (uint8_t i = 0; i < e->records; i++) {
+        uint32_t ttl = get32(response + e->ttl[i]);
+        put32(response + e->ttl[i], ttl > age ? ttl - age : 0);
+    }
+
+    // The app asking may not be the one the answer was cached for
+    dns_names_store(args->ctx, response, e->length, uid);
+
+    struct udp_session reply;
+    dns_reply_session(pkt, payload, &reply);
+    if (write_udp(args, &reply, response, e->length) < 0)
+        log_android(ANDROID_LOG_WARN, "DNS cache response write failed");
+    ng_pool_free(response, __FILE__, __LINE__);
+
+    return 1;
+}
+
+void dns_cache_store(struct context *ctx, const uint8_t *data, size_t datalen) {
+    if (datalen < sizeof(struct dns_header) || datalen > DNS_CACHE_RESPONSE_MAX)
+        return;
+
+    const struct dns_header *dns = (const struct dns_header *) data;
+    if (!dns->qr || dns->opcode != 0 || dns->tc ||
+        (dns->rcode != 0 && dns->rcode != DNS_RCODE_NXDOMAIN))
+        return;
+
+    size_t qend = dns_question_end(data, datalen);
+    if (qend == 0)
+        return;
+
+    // Positive answers live as long as their shortest TTL,
+    // negative ones as long as the SOA of the authority section says
+    uint16_t answers = ntohs(dns->ans_count);
+    uint16_t authority = ntohs(dns->auth_count);
+    uint32_t records = (uint32_t) answers + authority + ntohs(dns->add_count);
+    int negative = (dns->rcode == DNS_RCODE_NXDOMAIN || answers == 0);
+    int flags = (dns->cd ? DNS_KEY_CD : 0);
+    uint32_t lifetime = UINT32_MAX;
+    uint16_t ttl[DNS_CACHE_RECORDS];
+    uint8_t nttl = 0;
+
+    size_t off = qend;
+    for (uint32_t i = 0; i < records; i++) {
+        off = dns_skip_name(data, datalen, off);
+        if (off == 0 || off + 10 > datalen)
+            return;
+
+        uint16_t type = get16(data + off);
+        uint32_t value = get32(data + off + 4);
+        uint16_t rdlength = get16(data + off + 8);
+        size_t rdata = off + 10;
+        if (rdata + rdlength > datalen)
+            return;
+
+        if (type == DNS_QTYPE_OPT) {
+            // Only sent back to a query with EDNS, the TTL field holds the extended flags
+            flags |= DNS_KEY_EDNS;
+            if (data[off + 6] & 0x80)
+                flags |= DNS_KEY_DO;
+        } else {
+            if (nttl == DNS_CACHE_RECORDS)
+                return;
+            ttl[nttl++] = (uint16_t) (off + 4);
+
+            if (value & 0x80000000) // RFC 2181
+                value = 0;
+            if (negative) {
+                if (type == DNS_QTYPE_SOA && i >= answers && i < answers + authority && rdlength >= 4) {
+                    uint32_t minimum = get32(data + rdata + rdlength - 4);
+                    if (minimum < value)
+                        value = minimum;
+                    if (value < lifetime)
+                        lifetime = value;
+                }
+            } else if (value < lifetime)
+                lifetime = value;
+        }
+
+        off = rdata + rdlength;
+    }
+
+    if (lifetime == UINT32_MAX || lifetime == 0)
+        return;
+    if (negative && lifetime > DNS_CACHE_NEGATIVE_TTL_MAX)
+        lifetime = DNS_CACHE_NEGATIVE_TTL_MAX;
+    else if (lifetime > DNS_CACHE_TTL_MAX)
+        lifetime = DNS_CACHE_TTL_MAX;
+
+    struct dns_cache *cache = &ctx->dns_cache;
+    if (cache->buckets == NULL) {
+        cache->buckets = ng_calloc(DNS_CACHE_BUCKETS, sizeof(struct dns_cache_entry *), "dns cache");
+        if (cache->buckets == NULL)
+            return;
+    }
+
+    uint8_t key[DNS_KEY_MAX];
+    size_t keylen = make_key(data, qend, flags, key);
+    uint32_t hash = hash_key(key, keylen);
+    struct dns_cache_entry *old = *find_slot(cache, key, keylen, hash);
+    if (old != NULL)
+        remove_entry(cache, old);
+
+    struct dns_cache_entry *e = ng_malloc(sizeof(struct dns_cache_entry) + keylen + datalen, "dns cache");
+    if (e == NULL)
+        return;
+    e->hash = hash;
+    e->stored = time(NULL);
+    e->expires = e->stored + lifetime;
+    e->key_length = (uint16_t) keylen;
+    e->length = (uint16_t) datalen;
+    e->records = nttl;
+    memcpy(e->ttl, ttl, nttl * sizeof(uint16_t));
+    memcpy(e->data, key, keylen);
+    memcpy(e->data + keylen, data, datalen);
+
+    struct dns_cache_entry **slot = &cache->buckets[hash & (DNS_CACHE_BUCKETS - 1)];
+    e->hash_next = *slot;
+    *slot = e;
+    lru_push(cache, e);
+    cache->stats.entries++;
+    cache->stats.bytes += entry_size(e);
+    cache->stats.stored++;
+
+    while (cache->stats.entries > DNS_CACHE_ENTRIES || cache->stats.bytes > DNS_CACHE_BYTES) {
+        remove_entry(cache, cache->lru_tail);
+        cache->stats.evicted++;
+    }
+}
+
+void dns_cache_clear(struct context *ctx) {
+    struct dns_cache *cache = &ctx->dns_cache;
+    struct dns_cache_entry *e = cache->lru_head;
+    while (e != NULL) {
+        struct dns_cache_entry *next = e->lru_next;
+        ng_free(e, __FILE__, __LINE__);
+        e = next;
+    }
+    if (cache->buckets != NULL)
+        ng_free(cache->buckets, __FILE__, __LINE__);
+
+    // The counters are kept, they describe the whole run
+    cache->buckets = NULL;
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->stats.entries = 0;
+    cache->stats.bytes = 0;
+}
+
+void dns_cache_get_stats(struct context *ctx, struct dns_cache_stats *stats) {
+    *stats = ctx->dns_cache.stats;
+}
@@ -0,0 +1,332 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// Queries to the redirect addresses share a few sockets connected to the
+// configured server instead of a session and a socket each. The id of a
+// query is replaced by a random one, unused by the other outstanding
+// queries, which leads back to the slot remembering where the query came
+// from; the question is checked on the answer, so an answer can only reach
+// the query it was meant for. A forged answer has to guess the id and the
+// source port, so the sockets are replaced now and then for new ephemeral
+// ports. Queries that cannot be multiplexed fall back to a UDP session.
+
+void dns_mux_init(struct context *ctx) {
+    for (int i = 0; i < 2 * DNS_MUX_SOCKETS; i++) {
+        ctx->dns_mux.upstream[i].socket = -1;
+        ctx->dns_mux.upstream[i].version = (i < DNS_MUX_SOCKETS ? 4 : 6);
+    }
+}
+
+static int open_dns_upstream(const struct arguments *args, struct dns_upstream *u, int epoll_fd) {
+    struct context *ctx = args->ctx;
+    struct sockaddr_in addr4;
+    struct sockaddr_in6 addr6;
+
+    if (u->version == 4) {
+        memset(&addr4, 0, sizeof(struct sockaddr_in));
+        addr4.sin_family = AF_INET;
+        addr4.sin_port = htons(53);
+        addr4.sin_addr = ctx->dns_server_v4;
+    } else {
+        memset(&addr6, 0, sizeof(struct sockaddr_in6));
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_port = htons(53);
+        addr6.sin6_addr = ctx->dns_server_v6;
+    }
+
+    int sock = socket(u->version == 4 ? PF_INET : PF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        log_android(ANDROID_LOG_ERROR, "DNS upstream socket error %d: %s", errno, strerror(errno));
+        return -1;
+    }
+
+    // Connected, so the kernel drops datagrams from anyone but the server
+    if (connect(sock,
+                (u->version == 4 ? (const struct sockaddr *) &addr4 : (const struct sockaddr *) &addr6),
+                (socklen_t) (u->version == 4 ? sizeof(addr4) : sizeof(addr6)))) {
+        log_android(ANDROID_LOG_ERROR, "DNS upstream connect error %d: %s", errno, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    memset(&u->ev, 0, sizeof(struct epoll_event));
+    u->ev.events = EPOLLIN | EPOLLERR;
+    u->ev.data.ptr = u;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &u->ev)) {
+        log_android(ANDROID_LOG_ERROR, "DNS upstream epoll error %d: %s", errno, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    u->socket = sock;
+    u->opened = time(NULL);
+    u->queries = 0;
+    u->retired = 0;
+    log_android(ANDROID_LOG_INFO, "DNS upstream socket %d IPv%d", sock, u->version);
+    return 0;
+}
+
+static void close_dns_upstream(struct dns_upstream *u) {
+    if (u->socket >= 0) {
+        if (close(u->socket))
+            log_android(ANDROID_LOG_WARN, "Failed to close DNS upstream socket %d: %s",
+                        u->socket, strerror(errno));
+        u->socket = -1;
+    }
+    u->retired = 0;
+}
+
+// The socket of the family for the next query. A socket that served its share
+// takes no new queries while another one does, and is closed once the queries
+// it carried have expired; the next query on it opens a new one.
+static struct dns_upstream *next_dns_upstream(struct dns_mux *mux, uint8_t version, time_t now,
+                                              uint32_t *index) {
+    uint32_t base = (version == 4 ? 0 : DNS_MUX_SOCKETS);
+    for (uint32_t i = base; i < base + DNS_MUX_SOCKETS; i++) {
+        struct dns_upstream *u = &mux->upstream[i];
+        if (u->retired && u->retired + UDP_TIMEOUT_53 <= now) {
+            close_dns_upstream(u);
+            mux->stats.rotated++;
+        }
+    }
+
+    for (uint32_t n = 0; n < DNS_MUX_SOCKETS; n++) {
+        *index = base + mux->next++ % DNS_MUX_SOCKETS;
+        struct dns_upstream *u = &mux->upstream[*index];
+        if (u->retired)
+            continue;
+        if (u->socket >= 0 &&
+            (u->queries >= DNS_MUX_ROTATE_QUERIES || u->opened + DNS_MUX_ROTATE_TIME <= now)) {
+            int others = 0;
+            for (uint32_t i = base; i < base + DNS_MUX_SOCKETS; i++)
+                if (&mux->upstream[i] != u && !mux->upstream[i].retired)
+                    others++;
+            if (others > 0) {
+                u->retired = now;
+                continue;
+            }
+        }
+        return u;
+    }
+    return NULL;
+}
+
+// A random id no outstanding query was sent with, or -1
+static int draw_dns_id(const struct dns_mux *mux) {
+    for (int i = 0; i < DNS_MUX_ID_TRIES; i++) {
+        uint16_t id = (uint16_t) arc4random_uniform(DNS_MUX_IDS);
+        if (mux->slots[id] == DNS_MUX_PENDING)
+            return id;
+    }
+    return -1;
+}
+
+static void release_dns_pending(struct dns_mux *mux, struct dns_pending *p) {
+    p->active = 0;
+    mux->slots[p->id] = DNS_MUX_PENDING;
+}
+
+int dns_mux_query(const struct arguments *args,
+                  const uint8_t *pkt, size_t length,
+                  const uint8_t *payload, jint uid, int epoll_fd) {
+    if (!is_dns_redirect(pkt, payload))
+        return 0;
+
+    const uint8_t *query = payload + sizeof(struct udphdr);
+    size_t querylen = length - (query - pkt);
+    if (querylen < sizeof(struct dns_header))
+        return 0;
+
+    const struct dns_header *dns = (const struct dns_header *) query;
+    if (dns->qr || dns->opcode != 0)
+        return 0;
+    size_t qend = dns_question_end(query, querylen);
+    if (qend == 0)
+        return 0;
+
+    struct dns_mux *mux = &args->ctx->dns_mux;
+    if (mux->pending == NULL) {
+        mux->pending = ng_calloc(DNS_MUX_PENDING, sizeof(struct dns_pending), "dns pending");
+        mux->slots = ng_malloc(DNS_MUX_IDS * sizeof(uint16_t), "dns slots");
+        if (mux->pending == NULL || mux->slots == NULL) {
+            ng_free(mux->pending, __FILE__, __LINE__);
+            ng_free(mux->slots, __FILE__, __LINE__);
+            mux->pending = NULL;
+            mux->slots = NULL;
+            return 0;
+        }
+        for (uint32_t i = 0; i < DNS_MUX_IDS; i++)
+            mux->slots[i] = DNS_MUX_PENDING;
+    }
+
+    // Unanswered queries are given up after the time a session would have waited
+    time_t now = time(NULL);
+    struct dns_pending *p = NULL;
+    uint32_t slot = 0;
+    for (uint32_t i = 0; i < DNS_MUX_PENDING; i++) {
+        slot = (mux->cursor + i) & (DNS_MUX_PENDING - 1);
+        struct dns_pending *c = &mux->pending[slot];
+        if (c->active && c->expires <= now) {
+            release_dns_pending(mux, c);
+            mux->stats.expired++;
+        }
+        if (!c->active) {
+            p = c;
+            break;
+        }
+    }
+    if (p == NULL)
+        return 0;
+
+    uint32_t index;
+    struct dns_upstream *u = next_dns_upstream(mux, (*pkt) >> 4, now, &index);
+    if (u == NULL || (u->socket < 0 && open_dns_upstream(args, u, epoll_fd)))
+        return 0;
+
+    int drawn = draw_dns_id(mux);
+    if (drawn < 0)
+        return 0;
+
+    // Send the query as it is but for the id
+    uint16_t id = (uint16_t) drawn;
+    uint16_t nid = htons(id);
+    struct iovec iov[2];
+    iov[0].iov_base = &nid;
+    iov[0].iov_len = sizeof(uint16_t);
+    iov[1].iov_base = (void *) (query + sizeof(uint16_t));
+    iov[1].iov_len = querylen - sizeof(uint16_t);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(struct msghdr));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if (sendmsg(u->socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) != querylen) {
+        log_android(ANDROID_LOG_WARN, "DNS upstream send error %d: %s", errno, strerror(errno));
+        if (errno != EINTR && errno != EAGAIN)
+            close_dns_upstream(u);
+        return 0;
+    }
+
+    p->active = 1;
+    p->upstream = (uint8_t) index;
+    p->id = id;
+    mux->slots[id] = (uint16_t) slot;
+    u->queries++;
+    memcpy(&p->client_id, query, sizeof(uint16_t));
+    p->question = dns_question_hash(query, qend);
+    p->expires = now + UDP_TIMEOUT_53;
+    dns_reply_session(pkt, payload, &p->reply);
+    p->reply.uid = uid;
+
+    mux->cursor = slot + 1;
+    mux->stats.queries++;
+    return 1;
+}
+
+int is_dns_upstream(const struct context *ctx, const void *ptr) {
+    const struct dns_upstream *u = (const struct dns_upstream *) ptr;
+    return (u >= ctx->dns_mux.upstream && u < ctx->dns_mux.upstream + 2 * DNS_MUX_SOCKETS);
+}
+
+static void dns_mux_answer(const struct arguments *args, const struct dns_upstream *u,
+                           uint8_t *data, size_t datalen) {
+    struct dns_mux *mux = &args->ctx->dns_mux;
+    if (datalen < sizeof(struct dns_header) || mux->pending == NULL) {
+        mux->stats.unmatched++;
+        return;
+    }
+
+    uint16_t id = ntohs(((const struct dns_header *) data)->id);
+    uint16_t slot = mux->slots[id];
+    if (slot == DNS_MUX_PENDING) {
+        mux->stats.unmatched++;
+        return;
+    }
+    struct dns_pending *p = &mux->pending[slot];
+    size_t qend = dns_question_end(data, datalen);
+    if (!p->active || p->id != id || &mux->upstream[p->upstream] != u || p->expires <= time(NULL) ||
+        qend == 0 || dns_question_hash(data, qend) != p->question) {
+        mux->stats.unmatched++;
+        return;
+    }
+    release_dns_pending(mux, p);
+    mux->stats.answers++;
+
+    dns_cache_store(args->ctx, data, datalen);
+    dns_names_store(args->ctx, data, datalen, p->reply.uid);
+
+    memcpy(data, &p->client_id, sizeof(uint16_t));
+    if (write_udp(args, &p->reply, data, datalen) < 0)
+        log_android(ANDROID_LOG_WARN, "DNS upstream answer write failed");
+}
+
+void check_dns_upstream(const struct arguments *args, const struct epoll_event *ev) {
+    struct dns_upstream *u = (struct dns_upstream *) ev->data.ptr;
+
+    // Closed since the event was reported
+    if (u->socket < 0)
+        return;
+
+    if (ev->events & EPOLLERR) {
+        // Errors of a connected datagram socket, as port unreachable, do not close it
+        int serr = 0;
+        socklen_t optlen = sizeof(int);
+        getsockopt(u->socket, SOL_SOCKET, SO_ERROR, &serr, &optlen);
+        log_android(ANDROID_LOG_WARN, "DNS upstream socket %d error %d: %s",
+                    u->socket, serr, strerror(serr));
+    }
+
+    if (!(ev->events & EPOLLIN))
+        return;
+
+    size_t size = (size_t) (u->version == 4 ? UDP4_MAXMSG : UDP6_MAXMSG);
+    uint8_t *buffer = ng_pool_alloc(size, "dns upstream");
+    if (buffer == NULL) {
+        log_android(ANDROID_LOG_ERROR, "DNS upstream buffer allocation failed");
+        return;
+    }
+    for (int count = 0; count < UDP_YIELD; count++) {
+        ssize_t bytes = recv(u->socket, buffer, size, MSG_DONTWAIT);
+        if (bytes < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                log_android(ANDROID_LOG_WARN, "DNS upstream recv error %d: %s", errno, strerror(errno));
+            break;
+        }
+        dns_mux_answer(args, u, buffer, (size_t) bytes);
+    }
+    ng_pool_free(buffer, __FILE__, __LINE__);
+}
+
+void dns_mux_close(struct context *ctx) {
+    struct dns_mux *mux = &ctx->dns_mux;
+    for (int i = 0; i < 2 * DNS_MUX_SOCKETS; i++)
+        close_dns_upstream(&mux->upstream[i]);
+
+    // Clients retry what was still outstanding
+    if (mux->pending != NULL)
+        ng_free(mux->pending, __FILE__, __LINE__);
+    if (mux->slots != NULL)
+        ng_free(mux->slots, __FILE__, __LINE__);
+    mux->pending = NULL;
+    mux->slots = NULL;
+    mux->cursor = 0;
+}
@@ -0,0 +1,240 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// The names apps looked up, by the addresses the answers gave them, so new
+// flows can be labeled without a reverse lookup. The name of an address is
+// the one of the question, also when the answer came through a CNAME chain.
+// Addresses are kept per asking app since CDNs share them between names.
+// The table belongs to the event loop and is guarded by the context lock.
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+static uint32_t hash_addr(int version, const uint8_t *addr) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < (version == 4 ? 4 : 16); i++) {
+        hash ^= addr[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int question_name(const uint8_t *data, size_t qend, char *name) {
+    // The question was checked by dns_question_end
+    size_t off = sizeof(struct dns_header);
+    size_t len = 0;
+    while (data[off] != 0) {
+        uint8_t noctets = data[off++];
+        if (len + noctets + 1 > DNS_QNAME_MAX)
+            return 0;
+        if (len)
+            name[len++] = '.';
+        for (uint8_t i = 0; i < noctets; i++) {
+            uint8_t c = data[off + i];
+            if (c == 0 || c == '.')
+                return 0;
+            name[len++] = (char) tolower(c);
+        }
+        off += noctets;
+    }
+    name[len] = 0;
+    return (len > 0 && off + 5 == qend);
+}
+
+static void lru_unlink(struct dns_names *names, struct dns_name *e) {
+    if (e->lru_prev == NULL)
+        names->lru_head = e->lru_next;
+    else
+        e->lru_prev->lru_next = e->lru_next;
+    if (e->lru_next == NULL)
+        names->lru_tail = e->lru_prev;
+    else
+        e->lru_next->lru_prev = e->lru_prev;
+}
+
+static void lru_push(struct dns_names *names, struct dns_name *e) {
+    e->lru_prev = NULL;
+    e->lru_next = names->lru_head;
+    if (names->lru_head != NULL)
+        names->lru_head->lru_prev = e;
+    names->lru_head = e;
+    if (names->lru_tail == NULL)
+        names->lru_tail = e;
+}
+
+static void remove_name(struct dns_names *names, struct dns_name *e) {
+    struct dns_name **slot = &names->buckets[e->hash & (DNS_NAMES_BUCKETS - 1)];
+    while (*slot != e)
+        slot = &(*slot)->hash_next;
+    *slot = e->hash_next;
+
+    lru_unlink(names, e);
+    names->entries--;
+    ng_free(e, __FILE__, __LINE__);
+}
+
+static void add_name(struct dns_names *names, int version, const uint8_t *addr,
+                     jint uid, const char *name, size_t namelen, time_t expires) {
+    uint32_t hash = hash_addr(version, addr);
+    size_t addrlen = (version == 4 ? 4 : 16);
+
+    // One name per address and app, the last one asked for
+    struct dns_name *e = names->buckets[hash & (DNS_NAMES_BUCKETS - 1)];
+    while (e != NULL) {
+        if (e->hash == hash && e->uid == uid && e->version == version &&
+            memcmp(e->addr, addr, addrlen) == 0)
+            break;
+        e = e->hash_next;
+    }
+    if (e != NULL && strcmp(e->name, name) == 0) {
+        if (expires > e->expires)
+            e->expires = expires;
+        lru_unlink(names, e);
+        lru_push(names, e);
+        return;
+    }
+    if (e != NULL)
+        remove_name(names, e);
+
+    e = ng_malloc(sizeof(struct dns_name) + namelen + 1, "dns name");
+    if (e == NULL)
+        return;
+    e->hash = hash;
+    e->expires = expires;
+    e->uid = uid;
+    e->version = (uint8_t) version;
+    memset(e->addr, 0, sizeof(e->addr));
+    memcpy(e->addr, addr, addrlen);
+    memcpy(e->name, name, namelen + 1);
+
+    struct dns_name **slot = &names->buckets[hash & (DNS_NAMES_BUCKETS - 1)];
+    e->hash_next = *slot;
+    *slot = e;
+    lru_push(names, e);
+    names->entries++;
+
+    while (names->entries > DNS_NAMES_ENTRIES)
+        remove_name(names, names->lru_tail);
+}
+
+void dns_names_store(struct context *ctx, const uint8_t *data, size_t datalen, jint uid) {
+    if (datalen < sizeof(struct dns_header))
+        return;
+
+    const struct dns_header *dns = (const struct dns_header *) data;
+    if (!dns->qr || dns->opcode != 0 || dns->rcode != 0 || dns->ans_count == 0)
+        return;
+
+    size_t qend = dns_question_end(data, datalen);
+    char name[DNS_QNAME_MAX + 1];
+    if (qend == 0 || !question_name(data, qend, name))
+        return;
+    size_t namelen = strlen(name);
+
+    struct dns_names *names = &ctx->dns_names;
+    if (names->buckets == NULL) {
+        names->buckets = ng_calloc(DNS_NAMES_BUCKETS, sizeof(struct dns_name *), "dns names");
+        if (names->buckets == NULL)
+            return;
+    }
+
+    time_t now = time(NULL);
+    uint16_t answers = ntohs(dns->ans_count);
+    size_t off = qend;
+    for (uint16_t i = 0; i < answers; i++) {
+        off = dns_skip_name(data, datalen, off);
+        if (off == 0 || off + 10 > datalen)
+            return;
+
+        uint16_t type = get16(data + off);
+        uint16_t qclass = get16(data + off + 2);
+        uint32_t ttl = get32(data + off + 4);
+        uint16_t rdlength = get16(data + off + 8);
+        size_t rdata = off + 10;
+        if (rdata + rdlength > datalen)
+            return;
+
+        if (qclass == DNS_QCLASS_IN &&
+            ((type == DNS_QTYPE_A && rdlength == 4) || (type == DNS_QTYPE_AAAA && rdlength == 16))) {
+            if (ttl & 0x80000000) // RFC 2181
+                ttl = 0;
+            if (ttl < DNS_NAMES_TTL_MIN)
+                ttl = DNS_NAMES_TTL_MIN;
+            else if (ttl > DNS_NAMES_TTL_MAX)
+                ttl = DNS_NAMES_TTL_MAX;
+            add_name(names, type == DNS_QTYPE_A ? 4 : 6, data + rdata, uid, name, namelen, now + ttl);
+        }
+
+        off = rdata + rdlength;
+    }
+}
+
+int dns_names_lookup(struct context *ctx, int version, const void *addr, jint uid, char *name) {
+    struct dns_names *names = &ctx->dns_names;
+    if (names->buckets == NULL)
+        return 0;
+
+    // The name the app asked for, else the last one any app asked for
+    uint32_t hash = hash_addr(version, addr);
+    size_t addrlen = (version == 4 ? 4 : 16);
+    time_t now = time(NULL);
+    struct dns_name *found = NULL;
+    struct dns_name *e = names->buckets[hash & (DNS_NAMES_BUCKETS - 1)];
+    while (e != NULL) {
+        struct dns_name *next = e->hash_next;
+        if (e->expires <= now)
+            remove_name(names, e);
+        else if (e->hash == hash && e->version == version && memcmp(e->addr, addr, addrlen) == 0) {
+            if (e->uid == uid) {
+                found = e;
+                break;
+            }
+            if (found == NULL)
+                found = e;
+        }
+        e = next;
+    }
+    if (found == NULL)
+        return 0;
+
+    lru_unlink(names, found);
+    lru_push(names, found);
+    strcpy(name, found->name);
+    return 1;
+}
+
+void dns_names_clear(struct context *ctx) {
+    struct dns_names *names = &ctx->dns_names;
+    struct dns_name *e = names->lru_head;
+    while (e != NULL) {
+        struct dns_name *next = e->lru_next;
+        ng_free(e, __FILE__, __LINE__);
+        e = next;
+    }
+    if (names->buckets != NULL)
+        ng_free(names->buckets, __FILE__, __LINE__);
+    memset(names, 0, sizeof(struct dns_names));
+}
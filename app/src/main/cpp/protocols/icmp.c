@@ -30,16 +30,6 @@ int check_icmp_session(const struct arguments *args, struct ng_session *s, int s
     int timeout = get_icmp_timeout(&s->icmp, sessions, maxsessions);
 
     if (s->icmp.stop || s->icmp.time + timeout < now) {
-        char source[INET6_ADDRSTRLEN + 1];
-        char dest[INET6_ADDRSTRLEN + 1];
-        if (s->icmp.version == 4) {
-            inet_ntop(AF_INET, &s->icmp.saddr.ip4, source, sizeof(source));
-            inet_ntop(AF_INET, &s->icmp.daddr.ip4, dest, sizeof(dest));
-        } else {
-            inet_ntop(AF_INET6, &s->icmp.saddr.ip6, source, sizeof(source));
-            inet_ntop(AF_INET6, &s->icmp.daddr.ip6, dest, sizeof(dest));
-        }
-
         if (s->socket >= 0) {
             if (close(s->socket) != 0) {
                 log_android(ANDROID_LOG_WARN, "Failed to close ICMP socket %d: %s", s->socket, strerror(errno));
@@ -66,7 +56,7 @@ void check_icmp_socket(const struct arguments *args, const struct epoll_event *e
     } else if (ev->events & EPOLLIN) {
         s->icmp.time = time(NULL);
         uint16_t blen = (uint16_t) (s->icmp.version == 4 ? ICMP4_MAXMSG : ICMP6_MAXMSG);
-        uint8_t *buffer = ng_malloc(blen, "icmp socket");
+        uint8_t *buffer = ng_pool_alloc(blen, "icmp socket");
         ssize_t bytes = recv(s->socket, buffer, blen, 0);
 
         if (bytes < 0) {
@@ -75,26 +65,32 @@ void check_icmp_socket(const struct arguments *args, const struct epoll_event *e
         } else if (bytes == 0) {
             s->icmp.stop = 1;
         } else {
+            s->traffic.received_bytes += bytes;
+            s->traffic.received_packets++;
+
             struct icmp *icmp = (struct icmp *) buffer;
+            uint16_t id = icmp->icmp_id;
             icmp->icmp_id = s->icmp.id;
 
-            uint16_t csum = 0;
-            if (s->icmp.version == 6) {
+            // Only the id changes for IPv4; the IPv6 checksum covers addresses the tunnel replaces
+            if (s->icmp.version == 4)
+                icmp->icmp_cksum = checksum_update16(icmp->icmp_cksum, id, icmp->icmp_id);
+            else {
                 struct ip6_hdr_pseudo pseudo;
                 memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
                 memcpy(&pseudo.ip6ph_src, &s->icmp.daddr.ip6, 16);
                 memcpy(&pseudo.ip6ph_dst, &s->icmp.saddr.ip6, 16);
                 pseudo.ip6ph_len = bytes - sizeof(struct ip6_hdr);
                 pseudo.ip6ph_nxt = IPPROTO_ICMPV6;
-                csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
+                uint16_t csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
+                icmp->icmp_cksum = 0;
+                icmp->icmp_cksum = ~calc_checksum(csum, buffer, (size_t) bytes);
             }
-            icmp->icmp_cksum = 0;
-            icmp->icmp_cksum = ~calc_checksum(csum, buffer, (size_t) bytes);
 
             if (write_icmp(args, &s->icmp, buffer, (size_t) bytes) < 0)
                 s->icmp.stop = 1;
         }
-        ng_free(buffer, __FILE__, __LINE__);
+        ng_pool_free(buffer, __FILE__, __LINE__);
     }
 }
 
@@ -118,15 +114,17 @@ jboolean handle_icmp(const struct arguments *args, const uint8_t *pkt, size_t le
     if (icmp->icmp_type != ICMP_ECHO)
         return 0;
 
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL && !((cur->protocol == IPPROTO_ICMP || cur->protocol == IPPROTO_ICMPV6) &&
-                            !cur->icmp.stop && cur->icmp.version == version &&
-                            (version == 4 ? cur->icmp.saddr.ip4 == ip4->saddr && cur->icmp.daddr.ip4 == ip4->daddr :
-                             memcmp(&cur->icmp.saddr.ip6, &ip6->ip6_src, 16) == 0 && memcmp(&cur->icmp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct flow_key key;
+    flow_key_packet(pkt, payload, IPPROTO_ICMP, &key);
+    struct ng_session *cur = flow_lookup(&args->worker->flows, &key);
+    if (cur != NULL && cur->icmp.stop) {
+        // Stopped sessions are replaced and reaped by the expiry check
+        flow_remove(&args->worker->flows, cur);
+        cur = NULL;
+    }
 
     if (cur == NULL) {
-        struct ng_session *s = ng_malloc(sizeof(struct ng_session), "icmp session");
+        struct ng_session *s = slab_alloc(&args->worker->session_slab);
         s->protocol = (uint8_t) (version == 4 ? IPPROTO_ICMP : IPPROTO_ICMPV6);
         s->icmp.time = time(NULL);
         s->icmp.uid = uid;
@@ -135,9 +133,11 @@ jboolean handle_icmp(const struct arguments *args, const uint8_t *pkt, size_t le
         if (version == 4) {
             s->icmp.saddr.ip4 = (__be32) ip4->saddr;
             s->icmp.daddr.ip4 = (__be32) ip4->daddr;
+            init_template(&s->icmp.tpl, version, IPPROTO_ICMP, &ip4->daddr, &ip4->saddr);
         } else {
             memcpy(&s->icmp.saddr.ip6, &ip6->ip6_src, 16);
             memcpy(&s->icmp.daddr.ip6, &ip6->ip6_dst, 16);
+            init_template(&s->icmp.tpl, version, IPPROTO_ICMPV6, &ip6->ip6_dst, &ip6->ip6_src);
         }
 
         s->icmp.id = icmp->icmp_id;
@@ -146,7 +146,7 @@ jboolean handle_icmp(const struct arguments *args, const uint8_t *pkt, size_t le
 
         s->socket = open_icmp_socket(args, &s->icmp);
         if (s->socket < 0) {
-            ng_free(s, __FILE__, __LINE__);
+            slab_free(&args->worker->session_slab, s);
             return 0;
         }
 
@@ -156,24 +156,15 @@ jboolean handle_icmp(const struct arguments *args, const uint8_t *pkt, size_t le
         if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->socket, &s->ev))
             return -1;
 
-        s->next = args->ctx->ng_session;
-        args->ctx->ng_session = s;
+        add_session(args->worker, s);
         cur = s;
-    }
+    } else
+        touch_session(args->worker, cur);
 
-    icmp->icmp_id = ~icmp->icmp_id;
-    uint16_t csum = 0;
-    if (version == 6) {
-        struct ip6_hdr_pseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
-        memcpy(&pseudo.ip6ph_src, &ip6->ip6_dst, 16);
-        memcpy(&pseudo.ip6ph_dst, &ip6->ip6_src, 16);
-        pseudo.ip6ph_len = ip6->ip6_ctlun.ip6_un1.ip6_un1_plen;
-        pseudo.ip6ph_nxt = ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
-    }
-    icmp->icmp_cksum = 0;
-    icmp->icmp_cksum = ~calc_checksum(csum, (uint8_t *) icmp, icmplen);
+    // The pseudo header of IPv6 stays the same, only the id changes
+    uint16_t id = icmp->icmp_id;
+    icmp->icmp_id = ~id;
+    icmp->icmp_cksum = checksum_update16(icmp->icmp_cksum, id, icmp->icmp_id);
 
     cur->icmp.time = time(NULL);
 
@@ -196,6 +187,9 @@ jboolean handle_icmp(const struct arguments *args, const uint8_t *pkt, size_t le
             cur->icmp.stop = 1;
             return 0;
         }
+    } else {
+        cur->traffic.sent_bytes += icmplen;
+        cur->traffic.sent_packets++;
     }
 
     return 1;
@@ -209,47 +203,9 @@ int open_icmp_socket(const struct arguments *args, const struct icmp_session *cu
 }
 
 ssize_t write_icmp(const struct arguments *args, const struct icmp_session *cur, uint8_t *data, size_t datalen) {
-    size_t len;
-    u_int8_t *buffer;
-
-    if (cur->version == 4) {
-        len = sizeof(struct iphdr) + datalen;
-        buffer = ng_malloc(len, "icmp write4");
-        struct iphdr *ip4 = (struct iphdr *) buffer;
-        if (datalen)
-            memcpy(buffer + sizeof(struct iphdr), data, datalen);
-
-        memset(ip4, 0, sizeof(struct iphdr));
-        ip4->version = 4;
-        ip4->ihl = sizeof(struct iphdr) >> 2;
-        ip4->tot_len = htons(len);
-        ip4->ttl = IPDEFTTL;
-        ip4->protocol = IPPROTO_ICMP;
-        ip4->saddr = cur->daddr.ip4;
-        ip4->daddr = cur->saddr.ip4;
-        ip4->check = ~calc_checksum(0, (uint8_t *) ip4, sizeof(struct iphdr));
-    } else {
-        len = sizeof(struct ip6_hdr) + datalen;
-        buffer = ng_malloc(len, "icmp write6");
-        struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
-        if (datalen)
-            memcpy(buffer + sizeof(struct ip6_hdr), data, datalen);
-
-        memset(ip6, 0, sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_flow = 0;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(len - sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = IPPROTO_ICMPV6;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = IPDEFTTL;
-        ip6->ip6_ctlun.ip6_un2_vfc = IPV6_VERSION;
-        memcpy(&(ip6->ip6_src), &cur->daddr.ip6, 16);
-        memcpy(&(ip6->ip6_dst), &cur->saddr.ip6, 16);
-    }
-
-    ssize_t res = write(args->tun, buffer, len);
-    ng_free(buffer, __FILE__, __LINE__);
-
-    if (res != len)
-        return -1;
-
-    return res;
+    // The ICMP header is in the data, as received from the socket
+    uint8_t header[PACKET_HEADER_MAX] __attribute__((aligned(4)));
+    uint16_t csum;
+    size_t hlen = apply_template(&cur->tpl, cur->version, header, datalen, &csum);
+    return write_packet(args, header, hlen, data, datalen);
 }
\ No newline at end of file
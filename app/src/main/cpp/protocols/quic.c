@@ -0,0 +1,233 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// The server name of a QUIC connection is in the ClientHello carried by the
+// CRYPTO frames of the client's Initial packets (RFC 9001, RFC 9369). Their
+// keys derive from the destination connection id, so the first datagrams of
+// a UDP flow can be decrypted here. A ClientHello may span datagrams and its
+// CRYPTO frames may come in any order; the stream is reassembled in a probe
+// on the session, which keeps a bitmap of the bytes received after its data.
+
+static const uint8_t quic_v1_salt[] = {
+        0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+        0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a
+};
+
+static const uint8_t quic_v2_salt[] = {
+        0x0d, 0xed, 0xe3, 0xde, 0xf7, 0x00, 0xa6, 0xdb, 0x81, 0x93,
+        0x81, 0xbe, 0x6e, 0x26, 0x9d, 0xcb, 0xf9, 0xbd, 0x2e, 0xd9
+};
+
+static int quic_varint(const uint8_t *data, size_t len, size_t *off, uint64_t *value) {
+    if (*off >= len)
+        return -1;
+    size_t n = (size_t) 1 << (data[*off] >> 6);
+    if (*off + n > len)
+        return -1;
+    uint64_t v = data[*off] & 0x3f;
+    for (size_t i = 1; i < n; i++)
+        v = (v << 8) | data[*off + i];
+    *off += n;
+    *value = v;
+    return 0;
+}
+
+static int is_quic_initial(const uint8_t *data, size_t len) {
+    // Long header with the fixed bit, the packet type of Initial differs per version
+    if (len < 7 || (data[0] & 0xc0) != 0xc0)
+        return 0;
+    uint32_t version = ((uint32_t) data[1] << 24) | ((uint32_t) data[2] << 16) |
+                       ((uint32_t) data[3] << 8) | data[4];
+    uint8_t type = (uint8_t) ((data[0] >> 4) & 3);
+    return ((version == QUIC_V1 && type == 0) || (version == QUIC_V2 && type == 1));
+}
+
+// Removes the protection of the Initial packet at the start of a copy of the datagram,
+// returns its size, with the offset and length of the decrypted frames, or 0
+static size_t quic_open_initial(uint8_t *packet, size_t len, size_t *frames, size_t *frameslen) {
+    if (!is_quic_initial(packet, len))
+        return 0;
+    int v2 = (packet[1] != 0);
+
+    size_t off = 5;
+    uint8_t dcil = packet[off++];
+    if (dcil > QUIC_CID_MAX || off + dcil >= len)
+        return 0;
+    const uint8_t *dcid = packet + off;
+    off += dcil;
+    uint8_t scil = packet[off++];
+    if (scil > QUIC_CID_MAX || off + scil > len)
+        return 0;
+    off += scil;
+
+    uint64_t token;
+    uint64_t length;
+    if (quic_varint(packet, len, &off, &token) || token > len - off)
+        return 0;
+    off += token;
+    if (quic_varint(packet, len, &off, &length) || length > len - off || length < 4 + 16 + 16)
+        return 0;
+    size_t pn_offset = off;
+    size_t end = pn_offset + (size_t) length;
+
+    // Keys of the client
+    uint8_t secret[SHA256_LENGTH];
+    uint8_t client[SHA256_LENGTH];
+    uint8_t key[16];
+    uint8_t iv[12];
+    uint8_t hp[16];
+    hkdf_extract(v2 ? quic_v2_salt : quic_v1_salt, sizeof(quic_v1_salt), dcid, dcil, secret);
+    hkdf_expand_label(secret, "client in", client, SHA256_LENGTH);
+    hkdf_expand_label(client, v2 ? "quicv2 key" : "quic key", key, sizeof(key));
+    hkdf_expand_label(client, v2 ? "quicv2 iv" : "quic iv", iv, sizeof(iv));
+    hkdf_expand_label(client, v2 ? "quicv2 hp" : "quic hp", hp, sizeof(hp));
+
+    // Header protection: the sample starts as if the packet number were four bytes
+    struct aes128 aes;
+    uint8_t mask[16];
+    aes128_init(&aes, hp);
+    aes128_encrypt(&aes, packet + pn_offset + 4, mask);
+    packet[0] ^= (uint8_t) (mask[0] & 0x0f);
+    size_t pnlen = (size_t) (packet[0] & 3) + 1;
+    for (size_t i = 0; i < pnlen; i++) {
+        packet[pn_offset + i] ^= mask[1 + i];
+        iv[12 - pnlen + i] ^= packet[pn_offset + i];
+    }
+
+    size_t payload = pn_offset + pnlen;
+    size_t payloadlen = end - payload - 16;
+    if (aes128_gcm_open(key, iv, packet, payload, packet + payload, payloadlen,
+                        packet + end - 16, packet + payload))
+        return 0;
+
+    *frames = payload;
+    *frameslen = payloadlen;
+    return end;
+}
+
+static void quic_crypto_data(struct name_probe *probe, uint64_t offset, const uint8_t *data, size_t len) {
+    // Bytes beyond what is kept of a ClientHello are left out
+    if (offset >= probe->size)
+        return;
+    if (len > probe->size - offset)
+        len = (size_t) (probe->size - offset);
+    memcpy(probe->data + offset, data, len);
+
+    uint8_t *received = probe->data + probe->size;
+    for (size_t i = (size_t) offset; i < offset + len; i++)
+        received[i / 8] |= (uint8_t) (1 << (i % 8));
+    while (probe->length < probe->size && (received[probe->length / 8] & (1 << (probe->length % 8))))
+        probe->length++;
+}
+
+static int quic_frames(struct name_probe *probe, const uint8_t *frames, size_t len) {
+    // A client sends only these frames in Initial packets
+    size_t off = 0;
+    while (off < len) {
+        uint8_t type = frames[off++];
+        uint64_t v1, v2, count;
+        if (type == 0x00 || type == 0x01)
+            continue; // PADDING, PING
+        else if (type == 0x02 || type == 0x03) {
+            // ACK: largest, delay, range count, first range, ranges, ECN counts
+            if (quic_varint(frames, len, &off, &v1) || quic_varint(frames, len, &off, &v1) ||
+                quic_varint(frames, len, &off, &count) || quic_varint(frames, len, &off, &v1))
+                return -1;
+            for (uint64_t i = 0; i < count * 2 + (type == 0x03 ? 3 : 0); i++)
+                if (quic_varint(frames, len, &off, &v1))
+                    return -1;
+        } else if (type == 0x06) {
+            // CRYPTO: offset, length, data
+            if (quic_varint(frames, len, &off, &v1) || quic_varint(frames, len, &off, &v2) ||
+                v2 > len - off)
+                return -1;
+            quic_crypto_data(probe, v1, frames + off, (size_t) v2);
+            off += v2;
+        } else
+            return -1; // CONNECTION_CLOSE or not a client Initial
+    }
+    return 0;
+}
+
+static void free_quic_probe(struct ng_session *s) {
+    if (s->probe != NULL) {
+        ng_free(s->probe, __FILE__, __LINE__);
+        s->probe = NULL;
+    }
+}
+
+int inspect_quic_name(const struct arguments *args, struct ng_session *s,
+                      const uint8_t *data, size_t datalen) {
+    if (s->name_state == NAME_PENDING) {
+        // Not QUIC, or a version without known Initial keys
+        if (!is_quic_initial(data, datalen)) {
+            s->name_state = NAME_DONE;
+            return VERDICT_UNKNOWN;
+        }
+        s->probe = ng_calloc(1, sizeof(struct name_probe) + NAME_HELLO_MAX + NAME_HELLO_MAX / 8,
+                             "quic probe");
+        if (s->probe == NULL) {
+            s->name_state = NAME_DONE;
+            return VERDICT_UNKNOWN;
+        }
+        s->probe->size = NAME_HELLO_MAX;
+        s->name_state = NAME_COLLECTING;
+    }
+
+    struct name_probe *probe = s->probe;
+    probe->segments++;
+
+    // Coalesced Initial packets are decrypted in a copy of the datagram
+    uint8_t *packet = ng_pool_alloc(datalen, "quic initial");
+    if (packet == NULL) {
+        free_quic_probe(s);
+        s->name_state = NAME_DONE;
+        return VERDICT_UNKNOWN;
+    }
+    memcpy(packet, data, datalen);
+    size_t off = 0;
+    size_t frames;
+    size_t frameslen;
+    size_t size;
+    while ((size = quic_open_initial(packet + off, datalen - off, &frames, &frameslen)) > 0) {
+        quic_frames(probe, packet + off + frames, frameslen);
+        off += size;
+    }
+    ng_pool_free(packet, __FILE__, __LINE__);
+
+    char name[TLS_SNI_LENGTH + 1];
+    int found = get_client_hello_sni(probe->data, probe->length, name);
+    if (found == NAME_MORE && probe->length < probe->size && probe->segments < NAME_SEGMENTS)
+        return VERDICT_UNKNOWN;
+
+    free_quic_probe(s);
+    s->name_state = NAME_DONE;
+    if (found != NAME_FOUND)
+        return VERDICT_UNKNOWN;
+
+    session_set_name(s, name);
+    int verdict = domain_evaluate(args->ctx, name);
+    if (verdict == VERDICT_BLOCK)
+        log_android(ANDROID_LOG_INFO, "QUIC blocked %s uid %d", name, s->udp.uid);
+    else
+        log_android(ANDROID_LOG_DEBUG, "QUIC server name %s uid %d", name, s->udp.uid);
+    return verdict;
+}
@@ -0,0 +1,233 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// Server names from the first data of a connection: the SNI of a TLS
+// ClientHello or the Host header of an HTTP/1.x request. The parsers
+// only read the data they are given and return NAME_MORE when a
+// ClientHello continues in the next segments.
+
+static int copy_name(const uint8_t *name, size_t len, char *server_name) {
+    // A trailing dot is allowed, an address literal is not a name
+    if (len > 0 && name[len - 1] == '.')
+        len--;
+    if (len == 0 || len > TLS_SNI_LENGTH)
+        return NAME_NONE;
+
+    int letters = 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = (char) tolower(name[i]);
+        if (!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_'))
+            return NAME_NONE;
+        if (c >= 'a' && c <= 'z')
+            letters = 1;
+        server_name[i] = c;
+    }
+    server_name[len] = 0;
+    return (letters ? NAME_FOUND : NAME_NONE);
+}
+
+int get_client_hello_sni(const uint8_t *hello, size_t len, char *server_name) {
+    // Handshake header: type, length
+    if (len < 4)
+        return NAME_MORE;
+    if (hello[0] != 1)
+        return NAME_NONE;
+    size_t end = 4 + (((size_t) hello[1] << 16) | ((size_t) hello[2] << 8) | hello[3]);
+    int truncated = (len < end);
+    if (!truncated)
+        len = end;
+
+    // Version, random
+    size_t off = 4 + 2 + 32;
+    if (off + 1 > len)
+        return (truncated ? NAME_MORE : NAME_NONE);
+
+    // Session id, cipher suites, compression methods
+    off += 1 + hello[off];
+    if (off + 2 > len)
+        return (truncated ? NAME_MORE : NAME_NONE);
+    off += 2 + (((size_t) hello[off] << 8) | hello[off + 1]);
+    if (off + 1 > len)
+        return (truncated ? NAME_MORE : NAME_NONE);
+    off += 1 + hello[off];
+
+    if (off + 2 > len)
+        return (truncated ? NAME_MORE : NAME_NONE);
+    size_t ext_end = off + 2 + (((size_t) hello[off] << 8) | hello[off + 1]);
+    off += 2;
+
+    while (off + 4 <= len && off + 4 <= ext_end) {
+        uint16_t type = (uint16_t) ((hello[off] << 8) | hello[off + 1]);
+        size_t ext_len = ((size_t) hello[off + 2] << 8) | hello[off + 3];
+        off += 4;
+
+        if (type == 0) {
+            // server_name: list length, then entries of type, length, name
+            if (off + ext_len > len)
+                return (truncated ? NAME_MORE : NAME_NONE);
+            size_t p = off + 2;
+            size_t list_end = off + ext_len;
+            while (p + 3 <= list_end) {
+                size_t name_len = ((size_t) hello[p + 1] << 8) | hello[p + 2];
+                if (p + 3 + name_len > list_end)
+                    return NAME_NONE;
+                if (hello[p] == 0)
+                    return copy_name(hello + p + 3, name_len, server_name);
+                p += 3 + name_len;
+            }
+            return NAME_NONE;
+        }
+
+        off += ext_len;
+    }
+
+    return (truncated && off < ext_end ? NAME_MORE : NAME_NONE);
+}
+
+int get_sni(const uint8_t *data, size_t datalen, char *server_name) {
+    // TLS record: handshake, version 3.x, length
+    if (datalen < 5)
+        return (datalen > 0 && data[0] == 22 ? NAME_MORE : NAME_NONE);
+    if (data[0] != 22 || data[1] != 3)
+        return NAME_NONE;
+    return get_client_hello_sni(data + 5, datalen - 5, server_name);
+}
+
+int get_http_host(const uint8_t *data, size_t datalen, char *server_name) {
+    // Request line: an upper case method, a space
+    size_t off = 0;
+    while (off < datalen && off < 16 && data[off] >= 'A' && data[off] <= 'Z')
+        off++;
+    if (off < 3 || off >= datalen || data[off] != ' ')
+        return NAME_NONE;
+
+    while (off < datalen) {
+        // Next line
+        while (off < datalen && data[off] != '\n')
+            off++;
+        off++;
+        if (off + 5 >= datalen || data[off] == '\r' || data[off] == '\n')
+            return NAME_NONE;
+
+        if (strncasecmp((const char *) data + off, "host:", 5) == 0) {
+            off += 5;
+            while (off < datalen && (data[off] == ' ' || data[off] == '\t'))
+                off++;
+            size_t start = off;
+            while (off < datalen && data[off] != ':' && data[off] != '\r' && data[off] != '\n' &&
+                   data[off] != ' ')
+                off++;
+            if (off == datalen)
+                return NAME_NONE;
+            return copy_name(data + start, off - start, server_name);
+        }
+    }
+
+    return NAME_NONE;
+}
+
+static void free_probe(struct ng_session *s) {
+    if (s->probe != NULL) {
+        ng_free(s->probe, __FILE__, __LINE__);
+        s->probe = NULL;
+    }
+}
+
+void session_set_name(struct ng_session *s, const char *name) {
+    session_free_name(s);
+    size_t len = strlen(name);
+    s->server_name = ng_malloc(len + 1, "server name");
+    if (s->server_name != NULL)
+        memcpy(s->server_name, name, len + 1);
+}
+
+void session_free_name(struct ng_session *s) {
+    free_probe(s);
+    if (s->server_name != NULL) {
+        ng_free(s->server_name, __FILE__, __LINE__);
+        s->server_name = NULL;
+    }
+}
+
+int inspect_server_name(const struct arguments *args, struct ng_session *s,
+                        const uint8_t *data, size_t datalen, uint32_t seq) {
+    char name[TLS_SNI_LENGTH + 1];
+    int found;
+
+    if (s->name_state == NAME_PENDING) {
+        found = get_sni(data, datalen, name);
+        if (found == NAME_NONE)
+            found = get_http_host(data, datalen, name);
+        else if (found == NAME_MORE) {
+            // Keep the start of the ClientHello, within bounds
+            size_t need = (datalen >= 5 ? 5 + ((size_t) data[3] << 8 | data[4]) : NAME_HELLO_MAX);
+            if (need < datalen || need > NAME_HELLO_MAX)
+                need = NAME_HELLO_MAX;
+            s->probe = ng_malloc(sizeof(struct name_probe) + need, "name probe");
+            if (s->probe == NULL) {
+                s->name_state = NAME_DONE;
+                return VERDICT_UNKNOWN;
+            }
+            s->probe->size = (uint16_t) need;
+            s->probe->length = (uint16_t) (datalen < need ? datalen : need);
+            s->probe->segments = 1;
+            s->probe->seq = seq + (uint32_t) datalen;
+            memcpy(s->probe->data, data, s->probe->length);
+            s->name_state = NAME_COLLECTING;
+            return VERDICT_UNKNOWN;
+        }
+    } else {
+        // Only the next segment in order continues the ClientHello
+        struct name_probe *probe = s->probe;
+        if (seq != probe->seq) {
+            if (compare_u32(seq, probe->seq) < 0)
+                return VERDICT_UNKNOWN; // retransmission
+            free_probe(s);
+            s->name_state = NAME_DONE;
+            return VERDICT_UNKNOWN;
+        }
+
+        size_t copy = probe->size - probe->length;
+        if (copy > datalen)
+            copy = datalen;
+        memcpy(probe->data + probe->length, data, copy);
+        probe->length += (uint16_t) copy;
+        probe->seq += (uint32_t) datalen;
+        probe->segments++;
+
+        found = get_sni(probe->data, probe->length, name);
+        if (found == NAME_MORE && probe->length < probe->size && probe->segments < NAME_SEGMENTS)
+            return VERDICT_UNKNOWN;
+        free_probe(s);
+    }
+
+    s->name_state = NAME_DONE;
+    if (found != NAME_FOUND)
+        return VERDICT_UNKNOWN;
+
+    session_set_name(s, name);
+    int verdict = domain_evaluate(args->ctx, name);
+    if (verdict == VERDICT_BLOCK)
+        log_android(ANDROID_LOG_INFO, "TCP blocked %s uid %d", name, s->tcp.uid);
+    else
+        log_android(ANDROID_LOG_DEBUG, "TCP server name %s uid %d", name, s->tcp.uid);
+    return verdict;
+}
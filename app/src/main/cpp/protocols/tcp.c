@@ -24,14 +24,15 @@ int socks5_port = 0;
 char socks5_username[127 + 1];
 char socks5_password[127 + 1];
 
-void clear_tcp_data(struct tcp_session *cur) {
+void clear_tcp_data(struct worker *worker, struct tcp_session *cur) {
     struct segment *s = cur->forward;
     while (s != NULL) {
         struct segment *p = s;
         s = s->next;
-        ng_free(p->data, __FILE__, __LINE__);
-        ng_free(p, __FILE__, __LINE__);
+        ng_pool_free(p->data, __FILE__, __LINE__);
+        slab_free(&worker->segment_slab, p);
     }
+    cur->forward = NULL;
 }
 
 int get_tcp_timeout(const struct tcp_session *t, int sessions, int maxsessions) {
@@ -52,16 +53,6 @@ int get_tcp_timeout(const struct tcp_session *t, int sessions, int maxsessions)
 int check_tcp_session(const struct arguments *args, struct ng_session *s, int sessions, int maxsessions) {
     time_t now = time(NULL);
 
-    char source[INET6_ADDRSTRLEN + 1];
-    char dest[INET6_ADDRSTRLEN + 1];
-    if (s->tcp.version == 4) {
-        inet_ntop(AF_INET, &s->tcp.saddr.ip4, source, sizeof(source));
-        inet_ntop(AF_INET, &s->tcp.daddr.ip4, dest, sizeof(dest));
-    } else {
-        inet_ntop(AF_INET6, &s->tcp.saddr.ip6, source, sizeof(source));
-        inet_ntop(AF_INET6, &s->tcp.daddr.ip6, dest, sizeof(dest));
-    }
-
     int timeout = get_tcp_timeout(&s->tcp, sessions, maxsessions);
 
     if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE && s->tcp.time + timeout < now) {
@@ -161,12 +152,12 @@ void queue_tcp(const struct arguments *args, const struct tcphdr *tcphdr, const
         }
 
         if (s == NULL || compare_u32(s->seq, seq) > 0) {
-            struct segment *n = ng_malloc(sizeof(struct segment), "tcp segment");
+            struct segment *n = slab_alloc(&args->worker->segment_slab);
             n->seq = seq;
             n->len = datalen;
             n->sent = 0;
             n->psh = tcphdr->psh;
-            n->data = ng_malloc(datalen, "tcp segment");
+            n->data = ng_pool_alloc(datalen, "tcp segment");
             memcpy(n->data, data, datalen);
             n->next = s;
             if (p == NULL)
@@ -175,9 +166,9 @@ void queue_tcp(const struct arguments *args, const struct tcphdr *tcphdr, const
                 p->next = n;
         } else if (s != NULL && s->seq == seq) {
             if (s->len != datalen) {
-                ng_free(s->data, __FILE__, __LINE__);
+                ng_pool_free(s->data, __FILE__, __LINE__);
                 s->len = datalen;
-                s->data = ng_malloc(datalen, "tcp segment");
+                s->data = ng_pool_alloc(datalen, "tcp segment");
                 memcpy(s->data, data, datalen);
             }
         }
@@ -373,13 +364,15 @@ void check_tcp_socket(const struct arguments *args, const struct epoll_event *ev
                         buffer_size -= sent;
                         s->tcp.sent += sent;
                         s->tcp.forward->sent += sent;
+                        s->traffic.sent_bytes += sent;
 
                         if (s->tcp.forward->len == s->tcp.forward->sent) {
+                            s->traffic.sent_packets++;
                             s->tcp.remote_seq = s->tcp.forward->seq + s->tcp.forward->sent;
                             struct segment *p = s->tcp.forward;
                             s->tcp.forward = s->tcp.forward->next;
-                            ng_free(p->data, __FILE__, __LINE__);
-                            ng_free(p, __FILE__, __LINE__);
+                            ng_pool_free(p->data, __FILE__, __LINE__);
+                            slab_free(&args->worker->segment_slab, p);
                         } else
                             break;
                     }
@@ -402,7 +395,7 @@ void check_tcp_socket(const struct arguments *args, const struct epoll_event *ev
                 if ((ev->events & EPOLLIN) && send_window > 0) {
                     s->tcp.time = time(NULL);
                     uint32_t buffer_size = (send_window > s->tcp.mss ? s->tcp.mss : send_window);
-                    uint8_t *buffer = ng_malloc(buffer_size, "tcp socket");
+                    uint8_t *buffer = ng_pool_alloc(buffer_size, "tcp socket");
                     ssize_t bytes = recv(s->socket, buffer, (size_t) buffer_size, 0);
                     if (bytes < 0) {
                         if (errno != EINTR && errno != EAGAIN)
@@ -429,12 +422,14 @@ void check_tcp_socket(const struct arguments *args, const struct epoll_event *ev
                         }
                     } else {
                         s->tcp.received += bytes;
+                        s->traffic.received_bytes += bytes;
+                        s->traffic.received_packets++;
                         if (write_data(args, &s->tcp, buffer, (size_t) bytes) >= 0) {
                             s->tcp.local_seq += bytes;
                             s->tcp.unconfirmed++;
                         }
                     }
-                    ng_free(buffer, __FILE__, __LINE__);
+                    ng_pool_free(buffer, __FILE__, __LINE__);
                 }
             }
         }
@@ -454,9 +449,9 @@ jboolean handle_tcp(const struct arguments *args, const uint8_t *pkt, size_t len
     const uint8_t *data = payload + sizeof(struct tcphdr) + tcpoptlen;
     const uint16_t datalen = (const uint16_t) (length - (data - pkt));
 
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL && !(cur->protocol == IPPROTO_TCP && cur->tcp.version == version && cur->tcp.source == tcphdr->source && cur->tcp.dest == tcphdr->dest && (version == 4 ? cur->tcp.saddr.ip4 == ip4->saddr && cur->tcp.daddr.ip4 == ip4->daddr : memcmp(&cur->tcp.saddr.ip6, &ip6->ip6_src, 16) == 0 && memcmp(&cur->tcp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct flow_key key;
+    flow_key_packet(pkt, payload, IPPROTO_TCP, &key);
+    struct ng_session *cur = flow_lookup(&args->worker->flows, &key);
 
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
@@ -497,7 +492,7 @@ jboolean handle_tcp(const struct arguments *args, const uint8_t *pkt, size_t len
                 }
             }
 
-            struct ng_session *s = ng_malloc(sizeof(struct ng_session), "tcp session");
+            struct ng_session *s = slab_alloc(&args->worker->session_slab);
             s->protocol = IPPROTO_TCP;
 
             s->tcp.time = time(NULL);
@@ -509,7 +504,7 @@ jboolean handle_tcp(const struct arguments *args, const uint8_t *pkt, size_t len
             s->tcp.send_window = ((uint32_t) ntohs(tcphdr->window)) << s->tcp.send_scale;
             s->tcp.unconfirmed = 0;
             s->tcp.remote_seq = ntohl(tcphdr->seq);
-            s->tcp.local_seq = (uint32_t) rand();
+            s->tcp.local_seq = arc4random();
             s->tcp.remote_start = s->tcp.remote_seq;
             s->tcp.local_start = s->tcp.local_seq;
             s->tcp.acked = 0;
@@ -520,9 +515,11 @@ jboolean handle_tcp(const struct arguments *args, const uint8_t *pkt, size_t len
             if (version == 4) {
                 s->tcp.saddr.ip4 = (__be32) ip4->saddr;
                 s->tcp.daddr.ip4 = (__be32) ip4->daddr;
+                init_template(&s->tcp.tpl, version, IPPROTO_TCP, &ip4->daddr, &ip4->saddr);
             } else {
                 memcpy(&s->tcp.saddr.ip6, &ip6->ip6_src, 16);
                 memcpy(&s->tcp.daddr.ip6, &ip6->ip6_dst, 16);
+                init_template(&s->tcp.tpl, version, IPPROTO_TCP, &ip6->ip6_dst, &ip6->ip6_src);
             }
 
             s->tcp.source = tcphdr->source;
@@ -533,19 +530,20 @@ jboolean handle_tcp(const struct arguments *args, const uint8_t *pkt, size_t len
             s->next = NULL;
 
             if (datalen) {
-                s->tcp.forward = ng_malloc(sizeof(struct segment), "syn segment");
+                s->tcp.forward = slab_alloc(&args->worker->segment_slab);
                 s->tcp.forward->seq = s->tcp.remote_seq;
                 s->tcp.forward->len = datalen;
                 s->tcp.forward->sent = 0;
                 s->tcp.forward->psh = tcphdr->psh;
-                s->tcp.forward->data = ng_malloc(datalen, "syn segment data");
+                s->tcp.forward->data = ng_pool_alloc(datalen, "syn segment data");
                 memcpy(s->tcp.forward->data, data, datalen);
                 s->tcp.forward->next = NULL;
             }
 
             s->socket = open_tcp_socket(args, &s->tcp, redirect);
             if (s->socket < 0) {
-                ng_free(s, __FILE__, __LINE__);
+                clear_tcp_data(args->worker, &s->tcp);
+                slab_free(&args->worker->session_slab, s);
                 return 0;
             }
 
@@ -557,8 +555,7 @@ jboolean handle_tcp(const struct arguments *args, const uint8_t *pkt, size_t len
             if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->socket, &s->ev))
                 return 0;
 
-            s->next = args->ctx->ng_session;
-            args->ctx->ng_session = s;
+            add_session(args->worker, s);
 
             if (!allowed)
                 write_rst(args, &s->tcp);
@@ -572,9 +569,11 @@ jboolean handle_tcp(const struct arguments *args, const uint8_t *pkt, size_t len
             if (version == 4) {
                 rst.saddr.ip4 = (__be32) ip4->saddr;
                 rst.daddr.ip4 = (__be32) ip4->daddr;
+                init_template(&rst.tpl, version, IPPROTO_TCP, &ip4->daddr, &ip4->saddr);
             } else {
                 memcpy(&rst.saddr.ip6, &ip6->ip6_src, 16);
                 memcpy(&rst.daddr.ip6, &ip6->ip6_dst, 16);
+                init_template(&rst.tpl, version, IPPROTO_TCP, &ip6->ip6_dst, &ip6->ip6_src);
             }
 
             rst.source = tcphdr->source;
@@ -584,6 +583,7 @@ jboolean handle_tcp(const struct arguments *args, const uint8_t *pkt, size_t len
             return 0;
         }
     } else {
+        touch_session(args->worker, cur);
         if (cur->tcp.state == TCP_CLOSING || cur->tcp.state == TCP_CLOSE) {
             write_rst(args, &cur->tcp);
             return 0;
@@ -755,69 +755,13 @@ void write_rst(const struct arguments *args, struct tcp_session *cur) {
 }
 
 ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur, const uint8_t *data, size_t datalen, int syn, int ack, int fin, int rst) {
-    size_t len;
-    u_int8_t *buffer;
-    struct tcphdr *tcp;
+    int optlen = (syn ? 4 + 3 + 1 : 0);
+    uint8_t header[PACKET_HEADER_MAX] __attribute__((aligned(4)));
     uint16_t csum;
-    char source[INET6_ADDRSTRLEN + 1];
-    char dest[INET6_ADDRSTRLEN + 1];
 
-    int optlen = (syn ? 4 + 3 + 1 : 0);
-    uint8_t *options;
-    if (cur->version == 4) {
-        len = sizeof(struct iphdr) + sizeof(struct tcphdr) + optlen + datalen;
-        buffer = ng_malloc(len, "tcp write4");
-        struct iphdr *ip4 = (struct iphdr *) buffer;
-        tcp = (struct tcphdr *) (buffer + sizeof(struct iphdr));
-        options = buffer + sizeof(struct iphdr) + sizeof(struct tcphdr);
-        if (datalen)
-            memcpy(buffer + sizeof(struct iphdr) + sizeof(struct tcphdr) + optlen, data, datalen);
-
-        memset(ip4, 0, sizeof(struct iphdr));
-        ip4->version = 4;
-        ip4->ihl = sizeof(struct iphdr) >> 2;
-        ip4->tot_len = htons(len);
-        ip4->ttl = IPDEFTTL;
-        ip4->protocol = IPPROTO_TCP;
-        ip4->saddr = cur->daddr.ip4;
-        ip4->daddr = cur->saddr.ip4;
-
-        ip4->check = ~calc_checksum(0, (uint8_t *) ip4, sizeof(struct iphdr));
-
-        struct ippseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ippseudo));
-        pseudo.ippseudo_src.s_addr = (__be32) ip4->saddr;
-        pseudo.ippseudo_dst.s_addr = (__be32) ip4->daddr;
-        pseudo.ippseudo_p = ip4->protocol;
-        pseudo.ippseudo_len = htons(sizeof(struct tcphdr) + optlen + datalen);
-
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ippseudo));
-    } else {
-        len = sizeof(struct ip6_hdr) + sizeof(struct tcphdr) + optlen + datalen;
-        buffer = ng_malloc(len, "tcp write 6");
-        struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
-        tcp = (struct tcphdr *) (buffer + sizeof(struct ip6_hdr));
-        options = buffer + sizeof(struct ip6_hdr) + sizeof(struct tcphdr);
-        if (datalen)
-            memcpy(buffer + sizeof(struct ip6_hdr) + sizeof(struct tcphdr) + optlen, data, datalen);
-
-        memset(ip6, 0, sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(len - sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = IPPROTO_TCP;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = IPDEFTTL;
-        ip6->ip6_ctlun.ip6_un2_vfc = 0x60;
-        memcpy(&(ip6->ip6_src), &cur->daddr.ip6, 16);
-        memcpy(&(ip6->ip6_dst), &cur->saddr.ip6, 16);
-
-        struct ip6_hdr_pseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
-        memcpy(&pseudo.ip6ph_src, &ip6->ip6_dst, 16);
-        memcpy(&pseudo.ip6ph_dst, &ip6->ip6_src, 16);
-        pseudo.ip6ph_len = ip6->ip6_ctlun.ip6_un1.ip6_un1_plen;
-        pseudo.ip6ph_nxt = ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
-
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
-    }
+    size_t hlen = apply_template(&cur->tpl, cur->version, header, sizeof(struct tcphdr) + optlen + datalen, &csum);
+    struct tcphdr *tcp = (struct tcphdr *) (header + hlen);
+    uint8_t *options = header + hlen + sizeof(struct tcphdr);
 
     memset(tcp, 0, sizeof(struct tcphdr));
     tcp->source = cur->dest;
@@ -851,15 +795,5 @@ ssize_t write_tcp(const struct arguments *args, const struct tcp_session *cur, c
     csum = calc_checksum(csum, data, datalen);
     tcp->check = ~csum;
 
-    inet_ntop(cur->version == 4 ? AF_INET : AF_INET6, cur->version == 4 ? (const void *) &cur->saddr.ip4 : (const void *) &cur->saddr.ip6, source, sizeof(source));
-    inet_ntop(cur->version == 4 ? AF_INET : AF_INET6, cur->version == 4 ? (const void *) &cur->daddr.ip4 : (const void *) &cur->daddr.ip6, dest, sizeof(dest));
-
-    ssize_t res = write(args->tun, buffer, len);
-
-    ng_free(buffer, __FILE__, __LINE__);
-
-    if (res != len)
-        return -1;
-
-    return res;
+    return write_packet(args, header, hlen + sizeof(struct tcphdr) + optlen, data, datalen);
 }
\ No newline at end of file
@@ -28,16 +28,6 @@ int get_udp_timeout(const struct udp_session *u, int sessions, int maxsessions)
 int check_udp_session(const struct arguments *args, struct ng_session *s, int sessions, int maxsessions) {
     time_t now = time(NULL);
 
-    char source[INET6_ADDRSTRLEN + 1];
-    char dest[INET6_ADDRSTRLEN + 1];
-    if (s->udp.version == 4) {
-        inet_ntop(AF_INET, &s->udp.saddr.ip4, source, sizeof(source));
-        inet_ntop(AF_INET, &s->udp.daddr.ip4, dest, sizeof(dest));
-    } else {
-        inet_ntop(AF_INET6, &s->udp.saddr.ip6, source, sizeof(source));
-        inet_ntop(AF_INET6, &s->udp.daddr.ip6, dest, sizeof(dest));
-    }
-
     int timeout = get_udp_timeout(&s->udp, sessions, maxsessions);
     if (s->udp.state == UDP_ACTIVE && s->udp.time + timeout < now) {
         s->udp.state = UDP_FINISHING;
@@ -78,25 +68,65 @@ void check_udp_socket(const struct arguments *args, const struct epoll_event *ev
         s->udp.state = UDP_FINISHING;
     } else if (ev->events & EPOLLIN) {
         s->udp.time = time(NULL);
-        uint8_t *buffer = ng_malloc(s->udp.mss, "udp recv");
-        ssize_t bytes = recv(s->socket, buffer, s->udp.mss, 0);
 
-        if (bytes < 0) {
+        // Pages of the buffers are only touched by datagrams that large
+        struct udp_recv_batch *batch = &args->worker->udp_recv;
+        if (batch->buffers == NULL) {
+            batch->buffers = ng_malloc(UDP_BATCH * UDP4_MAXMSG, "udp recv");
+            if (batch->buffers == NULL)
+                return;
+        }
+        for (int i = 0; i < UDP_BATCH; i++) {
+            batch->iov[i].iov_base = batch->buffers + i * UDP4_MAXMSG;
+            batch->iov[i].iov_len = s->udp.mss;
+            memset(&batch->msgs[i], 0, sizeof(struct mmsghdr));
+            batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+            batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int count = recvmmsg(s->socket, batch->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (count < 0) {
             if (errno != EINTR && errno != EAGAIN)
                 s->udp.state = UDP_FINISHING;
-        } else if (bytes == 0) {
-            s->udp.state = UDP_FINISHING;
-        } else {
+            return;
+        }
+
+        for (int i = 0; i < count; i++) {
+            uint8_t *buffer = batch->iov[i].iov_base;
+            size_t bytes = batch->msgs[i].msg_len;
+            if (bytes == 0) {
+                s->udp.state = UDP_FINISHING;
+                break;
+            }
+
             s->udp.received += bytes;
-            if (write_udp(args, &s->udp, buffer, (size_t) bytes) < 0)
+            s->traffic.received_bytes += bytes;
+            s->traffic.received_packets++;
+            if (s->udp.dns || ntohs(s->udp.dest) == 53) {
+                if (pthread_mutex_lock(&args->ctx->lock))
+                    log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+                if (s->udp.dns)
+                    dns_cache_store(args->ctx, buffer, bytes);
+                if (ntohs(s->udp.dest) == 53)
+                    dns_names_store(args->ctx, buffer, bytes, s->udp.uid);
+                if (pthread_mutex_unlock(&args->ctx->lock))
+                    log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+            }
+            if (write_udp(args, &s->udp, buffer, bytes) < 0) {
                 s->udp.state = UDP_FINISHING;
-            else if (ntohs(s->udp.dest) == 53)
+                break;
+            } else if (ntohs(s->udp.dest) == 53)
                 s->udp.state = UDP_FINISHING;
         }
-        ng_free(buffer, __FILE__, __LINE__);
     }
 }
 
+void free_udp_batch(struct worker *worker) {
+    if (worker->udp_recv.buffers != NULL)
+        ng_free(worker->udp_recv.buffers, __FILE__, __LINE__);
+    worker->udp_recv.buffers = NULL;
+}
+
 jboolean handle_udp(const struct arguments *args, const uint8_t *pkt, size_t length, const uint8_t *payload, int uid, struct allowed *redirect, const int epoll_fd) {
     const uint8_t version = (*pkt) >> 4;
     const struct iphdr *ip4 = (struct iphdr *) pkt;
@@ -105,12 +135,9 @@ jboolean handle_udp(const struct arguments *args, const uint8_t *pkt, size_t len
     const uint8_t *data = payload + sizeof(struct udphdr);
     const size_t datalen = length - (data - pkt);
 
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL && !(cur->protocol == IPPROTO_UDP && cur->udp.version == version &&
-                            cur->udp.source == udphdr->source && cur->udp.dest == udphdr->dest &&
-                            (version == 4 ? cur->udp.saddr.ip4 == ip4->saddr && cur->udp.daddr.ip4 == ip4->daddr :
-                             memcmp(&cur->udp.saddr.ip6, &ip6->ip6_src, 16) == 0 && memcmp(&cur->udp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+    struct flow_key key;
+    flow_key_packet(pkt, payload, IPPROTO_UDP, &key);
+    struct ng_session *cur = flow_lookup(&args->worker->flows, &key);
 
     char source[INET6_ADDRSTRLEN + 1];
     char dest[INET6_ADDRSTRLEN + 1];
@@ -126,7 +153,7 @@ jboolean handle_udp(const struct arguments *args, const uint8_t *pkt, size_t len
         return 0;
 
     if (cur == NULL) {
-        struct ng_session *s = ng_malloc(sizeof(struct ng_session), "udp session");
+        struct ng_session *s = slab_alloc(&args->worker->session_slab);
         s->protocol = IPPROTO_UDP;
         s->udp.time = time(NULL);
         s->udp.uid = uid;
@@ -136,46 +163,33 @@ jboolean handle_udp(const struct arguments *args, const uint8_t *pkt, size_t len
         s->udp.mss = (uint16_t) (rversion == 4 ? UDP4_MAXMSG : UDP6_MAXMSG);
         s->udp.sent = 0;
         s->udp.received = 0;
+        s->udp.dns = 0;
 
         if (version == 4) {
             s->udp.saddr.ip4 = (__be32) ip4->saddr;
             s->udp.daddr.ip4 = (__be32) ip4->daddr;
-
-            // Check for DNS redirection: 198.18.0.1 -> user's DNS server
-            uint32_t target_ip = htonl(0xC6120001); // 198.18.0.1 in network byte order
-
-            if (s->udp.daddr.ip4 == target_ip && ntohs(udphdr->dest) == 53) {
-                // Convert user's DNS server from string to network byte order
-                struct in_addr dns_addr;
-                if (inet_pton(AF_INET, args->ctx->dns_server_v4, &dns_addr) == 1) {
-                    s->udp.daddr.ip4 = dns_addr.s_addr;
-                } else {
-                    // Fallback to 9.9.9.9 if parsing fails
-                    s->udp.daddr.ip4 = htonl(0x09090909);
-                    log_android(ANDROID_LOG_WARN, "Failed to parse DNS IPv4, using fallback: 9.9.9.9");
-                }
-            }
         } else {
             memcpy(&s->udp.saddr.ip6, &ip6->ip6_src, 16);
             memcpy(&s->udp.daddr.ip6, &ip6->ip6_dst, 16);
+        }
 
-            // Check for IPv6 DNS redirection: fd00::53 -> user's IPv6 DNS server
-            struct in6_addr target_ipv6;
-            inet_pton(AF_INET6, "fd00::53", &target_ipv6);
-
-            if (memcmp(&s->udp.daddr.ip6, &target_ipv6, 16) == 0 && ntohs(udphdr->dest) == 53) {
-                // Convert user's IPv6 DNS server from string
-                struct in6_addr dns_addr6;
-                if (inet_pton(AF_INET6, args->ctx->dns_server_v6, &dns_addr6) == 1) {
-                    memcpy(&s->udp.daddr.ip6, &dns_addr6, 16);
-                    log_android(ANDROID_LOG_DEBUG, "DNS IPv6 redirected to: %s", args->ctx->dns_server_v6);
-                } else {
-                    // Fallback to 2620:fe::fe if parsing fails
-                    inet_pton(AF_INET6, "2620:fe::fe", &dns_addr6);
-                    memcpy(&s->udp.daddr.ip6, &dns_addr6, 16);
-                    log_android(ANDROID_LOG_WARN, "Failed to parse DNS IPv6, using fallback: 2620:fe::fe");
-                }
-            }
+        // Answers come from the address the app asked, the tuple is built before
+        // a query to 198.18.0.1 or fd00::53 is redirected to the configured server
+        if (version == 4)
+            init_template(&s->udp.tpl, version, IPPROTO_UDP, &s->udp.daddr.ip4, &s->udp.saddr.ip4);
+        else
+            init_template(&s->udp.tpl, version, IPPROTO_UDP, &s->udp.daddr.ip6, &s->udp.saddr.ip6);
+
+        if (is_dns_redirect(pkt, payload)) {
+            s->udp.dns = 1;
+            if (pthread_mutex_lock(&args->ctx->lock))
+                log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+            if (version == 4)
+                s->udp.daddr.ip4 = args->ctx->dns_server_v4.s_addr;
+            else
+                memcpy(&s->udp.daddr.ip6, &args->ctx->dns_server_v6, 16);
+            if (pthread_mutex_unlock(&args->ctx->lock))
+                log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
         }
 
         s->udp.source = udphdr->source;
@@ -185,7 +199,7 @@ jboolean handle_udp(const struct arguments *args, const uint8_t *pkt, size_t len
 
         s->socket = open_udp_socket(args, &s->udp, redirect);
         if (s->socket < 0) {
-            ng_free(s, __FILE__, __LINE__);
+            slab_free(&args->worker->session_slab, s);
             return 0;
         }
 
@@ -195,13 +209,37 @@ jboolean handle_udp(const struct arguments *args, const uint8_t *pkt, size_t len
         if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->socket, &s->ev))
             return -1;
 
-        s->next = args->ctx->ng_session;
-        args->ctx->ng_session = s;
+        add_session(args->worker, s);
         cur = s;
-    }
+    } else
+        touch_session(args->worker, cur);
 
     cur->udp.time = time(NULL);
 
+    // QUIC names the server in its first datagrams; a blocked flow is closed before they
+    // leave and stays closed for a while, so the retries of the client are dropped too
+    if (ntohs(udphdr->dest) == 443 && cur->name_state != NAME_DONE &&
+        inspect_quic_name(args, cur, data, datalen) == VERDICT_BLOCK) {
+        traffic_block(args->worker, cur->udp.uid);
+        cur->udp.state = UDP_FINISHING;
+        touch_session(args->worker, cur);
+        return 0;
+    }
+
+    // Connected sockets need no address, their datagrams go out with the others of the round
+    if (cur->udp.connected) {
+        struct udp_send_queue *queue = &args->worker->udp_send;
+        if (queue->count == UDP_BATCH)
+            flush_udp(args);
+        queue->session[queue->count] = cur;
+        queue->iov[queue->count].iov_base = (void *) data;
+        queue->iov[queue->count].iov_len = datalen;
+        queue->packet[queue->count] = NULL;
+        queue->parked[queue->count] = 0;
+        queue->count++;
+        return 1;
+    }
+
     int rversion;
     struct sockaddr_in addr4;
     struct sockaddr_in6 addr6;
@@ -236,13 +274,16 @@ jboolean handle_udp(const struct arguments *args, const uint8_t *pkt, size_t len
             cur->udp.state = UDP_FINISHING;
             return 0;
         }
-    } else
+    } else {
         cur->udp.sent += datalen;
+        cur->traffic.sent_bytes += datalen;
+        cur->traffic.sent_packets++;
+    }
 
     return 1;
 }
 
-int open_udp_socket(const struct arguments *args, const struct udp_session *cur, const struct allowed *redirect) {
+int open_udp_socket(const struct arguments *args, struct udp_session *cur, const struct allowed *redirect) {
     int sock;
     int version = (redirect == NULL ? cur->version : (strstr(redirect->raddr, ":") == NULL ? 4 : 6));
 
@@ -250,13 +291,18 @@ int open_udp_socket(const struct arguments *args, const struct udp_session *cur,
     if (sock < 0)
         return -1;
 
+    // Answers to broadcasts and multicasts come from other addresses
+    int group = 0;
     if (cur->version == 4) {
         uint32_t broadcast4 = INADDR_BROADCAST;
         if (memcmp(&cur->daddr.ip4, &broadcast4, sizeof(broadcast4)) == 0) {
             int on = 1;
             setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
-        }
+            group = 1;
+        } else if ((*((uint8_t *) &cur->daddr.ip4) & 0xF0) == 0xE0)
+            group = 1;
     } else if (*((uint8_t *) &cur->daddr.ip6) == 0xFF) {
+        group = 1;
         int loop = 1;
         setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop));
 
@@ -269,95 +315,103 @@ int open_udp_socket(const struct arguments *args, const struct udp_session *cur,
         setsockopt(sock, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &mreq6, sizeof(mreq6));
     }
 
+    // Connected, datagrams are sent without an address and the kernel keeps the route;
+    // a subnet broadcast refuses the connect and is sent to per datagram as before
+    cur->connected = 0;
+    if (!group) {
+        struct sockaddr_in addr4;
+        struct sockaddr_in6 addr6;
+        memset(&addr4, 0, sizeof(struct sockaddr_in));
+        memset(&addr6, 0, sizeof(struct sockaddr_in6));
+        if (redirect == NULL) {
+            if (version == 4) {
+                addr4.sin_family = AF_INET;
+                addr4.sin_addr.s_addr = (__be32) cur->daddr.ip4;
+                addr4.sin_port = cur->dest;
+            } else {
+                addr6.sin6_family = AF_INET6;
+                memcpy(&addr6.sin6_addr, &cur->daddr.ip6, 16);
+                addr6.sin6_port = cur->dest;
+            }
+        } else if (version == 4) {
+            addr4.sin_family = AF_INET;
+            inet_pton(AF_INET, redirect->raddr, &addr4.sin_addr);
+            addr4.sin_port = htons(redirect->rport);
+        } else {
+            addr6.sin6_family = AF_INET6;
+            inet_pton(AF_INET6, redirect->raddr, &addr6.sin6_addr);
+            addr6.sin6_port = htons(redirect->rport);
+        }
+
+        if (connect(sock,
+                    (version == 4 ? (const struct sockaddr *) &addr4 : (const struct sockaddr *) &addr6),
+                    (socklen_t) (version == 4 ? sizeof(addr4) : sizeof(addr6))) == 0)
+            cur->connected = 1;
+        else
+            log_android(ANDROID_LOG_DEBUG, "UDP connect error %d: %s", errno, strerror(errno));
+    }
+
     return sock;
 }
 
-ssize_t write_udp(const struct arguments *args, const struct udp_session *cur, uint8_t *data, size_t datalen) {
-    size_t len;
-    u_int8_t *buffer;
-    struct udphdr *udp;
-    uint16_t csum;
+void flush_udp(const struct arguments *args) {
+    // Per socket in the order they were read, so each flow keeps its order
+    struct udp_send_queue *queue = &args->worker->udp_send;
+    struct mmsghdr msgs[UDP_BATCH];
+    uint8_t done[UDP_BATCH];
+    memset(done, 0, sizeof(done));
+
+    for (int i = 0; i < queue->count; i++) {
+        if (done[i])
+            continue;
+
+        struct ng_session *s = queue->session[i];
+        int n = 0;
+        for (int j = i; j < queue->count; j++)
+            if (!done[j] && queue->session[j] == s) {
+                memset(&msgs[n], 0, sizeof(struct mmsghdr));
+                msgs[n].msg_hdr.msg_iov = &queue->iov[j];
+                msgs[n].msg_hdr.msg_iovlen = 1;
+                done[j] = 1;
+                n++;
+            }
 
-    if (cur->version == 4) {
-        len = sizeof(struct iphdr) + sizeof(struct udphdr) + datalen;
-        buffer = ng_malloc(len, "udp write4");
-        struct iphdr *ip4 = (struct iphdr *) buffer;
-        udp = (struct udphdr *) (buffer + sizeof(struct iphdr));
-        if (datalen)
-            memcpy(buffer + sizeof(struct iphdr) + sizeof(struct udphdr), data, datalen);
-
-        memset(ip4, 0, sizeof(struct iphdr));
-        ip4->version = 4;
-        ip4->ihl = sizeof(struct iphdr) >> 2;
-        ip4->tot_len = htons(len);
-        ip4->ttl = IPDEFTTL;
-        ip4->protocol = IPPROTO_UDP;
-        // Check if this is a response from redirected DNS (user's DNS -> 198.18.0.1)
-        uint32_t target_ip = htonl(0xC6120001); // 198.18.0.1 in network byte order
-
-        // Parse user's DNS server to check if this is a DNS response
-        struct in_addr user_dns_addr;
-        int is_dns_response = 0;
-        if (inet_pton(AF_INET, args->ctx->dns_server_v4, &user_dns_addr) == 1) {
-            is_dns_response = (cur->daddr.ip4 == user_dns_addr.s_addr && ntohs(cur->dest) == 53);
+        // Queued while the flow was allowed, also when a later datagram blocked it
+        int sent = 0;
+        while (sent < n && s->socket >= 0) {
+            int res = sendmmsg(s->socket, msgs + sent, (unsigned int) (n - sent), MSG_NOSIGNAL);
+            if (res < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno != EAGAIN) {
+                    s->udp.state = UDP_FINISHING;
+                    touch_session(args->worker, s);
+                }
+                break;
+            }
+            for (int k = sent; k < sent + res; k++) {
+                s->udp.sent += msgs[k].msg_len;
+                s->traffic.sent_bytes += msgs[k].msg_len;
+            }
+            s->traffic.sent_packets += res;
+            sent += res;
         }
+    }
 
-        if (is_dns_response) {
-            ip4->saddr = target_ip;
-        } else {
-            ip4->saddr = cur->daddr.ip4;
-        }
-        ip4->daddr = cur->saddr.ip4;
-        ip4->check = ~calc_checksum(0, (uint8_t *) ip4, sizeof(struct iphdr));
-
-        struct ippseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ippseudo));
-        pseudo.ippseudo_src.s_addr = (__be32) ip4->saddr;
-        pseudo.ippseudo_dst.s_addr = (__be32) ip4->daddr;
-        pseudo.ippseudo_p = ip4->protocol;
-        pseudo.ippseudo_len = htons(sizeof(struct udphdr) + datalen);
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ippseudo));
-    } else {
-        len = sizeof(struct ip6_hdr) + sizeof(struct udphdr) + datalen;
-        buffer = ng_malloc(len, "udp write6");
-        struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
-        udp = (struct udphdr *) (buffer + sizeof(struct ip6_hdr));
-        if (datalen)
-            memcpy(buffer + sizeof(struct ip6_hdr) + sizeof(struct udphdr), data, datalen);
-
-        memset(ip6, 0, sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_flow = 0;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(len - sizeof(struct ip6_hdr));
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = IPPROTO_UDP;
-        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = IPDEFTTL;
-        ip6->ip6_ctlun.ip6_un2_vfc = IPV6_VERSION;
-
-        // Check if this is a response from redirected IPv6 DNS (user's DNS -> fd00::53)
-        struct in6_addr user_dns_addr6;
-        struct in6_addr target_ipv6;
-        inet_pton(AF_INET6, "fd00::53", &target_ipv6);
-
-        int is_dns_response_v6 = 0;
-        if (inet_pton(AF_INET6, args->ctx->dns_server_v6, &user_dns_addr6) == 1) {
-            is_dns_response_v6 = (memcmp(&cur->daddr.ip6, &user_dns_addr6, 16) == 0 && ntohs(cur->dest) == 53);
-        }
+    for (int i = 0; i < queue->count; i++)
+        if (queue->parked[i])
+            ng_pool_free(queue->packet[i], __FILE__, __LINE__);
+        else if (queue->packet[i] != NULL)
+            free_tun_buffer(args, queue->packet[i]);
+    queue->count = 0;
+}
 
-        if (is_dns_response_v6) {
-            memcpy(&(ip6->ip6_src), &target_ipv6, 16);
-        } else {
-            memcpy(&(ip6->ip6_src), &cur->daddr.ip6, 16);
-        }
-        memcpy(&(ip6->ip6_dst), &cur->saddr.ip6, 16);
-
-        struct ip6_hdr_pseudo pseudo;
-        memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
-        memcpy(&pseudo.ip6ph_src, &ip6->ip6_dst, 16);
-        memcpy(&pseudo.ip6ph_dst, &ip6->ip6_src, 16);
-        pseudo.ip6ph_len = ip6->ip6_ctlun.ip6_un1.ip6_un1_plen;
-        pseudo.ip6ph_nxt = ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt;
-        csum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
-    }
+ssize_t write_udp(const struct arguments *args, const struct udp_session *cur, uint8_t *data, size_t datalen) {
+    uint8_t header[PACKET_HEADER_MAX] __attribute__((aligned(4)));
+    uint16_t csum;
 
+    size_t hlen = apply_template(&cur->tpl, cur->version, header, sizeof(struct udphdr) + datalen, &csum);
+    struct udphdr *udp = (struct udphdr *) (header + hlen);
     memset(udp, 0, sizeof(struct udphdr));
     udp->source = cur->dest;
     udp->dest = cur->source;
@@ -367,11 +421,5 @@ ssize_t write_udp(const struct arguments *args, const struct udp_session *cur, u
     csum = calc_checksum(csum, data, datalen);
     udp->check = ~csum;
 
-    ssize_t res = write(args->tun, buffer, len);
-    ng_free(buffer, __FILE__, __LINE__);
-
-    if (res != len)
-        return -1;
-
-    return res;
+    return write_packet(args, header, hlen + sizeof(struct udphdr), data, datalen);
 }
\ No newline at end of file
@@ -0,0 +1,106 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// Control calls of Java are queued for the event loop instead of waiting for
+// its locks. Callers push onto a lock-free stack; the thread reading the pipe
+// takes the whole stack at once and runs it oldest first.
+
+void command_push(struct context *ctx, struct command *cmd) {
+    // The first of a batch wakes the loop, it takes the others with it
+    if (lf_stack_push(&ctx->commands, cmd, offsetof(struct command, next)) &&
+        write(ctx->pipefds[1], "c", 1) < 0 && errno != EAGAIN)
+        log_android(ANDROID_LOG_ERROR, "Command pipe write error %d: %s", errno, strerror(errno));
+}
+
+static struct command *take_commands(struct context *ctx) {
+    return lf_stack_take(&ctx->commands, offsetof(struct command, next));
+}
+
+static void clear_sessions(const struct arguments *args) {
+    struct context *ctx = args->ctx;
+
+    // Each worker closes its own sessions before its next round
+    for (int i = 0; i < WORKERS_MAX; i++) {
+        struct worker *w = &ctx->workers[i];
+        atomic_store(&w->clear, 1);
+        if (w->wake_fd >= 0) {
+            uint64_t one = 1;
+            write(w->wake_fd, &one, sizeof(one));
+        }
+    }
+
+    if (pthread_mutex_lock(&ctx->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    dns_cache_clear(ctx);
+    dns_names_clear(ctx);
+    dns_mux_close(ctx);
+    if (pthread_mutex_unlock(&ctx->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+}
+
+static void set_dns_servers(const struct arguments *args, const struct command *cmd) {
+    struct context *ctx = args->ctx;
+    if (pthread_mutex_lock(&ctx->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+
+    ctx->dns_server_v4 = cmd->dns_v4;
+    ctx->dns_server_v6 = cmd->dns_v6;
+
+    // Answers of the previous servers are not theirs to give
+    dns_cache_clear(ctx);
+    dns_mux_close(ctx);
+
+    if (pthread_mutex_unlock(&ctx->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+}
+
+static void inject_packet(const struct arguments *args, const struct command *cmd) {
+    ssize_t written = write(args->tun, cmd->data, cmd->length);
+    if (written == (ssize_t) cmd->length)
+        log_android(ANDROID_LOG_DEBUG, "Injected packet of %zu bytes", cmd->length);
+    else
+        log_android(ANDROID_LOG_ERROR, "Inject packet of %zu bytes error %zd errno %d: %s",
+                    cmd->length, written, errno, strerror(errno));
+}
+
+void run_commands(const struct arguments *args) {
+    struct command *cmd = take_commands(args->ctx);
+    while (cmd != NULL) {
+        struct command *next = cmd->next;
+        if (cmd->type == COMMAND_CLEAR)
+            clear_sessions(args);
+        else if (cmd->type == COMMAND_DNS)
+            set_dns_servers(args, cmd);
+        else if (cmd->type == COMMAND_INJECT)
+            inject_packet(args, cmd);
+        ng_free(cmd, __FILE__, __LINE__);
+        cmd = next;
+    }
+}
+
+void free_commands(struct context *ctx) {
+    struct command *cmd = take_commands(ctx);
+    while (cmd != NULL) {
+        struct command *next = cmd->next;
+        ng_free(cmd, __FILE__, __LINE__);
+        cmd = next;
+    }
+}
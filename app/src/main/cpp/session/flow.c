@@ -0,0 +1,288 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// Open addressing with linear probing; deleted slots keep a tombstone
+// so probe chains stay intact until the next rehash.
+#define FLOW_TOMBSTONE ((struct ng_session *) 1)
+
+static uint32_t flow_mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint32_t key_hash(uint32_t seed, const struct flow_key *key) {
+    uint32_t h = seed ^ ((uint32_t) key->protocol << 8 | key->version);
+    h = flow_mix(h ^ ((uint32_t) key->source << 16 | key->dest));
+    if (key->version == 4) {
+        h = flow_mix(h ^ key->saddr.ip4);
+        h = flow_mix(h ^ key->daddr.ip4);
+    } else {
+        const uint32_t *s = (const uint32_t *) &key->saddr.ip6;
+        const uint32_t *d = (const uint32_t *) &key->daddr.ip6;
+        for (int i = 0; i < 4; i++)
+            h = flow_mix(h ^ s[i] ^ (d[i] * 0x9e3779b1));
+    }
+    return h;
+}
+
+static uint32_t flow_hash(const struct flow_table *table, const struct flow_key *key) {
+    return key_hash(table->seed, key);
+}
+
+static int flow_equal(const struct flow_key *key, const struct ng_session *s) {
+    struct flow_key other;
+    flow_key_session(s, &other);
+    if (key->protocol != other.protocol || key->version != other.version ||
+        key->source != other.source || key->dest != other.dest)
+        return 0;
+    if (key->version == 4)
+        return (key->saddr.ip4 == other.saddr.ip4 && key->daddr.ip4 == other.daddr.ip4);
+    else
+        return (memcmp(&key->saddr.ip6, &other.saddr.ip6, 16) == 0 &&
+                memcmp(&key->daddr.ip6, &other.daddr.ip6, 16) == 0);
+}
+
+static int flow_alloc(struct flow_table *table, uint32_t size) {
+    table->slots = ng_calloc(size, sizeof(struct ng_session *), "flow slots");
+    table->hashes = ng_calloc(size, sizeof(uint32_t), "flow hashes");
+    if (table->slots == NULL || table->hashes == NULL) {
+        ng_free(table->slots, __FILE__, __LINE__);
+        ng_free(table->hashes, __FILE__, __LINE__);
+        table->slots = NULL;
+        table->hashes = NULL;
+        table->size = 0;
+        return -1;
+    }
+    table->size = size;
+    table->count = 0;
+    table->used = 0;
+    return 0;
+}
+
+static void flow_place(struct flow_table *table, struct ng_session *s, uint32_t hash) {
+    uint32_t mask = table->size - 1;
+    uint32_t i = hash & mask;
+    while (table->slots[i] != NULL)
+        i = (i + 1) & mask;
+    table->slots[i] = s;
+    table->hashes[i] = hash;
+    table->count++;
+    table->used++;
+}
+
+static int flow_resize(struct flow_table *table, uint32_t size) {
+    struct ng_session **slots = table->slots;
+    uint32_t *hashes = table->hashes;
+    uint32_t old = table->size;
+
+    if (flow_alloc(table, size)) {
+        table->slots = slots;
+        table->hashes = hashes;
+        table->size = old;
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < old; i++)
+        if (slots[i] != NULL && slots[i] != FLOW_TOMBSTONE)
+            flow_place(table, slots[i], hashes[i]);
+
+    ng_free(slots, __FILE__, __LINE__);
+    ng_free(hashes, __FILE__, __LINE__);
+
+    log_android(ANDROID_LOG_DEBUG, "Flow table resized %u -> %u flows %u", old, size, table->count);
+    return 0;
+}
+
+void flow_init(struct flow_table *table) {
+    // Tuples are chosen by remote peers, the seed must not be predictable; rand() is never seeded
+    table->seed = arc4random();
+    if (flow_alloc(table, FLOW_TABLE_MIN))
+        log_android(ANDROID_LOG_ERROR, "Flow table allocation failed");
+}
+
+void flow_free(struct flow_table *table) {
+    ng_free(table->slots, __FILE__, __LINE__);
+    ng_free(table->hashes, __FILE__, __LINE__);
+    table->slots = NULL;
+    table->hashes = NULL;
+    table->size = 0;
+    table->count = 0;
+    table->used = 0;
+}
+
+void flow_clear(struct flow_table *table) {
+    if (table->size > FLOW_TABLE_MIN) {
+        flow_free(table);
+        flow_alloc(table, FLOW_TABLE_MIN);
+    } else if (table->size) {
+        memset(table->slots, 0, table->size * sizeof(struct ng_session *));
+        table->count = 0;
+        table->used = 0;
+    }
+}
+
+void flow_key_packet(const uint8_t *pkt, const uint8_t *payload, uint8_t protocol, struct flow_key *key) {
+    const uint8_t version = (*pkt) >> 4;
+    memset(key, 0, sizeof(struct flow_key));
+    key->version = version;
+
+    if (version == 4) {
+        const struct iphdr *ip4 = (struct iphdr *) pkt;
+        key->saddr.ip4 = (__be32) ip4->saddr;
+        key->daddr.ip4 = (__be32) ip4->daddr;
+    } else {
+        const struct ip6_hdr *ip6 = (struct ip6_hdr *) pkt;
+        memcpy(&key->saddr.ip6, &ip6->ip6_src, 16);
+        memcpy(&key->daddr.ip6, &ip6->ip6_dst, 16);
+    }
+
+    if (protocol == IPPROTO_TCP) {
+        const struct tcphdr *tcphdr = (struct tcphdr *) payload;
+        key->protocol = IPPROTO_TCP;
+        key->source = tcphdr->source;
+        key->dest = tcphdr->dest;
+    } else if (protocol == IPPROTO_UDP) {
+        const struct udphdr *udphdr = (struct udphdr *) payload;
+        key->protocol = IPPROTO_UDP;
+        key->source = udphdr->source;
+        key->dest = udphdr->dest;
+    } else
+        key->protocol = (uint8_t) (version == 4 ? IPPROTO_ICMP : IPPROTO_ICMPV6);
+}
+
+void flow_key_session(const struct ng_session *s, struct flow_key *key) {
+    memset(key, 0, sizeof(struct flow_key));
+    key->protocol = s->protocol;
+
+    if (s->protocol == IPPROTO_TCP) {
+        key->version = (uint8_t) s->tcp.version;
+        key->source = s->tcp.source;
+        key->dest = s->tcp.dest;
+        memcpy(&key->saddr, &s->tcp.saddr, sizeof(key->saddr));
+        memcpy(&key->daddr, &s->tcp.daddr, sizeof(key->daddr));
+    } else if (s->protocol == IPPROTO_UDP) {
+        key->version = (uint8_t) s->udp.version;
+        key->source = s->udp.source;
+        key->dest = s->udp.dest;
+        memcpy(&key->saddr, &s->udp.saddr, sizeof(key->saddr));
+        memcpy(&key->daddr, &s->udp.daddr, sizeof(key->daddr));
+    } else {
+        key->version = (uint8_t) s->icmp.version;
+        memcpy(&key->saddr, &s->icmp.saddr, sizeof(key->saddr));
+        memcpy(&key->daddr, &s->icmp.daddr, sizeof(key->daddr));
+    }
+}
+
+struct ng_session *flow_lookup(const struct flow_table *table, const struct flow_key *key) {
+    if (table->size == 0)
+        return NULL;
+
+    uint32_t hash = flow_hash(table, key);
+    uint32_t mask = table->size - 1;
+    uint32_t i = hash & mask;
+    while (table->slots[i] != NULL) {
+        if (table->slots[i] != FLOW_TOMBSTONE && table->hashes[i] == hash && flow_equal(key, table->slots[i]))
+            return table->slots[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+int flow_insert(struct flow_table *table, struct ng_session *s) {
+    if (table->size == 0 || (table->used + 1) * 100 / table->size > FLOW_LOAD_MAX) {
+        uint32_t size = (table->size ? table->size : FLOW_TABLE_MIN);
+        if ((table->count + 1) * 100 / size > FLOW_LOAD_MAX / 2)
+            size <<= 1;
+        if (flow_resize(table, size))
+            return -1;
+    }
+
+    struct flow_key key;
+    flow_key_session(s, &key);
+    uint32_t hash = flow_hash(table, &key);
+    uint32_t mask = table->size - 1;
+    uint32_t i = hash & mask;
+    while (table->slots[i] != NULL) {
+        if (table->slots[i] != FLOW_TOMBSTONE && table->hashes[i] == hash && flow_equal(&key, table->slots[i])) {
+            // Replace a stale session with the same key
+            table->slots[i] = s;
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+
+    flow_place(table, s, hash);
+    return 0;
+}
+
+void flow_remove(struct flow_table *table, const struct ng_session *s) {
+    if (table->size == 0)
+        return;
+
+    struct flow_key key;
+    flow_key_session(s, &key);
+    uint32_t hash = flow_hash(table, &key);
+    uint32_t mask = table->size - 1;
+    uint32_t i = hash & mask;
+    while (table->slots[i] != NULL) {
+        if (table->slots[i] == s) {
+            // A tombstone is only needed when the probe chain continues
+            if (table->slots[(i + 1) & mask] == NULL) {
+                table->slots[i] = NULL;
+                table->used--;
+            } else
+                table->slots[i] = FLOW_TOMBSTONE;
+            table->count--;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+int flow_shard(const uint8_t *pkt, size_t length, int shards) {
+    // The same for every packet of a flow, as handle_ip keys it behind the same extension headers
+    if (shards <= 1 || length < 1)
+        return 0;
+
+    uint8_t protocol;
+    size_t off;
+    uint8_t version = (*pkt) >> 4;
+    if (version == 4 && length >= sizeof(struct iphdr)) {
+        const struct iphdr *ip4 = (const struct iphdr *) pkt;
+        protocol = ip4->protocol;
+        off = (size_t) ip4->ihl * 4;
+    } else if (version == 6 && length >= sizeof(struct ip6_hdr))
+        protocol = get_ip6_protocol(pkt, length, &off);
+    else
+        return 0;
+
+    // Without the ports only the addresses count
+    if ((protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) && off + 4 > length)
+        protocol = 0;
+
+    struct flow_key key;
+    flow_key_packet(pkt, pkt + off, protocol, &key);
+    return (int) (key_hash(0, &key) % (uint32_t) shards);
+}
@@ -0,0 +1,90 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// Java writes records of a 32 bit length in native order and the packet,
+// padded to four bytes, into the ring (InjectionRing.kt). A record does not
+// wrap: a zero length sends the reader to the start. Java only learns how
+// far the loop got when it publishes, so it never reads the counters itself.
+
+uint8_t *inject_buffer(struct context *ctx) {
+    struct inject_ring *ring = &ctx->inject;
+    if (ring->data == NULL)
+        ring->data = ng_malloc(INJECT_RING_BYTES, "inject ring");
+    return ring->data;
+}
+
+uint32_t inject_publish(struct context *ctx, uint32_t head) {
+    struct inject_ring *ring = &ctx->inject;
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+
+    // One wake until the loop drained, a pipe write per batch at most
+    if (!atomic_exchange(&ring->wake, 1) && write(ctx->pipefds[1], "i", 1) < 0 && errno != EAGAIN)
+        log_android(ANDROID_LOG_ERROR, "Inject pipe write error %d: %s", errno, strerror(errno));
+
+    return atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+void drain_injections(const struct arguments *args) {
+    struct inject_ring *ring = &args->ctx->inject;
+    atomic_store(&ring->wake, 0);
+    if (ring->data == NULL)
+        return;
+
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    while (tail != head) {
+        uint32_t pos = tail & (INJECT_RING_BYTES - 1);
+        uint32_t length;
+        memcpy(&length, ring->data + pos, sizeof(length));
+        if (length == 0) {
+            tail += INJECT_RING_BYTES - pos;
+            continue;
+        }
+
+        // A record Java could not have written, the rest cannot be trusted either
+        if (pos + sizeof(length) + length > INJECT_RING_BYTES || head - tail < sizeof(length) + length) {
+            log_android(ANDROID_LOG_ERROR, "Inject record of %u bytes at %u invalid", length, pos);
+            ring->errors++;
+            tail = head;
+            break;
+        }
+
+        ssize_t written = -1;
+        if (length <= get_mtu())
+            written = write(args->tun, ring->data + pos + sizeof(length), length);
+        if (written == (ssize_t) length)
+            ring->packets++;
+        else {
+            ring->errors++;
+            log_android(ANDROID_LOG_ERROR, "Inject write of %u bytes error %zd errno %d: %s",
+                        length, written, errno, strerror(errno));
+        }
+        tail += (sizeof(length) + length + 3) & ~3u;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+}
+
+void inject_free(struct context *ctx) {
+    struct inject_ring *ring = &ctx->inject;
+    if (ring->data != NULL)
+        ng_free(ring->data, __FILE__, __LINE__);
+    ring->data = NULL;
+}
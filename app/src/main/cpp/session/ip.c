@@ -39,11 +39,12 @@ int check_tun(const struct arguments *args, const struct epoll_event *ev, const
     }
 
     if (ev->events & EPOLLIN) {
-        uint8_t *buffer = ng_malloc(get_mtu(), "tun read");
+        uint8_t *buffer = ng_pool_alloc(get_mtu(), "tun read");
         ssize_t length = read(args->tun, buffer, get_mtu());
+        args->worker->tun_stats.reads++;
 
         if (length < 0) {
-            ng_free(buffer, __FILE__, __LINE__);
+            ng_pool_free(buffer, __FILE__, __LINE__);
             if (errno == EINTR || errno == EAGAIN)
                 return 0;
             else
@@ -52,11 +53,11 @@ int check_tun(const struct arguments *args, const struct epoll_event *ev, const
             if (length > max_tun_msg) {
                 max_tun_msg = length;
             }
+            args->worker->tun_stats.read_bytes += (uint64_t) length;
 
-            handle_ip(args, buffer, (size_t) length, epoll_fd, sessions, maxsessions);
-            ng_free(buffer, __FILE__, __LINE__);
+            handle_tun_packet(args, buffer, (size_t) length, epoll_fd, sessions, maxsessions);
         } else {
-            ng_free(buffer, __FILE__, __LINE__);
+            ng_pool_free(buffer, __FILE__, __LINE__);
             return -1;
         }
     }
@@ -64,6 +65,22 @@ int check_tun(const struct arguments *args, const struct epoll_event *ev, const
     return 0;
 }
 
+void handle_tun_packet(const struct arguments *args, uint8_t *buffer, size_t length,
+                       const int epoll_fd, int sessions, int maxsessions) {
+    handle_ip(args, buffer, length, epoll_fd, sessions, maxsessions);
+
+    // A queued datagram is sent from the packet after the round
+    struct udp_send_queue *queue = &args->worker->udp_send;
+    int parked = (args->worker->replay != NULL);
+    if (queue->count > 0 && queue->packet[queue->count - 1] == NULL) {
+        queue->packet[queue->count - 1] = buffer;
+        queue->parked[queue->count - 1] = (uint8_t) parked;
+    } else if (parked)
+        ng_pool_free(buffer, __FILE__, __LINE__);
+    else
+        free_tun_buffer(args, buffer);
+}
+
 int is_lower_layer(int protocol) {
     return (protocol == 0 || protocol == 60 || protocol == 43 || protocol == 44 || protocol == 51 || protocol == 50 || protocol == 135);
 }
@@ -72,23 +89,29 @@ int is_upper_layer(int protocol) {
     return (protocol == IPPROTO_TCP || protocol == IPPROTO_UDP || protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6);
 }
 
-int has_udp_session(const struct arguments *args, const uint8_t *pkt, const uint8_t *payload) {
-    const uint8_t version = (*pkt) >> 4;
-    const struct iphdr *ip4 = (struct iphdr *) pkt;
-    const struct ip6_hdr *ip6 = (struct ip6_hdr *) pkt;
-    const struct udphdr *udphdr = (struct udphdr *) payload;
-
-    if (ntohs(udphdr->dest) == 53 && !args->fwd53)
-        return 1;
-
-    struct ng_session *cur = args->ctx->ng_session;
-    while (cur != NULL && !(cur->protocol == IPPROTO_UDP && cur->udp.version == version &&
-                            cur->udp.source == udphdr->source && cur->udp.dest == udphdr->dest &&
-                            (version == 4 ? cur->udp.saddr.ip4 == ip4->saddr && cur->udp.daddr.ip4 == ip4->daddr :
-                             memcmp(&cur->udp.saddr.ip6, &ip6->ip6_src, 16) == 0 && memcmp(&cur->udp.daddr.ip6, &ip6->ip6_dst, 16) == 0)))
-        cur = cur->next;
+// The protocol of an IPv6 packet after its extension headers, with the offset of its header.
+// Fragments and ESP cannot be walked, those and unknown layers keep the first header.
+uint8_t get_ip6_protocol(const uint8_t *pkt, size_t length, size_t *off) {
+    uint8_t first = ((const struct ip6_hdr *) pkt)->ip6_nxt;
+    uint8_t protocol = first;
+    size_t next = sizeof(struct ip6_hdr);
+    while (is_lower_layer(protocol) && protocol != IPPROTO_FRAGMENT && protocol != IPPROTO_ESP &&
+           next + sizeof(struct ip6_ext) <= length) {
+        const struct ip6_ext *ext = (const struct ip6_ext *) (pkt + next);
+        // In units of 8 octets without the first, of 4 octets without the first two for AH
+        size_t extlen = (protocol == IPPROTO_AH
+                         ? ((size_t) ext->ip6e_len + 2) * 4
+                         : ((size_t) ext->ip6e_len + 1) * 8);
+        protocol = ext->ip6e_nxt;
+        next += extlen;
+    }
 
-    return (cur != NULL);
+    if (!is_upper_layer(protocol) || next > length) {
+        *off = sizeof(struct ip6_hdr);
+        return first;
+    }
+    *off = next;
+    return protocol;
 }
 
 void handle_ip(const struct arguments *args, const uint8_t *pkt, const size_t length, const int epoll_fd, int sessions, int maxsessions) {
@@ -135,26 +158,12 @@ void handle_ip(const struct arguments *args, const uint8_t *pkt, const size_t le
         }
 
         struct ip6_hdr *ip6hdr = (struct ip6_hdr *) pkt;
-        uint16_t off = 0;
-        protocol = ip6hdr->ip6_nxt;
-
-        if (!is_upper_layer(protocol)) {
-            off = sizeof(struct ip6_hdr);
-            struct ip6_ext *ext = (struct ip6_ext *) (pkt + off);
-            while (is_lower_layer(ext->ip6e_nxt) && !is_upper_layer(protocol)) {
-                protocol = ext->ip6e_nxt;
-                off += (8 + ext->ip6e_len);
-                ext = (struct ip6_ext *) (pkt + off);
-            }
-            if (!is_upper_layer(protocol)) {
-                off = 0;
-                protocol = ip6hdr->ip6_nxt;
-            }
-        }
+        size_t off;
+        protocol = get_ip6_protocol(pkt, length, &off);
 
         saddr = &ip6hdr->ip6_src;
         daddr = &ip6hdr->ip6_dst;
-        payload = (uint8_t *) (pkt + sizeof(struct ip6_hdr) + off);
+        payload = (uint8_t *) (pkt + off);
     } else {
         return;
     }
@@ -213,15 +222,45 @@ void handle_ip(const struct arguments *args, const uint8_t *pkt, const size_t le
 
     flags[flen] = 0;
 
+    struct ng_session *cur = NULL;
+    if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6 ||
+        protocol == IPPROTO_UDP || protocol == IPPROTO_TCP) {
+        struct flow_key key;
+        flow_key_packet(pkt, payload, protocol, &key);
+        cur = flow_lookup(&args->worker->flows, &key);
+        if (cur != NULL && cur->protocol != IPPROTO_TCP && cur->protocol != IPPROTO_UDP && cur->icmp.stop)
+            cur = NULL;
+    }
+
+    int udp_session = (protocol == IPPROTO_UDP && (cur != NULL || (dport == 53 && !args->fwd53)));
+
     if (sessions >= maxsessions) {
         if ((protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6) ||
-            (protocol == IPPROTO_UDP && !has_udp_session(args, pkt, payload)) ||
+            (protocol == IPPROTO_UDP && !udp_session) ||
             (protocol == IPPROTO_TCP && syn)) {
             return;
         }
     }
 
+    // The owner is looked up once, for the packet that opens a flow, and kept on its session.
+    // Queries to the redirect addresses are mostly answered without a session; their owner
+    // is looked up when one is needed, rules that depend on it leave the verdict to Java.
+    // Where the lookup is a Binder call, the verdict thread makes it while the flow is parked.
     jint uid = -1;
+    int owner = 0;
+    int redirect_dns = (cur == NULL && protocol == IPPROTO_UDP && is_dns_redirect(pkt, payload));
+    if (cur != NULL)
+        uid = (cur->protocol == IPPROTO_TCP ? cur->tcp.uid :
+               cur->protocol == IPPROTO_UDP ? cur->udp.uid : cur->icmp.uid);
+    else if (args->worker->replay != NULL)
+        uid = args->worker->replay->uid;
+    else if ((protocol == IPPROTO_UDP && !redirect_dns) || (protocol == IPPROTO_TCP && syn)) {
+        if (uid_deferred(args))
+            owner = VERDICT_OWNER;
+        else
+            uid = get_uid(args, pkt, payload, protocol);
+    }
+
     char server_name[TLS_SNI_LENGTH + 1];
     *server_name = 0;
 
@@ -230,41 +269,243 @@ void handle_ip(const struct arguments *args, const uint8_t *pkt, const size_t le
         const uint8_t tcpoptlen = (uint8_t) ((tcphdr->doff - 5) * 4);
         const uint8_t *data = payload + sizeof(struct tcphdr) + tcpoptlen;
         const uint16_t datalen = (const uint16_t) (length - (data - pkt));
+
+        // The server name comes with the first data of a connection, before it is forwarded
+        if (cur != NULL && datalen > 0 && cur->name_state != NAME_DONE &&
+            cur->tcp.state == TCP_ESTABLISHED &&
+            inspect_server_name(args, cur, data, datalen, ntohl(tcphdr->seq)) == VERDICT_BLOCK) {
+            traffic_block(args->worker, uid);
+            write_rst(args, &cur->tcp);
+            touch_session(args->worker, cur);
+            return;
+        }
+    }
+
+    if (cur != NULL && cur->server_name != NULL)
+        strcpy(server_name, cur->server_name);
+    else if (cur == NULL && dport != 53 && (protocol == IPPROTO_UDP || (protocol == IPPROTO_TCP && syn))) {
+        // A new flow
+        if (pthread_mutex_lock(&args->ctx->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+        dns_names_lookup(args->ctx, version, daddr, uid, server_name);
+        if (pthread_mutex_unlock(&args->ctx->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
     }
 
     if (*server_name != 0)
         strcpy(data, "sni");
 
     if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6 ||
-        (protocol == IPPROTO_UDP && !has_udp_session(args, pkt, payload)) ||
+        (protocol == IPPROTO_UDP && !udp_session) ||
         (protocol == IPPROTO_TCP && syn)) {
     }
 
     int allowed = 1;
     struct allowed *redirect = NULL;
 
-    if (protocol == IPPROTO_UDP && has_udp_session(args, pkt, payload))
+    if (protocol == IPPROTO_UDP && udp_session)
         allowed = 1;
     else if (protocol == IPPROTO_TCP && (!syn || (uid == 0 && dport == 53)) && *server_name == 0)
         allowed = 1;
 
-    // Apply packet filtering
+    // Queries for blocked names are answered here, without a session or a call into Java
+    int dns = VERDICT_ALLOW;
+    if (protocol == IPPROTO_UDP && dport == 53) {
+        dns = handle_dns_query(args, pkt, length, payload);
+        if (dns == VERDICT_BLOCK) {
+            traffic_block(args->worker, uid);
+            return;
+        }
+    }
+
+    // Apply packet filtering. A flow keeps the verdict of its first packet until the rules
+    // change; DNS is the exception, every query on a flow can ask for a different domain.
     jboolean allow_packet = JNI_TRUE;
-    
+    int cacheable = !(protocol == IPPROTO_UDP && dport == 53);
+    uint32_t generation = rule_generation(args->ctx);
+    int verdict;
+
+    if (cur != NULL && cacheable && cur->verdict_generation == generation)
+        verdict = cur->verdict;
+    else {
+        // An established TCP flow with a stale verdict is judged as its SYN was
+        verdict = (dns == VERDICT_UNKNOWN || owner ? VERDICT_UNKNOWN :
+                   rule_evaluate(args->ctx, pkt, protocol, dport, syn || cur != NULL, uid));
+        // A parked packet comes back with the answer, others wait for Java off the loop
+        if (verdict == VERDICT_UNKNOWN && args->worker->replay != NULL)
+            verdict = args->worker->replay->verdict;
+        else if (verdict == VERDICT_UNKNOWN && (protocol != IPPROTO_TCP || syn)) {
+            // The rules are evaluated once the owner is known, unless the query leaves it to Java
+            int rules = (owner && dns != VERDICT_UNKNOWN ? VERDICT_RULES : 0);
+            verdict = verdict_request(args, pkt, length, payload, protocol, uid, server_name,
+                                      cur, cacheable, owner | rules);
+            if (verdict == VERDICT_PENDING)
+                return;
+            if (owner) {
+                // Not parked, the owner is looked up here after all
+                uid = get_uid(args, pkt, payload, protocol);
+                if (rules)
+                    verdict = rule_evaluate(args->ctx, pkt, protocol, dport, 1, uid);
+            }
+        }
+        if (verdict == VERDICT_UNKNOWN) {
+            if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6)
+                allow_packet = filter_icmp_packet(args, pkt, length, DIRECTION_TUN_IN);
+            else if (protocol == IPPROTO_UDP)
+                allow_packet = filter_udp_packet(args, pkt, length, DIRECTION_TUN_IN, server_name);
+            else if (protocol == IPPROTO_TCP && syn)
+                allow_packet = filter_tcp_packet(args, pkt, length, DIRECTION_TUN_IN, server_name);
+            verdict = (allow_packet ? VERDICT_ALLOW : VERDICT_BLOCK);
+        }
+
+        if (cur != NULL && cacheable) {
+            cur->verdict = (int8_t) verdict;
+            cur->verdict_generation = generation;
+        }
+    }
+    allow_packet = (jboolean) (verdict == VERDICT_ALLOW);
+
+    // Attempts to open a flow; packets of a flow cut by a rule change are not counted
+    if (!allow_packet && cur == NULL && (protocol != IPPROTO_TCP || syn))
+        traffic_block(args->worker, uid);
+
     if (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6) {
-        allow_packet = filter_icmp_packet(args, pkt, length, "TUN_IN");
         if (allow_packet) {
             handle_icmp(args, pkt, length, payload, uid, epoll_fd);
         }
     } else if (protocol == IPPROTO_UDP) {
-        allow_packet = filter_udp_packet(args, pkt, length, "TUN_IN");
-        if (allow_packet) {
+        // Allowed queries to the redirect addresses are answered from the cache
+        // or sent over the shared upstream sockets, without a session
+        int dns_handled = 0;
+        if (allow_packet && dport == 53) {
+            if (pthread_mutex_lock(&args->ctx->lock))
+                log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+            dns_handled = (dns_cache_answer(args, pkt, length, payload, uid) ||
+                           dns_mux_query(args, pkt, length, payload, uid, epoll_fd));
+            if (pthread_mutex_unlock(&args->ctx->lock))
+                log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+        }
+        if (allow_packet && !dns_handled) {
+            // A session needs the owner; one found by the verdict thread is not looked for again
+            struct pending_verdict *replay = args->worker->replay;
+            int owner_rules = VERDICT_OWNER | (dns != VERDICT_UNKNOWN ? VERDICT_RULES : 0);
+            if (redirect_dns && uid < 0 && replay == NULL && uid_deferred(args) &&
+                verdict_request(args, pkt, length, payload, protocol, uid, server_name,
+                                NULL, 0, owner_rules) == VERDICT_PENDING)
+                return;
+            if (redirect_dns && uid < 0 && (replay == NULL || !replay->owner))
+                uid = get_uid(args, pkt, payload, protocol);
             handle_udp(args, pkt, length, payload, uid, redirect, epoll_fd);
         }
     } else if (protocol == IPPROTO_TCP) {
-        allow_packet = filter_tcp_packet(args, pkt, length, "TUN_IN");
         if (allow_packet) {
             handle_tcp(args, pkt, length, payload, uid, allowed, redirect, epoll_fd);
+        } else if (cur != NULL && cur->tcp.state != TCP_CLOSING && cur->tcp.state != TCP_CLOSE) {
+            // Blocked after a rule change, reset instead of waiting for the timeout
+            write_rst(args, &cur->tcp);
+            touch_session(args->worker, cur);
         }
     }
-}
\ No newline at end of file
+
+    // Stamp the verdict and the name on a flow created by this packet
+    if (cur == NULL && allow_packet && cacheable &&
+        (protocol == IPPROTO_ICMP || protocol == IPPROTO_ICMPV6 ||
+         protocol == IPPROTO_UDP || protocol == IPPROTO_TCP)) {
+        struct flow_key key;
+        flow_key_packet(pkt, payload, protocol, &key);
+        struct ng_session *s = flow_lookup(&args->worker->flows, &key);
+        if (s != NULL && cacheable) {
+            s->verdict = VERDICT_ALLOW;
+            s->verdict_generation = generation;
+        }
+        if (s != NULL && *server_name != 0 && s->server_name == NULL)
+            session_set_name(s, server_name);
+    }
+}
+
+void init_template(struct packet_template *tpl, int version, uint8_t protocol,
+                   const void *saddr, const void *daddr) {
+    // Addresses as written to the tunnel, the source is the remote end
+    memset(tpl, 0, sizeof(struct packet_template));
+    if (version == 4) {
+        struct iphdr *ip4 = (struct iphdr *) tpl->header;
+        ip4->version = 4;
+        ip4->ihl = sizeof(struct iphdr) >> 2;
+        ip4->ttl = IPDEFTTL;
+        ip4->protocol = protocol;
+        memcpy(&ip4->saddr, saddr, 4);
+        memcpy(&ip4->daddr, daddr, 4);
+        tpl->ip_sum = calc_checksum(0, tpl->header, sizeof(struct iphdr));
+
+        struct ippseudo pseudo;
+        memset(&pseudo, 0, sizeof(struct ippseudo));
+        pseudo.ippseudo_src.s_addr = (__be32) ip4->saddr;
+        pseudo.ippseudo_dst.s_addr = (__be32) ip4->daddr;
+        pseudo.ippseudo_p = protocol;
+        tpl->pseudo_sum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ippseudo));
+    } else {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *) tpl->header;
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = protocol;
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = IPDEFTTL;
+        ip6->ip6_ctlun.ip6_un2_vfc = IPV6_VERSION;
+        memcpy(&ip6->ip6_src, saddr, 16);
+        memcpy(&ip6->ip6_dst, daddr, 16);
+
+        struct ip6_hdr_pseudo pseudo;
+        memset(&pseudo, 0, sizeof(struct ip6_hdr_pseudo));
+        memcpy(&pseudo.ip6ph_src, saddr, 16);
+        memcpy(&pseudo.ip6ph_dst, daddr, 16);
+        pseudo.ip6ph_nxt = protocol;
+        tpl->pseudo_sum = calc_checksum(0, (uint8_t *) &pseudo, sizeof(struct ip6_hdr_pseudo));
+    }
+}
+
+size_t apply_template(const struct packet_template *tpl, int version,
+                      uint8_t *buffer, size_t l4len, uint16_t *csum) {
+    // Returns the length of the IP header, with the sum of the pseudo header
+    // to continue the checksum of the transport header with
+    size_t hlen;
+    if (version == 4) {
+        hlen = sizeof(struct iphdr);
+        memcpy(buffer, tpl->header, hlen);
+        struct iphdr *ip4 = (struct iphdr *) buffer;
+        ip4->tot_len = htons(hlen + l4len);
+        ip4->check = ~calc_checksum(tpl->ip_sum, (uint8_t *) &ip4->tot_len, sizeof(ip4->tot_len));
+    } else {
+        hlen = sizeof(struct ip6_hdr);
+        memcpy(buffer, tpl->header, hlen);
+        struct ip6_hdr *ip6 = (struct ip6_hdr *) buffer;
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen = htons(l4len);
+    }
+
+    __be16 len = htons(l4len);
+    *csum = calc_checksum(tpl->pseudo_sum, (uint8_t *) &len, sizeof(len));
+    return hlen;
+}
+
+ssize_t write_packet(const struct arguments *args, const uint8_t *header, size_t hlen,
+                     const uint8_t *data, size_t datalen) {
+    // The payload is gathered from where it was received, a tun device takes
+    // one packet per write, so there is nothing to gain from holding packets back
+    struct iovec iov[2];
+    iov[0].iov_base = (void *) header;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = datalen;
+
+    size_t len = hlen + datalen;
+    ssize_t res = writev(args->tun, iov, datalen ? 2 : 1);
+
+    struct tun_stats *stats = &args->worker->tun_stats;
+    stats->writes++;
+    if (res != len) {
+        stats->errors++;
+        if (res < 0)
+            log_android(ANDROID_LOG_WARN, "tun writev %zu error %d: %s", len, errno, strerror(errno));
+        else
+            log_android(ANDROID_LOG_WARN, "tun writev %zu short %zd", len, res);
+        return -1;
+    }
+    stats->written_bytes += len;
+    return res;
+}
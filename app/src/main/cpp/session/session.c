@@ -19,8 +19,10 @@
 
 #include "../athena.h"
 
-void clear(struct context *ctx) {
-    struct ng_session *s = ctx->ng_session;
+extern JavaVM *jvm;
+
+static void clear_worker(struct worker *worker) {
+    struct ng_session *s = worker->ng_session;
     while (s != NULL) {
         if (s->socket >= 0) {
             if (close(s->socket) != 0) {
@@ -29,123 +31,301 @@ void clear(struct context *ctx) {
             s->socket = -1;
         }
         if (s->protocol == IPPROTO_TCP)
-            clear_tcp_data(&s->tcp);
-        struct ng_session *p = s;
+            clear_tcp_data(worker, &s->tcp);
+        session_free_name(s);
+        traffic_fold(worker, s);
         s = s->next;
-        ng_free(p, __FILE__, __LINE__);
     }
-    ctx->ng_session = NULL;
+    worker->ng_session = NULL;
+    slab_reset(&worker->session_slab);
+    slab_reset(&worker->segment_slab);
+    flow_clear(&worker->flows);
+    timer_init(&worker->timers, time(NULL));
+    worker->dirty = NULL;
+    worker->sessions = 0;
+    worker->load_step = 0;
+    verdict_clear(worker);
 }
 
-void *handle_events(void *a) {
-    struct arguments *args = (struct arguments *) a;
+void clear(struct context *ctx) {
+    // Shards first, a worker takes the context lock while it holds its own
+    for (int i = 0; i < WORKERS_MAX; i++) {
+        struct worker *worker = &ctx->workers[i];
+        if (pthread_mutex_lock(&worker->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+        clear_worker(worker);
+        if (pthread_mutex_unlock(&worker->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+    }
 
-    int maxsessions = SESSION_MAX;
-    struct rlimit rlim;
-    if (!getrlimit(RLIMIT_NOFILE, &rlim)) {
-        maxsessions = (int) (rlim.rlim_cur * SESSION_LIMIT / 100);
-        if (maxsessions > SESSION_MAX)
-            maxsessions = SESSION_MAX;
+    if (pthread_mutex_lock(&ctx->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    dns_cache_clear(ctx);
+    dns_names_clear(ctx);
+    dns_mux_close(ctx);
+    if (pthread_mutex_unlock(&ctx->lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+}
+
+void add_session(struct worker *worker, struct ng_session *s) {
+    s->prev = NULL;
+    s->next = worker->ng_session;
+    if (s->next != NULL)
+        s->next->prev = s;
+    worker->ng_session = s;
+
+    s->timer_slot = -1;
+    s->timer_next = NULL;
+    s->timer_prev = NULL;
+    s->dirty = 0;
+    s->active = 0;
+    s->verdict = VERDICT_UNKNOWN;
+    s->verdict_generation = 0;
+    s->server_name = NULL;
+    s->name_state = NAME_PENDING;
+    s->probe = NULL;
+    memset(&s->traffic, 0, sizeof(struct traffic));
+
+    flow_insert(&worker->flows, s);
+    account_session(worker, s);
+    touch_session(worker, s);
+    traffic_flow(worker, s);
+}
+
+void delete_session(struct worker *worker, struct ng_session *s) {
+    if (s->prev == NULL)
+        worker->ng_session = s->next;
+    else
+        s->prev->next = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+
+    flow_remove(&worker->flows, s);
+    timer_cancel(&worker->timers, s);
+
+    if (s->dirty) {
+        struct ng_session **d = &worker->dirty;
+        while (*d != NULL && *d != s)
+            d = &(*d)->dirty_next;
+        if (*d != NULL)
+            *d = s->dirty_next;
     }
 
+    if (s->active)
+        worker->sessions--;
+
+    if (s->socket >= 0) {
+        if (close(s->socket) != 0)
+            log_android(ANDROID_LOG_WARN, "Failed to close socket %d: %s", s->socket, strerror(errno));
+        s->socket = -1;
+    }
+
+    if (s->protocol == IPPROTO_TCP)
+        clear_tcp_data(worker, &s->tcp);
+    session_free_name(s);
+    traffic_fold(worker, s);
+    slab_free(&worker->session_slab, s);
+}
+
+void touch_session(struct worker *worker, struct ng_session *s) {
+    if (!s->dirty) {
+        s->dirty = 1;
+        s->dirty_next = worker->dirty;
+        worker->dirty = s;
+    }
+}
+
+void account_session(struct worker *worker, struct ng_session *s) {
+    uint8_t active;
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+        active = !s->icmp.stop;
+    else if (s->protocol == IPPROTO_UDP)
+        active = (s->udp.state == UDP_ACTIVE);
+    else
+        active = (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE);
+
+    if (active != s->active) {
+        s->active = active;
+        worker->sessions += (active ? 1 : -1);
+    }
+}
+
+time_t get_session_deadline(const struct ng_session *s, time_t now, int sessions, int maxsessions) {
+    if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
+        if (s->icmp.stop)
+            return now;
+        return s->icmp.time + get_icmp_timeout(&s->icmp, sessions, maxsessions) + 1;
+    } else if (s->protocol == IPPROTO_UDP) {
+        if (s->udp.state == UDP_ACTIVE)
+            return s->udp.time + get_udp_timeout(&s->udp, sessions, maxsessions) + 1;
+        else if (s->udp.state == UDP_FINISHING)
+            return now;
+        else
+            return s->udp.time + UDP_KEEP_TIMEOUT + 1;
+    } else {
+        if (s->tcp.state == TCP_CLOSING)
+            return now;
+        else if (s->tcp.state == TCP_CLOSE)
+            return s->tcp.time + TCP_KEEP_TIMEOUT + 1;
+        else
+            return s->tcp.time + get_tcp_timeout(&s->tcp, sessions, maxsessions) + 1;
+    }
+}
+
+// Timeouts scale down as the table fills, a deadline armed at a lower load is
+// too late now; lower loads are left to the expiry, which recomputes them
+static void rearm_sessions(struct worker *w, time_t now, int maxsessions) {
+    int step = w->sessions * 100 / maxsessions / SESSION_LOAD_STEP;
+    int rising = (step > w->load_step);
+    w->load_step = step;
+    if (!rising)
+        return;
+
+    for (struct ng_session *s = w->ng_session; s != NULL; s = s->next)
+        if (s->timer_slot >= 0) {
+            time_t deadline = get_session_deadline(s, now, w->sessions, maxsessions);
+            if (deadline < s->timer_expires)
+                timer_schedule(&w->timers, s, deadline);
+        }
+}
+
+static void drain_ring(const struct arguments *args, int epoll_fd, int maxsessions) {
+    // Up to what was queued when woken, the dispatcher wakes again for the rest
+    struct worker *w = args->worker;
+    struct packet_ring *ring = &w->ring;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    while (tail != head) {
+        uint8_t *buffer = ring->slot[tail % WORKER_QUEUE].buffer;
+        size_t length = ring->slot[tail % WORKER_QUEUE].length;
+        atomic_store_explicit(&ring->tail, ++tail, memory_order_release);
+        if (args->ctx->stopping)
+            free_tun_buffer(args, buffer);
+        else
+            handle_tun_packet(args, buffer, length, epoll_fd, w->sessions, maxsessions);
+    }
+    flush_udp(args);
+}
+
+static void run_worker(struct arguments *args, int maxsessions) {
+    struct context *ctx = args->ctx;
+    struct worker *w = args->worker;
+    // A single worker reads the tun itself, else the dispatcher fills its ring
+    int dispatched = (ctx->worker_count > 1);
+
     int epoll_fd = epoll_create(1);
     if (epoll_fd < 0) {
-        args->ctx->stopping = 1;
+        ctx->stopping = 1;
+    }
+    w->epoll_fd = epoll_fd;
+
+    // Woken by the dispatcher and by the verdict thread
+    struct epoll_event ev_wake;
+    memset(&ev_wake, 0, sizeof(struct epoll_event));
+    ev_wake.events = EPOLLIN | EPOLLERR;
+    ev_wake.data.ptr = &ev_wake;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->wake_fd, &ev_wake)) {
+        ctx->stopping = 1;
     }
 
     struct epoll_event ev_pipe;
     memset(&ev_pipe, 0, sizeof(struct epoll_event));
     ev_pipe.events = EPOLLIN | EPOLLERR;
     ev_pipe.data.ptr = &ev_pipe;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, args->ctx->pipefds[0], &ev_pipe)) {
-        args->ctx->stopping = 1;
+    if (!dispatched && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ctx->pipefds[0], &ev_pipe)) {
+        ctx->stopping = 1;
     }
 
     struct epoll_event ev_tun;
     memset(&ev_tun, 0, sizeof(struct epoll_event));
     ev_tun.events = EPOLLIN | EPOLLERR;
     ev_tun.data.ptr = NULL;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, args->tun, &ev_tun)) {
-        args->ctx->stopping = 1;
+    if (!dispatched && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, args->tun, &ev_tun)) {
+        ctx->stopping = 1;
     }
 
+    // Published while no loop was running, the wake may have gone to a previous one
+    if (!dispatched)
+        drain_injections(args);
+
     long long last_check = 0;
-    while (!args->ctx->stopping) {
+    while (!ctx->stopping) {
         int recheck = 0;
         int timeout = EPOLL_TIMEOUT;
+        time_t now = time(NULL);
+
+        if (pthread_mutex_lock(&w->lock))
+            break;
 
-        int isessions = 0;
-        int usessions = 0;
-        int tsessions = 0;
-        struct ng_session *s = args->ctx->ng_session;
+        // Cleared between rounds, no event of this instance refers to a session anymore
+        if (atomic_exchange(&w->clear, 0)) {
+            log_android(ANDROID_LOG_INFO, "Worker %d clearing sessions", w->index);
+            clear_worker(w);
+            ng_pool_drain();
+        }
+
+        // Only sessions touched since the previous round are revisited
+        struct ng_session *s = w->dirty;
+        w->dirty = NULL;
         while (s != NULL) {
-            if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
-                if (!s->icmp.stop)
-                    isessions++;
-            } else if (s->protocol == IPPROTO_UDP) {
-                if (s->udp.state == UDP_ACTIVE)
-                    usessions++;
-            } else if (s->protocol == IPPROTO_TCP) {
-                if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE)
-                    tsessions++;
-                if (s->socket >= 0)
-                    recheck = recheck | monitor_tcp_session(args, s, epoll_fd);
+            struct ng_session *n = s->dirty_next;
+            s->dirty = 0;
+
+            int monitor = 0;
+            if (s->protocol == IPPROTO_TCP && s->socket >= 0)
+                monitor = monitor_tcp_session(args, s, epoll_fd);
+            account_session(w, s);
+            timer_schedule(&w->timers, s, get_session_deadline(s, now, w->sessions, maxsessions));
+
+            if (monitor) {
+                recheck = 1;
+                touch_session(w, s);
             }
-            s = s->next;
+            s = n;
         }
-        int sessions = isessions + usessions + tsessions;
 
         long long ms = get_ms();
         if (ms - last_check > EPOLL_MIN_CHECK) {
             last_check = ms;
 
-            time_t now = time(NULL);
-            struct ng_session *sl = NULL;
-            s = args->ctx->ng_session;
+            verdict_expire(w, now);
+            traffic_flush(w);
+            rearm_sessions(w, now, maxsessions);
+
+            s = timer_expire(&w->timers, now);
             while (s != NULL) {
-                int del = 0;
-                if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6) {
-                    del = check_icmp_session(args, s, sessions, maxsessions);
-                    if (!s->icmp.stop && !del) {
-                        int stimeout = s->icmp.time + get_icmp_timeout(&s->icmp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
-                } else if (s->protocol == IPPROTO_UDP) {
-                    del = check_udp_session(args, s, sessions, maxsessions);
-                    if (s->udp.state == UDP_ACTIVE && !del) {
-                        int stimeout = s->udp.time + get_udp_timeout(&s->udp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
-                } else if (s->protocol == IPPROTO_TCP) {
-                    del = check_tcp_session(args, s, sessions, maxsessions);
-                    if (s->tcp.state != TCP_CLOSING && s->tcp.state != TCP_CLOSE && !del) {
-                        int stimeout = s->tcp.time + get_tcp_timeout(&s->tcp, sessions, maxsessions) - now + 1;
-                        if (stimeout > 0 && stimeout < timeout)
-                            timeout = stimeout;
-                    }
-                }
+                struct ng_session *n = s->timer_next;
+                s->timer_next = NULL;
 
-                if (del) {
-                    if (sl == NULL)
-                        args->ctx->ng_session = s->next;
-                    else
-                        sl->next = s->next;
-
-                    struct ng_session *c = s;
-                    s = s->next;
-                    if (c->protocol == IPPROTO_TCP)
-                        clear_tcp_data(&c->tcp);
-                    ng_free(c, __FILE__, __LINE__);
-                } else {
-                    sl = s;
-                    s = s->next;
+                int del;
+                if (s->protocol == IPPROTO_ICMP || s->protocol == IPPROTO_ICMPV6)
+                    del = check_icmp_session(args, s, w->sessions, maxsessions);
+                else if (s->protocol == IPPROTO_UDP)
+                    del = check_udp_session(args, s, w->sessions, maxsessions);
+                else
+                    del = check_tcp_session(args, s, w->sessions, maxsessions);
+
+                if (del)
+                    delete_session(w, s);
+                else {
+                    account_session(w, s);
+                    timer_schedule(&w->timers, s, get_session_deadline(s, now, w->sessions, maxsessions));
                 }
+                s = n;
+            }
+
+            time_t next = timer_next(&w->timers);
+            if (next > 0) {
+                if (next <= now)
+                    recheck = 1;
+                else if (next - now < timeout)
+                    timeout = (int) (next - now);
             }
         } else {
             recheck = 1;
         }
+        if (pthread_mutex_unlock(&w->lock))
+            break;
 
         struct epoll_event ev[EPOLL_EVENTS];
         int ready = epoll_wait(epoll_fd, ev, EPOLL_EVENTS, recheck ? EPOLL_MIN_CHECK : timeout * 1000);
@@ -158,32 +338,45 @@ void *handle_events(void *a) {
         }
 
         if (ready > 0) {
-            if (pthread_mutex_lock(&args->ctx->lock))
+            if (pthread_mutex_lock(&w->lock))
                 break;
 
             int error = 0;
 
             for (int i = 0; i < ready; i++) {
-                if (ev[i].data.ptr == &ev_pipe) {
-                    uint8_t buffer[1];
-                    read(args->ctx->pipefds[0], buffer, 1);
+                if (ev[i].data.ptr == &ev_wake) {
+                    uint64_t count;
+                    read(w->wake_fd, &count, sizeof(count));
+                    if (dispatched)
+                        drain_ring(args, epoll_fd, maxsessions);
+                    verdict_complete(args, epoll_fd, maxsessions);
+                } else if (ev[i].data.ptr == &ev_pipe) {
+                    uint8_t buffer[16];
+                    read(ctx->pipefds[0], buffer, sizeof(buffer));
+                    run_commands(args);
+                    drain_injections(args);
+                } else if (is_dns_upstream(ctx, ev[i].data.ptr)) {
+                    if (pthread_mutex_lock(&ctx->lock) == 0) {
+                        check_dns_upstream(args, &ev[i]);
+                        pthread_mutex_unlock(&ctx->lock);
+                    }
                 } else if (ev[i].data.ptr == NULL) {
                     int count = 0;
-                    while (count < TUN_YIELD && !error && !args->ctx->stopping && is_readable(args->tun)) {
+                    while (count < TUN_YIELD && !error && !ctx->stopping && is_readable(args->tun)) {
                         count++;
-                        if (check_tun(args, &ev[i], epoll_fd, sessions, maxsessions) < 0)
+                        if (check_tun(args, &ev[i], epoll_fd, w->sessions, maxsessions) < 0)
                             error = 1;
                     }
+                    flush_udp(args);
                 } else {
                     struct ng_session *session = (struct ng_session *) ev[i].data.ptr;
+                    touch_session(w, session);
                     if (session->protocol == IPPROTO_ICMP || session->protocol == IPPROTO_ICMPV6)
                         check_icmp_socket(args, &ev[i]);
                     else if (session->protocol == IPPROTO_UDP) {
-                        int count = 0;
-                        while (count < UDP_YIELD && !args->ctx->stopping && !(ev[i].events & EPOLLERR) && (ev[i].events & EPOLLIN) && is_readable(session->socket)) {
-                            count++;
+                        // Up to UDP_BATCH datagrams with one recvmmsg, the rest next round
+                        if (!ctx->stopping && !(ev[i].events & EPOLLERR) && (ev[i].events & EPOLLIN))
                             check_udp_socket(args, &ev[i]);
-                        }
                     } else if (session->protocol == IPPROTO_TCP)
                         check_tcp_socket(args, &ev[i], epoll_fd);
                 }
@@ -192,7 +385,10 @@ void *handle_events(void *a) {
                     break;
             }
 
-            if (pthread_mutex_unlock(&args->ctx->lock))
+            // The flows this round opened go to Java together
+            verdict_flush(args);
+
+            if (pthread_mutex_unlock(&w->lock))
                 break;
 
             if (error)
@@ -200,10 +396,332 @@ void *handle_events(void *a) {
         }
     }
 
+    if (dispatched) {
+        // A worker that gave up stops the others
+        if (!ctx->stopping) {
+            ctx->stopping = 1;
+            write(ctx->pipefds[1], "w", 1);
+        }
+
+        // What the dispatcher queued after the last round
+        struct packet_ring *ring = &w->ring;
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++)
+            free_tun_buffer(args, ring->slot[tail % WORKER_QUEUE].buffer);
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+
+    // The DNS upstream sockets may be registered with this epoll instance
+    if (pthread_mutex_lock(&ctx->lock) == 0) {
+        if (epoll_fd >= 0)
+            close(epoll_fd);
+        w->epoll_fd = -1;
+        dns_mux_close(ctx);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    struct pool_stats stats;
+    ng_pool_get_stats(&stats);
+    log_android(ANDROID_LOG_INFO, "Worker %d pool hits %llu misses %llu recycled %llu released %llu cached %d",
+                w->index, (unsigned long long) stats.hits, (unsigned long long) stats.misses,
+                (unsigned long long) stats.recycled, (unsigned long long) stats.released, stats.cached);
+    verdict_clear(w);
+    free_udp_batch(w);
+    ng_pool_drain();
+    slab_log_stats(&w->session_slab);
+    slab_log_stats(&w->segment_slab);
+}
+
+static void *worker_thread(void *a) {
+    struct arguments *args = (struct arguments *) a;
+
+    // Filter callbacks need an environment of this thread
+    JNIEnv *env = NULL;
+    if (jvm != NULL && (*jvm)->AttachCurrentThread(jvm, &env, NULL) != JNI_OK) {
+        log_android(ANDROID_LOG_ERROR, "Worker %d attach failed", args->worker->index);
+        env = NULL;
+    }
+    args->env = env;
+
+    run_worker(args, args->worker->maxsessions);
+
+    if (env != NULL)
+        (*jvm)->DetachCurrentThread(jvm);
+    ng_free(args, __FILE__, __LINE__);
+    return NULL;
+}
+
+// The pools are per thread, a buffer read by the dispatcher goes back to it
+// instead of filling the pool of the worker and emptying its own.
+void free_tun_buffer(const struct arguments *args, uint8_t *buffer) {
+    if (args->ctx->worker_count > 1) {
+        struct packet_ring *ring = &args->worker->ring;
+        uint32_t head = atomic_load_explicit(&ring->free_head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&ring->free_tail, memory_order_acquire);
+        if (head - tail < WORKER_QUEUE) {
+            ring->returned[head % WORKER_QUEUE] = buffer;
+            atomic_store_explicit(&ring->free_head, head + 1, memory_order_release);
+            return;
+        }
+    }
+    ng_pool_free(buffer, __FILE__, __LINE__);
+}
+
+static void reclaim_tun_buffers(struct context *ctx) {
+    for (int i = 0; i < ctx->worker_count; i++) {
+        struct packet_ring *ring = &ctx->workers[i].ring;
+        uint32_t tail = atomic_load_explicit(&ring->free_tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring->free_head, memory_order_acquire);
+        for (; tail != head; tail++)
+            ng_pool_free(ring->returned[tail % WORKER_QUEUE], __FILE__, __LINE__);
+        atomic_store_explicit(&ring->free_tail, tail, memory_order_release);
+    }
+}
+
+static int dispatch_packet(struct context *ctx, uint8_t *buffer, size_t length) {
+    struct worker *w = &ctx->workers[flow_shard(buffer, length, ctx->worker_count)];
+    struct packet_ring *ring = &w->ring;
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= WORKER_QUEUE) {
+        // The worker is behind, the sender retransmits as for a full device queue
+        ring->dropped++;
+        ng_pool_free(buffer, __FILE__, __LINE__);
+        return -1;
+    }
+
+    ring->slot[head % WORKER_QUEUE].buffer = buffer;
+    ring->slot[head % WORKER_QUEUE].length = length;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return w->index;
+}
+
+static void dispatch_tun(const struct arguments *args, struct tun_stats *tun) {
+    struct context *ctx = args->ctx;
+
+    int epoll_fd = epoll_create(1);
+    if (epoll_fd < 0) {
+        ctx->stopping = 1;
+    }
+
+    struct epoll_event ev_pipe;
+    memset(&ev_pipe, 0, sizeof(struct epoll_event));
+    ev_pipe.events = EPOLLIN | EPOLLERR;
+    ev_pipe.data.ptr = &ev_pipe;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ctx->pipefds[0], &ev_pipe)) {
+        ctx->stopping = 1;
+    }
+
+    struct epoll_event ev_tun;
+    memset(&ev_tun, 0, sizeof(struct epoll_event));
+    ev_tun.events = EPOLLIN | EPOLLERR;
+    ev_tun.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, args->tun, &ev_tun)) {
+        ctx->stopping = 1;
+    }
+
+    drain_injections(args);
+
+    while (!ctx->stopping) {
+        struct epoll_event ev[2];
+        int ready = epoll_wait(epoll_fd, ev, 2, EPOLL_TIMEOUT * 1000);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            else
+                break;
+        }
+
+        int error = 0;
+        int woken[WORKERS_MAX];
+        memset(woken, 0, sizeof(woken));
+        for (int i = 0; i < ready && !error; i++) {
+            if (ev[i].data.ptr == &ev_pipe) {
+                uint8_t buffer[16];
+                read(ctx->pipefds[0], buffer, sizeof(buffer));
+                run_commands(args);
+                drain_injections(args);
+                continue;
+            }
+            if (ev[i].events & EPOLLERR) {
+                error = 1;
+                break;
+            }
+
+            reclaim_tun_buffers(ctx);
+            int count = 0;
+            while (count < TUN_YIELD && !ctx->stopping && is_readable(args->tun)) {
+                count++;
+                uint8_t *buffer = ng_pool_alloc(get_mtu(), "tun read");
+                ssize_t length = read(args->tun, buffer, get_mtu());
+                tun->reads++;
+                if (length <= 0) {
+                    ng_pool_free(buffer, __FILE__, __LINE__);
+                    if (length < 0 && (errno == EINTR || errno == EAGAIN))
+                        break;
+                    error = 1;
+                    break;
+                }
+                tun->read_bytes += (uint64_t) length;
+
+                int index = dispatch_packet(ctx, buffer, (size_t) length);
+                if (index >= 0)
+                    woken[index] = 1;
+            }
+        }
+
+        // Once per worker per round
+        for (int i = 0; i < ctx->worker_count; i++)
+            if (woken[i]) {
+                uint64_t one = 1;
+                write(ctx->workers[i].wake_fd, &one, sizeof(one));
+            }
+
+        if (error)
+            break;
+    }
+
     if (epoll_fd >= 0)
         close(epoll_fd);
+}
+
+void *handle_events(void *a) {
+    struct arguments *args = (struct arguments *) a;
+    struct context *ctx = args->ctx;
+
+    int maxsessions = SESSION_MAX;
+    struct rlimit rlim;
+    if (!getrlimit(RLIMIT_NOFILE, &rlim)) {
+        maxsessions = (int) (rlim.rlim_cur * SESSION_LIMIT / 100);
+        if (maxsessions > SESSION_MAX)
+            maxsessions = SESSION_MAX;
+    }
+
+    // Each worker owns a shard of the flows and of the session limit
+    int workers = ctx->worker_count;
+    for (int i = 0; i < workers; i++) {
+        struct worker *w = &ctx->workers[i];
+        w->maxsessions = (maxsessions / workers > 0 ? maxsessions / workers : 1);
+        w->epoll_fd = -1;
+        w->wake_fd = -1;
+        atomic_store(&w->ring.head, 0);
+        atomic_store(&w->ring.tail, 0);
+        atomic_store(&w->ring.free_head, 0);
+        atomic_store(&w->ring.free_tail, 0);
+    }
+
+    struct tun_stats tun;
+    memset(&tun, 0, sizeof(struct tun_stats));
+
+    int woken = 1;
+    for (int i = 0; i < workers; i++) {
+        struct worker *w = &ctx->workers[i];
+        w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->wake_fd < 0) {
+            log_android(ANDROID_LOG_ERROR, "Worker %d eventfd error %d: %s", i, errno, strerror(errno));
+            woken = 0;
+        }
+    }
+
+    // The verdict thread and the workers call into Java with a reference of their own
+    jobject instance = (args->env != NULL ? (*args->env)->NewGlobalRef(args->env, args->instance) : NULL);
+    if (woken)
+        verdict_start(args, instance);
+
+    if (!woken)
+        log_android(ANDROID_LOG_ERROR, "Event loop not started");
+    else if (workers == 1) {
+        args->worker = &ctx->workers[0];
+        run_worker(args, args->worker->maxsessions);
+    } else {
+        int started = 0;
+        for (; started < workers; started++) {
+            struct worker *w = &ctx->workers[started];
+            struct arguments *wargs = ng_malloc(sizeof(struct arguments), "worker arguments");
+            if (wargs == NULL) {
+                log_android(ANDROID_LOG_ERROR, "Worker %d arguments error", started);
+                break;
+            }
+            memcpy(wargs, args, sizeof(struct arguments));
+            wargs->instance = instance;
+            wargs->worker = w;
+            if (pthread_create(&w->thread, NULL, worker_thread, wargs)) {
+                log_android(ANDROID_LOG_ERROR, "Worker %d thread error", started);
+                ng_free(wargs, __FILE__, __LINE__);
+                break;
+            }
+        }
+        log_android(ANDROID_LOG_INFO, "Started %d of %d workers", started, workers);
+
+        if (started == workers)
+            dispatch_tun(args, &tun);
+
+        ctx->stopping = 1;
+        for (int i = 0; i < started; i++) {
+            uint64_t one = 1;
+            write(ctx->workers[i].wake_fd, &one, sizeof(one));
+        }
+        for (int i = 0; i < started; i++)
+            pthread_join(ctx->workers[i].thread, NULL);
+        reclaim_tun_buffers(ctx);
+        ng_pool_drain();
+    }
+
+    verdict_stop(ctx);
+    for (int i = 0; i < workers; i++)
+        if (ctx->workers[i].wake_fd >= 0) {
+            close(ctx->workers[i].wake_fd);
+            ctx->workers[i].wake_fd = -1;
+        }
+    if (instance != NULL)
+        (*args->env)->DeleteGlobalRef(args->env, instance);
+
+    uint64_t dropped = 0;
+    struct verdict_stats verdicts;
+    memset(&verdicts, 0, sizeof(struct verdict_stats));
+    for (int i = 0; i < workers; i++) {
+        struct verdict_stats *vs = &ctx->workers[i].verdict_stats;
+        verdicts.parked += vs->parked;
+        verdicts.refreshed += vs->refreshed;
+        verdicts.expired += vs->expired;
+        verdicts.dropped += vs->dropped;
+
+        struct tun_stats *stats = &ctx->workers[i].tun_stats;
+        tun.reads += stats->reads;
+        tun.read_bytes += stats->read_bytes;
+        tun.writes += stats->writes;
+        tun.written_bytes += stats->written_bytes;
+        tun.errors += stats->errors;
+        dropped += ctx->workers[i].ring.dropped;
+    }
+    log_android(ANDROID_LOG_INFO, "Tun reads %llu bytes %llu writes %llu bytes %llu errors %llu dropped %llu",
+                (unsigned long long) tun.reads, (unsigned long long) tun.read_bytes,
+                (unsigned long long) tun.writes, (unsigned long long) tun.written_bytes,
+                (unsigned long long) tun.errors, (unsigned long long) dropped);
+    log_android(ANDROID_LOG_INFO, "Verdicts parked %llu refreshed %llu expired %llu dropped %llu",
+                (unsigned long long) verdicts.parked, (unsigned long long) verdicts.refreshed,
+                (unsigned long long) verdicts.expired, (unsigned long long) verdicts.dropped);
+    log_android(ANDROID_LOG_INFO, "Injected packets %llu errors %llu",
+                (unsigned long long) ctx->inject.packets, (unsigned long long) ctx->inject.errors);
+
+    if (pthread_mutex_lock(&ctx->lock) == 0) {
+        struct dns_cache_stats dns;
+        dns_cache_get_stats(ctx, &dns);
+        log_android(ANDROID_LOG_INFO, "DNS cache hits %llu misses %llu stored %llu evicted %llu entries %u bytes %zu",
+                    (unsigned long long) dns.hits, (unsigned long long) dns.misses,
+                    (unsigned long long) dns.stored, (unsigned long long) dns.evicted,
+                    dns.entries, dns.bytes);
+
+        struct dns_mux_stats mux = ctx->dns_mux.stats;
+        log_android(ANDROID_LOG_INFO, "DNS upstream queries %llu answers %llu expired %llu unmatched %llu rotated %llu",
+                    (unsigned long long) mux.queries, (unsigned long long) mux.answers,
+                    (unsigned long long) mux.expired, (unsigned long long) mux.unmatched,
+                    (unsigned long long) mux.rotated);
+        pthread_mutex_unlock(&ctx->lock);
+    }
 
     ng_free(args, __FILE__, __LINE__);
 
     return NULL;
-}
\ No newline at end of file
+}
@@ -0,0 +1,144 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// Three levels of 64 one second slots cover a bit over three days,
+// timers further away are parked in the last slot and cascaded again.
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+static void timer_unlink(struct timer_wheel *wheel, struct ng_session *s) {
+    if (s->timer_prev == NULL)
+        wheel->slots[s->timer_slot] = s->timer_next;
+    else
+        s->timer_prev->timer_next = s->timer_next;
+    if (s->timer_next != NULL)
+        s->timer_next->timer_prev = s->timer_prev;
+    s->timer_prev = NULL;
+    s->timer_next = NULL;
+    s->timer_slot = -1;
+    wheel->pending--;
+}
+
+static void timer_link(struct timer_wheel *wheel, struct ng_session *s) {
+    time_t expires = (s->timer_expires < wheel->current ? wheel->current : s->timer_expires);
+    time_t delta = expires - wheel->current;
+    int slot;
+
+    if (delta < TIMER_SLOTS)
+        slot = (int) (expires & TIMER_MASK);
+    else if ((expires >> TIMER_BITS) - (wheel->current >> TIMER_BITS) < TIMER_SLOTS)
+        slot = TIMER_SLOTS + (int) ((expires >> TIMER_BITS) & TIMER_MASK);
+    else {
+        time_t block = (expires >> (2 * TIMER_BITS));
+        time_t last = (wheel->current >> (2 * TIMER_BITS)) + TIMER_MASK;
+        if (block > last)
+            block = last;
+        slot = 2 * TIMER_SLOTS + (int) (block & TIMER_MASK);
+    }
+
+    s->timer_slot = (int16_t) slot;
+    s->timer_prev = NULL;
+    s->timer_next = wheel->slots[slot];
+    if (s->timer_next != NULL)
+        s->timer_next->timer_prev = s;
+    wheel->slots[slot] = s;
+    wheel->pending++;
+}
+
+static void timer_cascade(struct timer_wheel *wheel, int slot) {
+    struct ng_session *s = wheel->slots[slot];
+    wheel->slots[slot] = NULL;
+    while (s != NULL) {
+        struct ng_session *n = s->timer_next;
+        wheel->pending--;
+        timer_link(wheel, s);
+        s = n;
+    }
+}
+
+static void timer_collect(struct timer_wheel *wheel, int slot, struct ng_session **expired) {
+    struct ng_session *s = wheel->slots[slot];
+    wheel->slots[slot] = NULL;
+    while (s != NULL) {
+        struct ng_session *n = s->timer_next;
+        wheel->pending--;
+        s->timer_slot = -1;
+        s->timer_prev = NULL;
+        s->timer_next = *expired;
+        *expired = s;
+        s = n;
+    }
+}
+
+void timer_init(struct timer_wheel *wheel, time_t now) {
+    memset(wheel, 0, sizeof(struct timer_wheel));
+    wheel->current = now;
+}
+
+void timer_schedule(struct timer_wheel *wheel, struct ng_session *s, time_t expires) {
+    if (s->timer_slot >= 0)
+        timer_unlink(wheel, s);
+    s->timer_expires = expires;
+    timer_link(wheel, s);
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct ng_session *s) {
+    if (s->timer_slot >= 0)
+        timer_unlink(wheel, s);
+}
+
+struct ng_session *timer_expire(struct timer_wheel *wheel, time_t now) {
+    struct ng_session *expired = NULL;
+
+    if (now - wheel->current >= TIMER_SLOTS * TIMER_SLOTS) {
+        // Clock jumped (suspend): hand everything back to be re-evaluated
+        for (int slot = 0; slot < TIMER_LEVELS * TIMER_SLOTS; slot++)
+            timer_collect(wheel, slot, &expired);
+        wheel->current = now + 1;
+        return expired;
+    }
+
+    while (wheel->current <= now) {
+        time_t t = wheel->current;
+        if ((t & TIMER_MASK) == 0) {
+            if (((t >> TIMER_BITS) & TIMER_MASK) == 0)
+                timer_cascade(wheel, 2 * TIMER_SLOTS + (int) ((t >> (2 * TIMER_BITS)) & TIMER_MASK));
+            timer_cascade(wheel, TIMER_SLOTS + (int) ((t >> TIMER_BITS) & TIMER_MASK));
+        }
+        timer_collect(wheel, (int) (t & TIMER_MASK), &expired);
+        wheel->current++;
+    }
+
+    return expired;
+}
+
+time_t timer_next(const struct timer_wheel *wheel) {
+    if (wheel->pending == 0)
+        return 0;
+
+    for (time_t t = wheel->current; t < wheel->current + TIMER_SLOTS; t++) {
+        if ((t & TIMER_MASK) == 0 && t != wheel->current)
+            return t; // cascade point
+        if (wheel->slots[t & TIMER_MASK] != NULL)
+            return t;
+    }
+    return wheel->current + TIMER_SLOTS;
+}
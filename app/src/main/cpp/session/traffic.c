@@ -0,0 +1,190 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// The hot paths only add to the counters of their session; the worker folds
+// them into its table when the session goes and every TRAFFIC_INTERVAL, so
+// the table lock is taken per fold instead of per packet.
+
+static uint32_t traffic_hash(jint uid) {
+    return (uint32_t) uid * 2654435761u;
+}
+
+static struct traffic_entry *traffic_place(struct traffic_entry *entries, uint32_t size, jint uid) {
+    uint32_t mask = size - 1;
+    uint32_t i = traffic_hash(uid) & mask;
+    while (entries[i].used && entries[i].uid != uid)
+        i = (i + 1) & mask;
+    return &entries[i];
+}
+
+static int traffic_resize(struct traffic_table *table, uint32_t size) {
+    struct traffic_entry *entries = ng_calloc(size, sizeof(struct traffic_entry), "traffic");
+    if (entries == NULL)
+        return -1;
+
+    for (uint32_t i = 0; i < table->size; i++)
+        if (table->entries[i].used)
+            *traffic_place(entries, size, table->entries[i].uid) = table->entries[i];
+
+    ng_free(table->entries, __FILE__, __LINE__);
+    table->entries = entries;
+    table->size = size;
+    return 0;
+}
+
+// The entry of an app, created when missing; NULL when the table cannot grow.
+// Callers hold the lock of the table.
+static struct traffic_entry *traffic_get(struct traffic_table *table, jint uid) {
+    // A full table keeps counting into the slots it has, one stays free to end the probes
+    if (table->size == 0 || (table->count + 1) * 100 > table->size * TRAFFIC_LOAD_MAX)
+        if (traffic_resize(table, table->size == 0 ? TRAFFIC_TABLE_MIN : table->size * 2) &&
+            table->count + 1 >= table->size)
+            return NULL;
+
+    struct traffic_entry *e = traffic_place(table->entries, table->size, uid);
+    if (!e->used) {
+        e->used = 1;
+        e->uid = uid;
+        table->count++;
+    }
+    return e;
+}
+
+static jint session_uid(const struct ng_session *s) {
+    if (s->protocol == IPPROTO_TCP)
+        return s->tcp.uid;
+    else if (s->protocol == IPPROTO_UDP)
+        return s->udp.uid;
+    else
+        return s->icmp.uid;
+}
+
+static void traffic_add(struct traffic *to, const struct traffic *from) {
+    to->sent_bytes += from->sent_bytes;
+    to->received_bytes += from->received_bytes;
+    to->sent_packets += from->sent_packets;
+    to->received_packets += from->received_packets;
+}
+
+static void traffic_fold_locked(struct worker *worker, struct ng_session *s) {
+    if (s->traffic.sent_packets == 0 && s->traffic.received_packets == 0)
+        return;
+
+    struct traffic_entry *e = traffic_get(&worker->traffic, session_uid(s));
+    if (e != NULL)
+        traffic_add(&e->traffic, &s->traffic);
+    memset(&s->traffic, 0, sizeof(struct traffic));
+}
+
+void traffic_fold(struct worker *worker, struct ng_session *s) {
+    if (s->traffic.sent_packets == 0 && s->traffic.received_packets == 0)
+        return;
+
+    if (pthread_mutex_lock(&worker->traffic.lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    traffic_fold_locked(worker, s);
+    if (pthread_mutex_unlock(&worker->traffic.lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+}
+
+void traffic_flush(struct worker *worker) {
+    long long ms = get_ms();
+    if (ms - worker->traffic_time < TRAFFIC_INTERVAL)
+        return;
+    worker->traffic_time = ms;
+
+    if (pthread_mutex_lock(&worker->traffic.lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    for (struct ng_session *s = worker->ng_session; s != NULL; s = s->next)
+        traffic_fold_locked(worker, s);
+    if (pthread_mutex_unlock(&worker->traffic.lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+}
+
+void traffic_flow(struct worker *worker, const struct ng_session *s) {
+    if (pthread_mutex_lock(&worker->traffic.lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    struct traffic_entry *e = traffic_get(&worker->traffic, session_uid(s));
+    if (e != NULL)
+        e->flows++;
+    if (pthread_mutex_unlock(&worker->traffic.lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+}
+
+void traffic_block(struct worker *worker, jint uid) {
+    if (pthread_mutex_lock(&worker->traffic.lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+    struct traffic_entry *e = traffic_get(&worker->traffic, uid);
+    if (e != NULL)
+        e->blocked++;
+    if (pthread_mutex_unlock(&worker->traffic.lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+}
+
+// The totals of all workers merged per app, into a buffer the caller frees.
+// Returns the number of apps, -1 when out of memory.
+int traffic_snapshot(struct context *ctx, struct traffic_entry **entries) {
+    struct traffic_table merged;
+    memset(&merged, 0, sizeof(struct traffic_table));
+
+    int result = 0;
+    for (int i = 0; i < WORKERS_MAX && result == 0; i++) {
+        struct traffic_table *table = &ctx->workers[i].traffic;
+        if (pthread_mutex_lock(&table->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+        for (uint32_t j = 0; j < table->size; j++) {
+            const struct traffic_entry *from = &table->entries[j];
+            if (!from->used)
+                continue;
+            struct traffic_entry *to = traffic_get(&merged, from->uid);
+            if (to == NULL) {
+                result = -1;
+                break;
+            }
+            to->flows += from->flows;
+            to->blocked += from->blocked;
+            traffic_add(&to->traffic, &from->traffic);
+        }
+        if (pthread_mutex_unlock(&table->lock))
+            log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+    }
+
+    *entries = NULL;
+    if (result == 0 && merged.count > 0) {
+        *entries = ng_malloc(merged.count * sizeof(struct traffic_entry), "traffic snapshot");
+        if (*entries == NULL)
+            result = -1;
+        else
+            for (uint32_t j = 0; j < merged.size; j++)
+                if (merged.entries[j].used)
+                    (*entries)[result++] = merged.entries[j];
+    }
+
+    ng_free(merged.entries, __FILE__, __LINE__);
+    return result;
+}
+
+void traffic_free(struct worker *worker) {
+    ng_free(worker->traffic.entries, __FILE__, __LINE__);
+    worker->traffic.entries = NULL;
+    worker->traffic.size = 0;
+    worker->traffic.count = 0;
+}
@@ -0,0 +1,282 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// The owner of a new flow is looked up once and kept on its session.
+// Android 10 and later deny apps sock_diag and /proc/net, there the VPN
+// service asks ConnectivityManager. Before, the kernel is asked directly
+// with an exact sock_diag query, and /proc/net is read when that fails.
+// The Binder call takes no lock; the socket and the tables have their own,
+// so a slow lookup does not hold up the DNS state of the other workers.
+// When the verdict thread runs, it makes the Binder call for the workers:
+// a new flow is parked with an unknown owner until the thread found it.
+
+static const char *uid_proc_files[UID_PROC_TABLES] = {
+        "/proc/net/tcp", "/proc/net/tcp6", "/proc/net/udp", "/proc/net/udp6"
+};
+
+static void uid_diag_close(struct context *ctx) {
+    // An answer may still come, it must not be taken for that of the next query
+    close(ctx->uid_socket);
+    ctx->uid_socket = -1;
+}
+
+static int uid_diag(struct context *ctx, int family, uint8_t protocol,
+                    const uint32_t *saddr, __be16 sport, const uint32_t *daddr, __be16 dport) {
+    if (ctx->uid_socket < 0) {
+        ctx->uid_socket = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_INET_DIAG);
+        if (ctx->uid_socket < 0) {
+            log_android(ANDROID_LOG_WARN, "sock_diag socket error %d: %s", errno, strerror(errno));
+            return -2;
+        }
+
+        // The worker holds uid_lock while it waits
+        struct timeval timeout = {0, UID_DIAG_TIMEOUT * 1000};
+        if (setsockopt(ctx->uid_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)))
+            log_android(ANDROID_LOG_WARN, "sock_diag timeout error %d: %s", errno, strerror(errno));
+    }
+
+    struct {
+        struct nlmsghdr nlh;
+        struct inet_diag_req_v2 req;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.nlh.nlmsg_len = sizeof(request);
+    request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST;
+    request.nlh.nlmsg_seq = ++ctx->uid_seq;
+    request.req.sdiag_family = (uint8_t) family;
+    request.req.sdiag_protocol = protocol;
+    request.req.idiag_states = 0xFFFFFFFF;
+    request.req.id.idiag_sport = sport;
+    request.req.id.idiag_dport = dport;
+    memcpy(request.req.id.idiag_src, saddr, family == AF_INET ? 4 : 16);
+    memcpy(request.req.id.idiag_dst, daddr, family == AF_INET ? 4 : 16);
+    request.req.id.idiag_cookie[0] = INET_DIAG_NOCOOKIE;
+    request.req.id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(ctx->uid_socket, &request, sizeof(request), 0,
+               (struct sockaddr *) &kernel, sizeof(kernel)) != sizeof(request)) {
+        log_android(ANDROID_LOG_WARN, "sock_diag send error %d: %s", errno, strerror(errno));
+        uid_diag_close(ctx);
+        return -2;
+    }
+
+    // A single answer: the socket, or an error when there is none.
+    // Answers to earlier queries are skipped.
+    uint8_t buffer[NLMSG_SPACE(sizeof(struct inet_diag_msg)) + 256];
+    const struct nlmsghdr *nlh = (const struct nlmsghdr *) buffer;
+    ssize_t len;
+    do {
+        len = recv(ctx->uid_socket, buffer, sizeof(buffer), 0);
+        if (len < 0) {
+            log_android(ANDROID_LOG_WARN, "sock_diag recv error %d: %s", errno, strerror(errno));
+            uid_diag_close(ctx);
+            return -2;
+        }
+    } while (NLMSG_OK(nlh, (size_t) len) && nlh->nlmsg_seq != request.nlh.nlmsg_seq);
+
+    if (!NLMSG_OK(nlh, (size_t) len) || nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY ||
+        nlh->nlmsg_len < NLMSG_LENGTH(sizeof(struct inet_diag_msg)))
+        return -1;
+    const struct inet_diag_msg *msg = (const struct inet_diag_msg *) NLMSG_DATA(nlh);
+    return (int) msg->idiag_uid;
+}
+
+static void uid_proc_read(struct uid_proc_table *table, const char *file, int version) {
+    table->count = 0;
+    FILE *fd = fopen(file, "r");
+    if (fd == NULL) {
+        log_android(ANDROID_LOG_DEBUG, "fopen %s error %d: %s", file, errno, strerror(errno));
+        return;
+    }
+
+    char line[250];
+    int fields;
+    char shex[33];
+    char dhex[33];
+    unsigned int sport;
+    unsigned int dport;
+    int uid;
+    const char *fmt = "%*d: %32[0-9A-Fa-f]:%X %32[0-9A-Fa-f]:%X %*X %*lX:%*lX %*X:%*X %*X %d";
+    size_t hexlen = (version == 4 ? 8 : 32);
+
+    while (fgets(line, sizeof(line), fd) != NULL) {
+        fields = sscanf(line, fmt, shex, &sport, dhex, &dport, &uid);
+        if (fields != 5 || strlen(shex) != hexlen || strlen(dhex) != hexlen)
+            continue;
+
+        if (table->count == table->capacity) {
+            uint32_t capacity = (table->capacity ? table->capacity * 2 : 64);
+            struct uid_proc_entry *entries = ng_malloc(capacity * sizeof(struct uid_proc_entry), "uid proc");
+            if (entries == NULL)
+                break;
+            if (table->entries != NULL) {
+                memcpy(entries, table->entries, table->count * sizeof(struct uid_proc_entry));
+                ng_free(table->entries, __FILE__, __LINE__);
+            }
+            table->entries = entries;
+            table->capacity = capacity;
+        }
+
+        // Words are printed in host order, which keeps the bytes in network order
+        struct uid_proc_entry *e = &table->entries[table->count++];
+        memset(e, 0, sizeof(struct uid_proc_entry));
+        for (size_t w = 0; w < hexlen / 8; w++) {
+            char word[9];
+            memcpy(word, shex + w * 8, 8);
+            word[8] = 0;
+            e->saddr[w] = (uint32_t) strtoul(word, NULL, 16);
+            memcpy(word, dhex + w * 8, 8);
+            e->daddr[w] = (uint32_t) strtoul(word, NULL, 16);
+        }
+        e->sport = (uint16_t) sport;
+        e->dport = (uint16_t) dport;
+        e->uid = uid;
+    }
+
+    if (fclose(fd))
+        log_android(ANDROID_LOG_ERROR, "fclose %s error %d: %s", file, errno, strerror(errno));
+}
+
+static int is_any(const uint32_t *addr, int words) {
+    for (int w = 0; w < words; w++)
+        if (addr[w])
+            return 0;
+    return 1;
+}
+
+static int uid_proc_find(const struct uid_proc_table *table, int words,
+                         const uint32_t *saddr, uint16_t sport, const uint32_t *daddr, uint16_t dport) {
+    // An exact match first, then a socket that is not connected
+    int uid = -1;
+    for (uint32_t i = 0; i < table->count; i++) {
+        const struct uid_proc_entry *e = &table->entries[i];
+        if (e->sport != sport)
+            continue;
+        int local = (memcmp(e->saddr, saddr, words * 4) == 0);
+        if (local && e->dport == dport && memcmp(e->daddr, daddr, words * 4) == 0)
+            return e->uid;
+        if ((local || is_any(e->saddr, words)) && e->dport == 0 && is_any(e->daddr, words))
+            uid = e->uid;
+    }
+    return uid;
+}
+
+static int uid_proc(struct context *ctx, int version, uint8_t protocol,
+                    const uint32_t *saddr, uint16_t sport, const uint32_t *daddr, uint16_t dport) {
+    int index = (protocol == IPPROTO_TCP ? 0 : 2) + (version == 4 ? 0 : 1);
+    int words = (version == 4 ? 1 : 4);
+    struct uid_proc_table *table = &ctx->uid_proc[index];
+
+    int uid = uid_proc_find(table, words, saddr, sport, daddr, dport);
+    if (uid >= 0)
+        return uid;
+
+    // Only reread a table when it might have changed since the last time
+    long long ms = get_ms();
+    if (ms - table->refreshed < UID_PROC_REFRESH)
+        return -1;
+    table->refreshed = ms;
+    uid_proc_read(table, uid_proc_files[index], version);
+    return uid_proc_find(table, words, saddr, sport, daddr, dport);
+}
+
+int uid_deferred(const struct arguments *args) {
+    // A Binder call per new flow would stall the event loop, the verdict thread makes it
+    return (args->ctx->sdk >= 29 && args->ctx->verdict_queue.running);
+}
+
+jint get_uid(const struct arguments *args, const uint8_t *pkt, const uint8_t *payload, uint8_t protocol) {
+    if (protocol != IPPROTO_TCP && protocol != IPPROTO_UDP)
+        return -1;
+
+    struct flow_key key;
+    flow_key_packet(pkt, payload, protocol, &key);
+    return get_flow_uid(args, &key);
+}
+
+jint get_flow_uid(const struct arguments *args, const struct flow_key *key) {
+    uint8_t version = key->version;
+    uint8_t protocol = key->protocol;
+    if (protocol != IPPROTO_TCP && protocol != IPPROTO_UDP)
+        return -1;
+
+    uint32_t saddr[4];
+    uint32_t daddr[4];
+    memset(saddr, 0, sizeof(saddr));
+    memset(daddr, 0, sizeof(daddr));
+    if (version == 4) {
+        saddr[0] = key->saddr.ip4;
+        daddr[0] = key->daddr.ip4;
+    } else {
+        memcpy(saddr, &key->saddr.ip6, 16);
+        memcpy(daddr, &key->daddr.ip6, 16);
+    }
+
+    if (args->ctx->sdk >= 29) {
+        char source[INET6_ADDRSTRLEN + 1];
+        char dest[INET6_ADDRSTRLEN + 1];
+        inet_ntop(version == 4 ? AF_INET : AF_INET6, saddr, source, sizeof(source));
+        inet_ntop(version == 4 ? AF_INET : AF_INET6, daddr, dest, sizeof(dest));
+        return get_uid_q(args, version, protocol, source, ntohs(key->source), dest, ntohs(key->dest));
+    }
+
+    if (pthread_mutex_lock(&args->ctx->uid_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_lock failed");
+
+    int uid = uid_diag(args->ctx, version == 4 ? AF_INET : AF_INET6, protocol,
+                       saddr, key->source, daddr, key->dest);
+
+    // IPv4 traffic of dual stack sockets is found as IPv4 mapped IPv6
+    if (uid == -1 && version == 4) {
+        uint32_t saddr6[4] = {0, 0, htonl(0x0000FFFF), saddr[0]};
+        uint32_t daddr6[4] = {0, 0, htonl(0x0000FFFF), daddr[0]};
+        uid = uid_diag(args->ctx, AF_INET6, protocol, saddr6, key->source, daddr6, key->dest);
+    }
+
+    if (uid < 0) {
+        uid = uid_proc(args->ctx, version, protocol, saddr, ntohs(key->source), daddr, ntohs(key->dest));
+        if (uid < 0 && version == 4) {
+            uint32_t saddr6[4] = {0, 0, htonl(0x0000FFFF), saddr[0]};
+            uint32_t daddr6[4] = {0, 0, htonl(0x0000FFFF), daddr[0]};
+            uid = uid_proc(args->ctx, 6, protocol, saddr6, ntohs(key->source), daddr6, ntohs(key->dest));
+        }
+    }
+
+    if (pthread_mutex_unlock(&args->ctx->uid_lock))
+        log_android(ANDROID_LOG_ERROR, "pthread_mutex_unlock failed");
+    return uid;
+}
+
+void uid_free(struct context *ctx) {
+    if (ctx->uid_socket >= 0) {
+        close(ctx->uid_socket);
+        ctx->uid_socket = -1;
+    }
+    for (int i = 0; i < UID_PROC_TABLES; i++) {
+        if (ctx->uid_proc[i].entries != NULL)
+            ng_free(ctx->uid_proc[i].entries, __FILE__, __LINE__);
+        memset(&ctx->uid_proc[i], 0, sizeof(struct uid_proc_table));
+    }
+}
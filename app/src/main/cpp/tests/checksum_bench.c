@@ -0,0 +1,55 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../utils/checksum.c"
+#include "host.h"
+#include "checksum_kernels.h"
+
+// Throughput of each kernel at an MTU sized packet and a large segment
+
+static const size_t lengths[] = {1500, 10000};
+
+int main() {
+    static uint8_t buffer[10000];
+    uint32_t state = 1071;
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = (uint8_t) host_random(&state);
+
+    struct kernel kernels[4];
+    int count = get_kernels(kernels);
+    for (int i = 0; i < count; i++)
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            volatile uint16_t sink = 0;
+            uint64_t rounds = 0;
+            double start = host_now();
+            double elapsed;
+            do {
+                for (int r = 0; r < 1000; r++) {
+                    // The buffer may have changed, the sum cannot be hoisted
+                    __asm__ volatile("" : : "r"(buffer) : "memory");
+                    sink += fold(kernels[i].sum(buffer, lengths[l]));
+                }
+                rounds += 1000;
+                elapsed = host_now() - start;
+            } while (elapsed < 0.5);
+            printf("%-6s %5zu bytes %8.2f GB/s\n", kernels[i].name, lengths[l],
+                   rounds * lengths[l] / elapsed / 1e9);
+        }
+    return 0;
+}
@@ -0,0 +1,42 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+// The checksum kernels built for this host, for the test and the benchmark,
+// which include checksum.c to reach them
+
+struct kernel {
+    const char *name;
+    uint64_t (*sum)(const uint8_t *buf, size_t len);
+};
+
+static int get_kernels(struct kernel *kernels) {
+    int count = 0;
+    kernels[count++] = (struct kernel) {"scalar", sum_scalar};
+#ifdef CHECKSUM_NEON
+    kernels[count++] = (struct kernel) {"neon", sum_neon};
+#endif
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels[count++] = (struct kernel) {"sse2", sum_sse2};
+    if (__builtin_cpu_supports("avx2"))
+        kernels[count++] = (struct kernel) {"avx2", sum_avx2};
+#endif
+    return count;
+}
@@ -0,0 +1,172 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../utils/checksum.c"
+#include "host.h"
+#include "checksum_kernels.h"
+
+// Every kernel against the scalar one and against a plain RFC 1071 sum,
+// at every length up to a few packets and every start offset, and the
+// RFC 1624 helpers against checksums of the whole changed buffer
+
+#define TEST_LENGTH 2048
+#define TEST_OFFSETS 16
+
+static int failures = 0;
+
+static void fail(const char *fmt, ...) {
+    if (failures++ < 20) {
+        va_list argptr;
+        va_start(argptr, fmt);
+        vfprintf(stderr, fmt, argptr);
+        fputc('\n', stderr);
+        va_end(argptr);
+    }
+}
+
+static uint16_t reference(const uint8_t *buf, size_t len) {
+    // 16 bit words in memory order, the last odd byte padded with a zero
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        uint16_t word;
+        memcpy(&word, buf + i, 2);
+        sum += word;
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    if (len & 1) {
+        uint8_t last[2] = {buf[len - 1], 0};
+        uint16_t word;
+        memcpy(&word, last, 2);
+        sum += word;
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return (uint16_t) sum;
+}
+
+static int same_sum(uint16_t a, uint16_t b) {
+    // 0x0000 and 0xFFFF are both zero in one's complement
+    return (a == b || ((a ^ b) == 0xFFFF && (a == 0 || b == 0)));
+}
+
+static void test_kernel(const struct kernel *k, const uint8_t *buffer, const char *pattern) {
+    if (!kernel_known(k->sum))
+        fail("%s: known checksums differ", k->name);
+
+    for (size_t off = 0; off < TEST_OFFSETS; off++)
+        for (size_t len = 0; len <= TEST_LENGTH; len++) {
+            uint16_t sum = fold(k->sum(buffer + off, len));
+            uint16_t scalar = fold(sum_scalar(buffer + off, len));
+            if (sum != scalar)
+                fail("%s: %s offset %zu length %zu sum %04x scalar %04x",
+                     k->name, pattern, off, len, sum, scalar);
+            if (!same_sum(sum, reference(buffer + off, len)))
+                fail("%s: %s offset %zu length %zu sum %04x reference %04x",
+                     k->name, pattern, off, len, sum, reference(buffer + off, len));
+        }
+}
+
+static void test_calc(const struct kernel *k, const uint8_t *buffer) {
+    // The start value is how pseudo headers are chained in
+    sum_kernel = k->sum;
+    uint32_t state = 0x5eed;
+    for (int i = 0; i < 1000; i++) {
+        uint16_t start = (uint16_t) host_random(&state);
+        size_t off = host_random(&state) % TEST_OFFSETS;
+        size_t len = host_random(&state) % (TEST_LENGTH + 1);
+        uint16_t sum = calc_checksum(start, buffer + off, len);
+        uint16_t chained = fold((uint64_t) start + reference(buffer + off, len));
+        if (!same_sum(sum, chained))
+            fail("%s: start %04x offset %zu length %zu sum %04x chained %04x",
+                 k->name, start, off, len, sum, chained);
+    }
+    sum_kernel = sum_scalar;
+}
+
+static uint16_t wire_checksum(const uint8_t *buf, size_t len) {
+    return (uint16_t) ~calc_checksum(0, buf, len);
+}
+
+static void test_update() {
+    uint8_t buf[64];
+    uint32_t state = 0x1624;
+    for (int i = 0; i < 100000; i++) {
+        for (size_t b = 0; b < sizeof(buf); b++)
+            buf[b] = (uint8_t) host_random(&state);
+        uint16_t check = wire_checksum(buf, sizeof(buf));
+
+        int kind = i % 3;
+        size_t length = (kind == 0 ? 2 : kind == 1 ? 4 : 2 * (1 + host_random(&state) % 16));
+        size_t off = (host_random(&state) % ((sizeof(buf) - length) / 2 + 1)) * 2;
+        if (kind == 1)
+            off &= ~(size_t) 3;
+
+        uint8_t from[32];
+        uint8_t to[32];
+        memcpy(from, buf + off, length);
+        for (size_t b = 0; b < length; b++)
+            to[b] = (uint8_t) host_random(&state);
+        // Now and then a word of all zero or all one bits
+        if (i % 7 == 0)
+            memset(to, (i % 14 == 0 ? 0x00 : 0xFF), 2);
+        memcpy(buf + off, to, length);
+
+        uint16_t updated;
+        if (kind == 0) {
+            uint16_t f;
+            uint16_t t;
+            memcpy(&f, from, 2);
+            memcpy(&t, to, 2);
+            updated = checksum_update16(check, f, t);
+        } else if (kind == 1) {
+            uint32_t f;
+            uint32_t t;
+            memcpy(&f, from, 4);
+            memcpy(&t, to, 4);
+            updated = checksum_update32(check, f, t);
+        } else
+            updated = checksum_update(check, from, to, length);
+
+        uint16_t full = wire_checksum(buf, sizeof(buf));
+        if (!same_sum(updated, full))
+            fail("update%s: offset %zu length %zu updated %04x full %04x",
+                 kind == 0 ? "16" : kind == 1 ? "32" : "", off, length, updated, full);
+    }
+}
+
+int main() {
+    static uint8_t random[TEST_LENGTH + TEST_OFFSETS];
+    static uint8_t ones[TEST_LENGTH + TEST_OFFSETS];
+    uint32_t state = 1071;
+    for (size_t i = 0; i < sizeof(random); i++)
+        random[i] = (uint8_t) host_random(&state);
+    memset(ones, 0xFF, sizeof(ones));
+
+    struct kernel kernels[4];
+    int count = get_kernels(kernels);
+    for (int i = 0; i < count; i++) {
+        test_kernel(&kernels[i], random, "random");
+        test_kernel(&kernels[i], ones, "ones");
+        test_calc(&kernels[i], random);
+        printf("%s: checked\n", kernels[i].name);
+    }
+    test_update();
+
+    printf("%d failures\n", failures);
+    return (failures ? 1 : 0);
+}
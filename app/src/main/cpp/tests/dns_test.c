@@ -0,0 +1,278 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../protocols/dns.c"
+#include "host.h"
+
+// The DNS question parsers on well formed, truncated, malformed and
+// oversize queries, and the answers handle_dns_query synthesizes for
+// blocked names
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (!ok) {
+        failures++;
+        fprintf(stderr, "%s\n", what);
+    }
+}
+
+// What handle_dns_query needs from the rest of the engine
+
+static uint8_t written[DNS_RESPONSE_MAX];
+static size_t writtenlen;
+
+ssize_t write_udp(const struct arguments *args, const struct udp_session *cur,
+                  uint8_t *data, size_t datalen) {
+    memcpy(written, data, datalen);
+    writtenlen = datalen;
+    return (ssize_t) datalen;
+}
+
+void init_template(struct packet_template *tpl, int version, uint8_t protocol,
+                   const void *saddr, const void *daddr) {
+}
+
+int domain_evaluate(struct context *ctx, const char *name) {
+    return (strcmp(name, "blocked.example") == 0 ? VERDICT_BLOCK : VERDICT_UNKNOWN);
+}
+
+static size_t header(uint8_t *q, int response, int questions) {
+    memset(q, 0, sizeof(struct dns_header));
+    q[0] = 0x12;
+    q[1] = 0x34;
+    q[2] = (uint8_t) (response ? 0x81 : 0x01);
+    q[5] = (uint8_t) questions;
+    return sizeof(struct dns_header);
+}
+
+static size_t query(uint8_t *q, const char *name, uint16_t qtype) {
+    // A name in dotted notation, each label prefixed with its length
+    size_t off = header(q, 0, 1);
+    while (*name) {
+        const char *dot = strchr(name, '.');
+        size_t n = (dot ? (size_t) (dot - name) : strlen(name));
+        q[off++] = (uint8_t) n;
+        memcpy(q + off, name, n);
+        off += n;
+        name += n + (dot ? 1 : 0);
+    }
+    q[off++] = 0;
+    q[off++] = (uint8_t) (qtype >> 8);
+    q[off++] = (uint8_t) qtype;
+    q[off++] = 0;
+    q[off++] = DNS_QCLASS_IN;
+    return off;
+}
+
+static void test_query() {
+    uint8_t q[600];
+    char qname[DNS_QNAME_MAX + 1];
+    uint16_t qtype, qclass;
+    size_t qend;
+
+    size_t len = query(q, "WWW.Example.com", DNS_QTYPE_AAAA);
+    check(get_dns_query(q, len, qname, &qtype, &qclass, &qend) == 0, "query");
+    check(strcmp(qname, "www.example.com") == 0, "query name folded to lower case");
+    check(qtype == DNS_QTYPE_AAAA && qclass == DNS_QCLASS_IN && qend == len, "query type, class, end");
+    check(dns_question_end(q, len) == len, "question end");
+
+    // Every truncation is refused
+    for (size_t cut = 0; cut < len; cut++) {
+        check(get_dns_query(q, cut, qname, &qtype, &qclass, &qend) == -1, "truncated query");
+        if (cut >= sizeof(struct dns_header))
+            check(dns_question_end(q, cut) == 0, "truncated question");
+    }
+
+    // Responses, other opcodes and other question counts
+    q[2] |= 0x80;
+    check(get_dns_query(q, len, qname, &qtype, &qclass, &qend) == -1, "response");
+    q[2] = 0x01 | (2 << 3);
+    check(get_dns_query(q, len, qname, &qtype, &qclass, &qend) == -1, "status opcode");
+    q[2] = 0x01;
+    q[5] = 2;
+    check(get_dns_query(q, len, qname, &qtype, &qclass, &qend) == -1, "two questions");
+    check(dns_question_end(q, len) == 0, "two questions end");
+    q[5] = 0;
+    check(get_dns_query(q, len, qname, &qtype, &qclass, &qend) == -1, "no question");
+
+    // The root name, a zero byte or a dot in a label
+    len = query(q, "", DNS_QTYPE_A);
+    check(get_dns_query(q, len, qname, &qtype, &qclass, &qend) == -1, "root name");
+    check(dns_question_end(q, len) == 0, "root name end");
+    len = query(q, "a.example", DNS_QTYPE_A);
+    q[sizeof(struct dns_header) + 1] = 0;
+    check(get_dns_query(q, len, qname, &qtype, &qclass, &qend) == -1, "zero in label");
+    q[sizeof(struct dns_header) + 1] = '.';
+    check(get_dns_query(q, len, qname, &qtype, &qclass, &qend) == -1, "dot in label");
+}
+
+static void test_compression() {
+    uint8_t q[64];
+    char qname[DNS_QNAME_MAX + 1];
+    uint16_t qtype, qclass;
+    size_t qend;
+
+    // A question pointing at itself, and one pointing back into its own name
+    size_t off = header(q, 0, 1);
+    q[off++] = 0xC0;
+    q[off++] = sizeof(struct dns_header);
+    memset(q + off, 0, 4);
+    check(get_dns_query(q, off + 4, qname, &qtype, &qclass, &qend) == -1, "pointer loop");
+    check(dns_question_end(q, off + 4) == 0, "pointer loop end");
+
+    off = header(q, 0, 1);
+    q[off++] = 1;
+    q[off++] = 'a';
+    q[off++] = 0xC0;
+    q[off++] = sizeof(struct dns_header);
+    memset(q + off, 0, 4);
+    check(get_dns_query(q, off + 4, qname, &qtype, &qclass, &qend) == -1, "pointer back");
+    check(dns_question_end(q, off + 4) == 0, "pointer back end");
+
+    // The reserved label types 01 and 10
+    q[sizeof(struct dns_header) + 2] = 0x40;
+    check(get_dns_query(q, off + 4, qname, &qtype, &qclass, &qend) == -1, "label type 01");
+    q[sizeof(struct dns_header) + 2] = 0x80;
+    check(get_dns_query(q, off + 4, qname, &qtype, &qclass, &qend) == -1, "label type 10");
+
+    // Names of records end at their first pointer, which is never followed
+    size_t end = dns_skip_name(q, off, sizeof(struct dns_header));
+    check(end == 0, "skip reserved label type");
+    q[sizeof(struct dns_header) + 2] = 0xC0;
+    end = dns_skip_name(q, off, sizeof(struct dns_header));
+    check(end == off, "skip name with pointer");
+    check(dns_skip_name(q, off - 1, sizeof(struct dns_header)) == 0, "skip truncated pointer");
+    check(dns_skip_name(q, off, off) == 0, "skip past the end");
+}
+
+static void test_oversize() {
+    uint8_t q[600];
+    char qname[DNS_QNAME_MAX + 1];
+    uint16_t qtype, qclass;
+    size_t qend;
+
+    // Labels of 63 bytes at most, names of 255 bytes on the wire at most
+    char name[300];
+    memset(name, 'a', 63);
+    name[63] = 0;
+    size_t len = query(q, name, DNS_QTYPE_A);
+    check(get_dns_query(q, len, qname, &qtype, &qclass, &qend) == 0, "label of 63");
+    q[sizeof(struct dns_header)] = 64;
+    check(get_dns_query(q, len, qname, &qtype, &qclass, &qend) == -1, "label of 64");
+    check(dns_question_end(q, len) == 0, "label of 64 end");
+
+    for (size_t n = 250; n <= 258; n++) {
+        // Labels of 9 and a dot, which makes n wire bytes with the length bytes and root
+        size_t text = n - 2;
+        for (size_t i = 0; i < text; i++)
+            name[i] = (char) (i % 10 == 9 ? '.' : 'b');
+        name[text] = 0;
+        if (name[text - 1] == '.')
+            continue;
+        len = query(q, name, DNS_QTYPE_A);
+        int ok = (n <= DNS_QNAME_MAX);
+        char what[64];
+        snprintf(what, sizeof(what), "name of %zu wire bytes", n);
+        int rc = get_dns_query(q, len, qname, &qtype, &qclass, &qend);
+        check(rc == (ok ? 0 : -1), what);
+        check(!ok || strlen(qname) == text, what);
+        check(dns_question_end(q, len) == (ok ? len : 0), what);
+    }
+
+    // Many labels, far beyond the name buffer
+    size_t off = header(q, 0, 1);
+    while (off < 560) {
+        q[off++] = 1;
+        q[off++] = 'c';
+    }
+    q[off++] = 0;
+    memset(q + off, 0, 4);
+    check(get_dns_query(q, off + 4, qname, &qtype, &qclass, &qend) == -1, "many labels");
+    check(dns_question_end(q, off + 4) == 0, "many labels end");
+}
+
+static void test_block() {
+    // A query to the tunnel resolver, as the worker sees it
+    uint8_t pkt[sizeof(struct iphdr) + sizeof(struct udphdr) + 300];
+    memset(pkt, 0, sizeof(pkt));
+    struct iphdr *ip4 = (struct iphdr *) pkt;
+    struct udphdr *udp = (struct udphdr *) (pkt + sizeof(struct iphdr));
+    uint8_t *q = pkt + sizeof(struct iphdr) + sizeof(struct udphdr);
+    ip4->version = 4;
+    ip4->ihl = 5;
+    ip4->protocol = IPPROTO_UDP;
+    ip4->saddr = htonl(0x0a010a01);
+    ip4->daddr = htonl(0xC6120001);
+    udp->source = htons(40000);
+    udp->dest = htons(53);
+
+    struct arguments args;
+    memset(&args, 0, sizeof(args));
+
+    // The unspecified address for A and AAAA, with the question echoed
+    static const struct {
+        uint16_t qtype;
+        size_t rdlength;
+    } types[] = {{DNS_QTYPE_A, 4}, {DNS_QTYPE_AAAA, 16}, {16, 0}};
+    for (size_t t = 0; t < 3; t++) {
+        size_t len = query(q, "Blocked.Example", types[t].qtype);
+        writtenlen = 0;
+        int verdict = handle_dns_query(&args, pkt, (size_t) (q + len - pkt), (uint8_t *) udp);
+        check(verdict == VERDICT_BLOCK, "blocked verdict");
+        check(writtenlen == len + (types[t].rdlength ? 12 + types[t].rdlength : 0), "block size");
+        check(memcmp(written + sizeof(struct dns_header), q + sizeof(struct dns_header),
+                     len - sizeof(struct dns_header)) == 0, "question echoed");
+        check(written[0] == 0x12 && written[1] == 0x34, "id echoed");
+        check((written[2] & 0x80) && (written[3] & 0x0f) == 0, "response without error");
+        check(written[7] == (types[t].rdlength ? 1 : 0), "answer count");
+        if (types[t].rdlength) {
+            uint8_t *a = written + len;
+            check(a[0] == 0xC0 && a[1] == sizeof(struct dns_header), "answer name");
+            check(a[9] == DNS_BLOCK_TTL && a[11] == types[t].rdlength, "answer ttl and length");
+            for (size_t i = 0; i < types[t].rdlength; i++)
+                check(a[12 + i] == 0, "unspecified address");
+        }
+    }
+
+    // Or the configured rcode, without answers
+    args.rcode = DNS_RCODE_NXDOMAIN;
+    size_t len = query(q, "blocked.example", DNS_QTYPE_A);
+    writtenlen = 0;
+    handle_dns_query(&args, pkt, (size_t) (q + len - pkt), (uint8_t *) udp);
+    check(writtenlen == len && (written[3] & 0x0f) == DNS_RCODE_NXDOMAIN && written[7] == 0, "nxdomain");
+
+    // Other names and malformed queries are left alone
+    len = query(q, "allowed.example", DNS_QTYPE_A);
+    writtenlen = 0;
+    check(handle_dns_query(&args, pkt, (size_t) (q + len - pkt), (uint8_t *) udp) == VERDICT_UNKNOWN &&
+          writtenlen == 0, "allowed name");
+    len = query(q, "blocked.example", DNS_QTYPE_A);
+    check(handle_dns_query(&args, pkt, (size_t) (q + len - 5 - pkt), (uint8_t *) udp) == VERDICT_UNKNOWN &&
+          writtenlen == 0, "truncated query");
+}
+
+int main() {
+    test_query();
+    test_compression();
+    test_oversize();
+    test_block();
+    printf("%d failures\n", failures);
+    return (failures ? 1 : 0);
+}
@@ -0,0 +1,294 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+#include "host.h"
+
+// Domain lists from text to lookups: the kinds of lines and how lines of a
+// name combine, parents, case and trailing dots, malformed lines, and
+// compiled files that are damaged or not compiled by this version
+
+static int failures = 0;
+static char dir[64];
+
+static void check(int ok, const char *what) {
+    if (!ok) {
+        failures++;
+        fprintf(stderr, "%s\n", what);
+    }
+}
+
+static void write_text(const char *path, const char *text, size_t len) {
+    FILE *f = fopen(path, "wb");
+    fwrite(text, 1, len, f);
+    fclose(f);
+}
+
+static struct domain_table *compile(const char *text, int complete) {
+    char source[128], path[128];
+    snprintf(source, sizeof(source), "%s/list.txt", dir);
+    snprintf(path, sizeof(path), "%s/list.bin", dir);
+    write_text(source, text, strlen(text));
+    if (domain_compile(source, path, complete, 42))
+        return NULL;
+    return domain_open(path);
+}
+
+static void expect(const struct domain_table *table, const char *name, int verdict) {
+    int v = domain_lookup(table, name);
+    if (v != verdict) {
+        failures++;
+        fprintf(stderr, "%s: got %d want %d\n", name, v, verdict);
+    }
+}
+
+static void test_kinds() {
+    struct domain_table *table = compile(
+            "B exact.example\n"
+            "S tree.example\n"
+            "D below.example\n"
+            "W allowed.tree.example\n"
+            "B undone.example\n"
+            "a undone.example\n"
+            "a redone.example\n"
+            "B redone.example\n"
+            "B both.example\n"
+            "W both.example\n"
+            "B Mixed.Case.Example.\r\n"
+            "B last.example", 1);
+    check(table != NULL, "compile");
+    if (table == NULL)
+        return;
+    check(table->count == 8 && table->complete && table->source == 42, "header");
+
+    // B is the name only
+    expect(table, "exact.example", VERDICT_BLOCK);
+    expect(table, "www.exact.example", VERDICT_UNKNOWN);
+    expect(table, "example", VERDICT_UNKNOWN);
+    expect(table, "notexact.example", VERDICT_UNKNOWN);
+    expect(table, "exact.example.org", VERDICT_UNKNOWN);
+
+    // S is the name and every name below it, D only the names below it
+    expect(table, "tree.example", VERDICT_BLOCK);
+    expect(table, "a.tree.example", VERDICT_BLOCK);
+    expect(table, "a.b.c.tree.example", VERDICT_BLOCK);
+    expect(table, "subtree.example", VERDICT_UNKNOWN);
+    expect(table, "below.example", VERDICT_UNKNOWN);
+    expect(table, "a.below.example", VERDICT_BLOCK);
+    expect(table, "a.b.below.example", VERDICT_BLOCK);
+
+    // W keeps the name itself out of a wildcard, and wins over B
+    expect(table, "allowed.tree.example", VERDICT_ALLOW);
+    expect(table, "a.allowed.tree.example", VERDICT_BLOCK);
+    expect(table, "both.example", VERDICT_ALLOW);
+
+    // a undoes an earlier B only
+    expect(table, "undone.example", VERDICT_UNKNOWN);
+    expect(table, "redone.example", VERDICT_BLOCK);
+
+    // Case, trailing dots and line ends
+    expect(table, "mixed.case.example", VERDICT_BLOCK);
+    expect(table, "MIXED.case.EXAMPLE.", VERDICT_BLOCK);
+    expect(table, "exact.example.", VERDICT_BLOCK);
+    expect(table, "last.example", VERDICT_BLOCK);
+
+    // Names that are no names
+    expect(table, "", VERDICT_UNKNOWN);
+    expect(table, ".", VERDICT_UNKNOWN);
+    char longname[300];
+    memset(longname, 'a', sizeof(longname) - 1);
+    longname[sizeof(longname) - 1] = 0;
+    expect(table, longname, VERDICT_UNKNOWN);
+    domain_close(table);
+}
+
+static void test_malformed_lines() {
+    // Unknown kinds, no space, no name, a bare dot and an oversize name are skipped
+    char text[1024];
+    char longname[300];
+    memset(longname, 'c', 256);
+    longname[256] = 0;
+    snprintf(text, sizeof(text),
+             "X skipped.example\n"
+             "Bnospace.example\n"
+             "B\n"
+             "B \n"
+             "B .\n"
+             "\n"
+             "B %s\n"
+             "b lower.example\n"
+             "B kept.example\n", longname);
+    struct domain_table *table = compile(text, 0);
+    check(table != NULL && table->count == 1 && !table->complete, "malformed lines");
+    if (table == NULL)
+        return;
+    expect(table, "kept.example", VERDICT_BLOCK);
+    expect(table, "skipped.example", VERDICT_UNKNOWN);
+    expect(table, "nospace.example", VERDICT_UNKNOWN);
+    expect(table, "pace.example", VERDICT_UNKNOWN);
+    expect(table, "lower.example", VERDICT_UNKNOWN);
+    domain_close(table);
+
+    // An empty list, and many names
+    table = compile("", 1);
+    check(table != NULL && table->count == 0, "empty list");
+    if (table != NULL) {
+        expect(table, "kept.example", VERDICT_UNKNOWN);
+        domain_close(table);
+    }
+
+    size_t size = 20000 * 24;
+    char *many = malloc(size);
+    size_t len = 0;
+    for (int i = 0; i < 20000; i++)
+        len += (size_t) sprintf(many + len, "%c n%d.example\n", (i % 2 ? 'S' : 'B'), i);
+    table = compile(many, 1);
+    free(many);
+    check(table != NULL && table->count == 20000, "many names");
+    if (table != NULL) {
+        for (int i = 0; i < 20000; i += 7) {
+            char name[64];
+            sprintf(name, "n%d.example", i);
+            expect(table, name, VERDICT_BLOCK);
+            sprintf(name, "www.n%d.example", i);
+            expect(table, name, (i % 2 ? VERDICT_BLOCK : VERDICT_UNKNOWN));
+            sprintf(name, "n%d.example", 20000 + i);
+            expect(table, name, VERDICT_UNKNOWN);
+        }
+        domain_close(table);
+    }
+}
+
+static void test_files() {
+    char path[128];
+    snprintf(path, sizeof(path), "%s/list.bin", dir);
+    struct domain_table *table = compile("B kept.example\n", 1);
+    check(table != NULL, "compile");
+    domain_close(table);
+
+    FILE *f = fopen(path, "rb");
+    uint8_t good[256];
+    size_t size = fread(good, 1, sizeof(good), f);
+    fclose(f);
+    uint8_t bad[256];
+    struct domain_file_header *header = (struct domain_file_header *) bad;
+
+    // No file is an empty, complete list, a missing one is an error
+    table = domain_open(NULL);
+    check(table != NULL && table->count == 0 && table->complete, "no file");
+    if (table != NULL) {
+        expect(table, "kept.example", VERDICT_UNKNOWN);
+        domain_close(table);
+    }
+    char missing[128];
+    snprintf(missing, sizeof(missing), "%s/missing.bin", dir);
+    check(domain_open(missing) == NULL, "missing file");
+
+    // Damaged headers and sizes
+    memcpy(bad, good, size);
+    header->magic ^= 1;
+    write_text(path, (char *) bad, size);
+    check(domain_open(path) == NULL, "bad magic");
+
+    memcpy(bad, good, size);
+    header->version = DOMAIN_FILE_VERSION + 1;
+    write_text(path, (char *) bad, size);
+    check(domain_open(path) == NULL, "other version");
+
+    write_text(path, (char *) good, sizeof(struct domain_file_header) - 1);
+    check(domain_open(path) == NULL, "short header");
+    write_text(path, (char *) good, size - 1);
+    check(domain_open(path) == NULL, "truncated");
+    memcpy(bad, good, size);
+    write_text(path, (char *) bad, size + 1);
+    check(domain_open(path) == NULL, "trailing byte");
+
+    // Sizes that add up only by wrapping around
+    memcpy(bad, good, size);
+    header->count += 1u << 29;
+    header->names_size -= (uint64_t) sizeof(struct domain_record) << 29;
+    write_text(path, (char *) bad, size);
+    check(domain_open(path) == NULL, "names size wrapped");
+
+    // A record beyond the names is not followed
+    memcpy(bad, good, size);
+    ((struct domain_record *) (header + 1))->offset = 1000;
+    write_text(path, (char *) bad, size);
+    table = domain_open(path);
+    check(table != NULL, "record beyond names");
+    if (table != NULL) {
+        expect(table, "kept.example", VERDICT_UNKNOWN);
+        domain_close(table);
+    }
+}
+
+static void test_evaluate() {
+    // The lists of a context together, as the worker asks
+    static struct context ctx;
+    pthread_rwlock_init(&ctx.rule_lock, NULL);
+    struct rule_table rules;
+    memset(&rules, 0, sizeof(rules));
+
+    check(domain_evaluate(&ctx, "kept.example") == VERDICT_UNKNOWN, "no rules");
+    ctx.rules = &rules;
+    check(domain_evaluate(&ctx, "kept.example") == VERDICT_UNKNOWN, "no lists");
+
+    ctx.domains[DOMAIN_LIST_HOSTS] = compile("S hosts.example\nW allowed.hosts.example\n", 1);
+    ctx.domains[DOMAIN_LIST_CUSTOM] = compile("B custom.example\nS allowed.hosts.example\n", 1);
+    check(domain_evaluate(&ctx, "a.hosts.example") == VERDICT_BLOCK, "hosts list");
+    check(domain_evaluate(&ctx, "custom.example") == VERDICT_BLOCK, "custom list");
+    check(domain_evaluate(&ctx, "other.example") == VERDICT_ALLOW, "complete lists");
+
+    // A whitelisted name is allowed by its own list only
+    check(domain_evaluate(&ctx, "allowed.hosts.example") == VERDICT_BLOCK, "whitelist of one list");
+
+    // Java decides when a list is incomplete, or packets are logged
+    domain_set(&ctx, DOMAIN_LIST_CUSTOM, compile("B custom.example\n", 0));
+    check(domain_evaluate(&ctx, "other.example") == VERDICT_UNKNOWN, "incomplete list");
+    check(domain_evaluate(&ctx, "custom.example") == VERDICT_BLOCK, "incomplete list block");
+    rules.flags = RULE_FLAG_LOG;
+    check(domain_evaluate(&ctx, "custom.example") == VERDICT_UNKNOWN, "logging");
+
+    domain_free(&ctx);
+    check(ctx.domains[0] == NULL && ctx.domains[1] == NULL, "free");
+    pthread_rwlock_destroy(&ctx.rule_lock);
+}
+
+int main() {
+    strcpy(dir, "/tmp/domains_test.XXXXXX");
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    test_kinds();
+    test_malformed_lines();
+    test_files();
+    test_evaluate();
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s/list.txt", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/list.bin", dir);
+    unlink(path);
+    rmdir(dir);
+
+    printf("%d failures\n", failures);
+    return (failures ? 1 : 0);
+}
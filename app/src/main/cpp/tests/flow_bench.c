@@ -0,0 +1,128 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+#include "host.h"
+
+// Lookup cost of the flow table from 10 to 10,000 sessions, for keys that
+// are found and keys that are not, and of removing and inserting flows
+// so deleted slots pile up and the table is rehashed
+
+#define LOOKUPS 2000000
+#define CHURN 2000000
+
+static const int counts[] = {10, 100, 1000, 10000};
+
+static uint32_t state = 5381;
+
+static void set_tuple(struct ng_session *s, int version) {
+    // TCP and UDP flows from the tun address to random peers
+    s->protocol = (uint8_t) (host_random(&state) & 1 ? IPPROTO_TCP : IPPROTO_UDP);
+    struct udp_session *u = &s->udp;
+    struct tcp_session *t = &s->tcp;
+    __be16 source = (__be16) host_random(&state);
+    __be16 dest = (__be16) host_random(&state);
+    if (s->protocol == IPPROTO_TCP) {
+        t->version = version;
+        t->source = source;
+        t->dest = dest;
+    } else {
+        u->version = version;
+        u->source = source;
+        u->dest = dest;
+    }
+
+    void *saddr = (s->protocol == IPPROTO_TCP ? (void *) &t->saddr : (void *) &u->saddr);
+    void *daddr = (s->protocol == IPPROTO_TCP ? (void *) &t->daddr : (void *) &u->daddr);
+    if (version == 4) {
+        __be32 src = htonl(0x0a010a01);
+        __be32 dst = host_random(&state);
+        memcpy(saddr, &src, 4);
+        memcpy(daddr, &dst, 4);
+    } else {
+        uint8_t src[16] = {0xfd, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+        uint32_t dst[4];
+        for (int i = 0; i < 4; i++)
+            dst[i] = host_random(&state);
+        memcpy(saddr, src, 16);
+        memcpy(daddr, dst, 16);
+    }
+}
+
+static double bench_lookup(const struct flow_table *table, const struct flow_key *keys, int count,
+                           int expect_found) {
+    int missed = 0;
+    double start = host_now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        const struct ng_session *s = flow_lookup(table, &keys[host_random(&state) % count]);
+        if ((s != NULL) != expect_found)
+            missed++;
+    }
+    double elapsed = host_now() - start;
+    if (missed)
+        fprintf(stderr, "%d lookups gave the wrong answer\n", missed);
+    return elapsed / LOOKUPS * 1e9;
+}
+
+static void bench(int version, int count) {
+    struct flow_table table;
+    flow_init(&table);
+
+    struct ng_session *sessions = calloc(count, sizeof(struct ng_session));
+    struct flow_key *hits = calloc(count, sizeof(struct flow_key));
+    struct flow_key *misses = calloc(count, sizeof(struct flow_key));
+    for (int i = 0; i < count; i++) {
+        set_tuple(&sessions[i], version);
+        flow_insert(&table, &sessions[i]);
+        flow_key_session(&sessions[i], &hits[i]);
+        misses[i] = hits[i];
+        misses[i].dest ^= 0x5a5a;
+    }
+
+    double hit = bench_lookup(&table, hits, count, 1);
+    double miss = bench_lookup(&table, misses, count, 0);
+
+    // Flows end and new ones start at random, the live count stays the same
+    double start = host_now();
+    for (int i = 0; i < CHURN; i++) {
+        struct ng_session *s = &sessions[host_random(&state) % count];
+        flow_remove(&table, s);
+        set_tuple(s, version);
+        flow_insert(&table, s);
+    }
+    double churn = (host_now() - start) / CHURN * 1e9;
+    for (int i = 0; i < count; i++)
+        flow_key_session(&sessions[i], &hits[i]);
+    double after = bench_lookup(&table, hits, count, 1);
+
+    printf("IPv%d %6d flows %6u slots  hit %5.1f ns  miss %5.1f ns  churn %5.1f ns  hit after churn %5.1f ns\n",
+           version, count, table.size, hit, miss, churn, after);
+
+    flow_free(&table);
+    free(sessions);
+    free(hits);
+    free(misses);
+}
+
+int main() {
+    for (int version = 4; version <= 6; version += 2)
+        for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+            bench(version, counts[c]);
+    return 0;
+}
@@ -0,0 +1,225 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+#include "host.h"
+
+// The flow table against a plain array of the live sessions: inserts,
+// lookups and removals at random, so the table grows, removed slots become
+// tombstones and a rehash in place reclaims them, then a clear
+
+#define SESSIONS 5000
+#define STEPS 500000
+
+static int failures = 0;
+
+static void check(int ok, const char *what, int step) {
+    if (!ok && failures++ < 20)
+        fprintf(stderr, "step %d: %s\n", step, what);
+}
+
+static uint32_t state = 0xf10;
+
+static void set_tuple(struct ng_session *s) {
+    // Few distinct values, so keys often differ in one field only
+    memset(s, 0, sizeof(struct ng_session));
+    int version = (host_random(&state) & 1 ? 4 : 6);
+    uint8_t protocols[] = {IPPROTO_TCP, IPPROTO_UDP, IPPROTO_ICMP};
+    s->protocol = protocols[host_random(&state) % 3];
+    if (s->protocol == IPPROTO_ICMP && version == 6)
+        s->protocol = IPPROTO_ICMPV6;
+    __be16 source = htons((uint16_t) (40000 + host_random(&state) % 64));
+    __be16 dest = htons((uint16_t) (host_random(&state) % 4 ? 443 : 53));
+    uint32_t d = host_random(&state) % 256;
+
+    void *saddr;
+    void *daddr;
+    if (s->protocol == IPPROTO_TCP) {
+        s->tcp.version = version;
+        s->tcp.source = source;
+        s->tcp.dest = dest;
+        saddr = &s->tcp.saddr;
+        daddr = &s->tcp.daddr;
+    } else if (s->protocol == IPPROTO_UDP) {
+        s->udp.version = version;
+        s->udp.source = source;
+        s->udp.dest = dest;
+        saddr = &s->udp.saddr;
+        daddr = &s->udp.daddr;
+    } else {
+        s->icmp.version = version;
+        saddr = &s->icmp.saddr;
+        daddr = &s->icmp.daddr;
+    }
+    if (version == 4) {
+        __be32 src = htonl(0x0a010a01);
+        __be32 dst = htonl(0xc0a80000 | d);
+        memcpy(saddr, &src, 4);
+        memcpy(daddr, &dst, 4);
+    } else {
+        uint8_t src[16] = {0xfd, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+        uint8_t dst[16] = {0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, (uint8_t) d};
+        memcpy(saddr, src, 16);
+        memcpy(daddr, dst, 16);
+    }
+}
+
+static int same_key(const struct flow_key *a, const struct flow_key *b) {
+    return (memcmp(a, b, sizeof(struct flow_key)) == 0);
+}
+
+static struct ng_session *find(struct ng_session **live, int count, const struct flow_key *key) {
+    for (int i = 0; i < count; i++) {
+        struct flow_key other;
+        flow_key_session(live[i], &other);
+        if (same_key(key, &other))
+            return live[i];
+    }
+    return NULL;
+}
+
+static void test_packet_key() {
+    // A packet is keyed the same as the session it belongs to
+    uint8_t pkt[sizeof(struct iphdr) + sizeof(struct tcphdr)];
+    memset(pkt, 0, sizeof(pkt));
+    struct iphdr *ip4 = (struct iphdr *) pkt;
+    struct tcphdr *tcp = (struct tcphdr *) (pkt + sizeof(struct iphdr));
+    ip4->version = 4;
+    ip4->ihl = 5;
+    ip4->protocol = IPPROTO_TCP;
+    ip4->saddr = htonl(0x0a010a01);
+    ip4->daddr = htonl(0x01020304);
+    tcp->source = htons(40001);
+    tcp->dest = htons(443);
+
+    struct ng_session s;
+    memset(&s, 0, sizeof(s));
+    s.protocol = IPPROTO_TCP;
+    s.tcp.version = 4;
+    s.tcp.source = tcp->source;
+    s.tcp.dest = tcp->dest;
+    s.tcp.saddr.ip4 = ip4->saddr;
+    s.tcp.daddr.ip4 = ip4->daddr;
+
+    struct flow_key a;
+    struct flow_key b;
+    flow_key_packet(pkt, (uint8_t *) tcp, IPPROTO_TCP, &a);
+    flow_key_session(&s, &b);
+    check(same_key(&a, &b), "packet and session keys differ", 0);
+}
+
+int main() {
+    test_packet_key();
+
+    static struct ng_session sessions[SESSIONS];
+    static struct ng_session *live[SESSIONS];
+    static struct ng_session *spare[SESSIONS];
+    int count = 0;
+    int spares = SESSIONS;
+    for (int i = 0; i < SESSIONS; i++)
+        spare[i] = &sessions[i];
+
+    struct flow_table table;
+    flow_init(&table);
+    check(table.size == FLOW_TABLE_MIN, "initial size", 0);
+
+    uint32_t grown = table.size;
+    int reclaimed = 0;
+    for (int step = 0; step < STEPS; step++) {
+        uint32_t size = table.size;
+        uint32_t used = table.used;
+        // Mostly growing for the first half, then churning around a steady count
+        uint32_t r = host_random(&state) % 100;
+        int insert = (step < STEPS / 2 ? r < 60 : r < 50);
+        if (insert && spares > 0) {
+            struct ng_session *s = spare[--spares];
+            set_tuple(s);
+            struct flow_key key;
+            flow_key_session(s, &key);
+            struct ng_session *old = find(live, count, &key);
+            check(flow_lookup(&table, &key) == old, "lookup before insert", step);
+            check(flow_insert(&table, s) == 0, "insert failed", step);
+            if (old != NULL) {
+                // The stale session with the same key is replaced
+                for (int i = 0; i < count; i++)
+                    if (live[i] == old)
+                        live[i] = s;
+                spare[spares++] = old;
+            } else
+                live[count++] = s;
+            check(flow_lookup(&table, &key) == s, "lookup after insert", step);
+        } else if (count > 0) {
+            int i = (int) (host_random(&state) % count);
+            struct ng_session *s = live[i];
+            live[i] = live[--count];
+            flow_remove(&table, s);
+            spare[spares++] = s;
+            struct flow_key key;
+            flow_key_session(s, &key);
+            check(flow_lookup(&table, &key) == NULL, "lookup after remove", step);
+        }
+
+        check(table.count == (uint32_t) count, "count", step);
+        check(table.used >= table.count, "used below count", step);
+        check((uint64_t) table.used * 100 / table.size <= FLOW_LOAD_MAX, "load", step);
+        check((table.size & (table.size - 1)) == 0, "size not a power of two", step);
+        if (table.size > grown)
+            grown = table.size;
+        if (table.size == size && table.used + 1 < used)
+            reclaimed++;
+
+        // Now and then every live session and a few absent keys
+        if (step % 50000 == 0) {
+            for (int i = 0; i < count; i++) {
+                struct flow_key key;
+                flow_key_session(live[i], &key);
+                check(flow_lookup(&table, &key) == live[i], "live session not found", step);
+            }
+            for (int i = 0; i < 1000; i++) {
+                struct ng_session probe;
+                set_tuple(&probe);
+                struct flow_key key;
+                flow_key_session(&probe, &key);
+                check(flow_lookup(&table, &key) == find(live, count, &key), "absent key found", step);
+            }
+        }
+    }
+    check(grown > FLOW_TABLE_MIN, "table never grew", STEPS);
+    check(reclaimed > 0, "tombstones never reclaimed", STEPS);
+
+    // Removing every session leaves nothing to find
+    while (count > 0) {
+        struct ng_session *s = live[--count];
+        flow_remove(&table, s);
+    }
+    check(table.count == 0, "count after removing all", STEPS);
+    for (int i = 0; i < SESSIONS; i++) {
+        struct flow_key key;
+        flow_key_session(&sessions[i], &key);
+        check(flow_lookup(&table, &key) == NULL, "lookup after removing all", STEPS);
+    }
+
+    flow_clear(&table);
+    check(table.size == FLOW_TABLE_MIN && table.count == 0 && table.used == 0, "clear", STEPS);
+    flow_free(&table);
+
+    printf("%d steps, table grew to %u slots, %d rehashes in place, %d failures\n",
+           STEPS, grown, reclaimed, failures);
+    return (failures ? 1 : 0);
+}
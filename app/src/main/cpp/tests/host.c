@@ -0,0 +1,98 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+#include "host.h"
+
+// What the modules under test take from util.c and ip.c, without the
+// rest of the engine those pull in
+
+void log_android(int prio, const char *fmt, ...) {
+    if (prio >= ANDROID_LOG_WARN) {
+        va_list argptr;
+        va_start(argptr, fmt);
+        vfprintf(stderr, fmt, argptr);
+        fputc('\n', stderr);
+        va_end(argptr);
+    }
+}
+
+void *ng_malloc(size_t __byte_count, const char *tag) {
+    return malloc(__byte_count);
+}
+
+void *ng_calloc(size_t __item_count, size_t __item_size, const char *tag) {
+    return calloc(__item_count, __item_size);
+}
+
+void ng_free(void *__ptr, const char *file, int line) {
+    free(__ptr);
+}
+
+void *ng_pool_alloc(size_t size, const char *tag) {
+    return malloc(size);
+}
+
+void ng_pool_free(void *ptr, const char *file, int line) {
+    free(ptr);
+}
+
+int compare_u32(uint32_t s1, uint32_t s2) {
+    if (s1 == s2)
+        return 0;
+
+    uint32_t i1 = s1;
+    uint32_t i2 = s2;
+    if ((i1 < i2 && i2 - i1 < 0x7FFFFFFF) ||
+        (i1 > i2 && i1 - i2 > 0x7FFFFFFF))
+        return -1;
+    else
+        return 1;
+}
+
+uint8_t get_ip6_protocol(const uint8_t *pkt, size_t length, size_t *off) {
+    // Only flow_shard asks, no host target shards
+    *off = sizeof(struct ip6_hdr);
+    return ((const struct ip6_hdr *) pkt)->ip6_nxt;
+}
+
+double host_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint32_t host_random(uint32_t *state) {
+    // xorshift32, the same sequence on every run
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return (*state = x);
+}
+
+size_t host_unhex(const char *hex, uint8_t *out) {
+    size_t len = 0;
+    for (; hex[0] && hex[1]; hex += 2) {
+        unsigned int b;
+        sscanf(hex, "%2x", &b);
+        out[len++] = (uint8_t) b;
+    }
+    return len;
+}
@@ -0,0 +1,30 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+// Helpers of the host tests and benchmarks, see host.c. athena.h has no
+// include guard, so this header does not include it.
+
+#include <stddef.h>
+#include <stdint.h>
+
+double host_now(); // seconds, monotonic
+
+uint32_t host_random(uint32_t *state);
+
+size_t host_unhex(const char *hex, uint8_t *out); // returns the number of bytes
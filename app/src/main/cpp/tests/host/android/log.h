@@ -0,0 +1,18 @@
+#ifndef ATHENA_HOST_ANDROID_LOG_H
+#define ATHENA_HOST_ANDROID_LOG_H
+
+enum {
+    ANDROID_LOG_UNKNOWN,
+    ANDROID_LOG_DEFAULT,
+    ANDROID_LOG_VERBOSE,
+    ANDROID_LOG_DEBUG,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+    ANDROID_LOG_FATAL,
+    ANDROID_LOG_SILENT
+};
+
+int __android_log_print(int prio, const char *tag, const char *fmt, ...);
+
+#endif
@@ -0,0 +1,23 @@
+// What Bionic defines and glibc does not, included before every source
+// of a host build
+
+#ifndef ATHENA_HOST_BIONIC_H
+#define ATHENA_HOST_BIONIC_H
+
+#include <netinet/in.h>
+
+#define __packed __attribute__((packed))
+
+#define IPV6_MAXPACKET 65535
+#define IPV6_VERSION 0x60
+#define IPV6_VERSION_MASK 0xf0
+
+struct ippseudo {
+    struct in_addr ippseudo_src;
+    struct in_addr ippseudo_dst;
+    u_int8_t ippseudo_pad;
+    u_int8_t ippseudo_p;
+    u_int16_t ippseudo_len;
+};
+
+#endif
@@ -0,0 +1,46 @@
+// The JNI types athena.h declares with, for host builds of the modules
+// that never call into Java
+
+#ifndef ATHENA_HOST_JNI_H
+#define ATHENA_HOST_JNI_H
+
+#include <stdint.h>
+
+typedef uint8_t jboolean;
+typedef int8_t jbyte;
+typedef uint16_t jchar;
+typedef int16_t jshort;
+typedef int32_t jint;
+typedef int64_t jlong;
+typedef float jfloat;
+typedef double jdouble;
+typedef jint jsize;
+
+typedef void *jobject;
+typedef jobject jclass;
+typedef jobject jstring;
+typedef jobject jthrowable;
+typedef jobject jarray;
+typedef jarray jobjectArray;
+typedef jarray jbooleanArray;
+typedef jarray jbyteArray;
+typedef jarray jintArray;
+typedef jarray jlongArray;
+
+typedef struct _jfieldID *jfieldID;
+typedef struct _jmethodID *jmethodID;
+
+typedef const struct JNINativeInterface *JNIEnv;
+typedef const struct JNIInvokeInterface *JavaVM;
+
+#define JNI_FALSE 0
+#define JNI_TRUE 1
+#define JNI_OK 0
+#define JNI_ERR (-1)
+#define JNI_EDETACHED (-2)
+#define JNI_VERSION_1_6 0x00010006
+
+#define JNIEXPORT __attribute__((visibility("default")))
+#define JNICALL
+
+#endif
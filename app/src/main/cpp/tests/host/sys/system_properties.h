@@ -0,0 +1,8 @@
+#ifndef ATHENA_HOST_SYSTEM_PROPERTIES_H
+#define ATHENA_HOST_SYSTEM_PROPERTIES_H
+
+#define PROP_VALUE_MAX 92
+
+int __system_property_get(const char *name, char *value);
+
+#endif
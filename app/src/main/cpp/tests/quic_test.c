@@ -0,0 +1,362 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../utils/crypto.c"
+#include "host.h"
+
+// Known answers of the primitives under QUIC Initial decryption (FIPS 180-4,
+// RFC 4231, RFC 5869, FIPS 197, the GCM test cases of McGrew and Viega as
+// used by NIST), the Initial keys of RFC 9001 and RFC 9369 Appendix A.1,
+// and the client Initial of RFC 9001 Appendix A.2 down to its server name
+
+static int failures = 0;
+
+static void check_bytes(const char *what, const uint8_t *got, const char *hex) {
+    uint8_t want[256];
+    size_t len = host_unhex(hex, want);
+    if (memcmp(got, want, len) != 0) {
+        failures++;
+        fprintf(stderr, "%s:\n got  ", what);
+        for (size_t i = 0; i < len; i++)
+            fprintf(stderr, "%02x", got[i]);
+        fprintf(stderr, "\n want %s\n", hex);
+    }
+}
+
+static void check(int ok, const char *what) {
+    if (!ok) {
+        failures++;
+        fprintf(stderr, "%s\n", what);
+    }
+}
+
+// inspect_quic_name evaluates the name it finds, the rules are not under test
+static char evaluated[TLS_SNI_LENGTH + 1];
+
+int domain_evaluate(struct context *ctx, const char *name) {
+    strcpy(evaluated, name);
+    return VERDICT_UNKNOWN;
+}
+
+static void sha256(const void *data, size_t len, uint8_t *digest) {
+    struct sha256 c;
+    sha256_init(&c);
+    sha256_update(&c, data, len);
+    sha256_final(&c, digest);
+}
+
+static void test_sha256() {
+    uint8_t digest[SHA256_LENGTH];
+    sha256("", 0, digest);
+    check_bytes("SHA-256 empty", digest,
+                "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    sha256("abc", 3, digest);
+    check_bytes("SHA-256 abc", digest,
+                "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    const char *two = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    sha256(two, strlen(two), digest);
+    check_bytes("SHA-256 two blocks", digest,
+                "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+    // A million times a, in pieces that do not line up with the blocks
+    uint8_t a[1000];
+    memset(a, 'a', sizeof(a));
+    struct sha256 c;
+    sha256_init(&c);
+    for (int i = 0; i < 1000; i++) {
+        sha256_update(&c, a, 333);
+        sha256_update(&c, a, 667);
+    }
+    sha256_final(&c, digest);
+    check_bytes("SHA-256 million", digest,
+                "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+static void test_hmac_hkdf() {
+    uint8_t key[131];
+    uint8_t mac[SHA256_LENGTH];
+
+    // RFC 4231 test cases 1, 2 and 6, the last with a key longer than a block
+    memset(key, 0x0b, 20);
+    hmac_sha256(key, 20, (const uint8_t *) "Hi There", 8, NULL, 0, mac);
+    check_bytes("HMAC case 1", mac,
+                "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7");
+    const char *what = "what do ya want for nothing?";
+    hmac_sha256((const uint8_t *) "Jefe", 4, (const uint8_t *) what, 10,
+                (const uint8_t *) what + 10, strlen(what) - 10, mac);
+    check_bytes("HMAC case 2", mac,
+                "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843");
+    memset(key, 0xaa, 131);
+    const char *large = "Test Using Larger Than Block-Size Key - Hash Key First";
+    hmac_sha256(key, 131, (const uint8_t *) large, strlen(large), NULL, 0, mac);
+    check_bytes("HMAC case 6", mac,
+                "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54");
+
+    // RFC 5869 test case 1, the pseudorandom key
+    uint8_t salt[13];
+    for (int i = 0; i < 13; i++)
+        salt[i] = (uint8_t) i;
+    memset(key, 0x0b, 22);
+    hkdf_extract(salt, sizeof(salt), key, 22, mac);
+    check_bytes("HKDF-Extract", mac,
+                "077709362c2e32df0ddc3f0dc47bba6390b6c73bb50f9c3122ec844ad7c2b3e5");
+}
+
+static void test_aes_gcm() {
+    uint8_t key[16];
+    uint8_t block[16];
+    struct aes128 aes;
+
+    // FIPS 197 Appendix C.1
+    host_unhex("000102030405060708090a0b0c0d0e0f", key);
+    host_unhex("00112233445566778899aabbccddeeff", block);
+    aes128_init(&aes, key);
+    aes128_encrypt(&aes, block, block);
+    check_bytes("AES-128", block, "69c4e0d86a7b0430d8cdb78070b4c55a");
+
+    // GCM test cases 1 to 4: no data, one zero block, four blocks, a partial block with AAD
+    static const struct {
+        const char *key, *iv, *aad, *plain, *cipher, *tag;
+    } cases[] = {
+            {"00000000000000000000000000000000", "000000000000000000000000", "", "", "",
+                    "58e2fccefa7e3061367f1d57a4e7455a"},
+            {"00000000000000000000000000000000", "000000000000000000000000", "",
+                    "00000000000000000000000000000000",
+                    "0388dace60b6a392f328c2b971b2fe78",
+                    "ab6e47d42cec13bdf53a67b21257bddf"},
+            {"feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888", "",
+                    "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+                    "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+                    "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+                    "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+                    "4d5c2af327cd64a62cf35abd2ba6fab4"},
+            {"feffe9928665731c6d6a8f9467308308", "cafebabefacedbaddecaf888",
+                    "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+                    "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+                    "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+                    "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+                    "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+                    "5bc94fbc3221a5db94fae95ae7121a47"},
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        uint8_t iv[12], aad[32], cipher[64], tag[16], out[64];
+        char what[32];
+        host_unhex(cases[c].key, key);
+        host_unhex(cases[c].iv, iv);
+        size_t aadlen = host_unhex(cases[c].aad, aad);
+        size_t len = host_unhex(cases[c].cipher, cipher);
+        host_unhex(cases[c].tag, tag);
+
+        snprintf(what, sizeof(what), "GCM case %zu", c + 1);
+        int rc = aes128_gcm_open(key, iv, aad, aadlen, cipher, len, tag, out);
+        check(rc == 0, what);
+        if (rc == 0 && len > 0)
+            check_bytes(what, out, cases[c].plain);
+
+        // Any change to the tag, the cipher text or the AAD is refused
+        tag[15] ^= 1;
+        check(aes128_gcm_open(key, iv, aad, aadlen, cipher, len, tag, out) == -1, what);
+        tag[15] ^= 1;
+        if (len > 0) {
+            cipher[len - 1] ^= 0x80;
+            check(aes128_gcm_open(key, iv, aad, aadlen, cipher, len, tag, out) == -1, what);
+            cipher[len - 1] ^= 0x80;
+        }
+        if (aadlen > 0) {
+            aad[0] ^= 1;
+            check(aes128_gcm_open(key, iv, aad, aadlen, cipher, len, tag, out) == -1, what);
+        }
+    }
+}
+
+static const uint8_t rfc9001_dcid[] = {0x83, 0x94, 0xc8, 0xf0, 0x3e, 0x51, 0x57, 0x08};
+
+// The initial salts as published, quic.c has its own copy which A.2 exercises
+static const uint8_t quic_v1_salt[] = {
+        0x38, 0x76, 0x2c, 0xf7, 0xf5, 0x59, 0x34, 0xb3, 0x4d, 0x17,
+        0x9a, 0xe6, 0xa4, 0xc8, 0x0c, 0xad, 0xcc, 0xbb, 0x7f, 0x0a
+};
+
+static const uint8_t quic_v2_salt[] = {
+        0x0d, 0xed, 0xe3, 0xde, 0xf7, 0x00, 0xa6, 0xdb, 0x81, 0x93,
+        0x81, 0xbe, 0x6e, 0x26, 0x9d, 0xcb, 0xf9, 0xbd, 0x2e, 0xd9
+};
+
+static void test_initial_keys() {
+    uint8_t secret[SHA256_LENGTH];
+    uint8_t client[SHA256_LENGTH];
+    uint8_t server[SHA256_LENGTH];
+    uint8_t key[16], iv[12], hp[16];
+
+    // RFC 9001 A.1
+    hkdf_extract(quic_v1_salt, sizeof(quic_v1_salt), rfc9001_dcid, sizeof(rfc9001_dcid), secret);
+    check_bytes("v1 initial_secret", secret,
+                "7db5df06e7a69e432496adedb00851923595221596ae2ae9fb8115c1e9ed0a44");
+    hkdf_expand_label(secret, "client in", client, SHA256_LENGTH);
+    check_bytes("v1 client_initial_secret", client,
+                "c00cf151ca5be075ed0ebfb5c80323c42d6b7db67881289af4008f1f6c357aea");
+    hkdf_expand_label(client, "quic key", key, sizeof(key));
+    hkdf_expand_label(client, "quic iv", iv, sizeof(iv));
+    hkdf_expand_label(client, "quic hp", hp, sizeof(hp));
+    check_bytes("v1 client key", key, "1f369613dd76d5467730efcbe3b1a22d");
+    check_bytes("v1 client iv", iv, "fa044b2f42a3fd3b46fb255c");
+    check_bytes("v1 client hp", hp, "9f50449e04a0e810283a1e9933adedd2");
+
+    hkdf_expand_label(secret, "server in", server, SHA256_LENGTH);
+    check_bytes("v1 server_initial_secret", server,
+                "3c199828fd139efd216c155ad844cc81fb82fa8d7446fa7d78be803acdda951b");
+    hkdf_expand_label(server, "quic key", key, sizeof(key));
+    hkdf_expand_label(server, "quic iv", iv, sizeof(iv));
+    hkdf_expand_label(server, "quic hp", hp, sizeof(hp));
+    check_bytes("v1 server key", key, "cf3a5331653c364c88f0f379b6067e37");
+    check_bytes("v1 server iv", iv, "0ac1493ca1905853b0bba03e");
+    check_bytes("v1 server hp", hp, "c206b8d9b9f0f37644430b490eeaa314");
+
+    // RFC 9369 A.1
+    hkdf_extract(quic_v2_salt, sizeof(quic_v2_salt), rfc9001_dcid, sizeof(rfc9001_dcid), secret);
+    hkdf_expand_label(secret, "client in", client, SHA256_LENGTH);
+    hkdf_expand_label(client, "quicv2 key", key, sizeof(key));
+    hkdf_expand_label(client, "quicv2 iv", iv, sizeof(iv));
+    hkdf_expand_label(client, "quicv2 hp", hp, sizeof(hp));
+    check_bytes("v2 client key", key, "8b1a0bc121284290a29e0971b5cd045d");
+    check_bytes("v2 client iv", iv, "91f73e2351d8fa91660e909f");
+    check_bytes("v2 client hp", hp, "45b95e15235d6f45a6b19cbcb0294ba9");
+}
+
+// The CRYPTO frame with the ClientHello of RFC 9001 A.2, padded to 1162 bytes
+static const char *rfc9001_crypto =
+        "060040f1010000ed0303ebf8fa56f12939b9584a3896472ec40bb863cfd3e868"
+        "04fe3a47f06a2b69484c00000413011302010000c000000010000e00000b6578"
+        "616d706c652e636f6dff01000100000a00080006001d00170018001000070005"
+        "04616c706e000500050100000000003300260024001d00209370b2c9caa47fba"
+        "baf4fe6f0a1c87b1d0a3bd1a1ae70b4bb5c9f18bb4d1f0b0002b000302030400"
+        "0d0010000e0403050306030203080408050806002d00020101001c0002400100"
+        "3900320408ffffffffffffffff05048000ffff07048000ffff08011001048000"
+        "75300901100f088394c8f03e51570806048000ffff";
+
+static void gcm_seal(const uint8_t *key, const uint8_t *iv, const uint8_t *aad, size_t aadlen,
+                     uint8_t *data, size_t len, uint8_t *tag) {
+    // The counterpart of aes128_gcm_open, only needed to build the packet
+    struct aes128 aes;
+    uint8_t h[16], y[16], counter[16], stream[16], lengths[16];
+    aes128_init(&aes, key);
+    memset(h, 0, 16);
+    aes128_encrypt(&aes, h, h);
+    memcpy(counter, iv, 12);
+    memcpy(counter + 12, "\0\0\0\1", 4);
+    for (size_t off = 0; off < len; off += 16) {
+        counter[15]++;
+        if (counter[15] == 0 && ++counter[14] == 0)
+            counter[13]++;
+        aes128_encrypt(&aes, counter, stream);
+        for (size_t i = 0; i < 16 && off + i < len; i++)
+            data[off + i] ^= stream[i];
+    }
+    memset(y, 0, 16);
+    ghash_update(y, h, aad, aadlen);
+    ghash_update(y, h, data, len);
+    for (int i = 0; i < 8; i++) {
+        lengths[i] = (uint8_t) ((uint64_t) aadlen * 8 >> (56 - i * 8));
+        lengths[8 + i] = (uint8_t) ((uint64_t) len * 8 >> (56 - i * 8));
+    }
+    ghash_update(y, h, lengths, 16);
+    memcpy(counter + 12, "\0\0\0\1", 4);
+    aes128_encrypt(&aes, counter, stream);
+    for (int i = 0; i < 16; i++)
+        tag[i] = (uint8_t) (y[i] ^ stream[i]);
+}
+
+static size_t rfc9001_initial(uint8_t *packet) {
+    // Header with packet number 2 in four bytes, payload and tag, then header protection
+    uint8_t key[16], iv[12], hp[16], mask[16];
+    host_unhex("1f369613dd76d5467730efcbe3b1a22d", key);
+    host_unhex("fa044b2f42a3fd3b46fb255c", iv);
+    host_unhex("9f50449e04a0e810283a1e9933adedd2", hp);
+    size_t header = host_unhex("c300000001088394c8f03e5157080000449e00000002", packet);
+    memset(packet + header, 0, 1162);
+    host_unhex(rfc9001_crypto, packet + header);
+    iv[11] ^= 2;
+    gcm_seal(key, iv, packet, header, packet + header, 1162, packet + header + 1162);
+
+    struct aes128 aes;
+    aes128_init(&aes, hp);
+    aes128_encrypt(&aes, packet + header, mask);
+    check_bytes("A.2 sample", packet + header, "d1b1c98dd7689fb8ec11d242b123dc9b");
+    check_bytes("A.2 mask", mask, "437b9aec36");
+    packet[0] ^= (uint8_t) (mask[0] & 0x0f);
+    for (int i = 0; i < 4; i++)
+        packet[header - 4 + i] ^= mask[1 + i];
+    return header + 1162 + 16;
+}
+
+static void test_client_initial() {
+    // RFC 9001 A.2, of which the first 100 bytes are compared
+    uint8_t packet[1200];
+    size_t len = rfc9001_initial(packet);
+    check(len == 1200, "A.2 packet size");
+    check_bytes("A.2 packet", packet,
+                "c000000001088394c8f03e5157080000449e7b9aec34d1b1c98dd7689fb8ec11"
+                "d242b123dc9bd8bab936b47d92ec356c0bab7df5976d27cd449f63300099f399"
+                "1c260ec4c60d17b31f8429157bb35a1282a643a8d2262cad67500cadb8e7378c"
+                "8eb7539e");
+
+    // Decrypted and read to the server name by the engine
+    struct arguments args;
+    struct ng_session s;
+    memset(&args, 0, sizeof(args));
+    memset(&s, 0, sizeof(s));
+    s.protocol = IPPROTO_UDP;
+    evaluated[0] = 0;
+    inspect_quic_name(&args, &s, packet, len);
+    check(s.name_state == NAME_DONE && s.probe == NULL, "A.2 state");
+    check(s.server_name != NULL && strcmp(s.server_name, "example.com") == 0, "A.2 server name");
+    check(strcmp(evaluated, "example.com") == 0, "A.2 evaluated");
+    session_free_name(&s);
+
+    // A packet that does not authenticate yields nothing
+    packet[len - 1] ^= 1;
+    memset(&s, 0, sizeof(s));
+    s.protocol = IPPROTO_UDP;
+    for (int i = 0; i < NAME_SEGMENTS; i++)
+        inspect_quic_name(&args, &s, packet, len);
+    check(s.name_state == NAME_DONE && s.server_name == NULL, "A.2 bad tag");
+    session_free_name(&s);
+
+    // Nor does a truncated one, or a long header of another version
+    packet[len - 1] ^= 1;
+    memset(&s, 0, sizeof(s));
+    for (int i = 0; i < NAME_SEGMENTS; i++)
+        inspect_quic_name(&args, &s, packet, 600);
+    check(s.name_state == NAME_DONE && s.server_name == NULL, "A.2 truncated");
+    session_free_name(&s);
+    packet[4] = 2;
+    memset(&s, 0, sizeof(s));
+    inspect_quic_name(&args, &s, packet, len);
+    check(s.name_state == NAME_DONE && s.probe == NULL && s.server_name == NULL, "other version");
+}
+
+int main() {
+    test_sha256();
+    test_hmac_hkdf();
+    test_aes_gcm();
+    test_initial_keys();
+    test_client_initial();
+    printf("%d failures\n", failures);
+    return (failures ? 1 : 0);
+}
@@ -0,0 +1,270 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+#include "host.h"
+
+// Server names from TLS ClientHellos and HTTP requests: complete, cut at
+// every length, malformed, and spread over segments of a TCP flow
+
+static int failures = 0;
+
+static void check(int ok, const char *what) {
+    if (!ok) {
+        failures++;
+        fprintf(stderr, "%s\n", what);
+    }
+}
+
+// inspect_server_name evaluates the name it finds, the rules are not under test
+int domain_evaluate(struct context *ctx, const char *name) {
+    return (strcmp(name, "blocked.example") == 0 ? VERDICT_BLOCK : VERDICT_UNKNOWN);
+}
+
+static size_t put16(uint8_t *p, size_t off, size_t v) {
+    p[off] = (uint8_t) (v >> 8);
+    p[off + 1] = (uint8_t) v;
+    return off + 2;
+}
+
+// A TLS record with a ClientHello, the server name extension between two
+// others; returns its length and where the server name extension ends
+static size_t client_hello(uint8_t *p, const char *name, size_t *sni_end) {
+    size_t off = 0;
+    p[off++] = 22;
+    p[off++] = 3;
+    p[off++] = 1;
+    off += 2; // record length
+    p[off++] = 1;
+    off += 3; // handshake length
+    p[off++] = 3;
+    p[off++] = 3;
+    memset(p + off, 0xab, 32);
+    off += 32;
+    p[off++] = 32; // session id
+    memset(p + off, 0xcd, 32);
+    off += 32;
+    off = put16(p, off, 4);
+    off = put16(p, off, 0x1301);
+    off = put16(p, off, 0x1302);
+    p[off++] = 1;
+    p[off++] = 0;
+    size_t exts = off;
+    off += 2;
+
+    // supported_groups, server_name, padding
+    off = put16(p, off, 10);
+    off = put16(p, off, 4);
+    off = put16(p, off, 2);
+    off = put16(p, off, 0x001d);
+    if (name != NULL) {
+        size_t n = strlen(name);
+        off = put16(p, off, 0);
+        off = put16(p, off, n + 5);
+        off = put16(p, off, n + 3);
+        p[off++] = 0;
+        off = put16(p, off, n);
+        memcpy(p + off, name, n);
+        off += n;
+    }
+    *sni_end = off;
+    off = put16(p, off, 21);
+    off = put16(p, off, 100);
+    memset(p + off, 0, 100);
+    off += 100;
+
+    put16(p, exts, off - exts - 2);
+    put16(p, 3, off - 5);
+    p[6] = (uint8_t) ((off - 9) >> 16);
+    put16(p, 7, off - 9);
+    return off;
+}
+
+static void test_client_hello() {
+    uint8_t hello[1024];
+    char name[TLS_SNI_LENGTH + 1];
+    size_t sni_end;
+    size_t len = client_hello(hello, "WWW.Example.COM.", &sni_end);
+
+    check(get_sni(hello, len, name) == NAME_FOUND && strcmp(name, "www.example.com") == 0, "sni");
+
+    // Cut anywhere, also within the extension: more until the name is complete
+    for (size_t cut = 0; cut < len; cut++) {
+        int found = get_sni(hello, cut, name);
+        int want = (cut == 0 ? NAME_NONE : (cut < sni_end ? NAME_MORE : NAME_FOUND));
+        if (found != want) {
+            failures++;
+            fprintf(stderr, "sni cut at %zu of %zu: got %d want %d\n", cut, len, found, want);
+        }
+    }
+
+    // Without a server name, more until the header of every extension was seen
+    len = client_hello(hello, NULL, &sni_end);
+    check(get_sni(hello, len, name) == NAME_NONE, "no sni");
+    check(get_sni(hello, sni_end + 3, name) == NAME_MORE, "no sni cut in a header");
+    check(get_sni(hello, sni_end + 4, name) == NAME_NONE, "no sni cut in the last extension");
+
+    // Not a handshake record, or not a ClientHello
+    len = client_hello(hello, "example.com", &sni_end);
+    hello[0] = 23;
+    check(get_sni(hello, len, name) == NAME_NONE, "application data");
+    check(get_sni(hello, 3, name) == NAME_NONE, "application data cut");
+    hello[0] = 22;
+    hello[1] = 2;
+    check(get_sni(hello, len, name) == NAME_NONE, "SSL 2");
+    hello[1] = 3;
+    hello[5] = 2;
+    check(get_sni(hello, len, name) == NAME_NONE, "ServerHello");
+}
+
+static void test_malformed_hello() {
+    uint8_t hello[1024];
+    char name[TLS_SNI_LENGTH + 1];
+    size_t sni_end;
+
+    // Names that are no host names
+    const char *bad[] = {"1.2.3.4", "exa mple.com", "example.com/", "ex\x01ample.com", "."};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        size_t len = client_hello(hello, bad[i], &sni_end);
+        check(get_sni(hello, len, name) == NAME_NONE, bad[i]);
+    }
+    char longname[300];
+    memset(longname, 'a', 256);
+    longname[256] = 0;
+    size_t len = client_hello(hello, longname, &sni_end);
+    check(get_sni(hello, len, name) == NAME_NONE, "name of 256");
+    longname[255] = 0;
+    len = client_hello(hello, longname, &sni_end);
+    check(get_sni(hello, len, name) == NAME_FOUND && strlen(name) == 255, "name of 255");
+
+    // Lengths that run past what contains them
+    len = client_hello(hello, "example.com", &sni_end);
+    size_t entry = sni_end - 11 - 2;
+    put16(hello, entry, 12);
+    check(get_sni(hello, len, name) == NAME_NONE, "name past its list");
+    put16(hello, entry, 11);
+    put16(hello, sni_end - 11 - 7, 200);
+    check(get_sni(hello, len, name) == NAME_NONE, "extension past the hello");
+    check(get_sni(hello, sni_end + 10, name) == NAME_MORE, "extension past a cut hello");
+    put16(hello, sni_end - 11 - 7, 16);
+
+    // A list entry of another type is skipped
+    hello[sni_end - 11 - 3] = 1;
+    check(get_sni(hello, len, name) == NAME_NONE, "other name type");
+    hello[sni_end - 11 - 3] = 0;
+
+    // A handshake length beyond the record is read as a cut hello
+    hello[6] = 1;
+    check(get_sni(hello, len, name) == NAME_FOUND, "long handshake with name");
+    hello[6] = 0;
+
+    // A session id or cipher suites running past the end
+    hello[43] = 255;
+    check(get_sni(hello, 60, name) == NAME_MORE, "session id cut");
+    check(get_sni(hello, len, name) == NAME_NONE, "session id past the hello");
+}
+
+static int host(const char *request, char *name) {
+    return get_http_host((const uint8_t *) request, strlen(request), name);
+}
+
+static void test_http_host() {
+    char name[TLS_SNI_LENGTH + 1];
+
+    check(host("GET / HTTP/1.1\r\nHost: Example.COM\r\n\r\n", name) == NAME_FOUND &&
+          strcmp(name, "example.com") == 0, "host");
+    check(host("POST /x HTTP/1.1\r\nUser-Agent: t\r\nhost:example.com:8080\r\n\r\n", name) == NAME_FOUND &&
+          strcmp(name, "example.com") == 0, "host with port");
+    check(host("GET / HTTP/1.0\nHOST: \texample.com.\n\n", name) == NAME_FOUND &&
+          strcmp(name, "example.com") == 0, "host with line feeds");
+
+    // A Host header without a line end may be cut, as may a request line
+    check(host("GET / HTTP/1.1\r\nHost: example.com", name) == NAME_NONE, "host without CRLF");
+    check(host("GET / HTTP/1.1\r\nHost: example.com\r", name) == NAME_FOUND, "host with CR");
+    check(host("GET / HTTP/1.1\r\nHo", name) == NAME_NONE, "cut header");
+    check(host("GET / HTTP/1.1", name) == NAME_NONE, "request line only");
+
+    // The headers end before a Host, or there is none
+    check(host("GET / HTTP/1.1\r\nAccept: */*\r\n\r\nHost: example.com\r\n", name) == NAME_NONE, "host in body");
+    check(host("GET / HTTP/1.1\r\nAccept: */*\r\n", name) == NAME_NONE, "no host");
+
+    // Not HTTP, or names that are no host names
+    check(host("get / HTTP/1.1\r\nHost: example.com\r\n", name) == NAME_NONE, "lower case method");
+    check(host("GETTINGTOOLONGMETHOD / HTTP/1.1\r\nHost: example.com\r\n", name) == NAME_NONE, "long method");
+    check(host("GET\r\nHost: example.com\r\n", name) == NAME_NONE, "no space");
+    check(host("\x16\x03\x01", name) == NAME_NONE, "TLS");
+    check(host("GET / HTTP/1.1\r\nHost: 10.0.0.1\r\n", name) == NAME_NONE, "address");
+    check(host("GET / HTTP/1.1\r\nHost: [::1]:80\r\n", name) == NAME_NONE, "IPv6 address");
+    check(host("GET / HTTP/1.1\r\nHost: \r\n", name) == NAME_NONE, "empty host");
+}
+
+static void test_segments() {
+    struct arguments args;
+    memset(&args, 0, sizeof(args));
+    uint8_t hello[1024];
+    size_t sni_end;
+    size_t len = client_hello(hello, "blocked.example", &sni_end);
+
+    // In three segments, the last one cutting the name, a retransmission in between
+    struct ng_session s;
+    memset(&s, 0, sizeof(s));
+    uint32_t seq = 0xffffffe0; // wraps
+    check(inspect_server_name(&args, &s, hello, 50, seq) == VERDICT_UNKNOWN &&
+          s.name_state == NAME_COLLECTING, "first segment");
+    check(inspect_server_name(&args, &s, hello, 50, seq) == VERDICT_UNKNOWN &&
+          s.name_state == NAME_COLLECTING, "retransmission");
+    check(inspect_server_name(&args, &s, hello + 50, sni_end - 55, seq + 50) == VERDICT_UNKNOWN &&
+          s.name_state == NAME_COLLECTING, "second segment");
+    check(inspect_server_name(&args, &s, hello + sni_end - 5, len - sni_end + 5,
+                              seq + (uint32_t) sni_end - 5) == VERDICT_BLOCK &&
+          s.name_state == NAME_DONE && s.probe == NULL, "third segment");
+    check(s.server_name != NULL && strcmp(s.server_name, "blocked.example") == 0, "segments name");
+    session_free_name(&s);
+
+    // A gap ends the search
+    memset(&s, 0, sizeof(s));
+    inspect_server_name(&args, &s, hello, 50, 1000);
+    check(inspect_server_name(&args, &s, hello + 60, len - 60, 1060) == VERDICT_UNKNOWN &&
+          s.name_state == NAME_DONE && s.probe == NULL && s.server_name == NULL, "gap");
+    session_free_name(&s);
+
+    // As do too many segments
+    memset(&s, 0, sizeof(s));
+    for (int i = 0; i < NAME_SEGMENTS && s.name_state != NAME_DONE; i++)
+        inspect_server_name(&args, &s, hello + i * 10, 10, (uint32_t) (i * 10));
+    check(s.name_state == NAME_DONE && s.probe == NULL && s.server_name == NULL, "segments");
+    session_free_name(&s);
+
+    // An HTTP request in one segment
+    const char *request = "GET / HTTP/1.1\r\nHost: www.example.com\r\n\r\n";
+    memset(&s, 0, sizeof(s));
+    check(inspect_server_name(&args, &s, (const uint8_t *) request, strlen(request), 0) == VERDICT_UNKNOWN &&
+          s.name_state == NAME_DONE && s.server_name != NULL &&
+          strcmp(s.server_name, "www.example.com") == 0, "http");
+    session_free_name(&s);
+}
+
+int main() {
+    test_client_hello();
+    test_malformed_hello();
+    test_http_host();
+    test_segments();
+    printf("%d failures\n", failures);
+    return (failures ? 1 : 0);
+}
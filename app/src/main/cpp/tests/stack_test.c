@@ -0,0 +1,83 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+#include "host.h"
+
+// Threads push numbered nodes while one thread takes; every node must come
+// back exactly once, and the nodes of each pusher in the order it pushed them
+
+#define PUSHERS 4
+#define NODES 200000 // per pusher
+
+struct node {
+    uint32_t value;
+    struct node *next; // not the first field, the offset is what counts
+};
+
+static struct lf_stack stack;
+static atomic_int done;
+
+static void *pusher(void *arg) {
+    struct node *nodes = (struct node *) arg;
+    for (int i = 0; i < NODES; i++)
+        lf_stack_push(&stack, &nodes[i], offsetof(struct node, next));
+    atomic_fetch_add(&done, 1);
+    return NULL;
+}
+
+int main() {
+    static struct node nodes[PUSHERS][NODES];
+    for (int t = 0; t < PUSHERS; t++)
+        for (int i = 0; i < NODES; i++)
+            nodes[t][i].value = (uint32_t) (t * NODES + i);
+
+    pthread_t threads[PUSHERS];
+    for (int t = 0; t < PUSHERS; t++)
+        pthread_create(&threads[t], NULL, pusher, nodes[t]);
+
+    static uint8_t seen[PUSHERS * NODES];
+    int last[PUSHERS];
+    for (int t = 0; t < PUSHERS; t++)
+        last[t] = -1;
+    int taken = 0;
+    int failures = 0;
+    while (1) {
+        int finished = (atomic_load(&done) == PUSHERS);
+        struct node *n = lf_stack_take(&stack, offsetof(struct node, next));
+        for (; n != NULL; n = n->next) {
+            int t = (int) (n->value / NODES);
+            int i = (int) (n->value % NODES);
+            if (seen[n->value]++ || i <= last[t])
+                failures++;
+            last[t] = i;
+            taken++;
+        }
+        if (finished)
+            break;
+    }
+
+    for (int t = 0; t < PUSHERS; t++)
+        pthread_join(threads[t], NULL);
+
+    if (taken != PUSHERS * NODES)
+        failures++;
+    printf("%d nodes taken, %d failures\n", taken, failures);
+    return (failures ? 1 : 0);
+}
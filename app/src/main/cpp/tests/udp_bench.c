@@ -0,0 +1,166 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+#include "host.h"
+
+// Datagrams per second through a loopback echo peer, read and written the
+// way check_udp_socket and handle_udp did before batching and the way they
+// do now: an unconnected socket with one sendto per datagram and one recv
+// per readiness, against a connected socket with one sendmmsg per round
+// and recvmmsg of up to UDP_BATCH datagrams
+
+#define DATAGRAMS 100000
+#define ROUND 10 // datagrams per round of tun packets
+#define PAYLOAD 1200 // bytes
+#define ROUND_TIMEOUT 20 // milliseconds without an answer
+
+static atomic_int stopping;
+
+static void *echo(void *arg) {
+    // Answers in batches, so the peer is never what is measured
+    int sock = *(int *) arg;
+    static uint8_t buffers[UDP_BATCH][PAYLOAD];
+    struct sockaddr_in addrs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct mmsghdr msgs[UDP_BATCH];
+    while (!atomic_load(&stopping)) {
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < UDP_BATCH; i++) {
+            iov[i].iov_base = buffers[i];
+            iov[i].iov_len = PAYLOAD;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        int n = recvmmsg(sock, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+        if (n <= 0)
+            continue;
+        for (int i = 0; i < n; i++)
+            iov[i].iov_len = msgs[i].msg_len;
+        sendmmsg(sock, msgs, (unsigned int) n, 0);
+    }
+    return NULL;
+}
+
+static int receive_single(int sock) {
+    // One datagram per readiness, into a buffer of the session's mss
+    uint8_t *buffer = ng_malloc(UDP4_MAXMSG, "udp recv");
+    ssize_t bytes = recv(sock, buffer, UDP4_MAXMSG, 0);
+    ng_free(buffer, __FILE__, __LINE__);
+    return (bytes > 0 ? 1 : 0);
+}
+
+static int receive_batch(int sock, struct udp_recv_batch *batch) {
+    for (int i = 0; i < UDP_BATCH; i++) {
+        memset(&batch->msgs[i], 0, sizeof(struct mmsghdr));
+        batch->iov[i].iov_base = batch->buffers + (size_t) i * UDP4_MAXMSG;
+        batch->iov[i].iov_len = UDP4_MAXMSG;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(sock, batch->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    return (n > 0 ? n : 0);
+}
+
+static void send_round(int sock, int batched, const struct sockaddr_in *peer, uint8_t *payload) {
+    if (batched) {
+        struct iovec iov[ROUND];
+        struct mmsghdr msgs[ROUND];
+        memset(msgs, 0, sizeof(msgs));
+        for (int i = 0; i < ROUND; i++) {
+            iov[i].iov_base = payload;
+            iov[i].iov_len = PAYLOAD;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        sendmmsg(sock, msgs, ROUND, 0);
+    } else
+        for (int i = 0; i < ROUND; i++)
+            sendto(sock, payload, PAYLOAD, 0, (const struct sockaddr *) peer, sizeof(*peer));
+}
+
+static void bench(int batched, const struct sockaddr_in *peer) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (batched)
+        connect(sock, (const struct sockaddr *) peer, sizeof(*peer));
+
+    int epoll_fd = epoll_create(1);
+    struct epoll_event ev = {.events = EPOLLIN};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+
+    struct udp_recv_batch batch;
+    batch.buffers = ng_malloc((size_t) UDP_BATCH * UDP4_MAXMSG, "udp recv batch");
+    uint8_t payload[PAYLOAD];
+    memset(payload, 0x5a, sizeof(payload));
+
+    int received = 0;
+    double start = host_now();
+    for (int sent = 0; sent < DATAGRAMS; sent += ROUND) {
+        send_round(sock, batched, peer, payload);
+        int answered = 0;
+        while (answered < ROUND) {
+            struct epoll_event ready;
+            if (epoll_wait(epoll_fd, &ready, 1, ROUND_TIMEOUT) <= 0)
+                break;
+            answered += (batched ? receive_batch(sock, &batch) : receive_single(sock));
+        }
+        received += answered;
+    }
+    double elapsed = host_now() - start;
+
+    // Answers that came after their round timed out are not counted
+    printf("%-12s %8.0f datagrams/s  %d of %d dropped (%.2f%%)\n",
+           batched ? "batched" : "per datagram", received / elapsed,
+           DATAGRAMS - received, DATAGRAMS, (DATAGRAMS - received) * 100.0 / DATAGRAMS);
+
+    ng_free(batch.buffers, __FILE__, __LINE__);
+    close(epoll_fd);
+    close(sock);
+}
+
+int main() {
+    int peer_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in peer = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(peer);
+    if (bind(peer_sock, (struct sockaddr *) &peer, sizeof(peer)) ||
+        getsockname(peer_sock, (struct sockaddr *) &peer, &len)) {
+        perror("echo peer");
+        return 1;
+    }
+
+    // The echo thread looks at stopping when a read times out
+    struct timeval timeout = {0, 100 * 1000};
+    setsockopt(peer_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, echo, &peer_sock);
+
+    printf("%d datagrams of %d bytes, %d per round\n", DATAGRAMS, PAYLOAD, ROUND);
+    for (int run = 0; run < 3; run++) {
+        bench(0, &peer);
+        bench(1, &peer);
+    }
+
+    atomic_store(&stopping, 1);
+    pthread_join(thread, NULL);
+    close(peer_sock);
+    return 0;
+}
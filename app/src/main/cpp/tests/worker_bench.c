@@ -0,0 +1,188 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+#include "host.h"
+
+// Packets per second from 1 to WORKERS_MAX workers. As in the engine one
+// thread shards the packets with flow_shard into the ring of each worker,
+// which keys the packet, finds its flow and checksums it. A single worker
+// handles the packets itself, without a dispatcher, as the engine does.
+// The speedup is bounded by the cores of the host, which are printed.
+
+#define FLOWS 2000
+#define PACKETS 4000000
+#define PACKET_SIZE 1400
+
+struct bench_worker {
+    pthread_t thread;
+    struct packet_ring ring;
+    struct flow_table flows;
+    uint64_t packets;
+    uint32_t sum;
+};
+
+static struct ng_session sessions[FLOWS];
+static uint8_t *packets[FLOWS];
+static _Atomic int done;
+
+static void build_flows() {
+    uint32_t state = 4711;
+    for (int i = 0; i < FLOWS; i++) {
+        struct ng_session *s = &sessions[i];
+        memset(s, 0, sizeof(struct ng_session));
+        s->protocol = (uint8_t) (i & 1 ? IPPROTO_TCP : IPPROTO_UDP);
+        __be32 src = htonl(0x0a010a01);
+        __be32 dst = host_random(&state);
+        __be16 source = (__be16) host_random(&state);
+        __be16 dest = (__be16) host_random(&state);
+        if (s->protocol == IPPROTO_TCP) {
+            s->tcp.version = 4;
+            s->tcp.saddr.ip4 = src;
+            s->tcp.daddr.ip4 = dst;
+            s->tcp.source = source;
+            s->tcp.dest = dest;
+        } else {
+            s->udp.version = 4;
+            s->udp.saddr.ip4 = src;
+            s->udp.daddr.ip4 = dst;
+            s->udp.source = source;
+            s->udp.dest = dest;
+        }
+
+        uint8_t *pkt = calloc(1, PACKET_SIZE);
+        struct iphdr *ip4 = (struct iphdr *) pkt;
+        ip4->version = 4;
+        ip4->ihl = 5;
+        ip4->tot_len = htons(PACKET_SIZE);
+        ip4->protocol = s->protocol;
+        ip4->saddr = src;
+        ip4->daddr = dst;
+        // Both headers start with the ports
+        __be16 *ports = (__be16 *) (pkt + sizeof(struct iphdr));
+        ports[0] = source;
+        ports[1] = dest;
+        size_t off = sizeof(struct iphdr) + sizeof(struct tcphdr);
+        memcpy(pkt + off, &i, sizeof(i));
+        for (size_t b = off + sizeof(i); b < PACKET_SIZE; b++)
+            pkt[b] = (uint8_t) host_random(&state);
+        packets[i] = pkt;
+    }
+}
+
+static void handle_packet(struct bench_worker *w, const uint8_t *pkt, size_t length) {
+    struct flow_key key;
+    flow_key_packet(pkt, pkt + sizeof(struct iphdr), pkt[9], &key);
+    if (flow_lookup(&w->flows, &key) == NULL) {
+        int index;
+        memcpy(&index, pkt + sizeof(struct iphdr) + sizeof(struct tcphdr), sizeof(index));
+        flow_insert(&w->flows, &sessions[index]);
+    }
+    w->sum += calc_checksum(0, pkt, length);
+    w->packets++;
+}
+
+static void *worker_thread(void *a) {
+    struct bench_worker *w = (struct bench_worker *) a;
+    struct packet_ring *ring = &w->ring;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    for (;;) {
+        int last = atomic_load_explicit(&done, memory_order_acquire);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == head) {
+            if (last)
+                break;
+            sched_yield();
+            continue;
+        }
+        while (tail != head) {
+            uint8_t *buffer = ring->slot[tail % WORKER_QUEUE].buffer;
+            size_t length = ring->slot[tail % WORKER_QUEUE].length;
+            handle_packet(w, buffer, length);
+            atomic_store_explicit(&ring->tail, ++tail, memory_order_release);
+        }
+    }
+    return NULL;
+}
+
+static void dispatch(struct bench_worker *workers, int count, uint8_t *buffer, size_t length) {
+    // The engine drops when the ring is full, here the dispatcher waits so every run does the same work
+    struct packet_ring *ring = &workers[flow_shard(buffer, length, count)].ring;
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= WORKER_QUEUE)
+        sched_yield();
+    ring->slot[head % WORKER_QUEUE].buffer = buffer;
+    ring->slot[head % WORKER_QUEUE].length = length;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static double bench(int count, double single) {
+    struct bench_worker *workers = calloc(count, sizeof(struct bench_worker));
+    for (int i = 0; i < count; i++)
+        flow_init(&workers[i].flows);
+    atomic_store(&done, 0);
+
+    uint32_t state = 1013;
+    double start = host_now();
+    if (count == 1)
+        for (int p = 0; p < PACKETS; p++)
+            handle_packet(&workers[0], packets[host_random(&state) % FLOWS], PACKET_SIZE);
+    else {
+        for (int i = 0; i < count; i++)
+            pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+        for (int p = 0; p < PACKETS; p++)
+            dispatch(workers, count, packets[host_random(&state) % FLOWS], PACKET_SIZE);
+        atomic_store_explicit(&done, 1, memory_order_release);
+        for (int i = 0; i < count; i++)
+            pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = host_now() - start;
+
+    // Flows and packets per worker, the busiest one bounds the speedup
+    uint64_t total = 0;
+    uint64_t busiest = 0;
+    uint32_t flows = 0;
+    for (int i = 0; i < count; i++) {
+        total += workers[i].packets;
+        if (workers[i].packets > busiest)
+            busiest = workers[i].packets;
+        flows += workers[i].flows.used;
+        flow_free(&workers[i].flows);
+    }
+    if (total != PACKETS || flows != FLOWS)
+        fprintf(stderr, "%d workers handled %llu packets of %u flows\n",
+                count, (unsigned long long) total, flows);
+
+    double rate = PACKETS / elapsed;
+    printf("%d workers  %6.2f Mpps  speedup %4.2f  busiest worker %5.1f%% of the packets\n",
+           count, rate / 1e6, single > 0 ? rate / single : 1.0, busiest * 100.0 / total);
+    free(workers);
+    return rate;
+}
+
+int main() {
+    printf("%ld cores\n", sysconf(_SC_NPROCESSORS_ONLN));
+    build_flows();
+    double single = bench(1, 0);
+    for (int count = 2; count <= WORKERS_MAX; count *= 2)
+        bench(count, single);
+    for (int i = 0; i < FLOWS; i++)
+        free(packets[i]);
+    return 0;
+}
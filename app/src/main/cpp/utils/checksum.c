@@ -0,0 +1,250 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+#if defined(__aarch64__) || (defined(__arm__) && defined(__ARM_NEON))
+#include <arm_neon.h>
+#define CHECKSUM_NEON
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86
+#endif
+
+// The Internet checksum (RFC 1071) of every packet written to the tunnel.
+// Words are added in memory order, the sum of 32 bit words folds to the same
+// 16 bit sum as the sum of 16 bit words, so the kernels add wide words into
+// 64 bit accumulators and fold once at the end. The vector kernel is chosen
+// at load time, after it gave the known checksums of a few buffers and
+// agreed with the plain one on many more.
+
+static uint64_t sum_tail(const uint8_t *buf, size_t len, uint64_t sum) {
+    uint32_t word;
+    while (len >= 4) {
+        memcpy(&word, buf, 4);
+        sum += word;
+        buf += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t half;
+        memcpy(&half, buf, 2);
+        sum += half;
+        buf += 2;
+        len -= 2;
+    }
+    if (len > 0)
+        sum += *buf; // padded with a zero, the low byte on little endian
+    return sum;
+}
+
+static uint16_t fold(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t) sum;
+}
+
+static uint64_t sum_scalar(const uint8_t *buf, size_t len) {
+    uint64_t sum0 = 0;
+    uint64_t sum1 = 0;
+    uint32_t words[4];
+    while (len >= 16) {
+        memcpy(words, buf, 16);
+        sum0 += (uint64_t) words[0] + words[1];
+        sum1 += (uint64_t) words[2] + words[3];
+        buf += 16;
+        len -= 16;
+    }
+    return sum_tail(buf, len, sum0 + sum1);
+}
+
+#ifdef CHECKSUM_NEON
+static uint64_t sum_neon(const uint8_t *buf, size_t len) {
+    uint64x2_t acc0 = vdupq_n_u64(0);
+    uint64x2_t acc1 = vdupq_n_u64(0);
+    while (len >= 32) {
+        acc0 = vpadalq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(buf)));
+        acc1 = vpadalq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(buf + 16)));
+        buf += 32;
+        len -= 32;
+    }
+    uint64x2_t acc = vaddq_u64(acc0, acc1);
+    uint64_t sum = vgetq_lane_u64(acc, 0);
+    uint64_t high = vgetq_lane_u64(acc, 1);
+    // Each lane stays far below 2^63, so the two lanes can be added
+    return sum_tail(buf, len, sum + high);
+}
+#endif
+
+#ifdef CHECKSUM_X86
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(const uint8_t *buf, size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero;
+    __m128i acc1 = zero;
+    while (len >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) buf);
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v, zero));
+        buf += 16;
+        len -= 16;
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, _mm_add_epi64(acc0, acc1));
+    return sum_tail(buf, len, lanes[0] + lanes[1]);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const uint8_t *buf, size_t len) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero;
+    __m256i acc1 = zero;
+    while (len >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) buf);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+        buf += 32;
+        len -= 32;
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+    return sum_tail(buf, len, lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+}
+#endif
+
+static uint64_t (*sum_kernel)(const uint8_t *buf, size_t len) = sum_scalar;
+
+uint16_t calc_checksum(uint16_t start, const uint8_t *buffer, size_t length) {
+    return fold(start + sum_kernel(buffer, length));
+}
+
+// Checksums as they appear on the wire, of the IPv4 header of RFC 1071 examples
+// and of the pattern below at odd offsets and lengths, computed independently
+static const uint8_t known_header[20] = {
+        0x45, 0x00, 0x00, 0x73, 0x00, 0x00, 0x40, 0x00, 0x40, 0x11,
+        0x00, 0x00, 0xc0, 0xa8, 0x00, 0x01, 0xc0, 0xa8, 0x00, 0xc7
+};
+
+static const struct {
+    size_t offset;
+    size_t length;
+    uint16_t checksum;
+} known_pattern[] = {
+        {0, 1500, 0x033e},
+        {1, 1500, 0x3d6f},
+        {3, 77, 0x9ea0}
+};
+
+static int is_known(uint64_t (*kernel)(const uint8_t *, size_t),
+                    const uint8_t *buffer, size_t length, uint16_t checksum) {
+    uint16_t sum = (uint16_t) ~fold(kernel(buffer, length));
+    const uint8_t *wire = (const uint8_t *) &sum;
+    return (wire[0] == (checksum >> 8) && wire[1] == (checksum & 0xFF));
+}
+
+static int kernel_known(uint64_t (*kernel)(const uint8_t *, size_t)) {
+    if (!is_known(kernel, known_header, sizeof(known_header), 0xb861))
+        return 0;
+
+    uint8_t buffer[1504];
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = (uint8_t) (i * 131 + 7);
+    for (size_t i = 0; i < sizeof(known_pattern) / sizeof(known_pattern[0]); i++)
+        if (!is_known(kernel, buffer + known_pattern[i].offset, known_pattern[i].length,
+                      known_pattern[i].checksum))
+            return 0;
+    return 1;
+}
+
+static int kernel_agrees(uint64_t (*kernel)(const uint8_t *, size_t)) {
+    // Every length up to a few vectors, at every alignment
+    uint8_t buffer[256 + 16];
+    for (size_t i = 0; i < sizeof(buffer); i++)
+        buffer[i] = (uint8_t) (i * 131 + 7);
+    for (size_t off = 0; off < 16; off++)
+        for (size_t len = 0; len <= 256; len++)
+            if (fold(kernel(buffer + off, len)) != fold(sum_scalar(buffer + off, len)))
+                return 0;
+
+    memset(buffer, 0xFF, sizeof(buffer));
+    return (fold(kernel(buffer, 256)) == fold(sum_scalar(buffer, 256)));
+}
+
+void checksum_init() {
+    const char *name = "scalar";
+    uint64_t (*kernel)(const uint8_t *, size_t) = NULL;
+
+#ifdef CHECKSUM_NEON
+    kernel = sum_neon;
+    name = "neon";
+#endif
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = sum_avx2;
+        name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernel = sum_sse2;
+        name = "sse2";
+    }
+#endif
+
+    if (!kernel_known(sum_scalar))
+        log_android(ANDROID_LOG_ERROR, "Checksum kernel scalar gives wrong checksums");
+    if (kernel != NULL && (!kernel_known(kernel) || !kernel_agrees(kernel))) {
+        log_android(ANDROID_LOG_ERROR, "Checksum kernel %s disagrees, using scalar", name);
+        kernel = NULL;
+        name = "scalar";
+    }
+    sum_kernel = (kernel == NULL ? sum_scalar : kernel);
+    log_android(ANDROID_LOG_INFO, "Checksum kernel %s", name);
+}
+
+// Incremental updates of a checksum field (RFC 1624, eqn. 3): HC' = ~(~HC + ~m + m')
+
+uint16_t checksum_update16(uint16_t check, uint16_t from, uint16_t to) {
+    uint32_t sum = (uint16_t) ~check;
+    sum += (uint16_t) ~from;
+    sum += to;
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t) ~sum;
+}
+
+uint16_t checksum_update32(uint16_t check, uint32_t from, uint32_t to) {
+    check = checksum_update16(check, (uint16_t) (from >> 16), (uint16_t) (to >> 16));
+    return checksum_update16(check, (uint16_t) from, (uint16_t) to);
+}
+
+uint16_t checksum_update(uint16_t check, const void *from, const void *to, size_t length) {
+    // Words as they are in memory, as the checksum field is
+    const uint8_t *o = (const uint8_t *) from;
+    const uint8_t *n = (const uint8_t *) to;
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        uint16_t ow;
+        uint16_t nw;
+        memcpy(&ow, o + i, 2);
+        memcpy(&nw, n + i, 2);
+        check = checksum_update16(check, ow, nw);
+    }
+    return check;
+}
@@ -0,0 +1,338 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// The little cryptography needed to read QUIC Initial packets: SHA-256 for
+// HKDF and AES-128-GCM. The keys of Initial packets are derived from values
+// sent in the clear, so there are no secrets to protect here and the code
+// is written to be small rather than constant time.
+
+static const uint32_t sha256_k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t count;
+    uint8_t buffer[64];
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct sha256 *c, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16) |
+               ((uint32_t) block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = c->state[0], b = c->state[1], d = c->state[3], e = c->state[4];
+    uint32_t cc = c->state[2], f = c->state[5], g = c->state[6], h = c->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) +
+                      sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = cc;
+        cc = b;
+        b = a;
+        a = t1 + t2;
+    }
+    c->state[0] += a;
+    c->state[1] += b;
+    c->state[2] += cc;
+    c->state[3] += d;
+    c->state[4] += e;
+    c->state[5] += f;
+    c->state[6] += g;
+    c->state[7] += h;
+}
+
+static void sha256_init(struct sha256 *c) {
+    static const uint32_t iv[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(c->state, iv, sizeof(iv));
+    c->count = 0;
+}
+
+static void sha256_update(struct sha256 *c, const uint8_t *data, size_t len) {
+    size_t used = (size_t) (c->count & 63);
+    c->count += len;
+    while (len > 0) {
+        size_t copy = 64 - used;
+        if (copy > len)
+            copy = len;
+        memcpy(c->buffer + used, data, copy);
+        used += copy;
+        data += copy;
+        len -= copy;
+        if (used == 64) {
+            sha256_block(c, c->buffer);
+            used = 0;
+        }
+    }
+}
+
+static void sha256_final(struct sha256 *c, uint8_t *digest) {
+    uint64_t bits = c->count * 8;
+    uint8_t pad = 0x80;
+    sha256_update(c, &pad, 1);
+    pad = 0;
+    while ((c->count & 63) != 56)
+        sha256_update(c, &pad, 1);
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++)
+        length[i] = (uint8_t) (bits >> (56 - i * 8));
+    sha256_update(c, length, 8);
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t) (c->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t) (c->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t) (c->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t) c->state[i];
+    }
+}
+
+static void hmac_sha256(const uint8_t *key, size_t keylen,
+                        const uint8_t *data1, size_t len1,
+                        const uint8_t *data2, size_t len2,
+                        uint8_t *mac) {
+    uint8_t k[64];
+    memset(k, 0, sizeof(k));
+    struct sha256 c;
+    if (keylen > 64) {
+        sha256_init(&c);
+        sha256_update(&c, key, keylen);
+        sha256_final(&c, k);
+    } else
+        memcpy(k, key, keylen);
+
+    uint8_t pad[64];
+    uint8_t inner[SHA256_LENGTH];
+    for (int i = 0; i < 64; i++)
+        pad[i] = (uint8_t) (k[i] ^ 0x36);
+    sha256_init(&c);
+    sha256_update(&c, pad, 64);
+    sha256_update(&c, data1, len1);
+    if (len2 > 0)
+        sha256_update(&c, data2, len2);
+    sha256_final(&c, inner);
+
+    for (int i = 0; i < 64; i++)
+        pad[i] = (uint8_t) (k[i] ^ 0x5c);
+    sha256_init(&c);
+    sha256_update(&c, pad, 64);
+    sha256_update(&c, inner, SHA256_LENGTH);
+    sha256_final(&c, mac);
+}
+
+void hkdf_extract(const uint8_t *salt, size_t saltlen,
+                  const uint8_t *ikm, size_t ikmlen, uint8_t *prk) {
+    hmac_sha256(salt, saltlen, ikm, ikmlen, NULL, 0, prk);
+}
+
+void hkdf_expand_label(const uint8_t *secret, const char *label, uint8_t *out, size_t outlen) {
+    // HkdfLabel of TLS 1.3 with an empty context, at most one block is needed here
+    uint8_t info[2 + 1 + 6 + 32 + 1 + 1];
+    size_t labellen = strlen(label);
+    if (labellen > 32 || outlen > SHA256_LENGTH)
+        return;
+    size_t i = 0;
+    info[i++] = (uint8_t) (outlen >> 8);
+    info[i++] = (uint8_t) outlen;
+    info[i++] = (uint8_t) (6 + labellen);
+    memcpy(info + i, "tls13 ", 6);
+    i += 6;
+    memcpy(info + i, label, labellen);
+    i += labellen;
+    info[i++] = 0;
+    info[i++] = 1; // block counter
+
+    uint8_t block[SHA256_LENGTH];
+    hmac_sha256(secret, SHA256_LENGTH, info, i, NULL, 0, block);
+    memcpy(out, block, outlen);
+}
+
+static const uint8_t aes_sbox[256] = {
+        0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+        0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+        0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+        0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+        0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+        0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+        0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+        0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+        0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+        0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+        0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+        0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+        0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+        0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+        0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+        0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+#define XTIME(x) ((uint8_t) (((x) << 1) ^ (((x) & 0x80) ? 0x1b : 0)))
+
+void aes128_init(struct aes128 *aes, const uint8_t *key) {
+    static const uint8_t rcon[10] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36};
+    uint8_t *rk = aes->rk;
+    memcpy(rk, key, 16);
+    for (int i = 16; i < AES128_ROUND_KEYS; i += 4) {
+        uint8_t t[4];
+        memcpy(t, rk + i - 4, 4);
+        if (i % 16 == 0) {
+            uint8_t first = t[0];
+            t[0] = (uint8_t) (aes_sbox[t[1]] ^ rcon[i / 16 - 1]);
+            t[1] = aes_sbox[t[2]];
+            t[2] = aes_sbox[t[3]];
+            t[3] = aes_sbox[first];
+        }
+        for (int j = 0; j < 4; j++)
+            rk[i + j] = (uint8_t) (rk[i - 16 + j] ^ t[j]);
+    }
+}
+
+void aes128_encrypt(const struct aes128 *aes, const uint8_t *in, uint8_t *out) {
+    uint8_t s[16];
+    for (int i = 0; i < 16; i++)
+        s[i] = (uint8_t) (in[i] ^ aes->rk[i]);
+
+    for (int round = 1; round <= 10; round++) {
+        // SubBytes and ShiftRows, the state is column major
+        uint8_t t[16];
+        for (int c = 0; c < 4; c++)
+            for (int r = 0; r < 4; r++)
+                t[c * 4 + r] = aes_sbox[s[((c + r) & 3) * 4 + r]];
+
+        // MixColumns, but not in the last round
+        if (round < 10)
+            for (int c = 0; c < 4; c++) {
+                uint8_t *col = t + c * 4;
+                uint8_t all = (uint8_t) (col[0] ^ col[1] ^ col[2] ^ col[3]);
+                uint8_t first = col[0];
+                col[0] ^= all ^ XTIME(col[0] ^ col[1]);
+                col[1] ^= all ^ XTIME(col[1] ^ col[2]);
+                col[2] ^= all ^ XTIME(col[2] ^ col[3]);
+                col[3] ^= all ^ XTIME(col[3] ^ first);
+            }
+
+        for (int i = 0; i < 16; i++)
+            s[i] = (uint8_t) (t[i] ^ aes->rk[round * 16 + i]);
+    }
+    memcpy(out, s, 16);
+}
+
+static void gf128_mul(uint8_t *x, const uint8_t *h) {
+    // Multiplication in GF(2^128) of GCM, bit by bit
+    uint8_t z[16];
+    uint8_t v[16];
+    memset(z, 0, 16);
+    memcpy(v, h, 16);
+    for (int i = 0; i < 128; i++) {
+        if (x[i / 8] & (0x80 >> (i % 8)))
+            for (int j = 0; j < 16; j++)
+                z[j] ^= v[j];
+        uint8_t lsb = (uint8_t) (v[15] & 1);
+        for (int j = 15; j > 0; j--)
+            v[j] = (uint8_t) ((v[j] >> 1) | (v[j - 1] << 7));
+        v[0] >>= 1;
+        if (lsb)
+            v[0] ^= 0xe1;
+    }
+    memcpy(x, z, 16);
+}
+
+static void ghash_update(uint8_t *y, const uint8_t *h, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t n = (len < 16 ? len : 16);
+        for (size_t i = 0; i < n; i++)
+            y[i] ^= data[i];
+        gf128_mul(y, h);
+        data += n;
+        len -= n;
+    }
+}
+
+int aes128_gcm_open(const uint8_t *key, const uint8_t *iv,
+                    const uint8_t *aad, size_t aadlen,
+                    const uint8_t *in, size_t len, const uint8_t *tag,
+                    uint8_t *out) {
+    struct aes128 aes;
+    aes128_init(&aes, key);
+
+    uint8_t h[16];
+    memset(h, 0, 16);
+    aes128_encrypt(&aes, h, h);
+
+    // The tag covers the additional data and the cipher text as received
+    uint8_t y[16];
+    memset(y, 0, 16);
+    ghash_update(y, h, aad, aadlen);
+    ghash_update(y, h, in, len);
+    uint8_t lengths[16];
+    uint64_t abits = (uint64_t) aadlen * 8;
+    uint64_t cbits = (uint64_t) len * 8;
+    for (int i = 0; i < 8; i++) {
+        lengths[i] = (uint8_t) (abits >> (56 - i * 8));
+        lengths[8 + i] = (uint8_t) (cbits >> (56 - i * 8));
+    }
+    ghash_update(y, h, lengths, 16);
+
+    uint8_t counter[16];
+    uint8_t stream[16];
+    memcpy(counter, iv, 12);
+    counter[12] = 0;
+    counter[13] = 0;
+    counter[14] = 0;
+    counter[15] = 1;
+    aes128_encrypt(&aes, counter, stream);
+    uint8_t diff = 0;
+    for (int i = 0; i < 16; i++)
+        diff |= (uint8_t) (y[i] ^ stream[i] ^ tag[i]);
+    if (diff)
+        return -1;
+
+    for (size_t off = 0; off < len; off += 16) {
+        for (int i = 15; i >= 12; i--)
+            if (++counter[i] != 0)
+                break;
+        aes128_encrypt(&aes, counter, stream);
+        size_t n = (len - off < 16 ? len - off : 16);
+        for (size_t i = 0; i < n; i++)
+            out[off + i] = (uint8_t) (in[off + i] ^ stream[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// Fixed size objects carved from contiguous chunks. Free objects are
+// chained through their first word; a reset returns every object at
+// once without visiting the heap.
+
+struct slab_chunk {
+    struct slab_chunk *next;
+    uint64_t reserved; // keeps objects 16 byte aligned
+};
+
+struct slab_free {
+    struct slab_free *next;
+};
+
+static void slab_carve(struct slab *slab, struct slab_chunk *chunk) {
+    uint8_t *base = (uint8_t *) (chunk + 1);
+    for (size_t i = slab->per_chunk; i > 0; i--) {
+        struct slab_free *f = (struct slab_free *) (base + (i - 1) * slab->size);
+        f->next = slab->free;
+        slab->free = f;
+    }
+}
+
+void slab_init(struct slab *slab, size_t size, size_t per_chunk, const char *tag) {
+    memset(slab, 0, sizeof(struct slab));
+    slab->tag = tag;
+    slab->size = (size + 15) & ~((size_t) 15);
+    slab->per_chunk = per_chunk;
+}
+
+void *slab_alloc(struct slab *slab) {
+    if (slab->free == NULL) {
+        struct slab_chunk *chunk = ng_malloc(sizeof(struct slab_chunk) + slab->size * slab->per_chunk, slab->tag);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = slab->chunks;
+        slab->chunks = chunk;
+        slab->chunk_count++;
+        slab_carve(slab, chunk);
+    }
+
+    struct slab_free *f = slab->free;
+    slab->free = f->next;
+    slab->used++;
+    if (slab->used > slab->peak)
+        slab->peak = slab->used;
+    return f;
+}
+
+void slab_free(struct slab *slab, void *obj) {
+    if (obj == NULL)
+        return;
+    struct slab_free *f = (struct slab_free *) obj;
+    f->next = slab->free;
+    slab->free = f;
+    slab->used--;
+}
+
+void slab_reset(struct slab *slab) {
+    // Keep the first chunk for the next run, release the rest
+    struct slab_chunk *keep = slab->chunks;
+    if (keep != NULL) {
+        struct slab_chunk *chunk = keep->next;
+        while (chunk != NULL) {
+            struct slab_chunk *n = chunk->next;
+            ng_free(chunk, __FILE__, __LINE__);
+            chunk = n;
+        }
+        keep->next = NULL;
+    }
+
+    slab->chunks = keep;
+    slab->chunk_count = (keep == NULL ? 0 : 1);
+    slab->free = NULL;
+    slab->used = 0;
+    if (keep != NULL)
+        slab_carve(slab, keep);
+}
+
+void slab_destroy(struct slab *slab) {
+    struct slab_chunk *chunk = slab->chunks;
+    while (chunk != NULL) {
+        struct slab_chunk *n = chunk->next;
+        ng_free(chunk, __FILE__, __LINE__);
+        chunk = n;
+    }
+    slab->chunks = NULL;
+    slab->chunk_count = 0;
+    slab->free = NULL;
+    slab->used = 0;
+}
+
+void slab_log_stats(const struct slab *slab) {
+    size_t capacity = slab->chunk_count * slab->per_chunk;
+    log_android(ANDROID_LOG_INFO, "Slab %s used %zu/%zu peak %zu chunks %zu of %zu bytes",
+                slab->tag, slab->used, capacity, slab->peak, slab->chunk_count,
+                sizeof(struct slab_chunk) + slab->size * slab->per_chunk);
+}
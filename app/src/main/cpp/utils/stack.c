@@ -0,0 +1,57 @@
+/*
+    This file is part of NetGuard.
+
+    NetGuard is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    NetGuard is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with NetGuard.  If not, see <http://www.gnu.org/licenses/>.
+
+    Copyright 2015-2024 by Marcel Bokhorst (M66B)
+*/
+
+#include "../athena.h"
+
+// A stack that many threads push onto and one thread empties. Pushers swap
+// the top with a compare and swap; the taker swaps out the whole stack at
+// once, so no node is popped while a pusher still looks at it, and gets the
+// nodes back oldest first. Nodes are linked through a pointer of their own,
+// found at the offset the caller gives.
+
+static void *get_next(void *node, size_t link) {
+    void *next;
+    memcpy(&next, (uint8_t *) node + link, sizeof(void *));
+    return next;
+}
+
+static void set_next(void *node, size_t link, void *next) {
+    memcpy((uint8_t *) node + link, &next, sizeof(void *));
+}
+
+int lf_stack_push(struct lf_stack *stack, void *node, size_t link) {
+    void *top = atomic_load_explicit(&stack->top, memory_order_relaxed);
+    do {
+        set_next(node, link, top);
+    } while (!atomic_compare_exchange_weak_explicit(&stack->top, &top, node,
+                                                    memory_order_release, memory_order_relaxed));
+    return (top == NULL);
+}
+
+void *lf_stack_take(struct lf_stack *stack, size_t link) {
+    void *node = atomic_exchange_explicit(&stack->top, NULL, memory_order_acquire);
+    void *ordered = NULL;
+    while (node != NULL) {
+        void *next = get_next(node, link);
+        set_next(node, link, ordered);
+        ordered = node;
+        node = next;
+    }
+    return ordered;
+}
@@ -76,23 +76,101 @@ void ng_free(void *__ptr, const char *file, int line) {
     free(__ptr);
 }
 
-uint16_t calc_checksum(uint16_t start, const uint8_t *buffer, size_t length) {
-    register uint32_t sum = start;
-    register uint16_t *buf = (uint16_t *) buffer;
-    register size_t len = length;
-
-    while (len > 1) {
-        sum += *buf++;
-        len -= 2;
+// Data path buffers are recycled through per-thread free lists, one per
+// size class, so steady state forwarding does not touch the heap.
+// Every buffer is preceded by a header naming its class.
+
+struct pool_header {
+    uint32_t cls;
+    uint32_t magic;
+    uint64_t reserved; // keeps the payload 16 byte aligned
+};
+
+struct pool_free {
+    struct pool_free *next;
+};
+
+#define POOL_MAGIC 0x4E47504C
+#define POOL_UNPOOLED POOL_CLASSES // the class of larger buffers, from and back to the heap
+
+static const size_t pool_size[POOL_CLASSES] = {
+        64, // header only packets
+        512, // small datagrams
+        2048, // small packets
+        16384, // MTU buffers
+        65536 // maximum datagrams
+};
+
+static const int pool_limit[POOL_CLASSES] = {1024, 1024, 256, 64, 16};
+
+static __thread struct pool_free *pool_list[POOL_CLASSES];
+static __thread int pool_count[POOL_CLASSES];
+static __thread struct pool_stats pool_stats;
+
+void *ng_pool_alloc(size_t size, const char *tag) {
+    uint32_t cls = 0;
+    while (cls < POOL_CLASSES && pool_size[cls] < size)
+        cls++;
+
+    struct pool_header *h;
+    if (cls != POOL_UNPOOLED && pool_list[cls] != NULL) {
+        h = (struct pool_header *) pool_list[cls];
+        pool_list[cls] = pool_list[cls]->next;
+        pool_count[cls]--;
+        pool_stats.hits++;
+    } else {
+        size_t bytes = (cls == POOL_UNPOOLED ? size : pool_size[cls]);
+        h = ng_malloc(sizeof(struct pool_header) + bytes, tag);
+        if (h == NULL)
+            return NULL;
+        pool_stats.misses++;
     }
 
-    if (len > 0)
-        sum += *((uint8_t *) buf);
+    h->cls = cls;
+    h->magic = POOL_MAGIC;
+    return h + 1;
+}
+
+void ng_pool_free(void *ptr, const char *file, int line) {
+    if (ptr == NULL)
+        return;
 
-    while (sum >> 16)
-        sum = (sum & 0xFFFF) + (sum >> 16);
+    struct pool_header *h = ((struct pool_header *) ptr) - 1;
+    if (h->magic != POOL_MAGIC) {
+        log_android(ANDROID_LOG_ERROR, "Pool free of foreign buffer at %s:%d", file, line);
+        return;
+    }
+    h->magic = 0;
+
+    uint32_t cls = h->cls;
+    if (cls < POOL_UNPOOLED && pool_count[cls] < pool_limit[cls]) {
+        struct pool_free *f = (struct pool_free *) h;
+        f->next = pool_list[cls];
+        pool_list[cls] = f;
+        pool_count[cls]++;
+        pool_stats.recycled++;
+    } else {
+        pool_stats.released++;
+        ng_free(h, file, line);
+    }
+}
+
+void ng_pool_drain() {
+    for (int cls = 0; cls < POOL_CLASSES; cls++) {
+        while (pool_list[cls] != NULL) {
+            struct pool_free *f = pool_list[cls];
+            pool_list[cls] = f->next;
+            ng_free(f, __FILE__, __LINE__);
+        }
+        pool_count[cls] = 0;
+    }
+}
 
-    return (uint16_t) sum;
+void ng_pool_get_stats(struct pool_stats *stats) {
+    *stats = pool_stats;
+    stats->cached = 0;
+    for (int cls = 0; cls < POOL_CLASSES; cls++)
+        stats->cached += pool_count[cls];
 }
 
 int compare_u32(uint32_t s1, uint32_t s2) {
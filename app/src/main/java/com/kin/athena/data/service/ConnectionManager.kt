@@ -29,6 +29,7 @@ import com.kin.athena.service.vpn.network.util.NetworkConstants
 import com.kin.athena.service.vpn.service.VpnConnectionServer
 import dagger.hilt.android.AndroidEntryPoint
 import dagger.hilt.android.qualifiers.ApplicationContext
+import java.util.concurrent.CopyOnWriteArrayList
 import javax.inject.Inject
 import javax.inject.Singleton
 
@@ -56,13 +57,19 @@ class ConnectionStateManager @Inject constructor(
     var networkManager: NetworkManager
 ) {
     private var currentConnectionType: NetworkManager.ConnectionType = networkManager.getCurrentConnectionType()
+    private val listeners = CopyOnWriteArrayList<(NetworkManager.ConnectionType) -> Unit>()
 
     fun getCurrentConnectionType(): NetworkManager.ConnectionType {
         return currentConnectionType
     }
 
+    fun addListener(listener: (NetworkManager.ConnectionType) -> Unit) {
+        listeners.add(listener)
+    }
+
     fun updateConnectionType(connectionType: NetworkManager.ConnectionType) {
         currentConnectionType = connectionType
+        listeners.forEach { it(connectionType) }
         try {
             val clearSessionsServiceIntent = Intent(context, VpnConnectionServer::class.java).apply {
                 action = NetworkConstants.ACTION_CLEAR_SESSIONS
@@ -21,6 +21,7 @@ import android.content.BroadcastReceiver
 import android.content.Context
 import android.content.Intent
 import dagger.hilt.android.AndroidEntryPoint
+import java.util.concurrent.CopyOnWriteArrayList
 import javax.inject.Inject
 import javax.inject.Singleton
 
@@ -46,9 +47,15 @@ class ScreenStateReceiver : BroadcastReceiver() {
 class ScreenStateManager
  {
     var currentScreenStatus: ScreenManager = ScreenManager.SCREEN_ON
+    private val listeners = CopyOnWriteArrayList<(ScreenManager) -> Unit>()
 
     fun updateScreenStatus(screenStatus: ScreenManager) {
         currentScreenStatus = screenStatus
+        listeners.forEach { it(screenStatus) }
+    }
+
+    fun addListener(listener: (ScreenManager) -> Unit) {
+        listeners.add(listener)
     }
 }
 
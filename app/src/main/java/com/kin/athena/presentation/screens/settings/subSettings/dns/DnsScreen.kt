@@ -89,7 +89,7 @@ fun DnsScreen(
     blockListViewModel: BlockListViewModel = hiltViewModel()
 ) {
     val doneNames = RuleDatabaseUpdateWorker.doneNames.collectAsState(initial = emptyList())
-    val blockList = blockListViewModel.ruleDatabase.blockedHosts.collectAsState()
+    val blockedCount = blockListViewModel.ruleDatabase.blockedCount.collectAsState()
     val context = LocalContext.current
     val showMagiskDialog by blockListViewModel.showMagiskDialog.collectAsState()
     val isDomainsLoading by blockListViewModel.isLoading.collectAsState()
@@ -589,7 +589,7 @@ fun DnsScreen(
             SettingsBox(
                 title = stringResource(id = R.string.dns_blocked_domains),
                 description = run {
-                    val currentCount = blockList.value.value.count()
+                    val currentCount = blockedCount.value
                     when {
                         currentCount > 0 -> {
                             val formatter = java.text.DecimalFormat("#,###")
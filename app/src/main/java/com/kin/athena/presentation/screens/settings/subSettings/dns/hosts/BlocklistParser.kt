@@ -298,7 +298,7 @@ object BlocklistParser {
      * Convert wildcard pattern to regex
      * Example: *.example.com -> ^.*\.example\.com$
      */
-    private fun wildcardToRegex(pattern: String): Regex {
+    fun wildcardToRegex(pattern: String): Regex {
         val regexPattern = pattern
             .replace(".", "\\.")
             .replace("*", ".*")
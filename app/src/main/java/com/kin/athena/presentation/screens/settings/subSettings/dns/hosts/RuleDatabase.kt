@@ -12,18 +12,19 @@
 
 package com.kin.athena.presentation.screens.settings.subSettings.dns.hosts
 
-import androidx.collection.MutableIntSet
-import androidx.collection.intSetOf
+import com.kin.athena.App.Companion.applicationContext
 import com.kin.athena.core.logging.Logger
 import com.kin.athena.core.utils.Shell
 import com.kin.athena.presentation.config
-import kotlinx.atomicfu.atomic
+import com.kin.athena.service.firewall.model.NativeDomainList
 import kotlinx.coroutines.flow.MutableStateFlow
 import java.io.BufferedReader
+import java.io.BufferedWriter
 import java.io.File
 import java.io.FileNotFoundException
 import java.io.IOException
 import java.io.Reader
+import java.util.concurrent.CopyOnWriteArrayList
 import javax.inject.Singleton
 
 @Singleton
@@ -33,6 +34,9 @@ class RuleDatabase {
         private const val IPV4_LOOPBACK = "127.0.0.1"
         private const val IPV6_LOOPBACK = "::1"
         private const val NO_ROUTE = "0.0.0.0"
+        private const val NATIVE_DOMAINS = "native_domains"
+        private const val COMPILED_DOMAINS = "domains.bin"
+        private const val COMPILED_PATTERNS = "domains.patterns"
 
         @Deprecated("Use BlocklistParser.parseLine() instead")
         fun parseLine(line: String): String? {
@@ -86,22 +90,42 @@ class RuleDatabase {
         }
     }
 
-    var blockedHosts = MutableStateFlow(atomic(intSetOf()))
+    var blockedCount = MutableStateFlow(0)
+
+    // Plain names, *.name wildcards and the whitelist are in the compiled list,
+    // these are the rules only a regex can match
     private val wildcardRules = mutableListOf<BlocklistRule.WildcardDomain>()
     private val regexRules = mutableListOf<BlocklistRule.RegexPattern>()
-    private val whitelistedHosts = mutableSetOf<String>()
+
+    @Volatile
+    private var domains: NativeDomainList? = null
+
+    /** The compiled list the native engine maps, null before the first load. */
+    val nativeDomains: File?
+        get() = if (domains != null) File(applicationContext.filesDir, COMPILED_DOMAINS) else null
+    private val nativeDomainsListeners = CopyOnWriteArrayList<() -> Unit>()
+    private var nativeWriter: BufferedWriter? = null
+    private var patternWriter: BufferedWriter? = null
+    private var nativeComplete = true
+
+    fun addNativeDomainsListener(listener: () -> Unit) {
+        nativeDomainsListeners.add(listener)
+    }
 
     fun isBlocked(host: String): Boolean {
         val lowerHost = host.lowercase()
 
-        // Check if whitelisted first
-        if (whitelistedHosts.contains(lowerHost)) {
-            return false
+        // Whitelisted and blocked names first; a list closed by a reload since it was
+        // read answers UNLISTED, the one that replaced it decides then
+        var list = domains
+        var listed = list?.lookup(lowerHost)
+        while (listed == NativeDomainList.UNLISTED && list !== domains) {
+            list = domains
+            listed = list?.lookup(lowerHost)
         }
-
-        // Check exact match in blocked hosts
-        if (blockedHosts.value.value.contains(lowerHost.hashCode())) {
-            return true
+        when (listed) {
+            NativeDomainList.ALLOWED -> return false
+            NativeDomainList.BLOCKED -> return true
         }
 
         // Check wildcard rules
@@ -131,48 +155,164 @@ class RuleDatabase {
             }
             .sortedBy { it.state.ordinal }
 
-        val newHosts = MutableIntSet(sortedHostItems.size + config.hosts.exceptions.size)
         val allHosts = mutableListOf<String>()
 
         // Clear previous wildcard and regex rules
         wildcardRules.clear()
         regexRules.clear()
-        whitelistedHosts.clear()
 
-        val totalItems = sortedHostItems.size
-        for ((index, item) in sortedHostItems.withIndex()) {
-            if (Thread.interrupted()) {
-                throw InterruptedException("Interrupted")
+        // The lists did not change since they were compiled: map the result instead of parsing
+        val source = if (rootMode) null else sourceFingerprint(sortedHostItems)
+        if (source != null && openCompiled(source)) {
+            progressCallback?.invoke(95)
+            return null
+        }
+
+        val nativeFile = if (rootMode) null else File.createTempFile(NATIVE_DOMAINS, ".tmp", applicationContext.filesDir)
+        val patternFile = if (rootMode) null else File.createTempFile(COMPILED_PATTERNS, ".tmp", applicationContext.filesDir)
+        nativeWriter = nativeFile?.bufferedWriter(bufferSize = 65536)
+        patternWriter = patternFile?.bufferedWriter()
+        nativeComplete = true
+        try {
+            val totalItems = sortedHostItems.size
+            for ((index, item) in sortedHostItems.withIndex()) {
+                if (Thread.interrupted()) {
+                    throw InterruptedException("Interrupted")
+                }
+                val hostsFromItem = loadItem(item, rootMode)
+                if (rootMode && hostsFromItem != null) {
+                    allHosts.addAll(hostsFromItem)
+                }
+
+                // Report progress: 75-95% for parsing
+                progressCallback?.invoke(75 + ((index + 1) * 20) / totalItems.coerceAtLeast(1))
+            }
+
+            if (rootMode) {
+                return allHosts
             }
-            val hostsFromItem = loadItem(newHosts, item, rootMode)
-            if (rootMode && hostsFromItem != null) {
-                allHosts.addAll(hostsFromItem)
+
+            for (exception in config.hosts.exceptions) {
+                if (Thread.interrupted()) {
+                    throw InterruptedException("Interrupted")
+                }
+                addHostException(exception)
             }
+        } catch (e: Exception) {
+            nativeFile?.delete()
+            patternFile?.delete()
+            throw e
+        } finally {
+            nativeWriter?.close()
+            nativeWriter = null
+            patternWriter?.close()
+            patternWriter = null
+        }
 
-            // Report progress: 75-95% for parsing
-            progressCallback?.invoke(75 + ((index + 1) * 20) / totalItems.coerceAtLeast(1))
+        val compiled = File(applicationContext.filesDir, COMPILED_DOMAINS)
+        val patterns = File(applicationContext.filesDir, COMPILED_PATTERNS)
+        // Patterns first: a list compiled without them would be taken as current
+        val isCompiled = patternFile!!.renameTo(patterns) &&
+            NativeDomainList.compile(nativeFile!!, compiled, nativeComplete, source ?: 0L)
+        nativeFile!!.delete()
+        patternFile.delete()
+        if (!isCompiled) {
+            Logger.error("Failed to compile domain rules")
+        } else {
+            // Without a fingerprint the list is recompiled at every load
+            openCompiled(source)
         }
+        Runtime.getRuntime().gc()
+        return null
+    }
 
-        if (rootMode) {
-            return allHosts
+    private fun openCompiled(source: Long?): Boolean {
+        val list = NativeDomainList.open(File(applicationContext.filesDir, COMPILED_DOMAINS)) ?: return false
+        if (source != null && list.source != source) {
+            list.close()
+            return false
         }
 
-        for (exception in config.hosts.exceptions) {
-            if (Thread.interrupted()) {
-                throw InterruptedException("Interrupted")
+        wildcardRules.clear()
+        regexRules.clear()
+        try {
+            File(applicationContext.filesDir, COMPILED_PATTERNS).forEachLine { line ->
+                val pattern = line.substring(2)
+                when (line[0]) {
+                    'X' -> wildcardRules.add(BlocklistRule.WildcardDomain(pattern, BlocklistParser.wildcardToRegex(pattern)))
+                    'R' -> regexRules.add(BlocklistRule.RegexPattern(pattern, Regex(pattern, RegexOption.IGNORE_CASE)))
+                }
             }
-            addHostException(newHosts, exception)
+        } catch (e: Exception) {
+            Logger.error("Failed to read domain patterns", e)
+            wildcardRules.clear()
+            regexRules.clear()
+            list.close()
+            return false
         }
 
-        blockedHosts.value = atomic(newHosts)
-        val totalRules = newHosts.size + wildcardRules.size + regexRules.size
-        Logger.info("Domain rules loaded: $totalRules total (${newHosts.size} domains, ${wildcardRules.size} wildcards, ${regexRules.size} regex, ${whitelistedHosts.size} whitelisted)")
-        Runtime.getRuntime().gc()
-        return null
+        // Published before the old list closes, lookups never see no list in between
+        val previous = domains
+        domains = list
+        previous?.close()
+        blockedCount.value = list.count
+        Logger.info("Domain rules loaded: ${list.count + wildcardRules.size + regexRules.size} total (${list.count} domains, ${wildcardRules.size} wildcards, ${regexRules.size} regex)")
+        nativeDomainsListeners.forEach { it() }
+        return true
+    }
+
+    /** Identifies the lists and their downloaded files; null when a list cannot be checked for changes. */
+    private fun sourceFingerprint(items: List<HostFile>): Long? {
+        var hash = -3750763034362895579L // FNV-1a offset basis
+        fun mix(value: Long) {
+            hash = (hash xor value) * 1099511628211L
+        }
+        fun mixString(value: String) {
+            value.forEach { mix(it.code.toLong()) }
+            mix(0L)
+        }
+
+        for (item in items) {
+            if (item.data.startsWith("content://")) {
+                return null
+            }
+            mix(item.state.ordinal.toLong())
+            mixString(item.data)
+            FileHelper.getItemFile(item)?.let { file ->
+                mix(file.length())
+                mix(file.lastModified())
+            }
+        }
+        for (exception in config.hosts.exceptions) {
+            mix(exception.state.ordinal.toLong())
+            mixString(exception.data)
+        }
+        return hash
+    }
+
+    // One line per rule, see filter/domains.c
+    private fun writeNative(kind: Char, host: String) {
+        nativeWriter?.apply {
+            write(kind.code)
+            write(' '.code)
+            write(host)
+            write('\n'.code)
+        }
+    }
+
+    // Rules left to isBlocked, restored from here when the compiled list is reused
+    private fun writePattern(kind: Char, pattern: String) {
+        nativeComplete = false
+        patternWriter?.apply {
+            write(kind.code)
+            write(' '.code)
+            write(pattern)
+            write('\n'.code)
+        }
     }
 
     @Throws(InterruptedException::class)
-    private fun loadItem(set: MutableIntSet, item: HostFile, rootMode: Boolean): List<String>? {
+    private fun loadItem(item: HostFile, rootMode: Boolean): List<String>? {
         if (item.state == HostState.IGNORE) {
             return null
         }
@@ -187,13 +327,13 @@ class RuleDatabase {
         val hosts = mutableListOf<String>()
 
         if (reader == null) {
-            val host = addHost(set, item, item.data, rootMode)
+            val host = addHost(item, item.data, rootMode)
             if (rootMode && host != null) {
                 hosts.add(host)
                 return hosts
             }
         } else {
-            val readerHosts = loadReader(set, item, reader, rootMode)
+            val readerHosts = loadReader(item, reader, rootMode)
             if (rootMode && readerHosts != null) {
                 hosts.addAll(readerHosts)
                 return hosts
@@ -202,17 +342,17 @@ class RuleDatabase {
         return if (rootMode) hosts else null
     }
 
-    private fun addHost(set: MutableIntSet, item: Host, host: String, rootMode: Boolean): String? {
+    private fun addHost(item: Host, host: String, rootMode: Boolean): String? {
         when (item.state) {
             HostState.ALLOW -> {
-                set.remove(host.hashCode())
+                writeNative('a', host)
                 return if (rootMode) host else null
             }
             HostState.DENY -> {
                 if (rootMode) {
                     return host
                 } else {
-                    set.add(host.hashCode())
+                    writeNative('B', host)
                     return null
                 }
             }
@@ -220,16 +360,16 @@ class RuleDatabase {
         }
     }
 
-    private fun addHostException(set: MutableIntSet, exception: HostException) {
+    private fun addHostException(exception: HostException) {
         when (exception.state) {
-            HostState.ALLOW -> set.remove(exception.data.hashCode())
-            HostState.DENY -> set.add(exception.data.hashCode())
+            HostState.ALLOW -> writeNative('a', exception.data)
+            HostState.DENY -> writeNative('B', exception.data)
             else -> return
         }
     }
 
     @Throws(InterruptedException::class)
-    private fun loadReader(set: MutableIntSet, item: Host, reader: Reader, rootMode: Boolean): List<String>? {
+    private fun loadReader(item: Host, reader: Reader, rootMode: Boolean): List<String>? {
         val hosts = if (rootMode) ArrayList<String>(10000) else null
         var count = 0
         var wildcardCount = 0
@@ -253,7 +393,7 @@ class RuleDatabase {
                         when (rule) {
                             is BlocklistRule.PlainDomain -> {
                                 count++
-                                val result = addHost(set, item, rule.domain, rootMode)
+                                val result = addHost(item, rule.domain, rootMode)
                                 if (rootMode && result != null) {
                                     hosts!!.add(result)
                                 }
@@ -261,7 +401,13 @@ class RuleDatabase {
                             is BlocklistRule.WildcardDomain -> {
                                 if (!rootMode) {
                                     if (isDeny) {
-                                        wildcardRules.add(rule)
+                                        // Only *.name is a plain suffix match
+                                        if (rule.pattern.startsWith("*.") && rule.pattern.indexOf('*', 2) < 0) {
+                                            writeNative('D', rule.pattern.substring(2))
+                                        } else {
+                                            wildcardRules.add(rule)
+                                            writePattern('X', rule.pattern)
+                                        }
                                         wildcardCount++
                                     }
                                 } else {
@@ -272,6 +418,7 @@ class RuleDatabase {
                                 if (!rootMode) {
                                     if (isDeny) {
                                         regexRules.add(rule)
+                                        writePattern('R', rule.pattern)
                                         regexCount++
                                     }
                                 } else {
@@ -280,7 +427,7 @@ class RuleDatabase {
                             }
                             is BlocklistRule.WhitelistDomain -> {
                                 if (!rootMode) {
-                                    whitelistedHosts.add(rule.domain)
+                                    writeNative('W', rule.domain)
                                     whitelistCount++
                                 } else {
                                     hosts!!.add("!" + rule.domain)
@@ -27,6 +27,8 @@ import androidx.compose.foundation.lazy.items
 import androidx.compose.foundation.pager.HorizontalPager
 import androidx.compose.foundation.pager.PagerState
 import androidx.compose.foundation.pager.rememberPagerState
+import androidx.compose.foundation.rememberScrollState
+import androidx.compose.foundation.verticalScroll
 import androidx.compose.foundation.shape.RoundedCornerShape
 import androidx.compose.material.icons.Icons
 import androidx.compose.material.icons.rounded.ArrowForwardIos
@@ -70,8 +72,12 @@ import androidx.compose.material3.MaterialTheme
 import androidx.compose.runtime.collectAsState
 import androidx.navigation.NavController
 import com.kin.athena.presentation.navigation.routes.LogRoutes
+import com.kin.athena.presentation.screens.settings.subSettings.logs.components.AppTrafficSection
+import com.kin.athena.presentation.screens.settings.subSettings.logs.components.DnsCacheSection
 import com.kin.athena.presentation.screens.settings.subSettings.logs.components.NetworkStatsSection
 import com.kin.athena.service.firewall.model.FirewallResult
+import com.kin.athena.service.vpn.service.AppTrafficStats
+import com.kin.athena.service.vpn.service.DnsCacheStats
 import java.net.URL
 import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.launch
@@ -118,7 +124,16 @@ fun LogsScreen(
                     context = context,
                     navController = navController
                 )
-                2 -> StatsSection(networkStats = networkStats.value)
+                2 -> {
+                    // Collected here so the engine is only polled while the page is shown
+                    val appTraffic = logsViewModel.appTraffic.collectAsState()
+                    val dnsCacheStats = logsViewModel.dnsCacheStats.collectAsState()
+                    StatsSection(
+                        networkStats = networkStats.value,
+                        appTraffic = appTraffic.value,
+                        dnsCacheStats = dnsCacheStats.value
+                    )
+                }
             }
         }
     }
@@ -347,7 +362,11 @@ fun DnsRequestsSection(
 }
 
 @Composable
-fun StatsSection(networkStats: com.kin.athena.domain.model.NetworkStatsState) {
+fun StatsSection(
+    networkStats: com.kin.athena.domain.model.NetworkStatsState,
+    appTraffic: List<AppTrafficStats>,
+    dnsCacheStats: DnsCacheStats?
+) {
     Column(
         modifier = Modifier
             .fillMaxSize()
@@ -357,18 +376,29 @@ fun StatsSection(networkStats: com.kin.athena.domain.model.NetworkStatsState) {
 
         Spacer(modifier = Modifier.height(16.dp))
 
-        // Additional stats can be added here in the future
-        MaterialPlaceholder(
-            placeholderIcon = {
-                Icon(
-                    imageVector = Icons.Rounded.Analytics,
-                    contentDescription = null,
-                    modifier = Modifier.scale(2f),
-                    tint = MaterialTheme.colorScheme.outline
-                )
-            },
-            placeholderText = stringResource(R.string.logs_stats_info)
-        )
+        dnsCacheStats?.let {
+            DnsCacheSection(dnsCacheStats = it)
+            Spacer(modifier = Modifier.height(16.dp))
+        }
+
+        if (appTraffic.isEmpty()) {
+            MaterialPlaceholder(
+                placeholderIcon = {
+                    Icon(
+                        imageVector = Icons.Rounded.Analytics,
+                        contentDescription = null,
+                        modifier = Modifier.scale(2f),
+                        tint = MaterialTheme.colorScheme.outline
+                    )
+                },
+                placeholderText = stringResource(R.string.logs_stats_info)
+            )
+        } else {
+            Column(modifier = Modifier.verticalScroll(rememberScrollState())) {
+                AppTrafficSection(appTraffic = appTraffic)
+                Spacer(modifier = Modifier.height(16.dp))
+            }
+        }
     }
 }
 
@@ -18,24 +18,38 @@
 package com.kin.athena.presentation.screens.settings.subSettings.logs.components
 
 import androidx.compose.foundation.layout.Column
+import androidx.compose.foundation.layout.padding
 import androidx.compose.foundation.lazy.LazyListScope
 import androidx.compose.foundation.shape.RoundedCornerShape
 import androidx.compose.material.icons.Icons
 import androidx.compose.material.icons.rounded.Analytics
+import androidx.compose.material.icons.rounded.Android
 import androidx.compose.material.icons.rounded.Block
 import androidx.compose.material.icons.rounded.CheckCircle
+import androidx.compose.material.icons.rounded.Dns
+import androidx.compose.material3.MaterialTheme
+import androidx.compose.material3.Text
 import androidx.compose.runtime.Composable
+import androidx.compose.runtime.remember
 import androidx.compose.ui.Modifier
 import androidx.compose.ui.draw.clip
+import androidx.compose.ui.graphics.toArgb
+import androidx.compose.ui.platform.LocalContext
 import androidx.compose.ui.res.stringResource
 import androidx.compose.ui.unit.dp
 import com.kin.athena.R
 import com.kin.athena.core.utils.NumberFormatter
+import com.kin.athena.core.utils.extensions.getApplicationIcon
+import com.kin.athena.core.utils.extensions.getApplicationName
+import com.kin.athena.core.utils.extensions.uidToApplication
 import com.kin.athena.domain.model.NetworkStatsState
 import com.kin.athena.presentation.screens.settings.components.IconType
 import com.kin.athena.presentation.screens.settings.components.SettingType
 import com.kin.athena.presentation.screens.settings.components.SettingsBox
 import com.kin.athena.presentation.screens.settings.components.settingsContainer
+import com.kin.athena.service.vpn.service.AppTrafficStats
+import com.kin.athena.service.vpn.service.DnsCacheStats
+import kotlin.math.roundToInt
 
 /**
  * Extension function for LazyListScope that adds network statistics section.
@@ -120,6 +134,79 @@ fun NetworkStatsSection(networkStats: NetworkStatsState) {
     }
 }
 
+/**
+ * Answers of the native DNS cache, with the share of queries it answered itself.
+ *
+ * @param dnsCacheStats The counters of the cache since the firewall started
+ */
+@Composable
+fun DnsCacheSection(dnsCacheStats: DnsCacheStats) {
+    Column(
+        modifier = Modifier.clip(RoundedCornerShape(32.dp))
+    ) {
+        SettingsBox(
+            icon = IconType.VectorIcon(Icons.Rounded.Dns),
+            title = stringResource(id = R.string.logs_dns_cache),
+            description = stringResource(
+                id = R.string.logs_dns_cache_desc,
+                NumberFormatter.formatCount(dnsCacheStats.hits),
+                NumberFormatter.formatCount(dnsCacheStats.misses),
+                NumberFormatter.formatCount(dnsCacheStats.entries)
+            ),
+            actionType = SettingType.TEXT,
+            customText = "${(dnsCacheStats.hitRate * 100).roundToInt()}%"
+        )
+    }
+}
+
+/**
+ * Per app traffic counted by the native engine, largest first.
+ *
+ * @param appTraffic The totals of each app since the firewall started
+ * @param limit The number of apps shown
+ */
+@Composable
+fun AppTrafficSection(appTraffic: List<AppTrafficStats>, limit: Int = 10) {
+    Text(
+        text = stringResource(id = R.string.logs_app_traffic),
+        style = MaterialTheme.typography.titleMedium,
+        modifier = Modifier.padding(start = 8.dp, bottom = 8.dp)
+    )
+    Column(
+        modifier = Modifier.clip(RoundedCornerShape(32.dp))
+    ) {
+        appTraffic.take(limit).forEach { stats ->
+            AppTrafficBox(stats)
+        }
+    }
+}
+
+@Composable
+private fun AppTrafficBox(stats: AppTrafficStats) {
+    val context = LocalContext.current
+    val tint = MaterialTheme.colorScheme.onSurface.toArgb()
+    // Names and icons only change with the app, not with its counters
+    val application = remember(stats.uid) { context.uidToApplication(stats.uid) }
+    val name = remember(stats.uid) { application?.getApplicationName(context.packageManager) }
+    val icon = remember(stats.uid) {
+        application?.getApplicationIcon(context.packageManager, tint, context = context)
+    }
+
+    SettingsBox(
+        icon = icon?.let { IconType.DrawableIcon(it) } ?: IconType.VectorIcon(Icons.Rounded.Android),
+        title = name ?: stringResource(id = R.string.logs_app_traffic_uid, stats.uid),
+        description = stringResource(
+            id = R.string.logs_app_traffic_desc,
+            NumberFormatter.formatBytes(stats.sentBytes),
+            NumberFormatter.formatBytes(stats.receivedBytes),
+            NumberFormatter.formatCount(stats.flows),
+            NumberFormatter.formatCount(stats.blocked)
+        ),
+        actionType = SettingType.TEXT,
+        customText = NumberFormatter.formatBytes(stats.totalBytes)
+    )
+}
+
 /**
  * Generates a description for the total activity section based on firewall status and session time.
  * 
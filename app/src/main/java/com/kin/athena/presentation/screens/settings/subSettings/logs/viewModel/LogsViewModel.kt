@@ -32,15 +32,23 @@ import com.kin.athena.domain.usecase.log.LogUseCases
 import com.kin.athena.service.firewall.model.FirewallResult
 import com.kin.athena.service.firewall.utils.FirewallStatus
 import com.kin.athena.service.utils.manager.FirewallManager
+import com.kin.athena.service.vpn.service.AppTrafficStats
+import com.kin.athena.service.vpn.service.DnsCacheStats
 import dagger.hilt.android.lifecycle.HiltViewModel
 import dagger.hilt.android.qualifiers.ApplicationContext
+import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.FlowPreview
+import kotlinx.coroutines.delay
 import kotlinx.coroutines.flow.MutableStateFlow
+import kotlinx.coroutines.flow.SharingStarted
 import kotlinx.coroutines.flow.StateFlow
 import kotlinx.coroutines.flow.asStateFlow
 import kotlinx.coroutines.flow.combine
 import kotlinx.coroutines.flow.debounce
 import kotlinx.coroutines.flow.distinctUntilChanged
+import kotlinx.coroutines.flow.flow
+import kotlinx.coroutines.flow.flowOn
+import kotlinx.coroutines.flow.stateIn
 import kotlinx.coroutines.launch
 import java.util.concurrent.ConcurrentHashMap
 import javax.inject.Inject
@@ -65,6 +73,18 @@ class LogsViewModel @Inject constructor(
     private val _networkStats = MutableStateFlow(NetworkStatsState())
     val networkStats: StateFlow<NetworkStatsState> = _networkStats.asStateFlow()
 
+    // Counters of the native engine, polled only while the stats are shown
+    private val enginePollInterval = 2000L
+
+    // Per app totals, largest first
+    val appTraffic: StateFlow<List<AppTrafficStats>> = pollEngine(emptyList()) {
+        firewallManager.getTrafficStats().sortedByDescending { it.totalBytes }
+    }
+
+    val dnsCacheStats: StateFlow<DnsCacheStats?> = pollEngine(null) {
+        firewallManager.getDnsCacheStats()
+    }
+
     private var sessionStartTime: Long? = null
     
     // Performance optimization: Cache for statistics calculations
@@ -250,6 +270,16 @@ class LogsViewModel @Inject constructor(
         }
     }
     
+    private fun <T> pollEngine(inactive: T, read: () -> T): StateFlow<T> = flow {
+        // The engine folds its counters about once a second, there is nothing newer to poll for
+        while (true) {
+            emit(if (isFirewallActive()) read() else inactive)
+            delay(enginePollInterval)
+        }
+    }
+        .flowOn(Dispatchers.IO)
+        .stateIn(viewModelScope, SharingStarted.WhileSubscribed(5000), inactive)
+
     /**
      * Determines if statistics should be updated based on batching logic.
      * Helps prevent excessive UI updates during rapid log insertions.
@@ -22,8 +22,9 @@ import com.kin.athena.service.firewall.model.FirewallResult
 import com.kin.athena.service.vpn.network.transport.dns.DNSModel
 import com.kin.athena.service.vpn.network.transport.ipv4.IPv4
 
-fun filterPacket(protocol: Any?, ipHeader: IPv4?, ruleManager: RuleHandler, dnsModel: DNSModel? = null, uid: Int? = null, bypassCheck: Boolean = false): Triple<Boolean, Int, FirewallResult> {
+fun filterPacket(protocol: Any?, ipHeader: IPv4?, ruleManager: RuleHandler, dnsModel: DNSModel? = null, uid: Int? = null, bypassCheck: Boolean = false, domain: String? = null): Triple<Boolean, Int, FirewallResult> {
     val handler = ProtocolHandlerFactory.getHandler(protocol)
     val fireWallModel = handler?.handle(protocol, ipHeader) ?: uid?.let { FireWallModel(uid = uid) }
+    fireWallModel?.domain = domain
     return fireWallModel?.let { ruleManager.handle(it, dnsModel, bypassCheck) } ?: Triple(true, 0, FirewallResult.ACCEPT)
 }
\ No newline at end of file
@@ -32,9 +32,13 @@ import com.kin.athena.domain.usecase.log.LogUseCases
 import com.kin.athena.domain.usecase.preferences.PreferencesUseCases
 import com.kin.athena.service.firewall.model.FireWallModel
 import com.kin.athena.service.firewall.model.FirewallResult
+import com.kin.athena.service.firewall.model.NativeRuleSet
+import com.kin.athena.service.firewall.model.NativeRuleSink
 import com.kin.athena.service.firewall.rule.AppRule
+import com.kin.athena.service.firewall.rule.CompiledRule
 import com.kin.athena.service.firewall.rule.CustomDomainRule
 import com.kin.athena.service.firewall.rule.DNSRule
+import com.kin.athena.service.firewall.rule.DomainListRule
 import com.kin.athena.service.firewall.rule.FilterRule
 import com.kin.athena.service.firewall.rule.FirewallRule
 import com.kin.athena.service.firewall.rule.HTTPRule
@@ -59,6 +63,7 @@ class RuleHandler @Inject constructor(
     @ApplicationContext private val context: Context
 ) {
     var allowLocal = false
+    private var nativeRuleSink: NativeRuleSink? = null
 
     init {
         val filter = IntentFilter(ConnectivityManager.CONNECTIVITY_ACTION)
@@ -72,15 +77,55 @@ class RuleHandler @Inject constructor(
             preferencesUseCases.loadSettings.execute().fold(
                 ifSuccess = { settings ->
                    allowLocal = settings.allowLocal
+                   publishNativeRules()
                 }
             )
         }
+
+        rules.filterIsInstance<CompiledRule>().forEach { compiledRule ->
+            compiledRule.onChanged = ::publishNativeRules
+        }
+
+        rules.filterIsInstance<DomainListRule>().forEach { domainListRule ->
+            domainListRule.onDomainsChanged = ::publishNativeDomains
+        }
         
         rules.filterIsInstance<CustomDomainRule>().forEach { customDomainRule ->
             customDomainRule.setRuleHandler(this)
         }
     }
 
+    /**
+     * Sets the receiver of compiled rules, which gets the current rules right
+     * away and again whenever one of them changes. Null detaches it.
+     */
+    fun attachNativeRules(sink: NativeRuleSink?) {
+        synchronized(this) {
+            nativeRuleSink = sink
+        }
+        publishNativeRules()
+        publishNativeDomains()
+    }
+
+    private fun publishNativeRules() {
+        synchronized(this) {
+            val sink = nativeRuleSink ?: return
+            val compiled = NativeRuleSet()
+            if (allowLocal) {
+                compiled.flags = compiled.flags or NativeRuleSet.FLAG_ALLOW_LOCAL
+            }
+            rules.filterIsInstance<CompiledRule>().forEach { it.compile(compiled) }
+            sink.setRules(compiled)
+        }
+    }
+
+    private fun publishNativeDomains() {
+        synchronized(this) {
+            val sink = nativeRuleSink ?: return
+            rules.filterIsInstance<DomainListRule>().forEach { it.publishDomains(sink) }
+        }
+    }
+
     suspend fun updateBlocklist(progressCallback: (suspend (Int) -> Unit)? = null) {
         rules.filterIsInstance<DNSRule>().forEach {
             it.updateBlocklist(progressCallback)
@@ -142,6 +187,22 @@ class RuleHandler @Inject constructor(
         }
     }
 
+    /**
+     * Judges the flows the native engine opened since it last asked, in one call.
+     * Null entries are flows the rules do not apply to; they are allowed.
+     */
+    fun handleFlows(flows: List<FireWallModel?>): BooleanArray {
+        return BooleanArray(flows.size) { index ->
+            val flow = flows[index] ?: return@BooleanArray true
+            try {
+                handle(flow, bypassCheck = false).first
+            } catch (e: Exception) {
+                Logger.error("Error filtering flow to ${flow.destinationIP}: ${e.message}")
+                true
+            }
+        }
+    }
+
     fun handle(packet: FireWallModel, dnsModel: DNSModel? = null, bypassCheck: Boolean): Triple<Boolean, Int, FirewallResult> {
         if (bypassCheck) {
             return Triple(true, packet.uid, FirewallResult.ACCEPT)
@@ -33,6 +33,7 @@ data class FireWallModel(
     val protocol: Byte = 0,
     var uid: Int = 0,
     var shouldLog: Boolean = true,
+    var domain: String? = null, // looked up by the native engine, from DNS answers or the server name
     var networkType: NetworkManager.ConnectionType = NetworkManager.ConnectionType.WIFI
 )
 
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2025 Vexzure
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+package com.kin.athena.service.firewall.model
+
+import java.io.Closeable
+import java.io.File
+import java.util.concurrent.locks.ReentrantReadWriteLock
+import kotlin.concurrent.read
+import kotlin.concurrent.write
+
+/**
+ * A compiled domain list (filter/domains.c), mapped read-only. The tunnel maps
+ * the same file, so both share its pages.
+ */
+class NativeDomainList private constructor(private var handle: Long) : Closeable {
+    private val lock = ReentrantReadWriteLock()
+
+    val count: Int = jni_count(handle)
+    val isComplete: Boolean = jni_complete(handle)
+    val source: Long = jni_source(handle)
+
+    /** Returns [BLOCKED], [ALLOWED] for a whitelisted name, or [UNLISTED]. */
+    fun lookup(name: String): Int = lock.read {
+        if (handle == 0L) UNLISTED else jni_lookup(handle, name)
+    }
+
+    override fun close() {
+        lock.write {
+            if (handle != 0L) {
+                jni_close(handle)
+                handle = 0L
+            }
+        }
+    }
+
+    companion object {
+        const val BLOCKED = 0
+        const val ALLOWED = 1
+        const val UNLISTED = -1
+
+        /** Compiles a text list into [target], replacing it atomically. */
+        fun compile(text: File, target: File, complete: Boolean, source: Long): Boolean =
+            jni_compile(text.path, target.path, complete, source)
+
+        /** Maps a compiled list, null when missing or of another format version. */
+        fun open(file: File): NativeDomainList? {
+            if (!file.exists()) {
+                return null
+            }
+            val handle = jni_open(file.path)
+            return if (handle == 0L) null else NativeDomainList(handle)
+        }
+
+        @JvmStatic private external fun jni_compile(textPath: String, path: String, complete: Boolean, source: Long): Boolean
+        @JvmStatic private external fun jni_open(path: String): Long
+        @JvmStatic private external fun jni_close(handle: Long)
+        @JvmStatic private external fun jni_lookup(handle: Long, name: String): Int
+        @JvmStatic private external fun jni_count(handle: Long): Int
+        @JvmStatic private external fun jni_complete(handle: Long): Boolean
+        @JvmStatic private external fun jni_source(handle: Long): Long
+
+        init {
+            System.loadLibrary("athena")
+        }
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2025 Vexzure
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+package com.kin.athena.service.firewall.model
+
+import com.kin.athena.service.vpn.network.transport.extenions.toIp
+import com.kin.athena.service.vpn.network.util.NetworkConstants
+
+/**
+ * New flows described by the native engine (filter/verdict.c), FLOW_STRIDE ints each.
+ * The layout must match describe_flow(); addresses are in host order, IPv4 in the first word.
+ */
+object NativeFlow {
+    const val FLOW_STRIDE = 13
+
+    private const val VERSION = 0
+    private const val PROTOCOL = 1
+    private const val SOURCE_PORT = 2
+    private const val DEST_PORT = 3
+    private const val UID = 4
+    private const val SOURCE = 5
+    private const val DEST = 9
+
+    /**
+     * The flow at [index] as the packet callbacks describe it, null for IPv6,
+     * which they do not filter either.
+     */
+    fun toModel(flows: IntArray, index: Int, name: String?): FireWallModel? {
+        val base = index * FLOW_STRIDE
+        if (flows[base + VERSION] != 4) {
+            return null
+        }
+
+        val protocol = flows[base + PROTOCOL].toByte()
+        val ports = protocol != NetworkConstants.ICMP_PROTOCOL
+        val uid = flows[base + UID]
+        return FireWallModel(
+            destinationIP = flows[base + DEST].toIp(),
+            destinationPort = if (ports) flows[base + DEST_PORT] else 0,
+            sourceIP = flows[base + SOURCE].toIp(),
+            sourcePort = if (ports) flows[base + SOURCE_PORT] else 0,
+            protocol = protocol,
+            // Unknown owners are looked up again by AppRule
+            uid = if (uid > 0) uid else 0,
+            domain = name
+        )
+    }
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2025 Vexzure
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+package com.kin.athena.service.firewall.model
+
+import com.kin.athena.data.service.NetworkManager
+import java.net.InetAddress
+
+/**
+ * Receives compiled rules, implemented by the tunnel that runs the native engine.
+ */
+interface NativeRuleSink {
+    fun setRules(rules: NativeRuleSet)
+
+    /** Drops the verdicts cached on native flows, for changes [setRules] does not cover. */
+    fun invalidateVerdicts()
+
+    /** Maps a domain list compiled by [NativeDomainList], a null path is an empty list. */
+    fun setDomains(list: Int, path: String?)
+}
+
+/**
+ * Rules compiled for the native engine (filter/rules.c).
+ * Each rule is packed as RULE_STRIDE ints, the layout must match rule_compile().
+ */
+class NativeRuleSet {
+    private val generic = ArrayList<IntArray>()
+    private val withUid = ArrayList<IntArray>()
+
+    var flags = 0
+    var state = 0
+
+    fun add(
+        uid: Int = ANY_UID,
+        protocol: Int = 0,
+        portLow: Int = 0,
+        portHigh: Int = 65535,
+        conditions: Int = NET_ANY,
+        allow: Boolean = false,
+        address: String? = null
+    ): Boolean {
+        val rule = IntArray(RULE_STRIDE)
+        rule[0] = uid
+        rule[1] = protocol
+        rule[2] = portLow
+        rule[3] = portHigh
+        rule[4] = conditions
+        rule[5] = if (allow) 1 else 0
+
+        if (address != null && !packAddress(address, rule)) {
+            return false
+        }
+
+        if (uid == ANY_UID) generic.add(rule) else withUid.add(rule)
+        return true
+    }
+
+    fun setNetwork(connectionType: NetworkManager.ConnectionType) {
+        state = (state and NET_ANY.inv()) or when (connectionType) {
+            NetworkManager.ConnectionType.WIFI -> NET_WIFI
+            NetworkManager.ConnectionType.MOBILE -> NET_MOBILE
+            NetworkManager.ConnectionType.NONE -> NET_OTHER
+        }
+    }
+
+    fun setScreenOff(screenOff: Boolean) {
+        state = if (screenOff) state or SCREEN_OFF else state and SCREEN_OFF.inv()
+    }
+
+    fun toIntArray(): IntArray {
+        // Rules without uid first, then by uid; sortedBy is stable so order within a uid is kept
+        val ordered = generic + withUid.sortedBy { it[0] }
+        val data = IntArray(ordered.size * RULE_STRIDE)
+        ordered.forEachIndexed { index, rule -> rule.copyInto(data, index * RULE_STRIDE) }
+        return data
+    }
+
+    private fun packAddress(address: String, rule: IntArray): Boolean {
+        val network = parseNetwork(address) ?: return false
+        val bytes = network.bytes
+
+        rule[6] = if (bytes.size == 4) 4 else 6
+        rule[7] = network.prefix
+        for (word in 0 until bytes.size / 4) {
+            var value = 0
+            for (i in 0 until 4) {
+                value = (value shl 8) or (bytes[word * 4 + i].toInt() and 0xFF)
+            }
+            rule[8 + word] = value
+        }
+        return true
+    }
+
+    /**
+     * An address rule as the native table matches it, the first [prefix] bits of [bytes].
+     */
+    class Network(val bytes: ByteArray, val prefix: Int) {
+        fun contains(address: ByteArray): Boolean {
+            if (address.size != bytes.size) {
+                return false
+            }
+            val whole = prefix / 8
+            for (i in 0 until whole) {
+                if (address[i] != bytes[i]) return false
+            }
+            val rest = prefix % 8
+            if (rest == 0) {
+                return true
+            }
+            val mask = (0xFF shl (8 - rest)) and 0xFF
+            return (address[whole].toInt() and mask) == (bytes[whole].toInt() and mask)
+        }
+    }
+
+    companion object {
+        const val RULE_STRIDE = 12
+        const val ANY_UID = -1
+
+        const val NET_WIFI = 1
+        const val NET_MOBILE = 2
+        const val NET_OTHER = 4
+        const val NET_ANY = NET_WIFI or NET_MOBILE or NET_OTHER
+        const val SCREEN_OFF = 8
+
+        const val FLAG_ALLOW_LOCAL = 1
+        const val FLAG_LOG = 2
+
+        const val DOMAIN_LIST_HOSTS = 0
+        const val DOMAIN_LIST_CUSTOM = 1
+
+        /** An address or `address/prefix` literal, null when it is neither. */
+        fun parseNetwork(address: String): Network? {
+            val host = address.substringBefore('/')
+            // Only literals, never let InetAddress resolve a host name
+            if (!IPV4_LITERAL.matches(host) && !(host.contains(':') && IPV6_LITERAL.matches(host))) {
+                return null
+            }
+
+            val bytes = try {
+                InetAddress.getByName(host).address
+            } catch (e: Exception) {
+                return null
+            }
+
+            val bits = bytes.size * 8
+            val prefix = address.substringAfter('/', "").toIntOrNull() ?: bits
+            if (prefix !in 0..bits) {
+                return null
+            }
+            return Network(bytes, prefix)
+        }
+
+        private val IPV4_LITERAL = Regex("""^\d{1,3}(\.\d{1,3}){3}$""")
+        private val IPV6_LITERAL = Regex("""^[0-9a-fA-F:.]+$""")
+    }
+}
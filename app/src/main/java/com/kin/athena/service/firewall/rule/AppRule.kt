@@ -25,6 +25,7 @@ import com.kin.athena.domain.usecase.application.ApplicationUseCases
 import com.kin.athena.domain.usecase.log.LogUseCases
 import com.kin.athena.service.firewall.model.FireWallModel
 import com.kin.athena.service.firewall.model.FirewallResult
+import com.kin.athena.service.firewall.model.NativeRuleSet
 import com.kin.athena.service.firewall.utils.ConnectivityUtils
 import com.kin.athena.service.vpn.network.transport.dns.DNSModel
 import kotlinx.coroutines.CoroutineScope
@@ -36,12 +37,14 @@ class AppRule @Inject constructor(
     private val applicationUseCases: ApplicationUseCases,
     private val networkConnectionStateManager: ConnectionStateManager,
     private val connectionUtils: ConnectivityUtils,
-) : FirewallRule {
+) : CompiledRule {
+    override var onChanged: (() -> Unit)? = null
     private var wifiBlockedUids: IntArray = IntArray(0)
     private var cellularBlockedUids: IntArray = IntArray(0)
 
     init {
         observePackages(updatedApplication = null)
+        networkConnectionStateManager.addListener { onChanged?.invoke() }
     }
 
     fun observePackages(updatedApplication: Application?) {
@@ -54,11 +57,18 @@ class AppRule @Inject constructor(
 
                     wifiBlockedUids = wifiBlocked
                     cellularBlockedUids = cellularBlocked
+                    onChanged?.invoke()
                 }
             )
         }
     }
 
+    override fun compile(rules: NativeRuleSet) {
+        rules.setNetwork(networkConnectionStateManager.getCurrentConnectionType())
+        wifiBlockedUids.forEach { rules.add(uid = it, conditions = NativeRuleSet.NET_WIFI) }
+        cellularBlockedUids.forEach { rules.add(uid = it, conditions = NativeRuleSet.NET_MOBILE) }
+    }
+
     override fun check(
         packet: FireWallModel,
         dnsModel: DNSModel?,
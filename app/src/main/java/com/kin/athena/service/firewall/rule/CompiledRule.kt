@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2025 Vexzure
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+package com.kin.athena.service.firewall.rule
+
+import com.kin.athena.service.firewall.model.NativeRuleSet
+
+/**
+ * A rule that can also be evaluated by the native engine, so packets it
+ * decides never have to be handed to [FirewallRule.check].
+ */
+interface CompiledRule : FirewallRule {
+    /** Invoked whenever the data behind [compile] changed. */
+    var onChanged: (() -> Unit)?
+
+    fun compile(rules: NativeRuleSet)
+}
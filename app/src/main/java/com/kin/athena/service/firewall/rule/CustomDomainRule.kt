@@ -17,24 +17,31 @@
 
 package com.kin.athena.service.firewall.rule
 
+import com.kin.athena.App.Companion.applicationContext
 import com.kin.athena.core.logging.Logger
 import com.kin.athena.domain.model.CustomDomain
 import com.kin.athena.domain.repository.CustomDomainRepository
 import com.kin.athena.domain.usecase.log.LogUseCases
 import com.kin.athena.service.firewall.model.FireWallModel
 import com.kin.athena.service.firewall.model.FirewallResult
+import com.kin.athena.service.firewall.model.NativeDomainList
+import com.kin.athena.service.firewall.model.NativeRuleSet
+import com.kin.athena.service.firewall.model.NativeRuleSink
 import com.kin.athena.service.vpn.network.transport.dns.DNSModel
 import com.kin.athena.service.firewall.handler.RuleHandler
 import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.flow.firstOrNull
 import kotlinx.coroutines.launch
+import java.io.File
 import javax.inject.Inject
 
 class CustomDomainRule @Inject constructor(
     private val customDomainRepository: CustomDomainRepository
-) : FirewallRule {
-    
+) : DomainListRule {
+
+    override var onDomainsChanged: (() -> Unit)? = null
+    private var nativeDomains: File? = null
     private var allowlistDomains: List<CustomDomain> = emptyList()
     private var blocklistDomains: List<CustomDomain> = emptyList()
     private var isCustomDomainRulesEnabled = true
@@ -58,6 +65,8 @@ class CustomDomainRule @Inject constructor(
             customDomainRepository.getEnabledBlocklistDomains().collect { domains ->
                 blocklistDomains = domains
                 Logger.info("Updated blocklist domains: ${domains.size} domains")
+                writeNativeDomains(domains)
+                onDomainsChanged?.invoke()
             }
         }
     }
@@ -65,11 +74,13 @@ class CustomDomainRule @Inject constructor(
     fun enableCustomDomainRules() {
         isCustomDomainRulesEnabled = true
         Logger.info("Custom domain rules enabled")
+        onDomainsChanged?.invoke()
     }
     
     fun disableCustomDomainRules() {
         isCustomDomainRulesEnabled = false
         Logger.info("Custom domain rules disabled")
+        onDomainsChanged?.invoke()
     }
     
     fun isCustomDomainRulesEnabled(): Boolean {
@@ -80,6 +91,39 @@ class CustomDomainRule @Inject constructor(
         ruleHandler = handler
     }
 
+    // A blocklist entry blocks the name and its subdomains, regex entries stay with check()
+    private fun writeNativeDomains(domains: List<CustomDomain>) {
+        val text = File.createTempFile(NATIVE_DOMAINS, ".tmp", applicationContext.filesDir)
+        try {
+            text.bufferedWriter().use { writer ->
+                domains.filter { !it.isRegex }.forEach { domain ->
+                    val name = domain.domain.trim().lowercase()
+                    if (name.isNotEmpty() && name.none { it.isWhitespace() }) {
+                        writer.write("S $name\n")
+                    }
+                }
+            }
+
+            val target = File(applicationContext.filesDir, COMPILED_DOMAINS)
+            synchronized(this) {
+                nativeDomains = if (NativeDomainList.compile(text, target, domains.none { it.isRegex }, 0L)) target else null
+            }
+        } catch (e: Exception) {
+            Logger.error("Failed to write native custom domains", e)
+        } finally {
+            text.delete()
+        }
+    }
+
+    override fun publishDomains(sink: NativeRuleSink) {
+        val domains = synchronized(this) { nativeDomains }
+        if (!isCustomDomainRulesEnabled) {
+            sink.setDomains(NativeRuleSet.DOMAIN_LIST_CUSTOM, null)
+        } else if (domains != null) {
+            sink.setDomains(NativeRuleSet.DOMAIN_LIST_CUSTOM, domains.path)
+        }
+    }
+
     override fun check(
         packet: FireWallModel,
         dnsModel: DNSModel?,
@@ -130,4 +174,9 @@ class CustomDomainRule @Inject constructor(
             domainName.endsWith(".${customDomain.domain}", ignoreCase = true)
         }
     }
+
+    companion object {
+        private const val NATIVE_DOMAINS = "native_custom_domains"
+        private const val COMPILED_DOMAINS = "custom_domains.bin"
+    }
 }
\ No newline at end of file
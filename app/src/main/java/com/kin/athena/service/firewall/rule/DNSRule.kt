@@ -22,14 +22,21 @@ import com.kin.athena.domain.usecase.log.LogUseCases
 import com.kin.athena.presentation.screens.settings.subSettings.dns.hosts.RuleDatabase
 import com.kin.athena.service.firewall.model.FireWallModel
 import com.kin.athena.service.firewall.model.FirewallResult
+import com.kin.athena.service.firewall.model.NativeRuleSet
+import com.kin.athena.service.firewall.model.NativeRuleSink
 import com.kin.athena.service.vpn.network.transport.dns.DNSModel
 import javax.inject.Inject
 
 class DNSRule @Inject constructor(
     private val ruleDatabase: RuleDatabase
-) : FirewallRule {
+) : DomainListRule {
+    override var onDomainsChanged: (() -> Unit)? = null
     private var isDnsBlockingEnabled = true
 
+    init {
+        ruleDatabase.addNativeDomainsListener { onDomainsChanged?.invoke() }
+    }
+
     suspend fun updateBlocklist(progressCallback: (suspend (Int) -> Unit)? = null) {
         ruleDatabase.initialize(progressCallback = progressCallback)
     }
@@ -37,17 +44,28 @@ class DNSRule @Inject constructor(
     fun enableDnsBlocking() {
         isDnsBlockingEnabled = true
         Logger.info("DNS blocking enabled")
+        onDomainsChanged?.invoke()
     }
     
     fun disableDnsBlocking() {
         isDnsBlockingEnabled = false
         Logger.info("DNS blocking disabled")
+        onDomainsChanged?.invoke()
     }
     
     fun isDnsBlockingEnabled(): Boolean {
         return isDnsBlockingEnabled
     }
 
+    override fun publishDomains(sink: NativeRuleSink) {
+        val domains = ruleDatabase.nativeDomains
+        if (!isDnsBlockingEnabled) {
+            sink.setDomains(NativeRuleSet.DOMAIN_LIST_HOSTS, null)
+        } else if (domains != null) {
+            sink.setDomains(NativeRuleSet.DOMAIN_LIST_HOSTS, domains.path)
+        }
+    }
+
     override fun check(
         packet: FireWallModel,
         dnsModel: DNSModel?,
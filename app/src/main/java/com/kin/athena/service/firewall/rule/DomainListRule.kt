@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2025 Vexzure
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+package com.kin.athena.service.firewall.rule
+
+import com.kin.athena.service.firewall.model.NativeRuleSink
+
+/**
+ * A rule on DNS query names whose domains are loaded by the native engine
+ * as a list, so blocked queries are answered without calling [FirewallRule.check].
+ */
+interface DomainListRule : FirewallRule {
+    /** Invoked whenever the list behind [publishDomains] changed. */
+    var onDomainsChanged: (() -> Unit)?
+
+    fun publishDomains(sink: NativeRuleSink)
+}
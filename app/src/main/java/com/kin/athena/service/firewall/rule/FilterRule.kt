@@ -17,11 +17,11 @@
 
 package com.kin.athena.service.firewall.rule
 
-import com.kin.athena.domain.model.Ip
 import com.kin.athena.domain.usecase.log.LogUseCases
 import com.kin.athena.domain.usecase.networkFilter.NetworkFilterUseCases
 import com.kin.athena.service.firewall.model.FireWallModel
 import com.kin.athena.service.firewall.model.FirewallResult
+import com.kin.athena.service.firewall.model.NativeRuleSet
 import com.kin.athena.service.vpn.network.transport.dns.DNSModel
 import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
@@ -30,35 +30,49 @@ import javax.inject.Inject
 
 class FilterRule @Inject constructor(
     private val networkFilterUseCases: NetworkFilterUseCases
-) : FirewallRule {
+) : CompiledRule {
+    override var onChanged: (() -> Unit)? = null
+
+    // IPv4 only: the packet callbacks let IPv6 through, the native table must not block it either
+    @Volatile
+    private var networks: List<Pair<String, NativeRuleSet.Network>> = emptyList()
+
     init {
         observeIps()
     }
 
-    private var ips: List<Ip>? = null
-
     fun observeIps() {
         CoroutineScope(Dispatchers.IO).launch {
             val packagesList = networkFilterUseCases.getIps.execute()
             packagesList.fold(
                 ifSuccess = {
                     it.collect { ip ->
-                        ips = ip
+                        networks = ip.mapNotNull { entry ->
+                            NativeRuleSet.parseNetwork(entry.ip)
+                                ?.takeIf { network -> network.bytes.size == 4 }
+                                ?.let { network -> entry.ip to network }
+                        }
+                        onChanged?.invoke()
                     }
                 }
             )
         }
     }
 
+    override fun compile(rules: NativeRuleSet) {
+        networks.forEach { rules.add(address = it.first) }
+    }
+
     override fun check(
         packet: FireWallModel,
         dnsModel: DNSModel?,
         logUseCases: LogUseCases,
         result: FirewallResult
     ): FirewallResult {
-        val isBlocked = ips?.firstOrNull { it.ip == packet.destinationIP } == null
-
-        return if (!isBlocked) FirewallResult.DROP else FirewallResult.ACCEPT
+        // Matched as the native table does, so both give the same verdict
+        val destination = NativeRuleSet.parseNetwork(packet.destinationIP)?.bytes
+        val isBlocked = destination != null && networks.any { it.second.contains(destination) }
 
+        return if (isBlocked) FirewallResult.DROP else FirewallResult.ACCEPT
     }
 }
@@ -24,6 +24,7 @@ import com.kin.athena.domain.usecase.log.LogUseCases
 import com.kin.athena.domain.usecase.preferences.PreferencesUseCases
 import com.kin.athena.service.firewall.model.FireWallModel
 import com.kin.athena.service.firewall.model.FirewallResult
+import com.kin.athena.service.firewall.model.NativeRuleSet
 import com.kin.athena.service.vpn.network.transport.dns.DNSModel
 import com.kin.athena.service.vpn.network.util.NetworkConstants
 import kotlinx.coroutines.CoroutineScope
@@ -36,7 +37,8 @@ import javax.inject.Inject
 class HTTPRule @Inject constructor(
     private val preferencesUseCases: PreferencesUseCases,
     private val externalScope: CoroutineScope
-) : FirewallRule {
+) : CompiledRule {
+    override var onChanged: (() -> Unit)? = null
 
     private var blockHTTP = false
     private var allowLocal = false
@@ -51,6 +53,7 @@ class HTTPRule @Inject constructor(
                 ifSuccess = { settings ->
                     blockHTTP = settings.blockPort80
                     allowLocal = settings.allowLocal
+                    onChanged?.invoke()
                 },
                 ifFailure = { error ->
                     Logger.error("Failed to load settings: ${error.message}")
@@ -59,6 +62,12 @@ class HTTPRule @Inject constructor(
         }
     }
 
+    override fun compile(rules: NativeRuleSet) {
+        if (blockHTTP) {
+            rules.add(portLow = 80, portHigh = 80)
+        }
+    }
+
     override fun check(
         packet: FireWallModel,
         dnsModel: DNSModel?,
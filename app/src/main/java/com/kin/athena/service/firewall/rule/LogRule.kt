@@ -24,6 +24,7 @@ import com.kin.athena.domain.usecase.log.LogUseCases
 import com.kin.athena.domain.usecase.preferences.PreferencesUseCases
 import com.kin.athena.service.firewall.model.FireWallModel
 import com.kin.athena.service.firewall.model.FirewallResult
+import com.kin.athena.service.firewall.model.NativeRuleSet
 import com.kin.athena.service.vpn.network.transport.dns.DNSModel
 import com.kin.athena.service.vpn.network.util.NetworkConstants
 import kotlinx.coroutines.CoroutineScope
@@ -36,7 +37,8 @@ import javax.inject.Inject
 class LogRule @Inject constructor(
     private val preferencesUseCases: PreferencesUseCases,
     private val externalScope: CoroutineScope
-) : FirewallRule {
+) : CompiledRule {
+    override var onChanged: (() -> Unit)? = null
 
     private val mutex = Mutex()
     private var isLogEnabled = false
@@ -48,6 +50,7 @@ class LogRule @Inject constructor(
     fun updateLogStatus(enabled: Boolean? = null) {
         if (enabled != null) {
             isLogEnabled = enabled
+            onChanged?.invoke()
         } else {
             externalScope.launch(Dispatchers.IO) {
                 preferencesUseCases.loadSettings.execute().fold(
@@ -55,6 +58,7 @@ class LogRule @Inject constructor(
                         mutex.withLock {
                             isLogEnabled = settings.logs
                         }
+                        onChanged?.invoke()
                     },
                     ifFailure = { error ->
                         Logger.error("Failed to load settings: ${error.message}")
@@ -64,6 +68,13 @@ class LogRule @Inject constructor(
         }
     }
 
+    override fun compile(rules: NativeRuleSet) {
+        // Logged packets have to pass through check()
+        if (isLogEnabled) {
+            rules.flags = rules.flags or NativeRuleSet.FLAG_LOG
+        }
+    }
+
     override fun check(
         packet: FireWallModel,
         dnsModel: DNSModel?,
@@ -86,7 +97,7 @@ class LogRule @Inject constructor(
                             NetworkConstants.ICMP_PROTOCOL -> "ICMP"
                             else -> "UKW"
                         },
-                        destinationAddress = dnsModel?.domainName ?: packet.destinationIP.resolveIpToHostname()
+                        destinationAddress = dnsModel?.domainName ?: packet.domain ?: packet.destinationIP.resolveIpToHostname()
                     )
                     try {
                         logUseCases.addLog.execute(log)
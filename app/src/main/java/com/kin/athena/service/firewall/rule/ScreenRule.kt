@@ -25,6 +25,7 @@ import com.kin.athena.domain.usecase.log.LogUseCases
 import com.kin.athena.domain.usecase.preferences.PreferencesUseCases
 import com.kin.athena.service.firewall.model.FireWallModel
 import com.kin.athena.service.firewall.model.FirewallResult
+import com.kin.athena.service.firewall.model.NativeRuleSet
 import com.kin.athena.service.vpn.network.transport.dns.DNSModel
 import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.Dispatchers
@@ -35,12 +36,14 @@ import javax.inject.Inject
 class ScreenRule @Inject constructor(
     private val screenStateManager: ScreenStateManager,
     private val preferencesUseCases: PreferencesUseCases
-) : FirewallRule {
+) : CompiledRule {
+    override var onChanged: (() -> Unit)? = null
     var blockWhenScreenOffWifi: Boolean? = null
     var blockWhenScreenOffData: Boolean? = null
 
     init {
         updateRules()
+        screenStateManager.addListener { onChanged?.invoke() }
     }
 
     fun updateRules() {
@@ -52,6 +55,18 @@ class ScreenRule @Inject constructor(
                 }
             )
         }
+        onChanged?.invoke()
+    }
+
+    override fun compile(rules: NativeRuleSet) {
+        rules.setScreenOff(screenStateManager.currentScreenStatus == ScreenManager.SCREEN_OFF)
+        if (blockWhenScreenOffData == true) {
+            rules.add(conditions = NativeRuleSet.NET_MOBILE or NativeRuleSet.SCREEN_OFF)
+        }
+        // Without a connection the packet is treated as wifi, as in check()
+        if (blockWhenScreenOffWifi == true) {
+            rules.add(conditions = NativeRuleSet.NET_WIFI or NativeRuleSet.NET_OTHER or NativeRuleSet.SCREEN_OFF)
+        }
     }
 
     override fun check(packet: FireWallModel, dnsModel: DNSModel?, logUseCases: LogUseCases, result: FirewallResult): FirewallResult {
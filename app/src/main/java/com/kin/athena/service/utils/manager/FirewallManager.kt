@@ -29,6 +29,8 @@ import com.kin.athena.domain.model.Application
 import com.kin.athena.service.firewall.utils.FirewallStatus
 import com.kin.athena.service.root.service.RootConnectionService
 import com.kin.athena.service.shizuku.ShizukuConnectionService
+import com.kin.athena.service.vpn.service.AppTrafficStats
+import com.kin.athena.service.vpn.service.DnsCacheStats
 import com.kin.athena.service.vpn.service.VpnConnectionServer
 import dagger.hilt.android.qualifiers.ApplicationContext
 import kotlinx.coroutines.flow.MutableStateFlow
@@ -53,6 +55,8 @@ interface FirewallService {
     fun updateHttpSettings()
     fun setDnsBlocking(enabled: Boolean)
     fun isDnsBlockingEnabled(): Boolean
+    fun getTrafficStats(): List<AppTrafficStats> = emptyList()
+    fun getDnsCacheStats(): DnsCacheStats? = null
 }
 
 @Singleton
@@ -122,6 +126,14 @@ class FirewallManager @Inject constructor(
         currentService.value?.updateHttpSettings()
     }
 
+    fun getTrafficStats(): List<AppTrafficStats> {
+        return currentService.value?.getTrafficStats() ?: emptyList()
+    }
+
+    fun getDnsCacheStats(): DnsCacheStats? {
+        return currentService.value?.getDnsCacheStats()
+    }
+
     fun update(state: FirewallStatus) {
         _rulesLoaded.value = state
     }
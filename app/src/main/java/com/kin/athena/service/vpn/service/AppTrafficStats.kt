@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2025 Vexzure
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+package com.kin.athena.service.vpn.service
+
+/**
+ * Traffic of one app through the native engine (session/traffic.c), since the tunnel started.
+ * Bytes are payload, without the IP and transport headers; uid -1 is traffic of an unknown owner.
+ */
+data class AppTrafficStats(
+    val uid: Int,
+    val sentBytes: Long,
+    val receivedBytes: Long,
+    val sentPackets: Long,
+    val receivedPackets: Long,
+    val flows: Long,
+    val blocked: Long
+) {
+    val totalBytes: Long
+        get() = sentBytes + receivedBytes
+
+    companion object {
+        private const val STRIDE = 7
+
+        /** Layout of jni_get_traffic_stats, STRIDE longs per app. */
+        fun fromArray(values: LongArray) = (0 until values.size / STRIDE).map { i ->
+            val base = i * STRIDE
+            AppTrafficStats(
+                uid = values[base].toInt(),
+                sentBytes = values[base + 1],
+                receivedBytes = values[base + 2],
+                sentPackets = values[base + 3],
+                receivedPackets = values[base + 4],
+                flows = values[base + 5],
+                blocked = values[base + 6]
+            )
+        }
+    }
+}
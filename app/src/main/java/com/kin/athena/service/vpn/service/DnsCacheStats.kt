@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2025 Vexzure
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+package com.kin.athena.service.vpn.service
+
+/**
+ * Counters of the native DNS answer cache (protocols/dns_cache.c).
+ * Hits were answered without a query to the configured server.
+ */
+data class DnsCacheStats(
+    val hits: Long,
+    val misses: Long,
+    val stored: Long,
+    val evicted: Long,
+    val entries: Long,
+    val bytes: Long
+) {
+    val hitRate: Double
+        get() = if (hits + misses == 0L) 0.0 else hits.toDouble() / (hits + misses)
+
+    companion object {
+        /** Layout of jni_get_dns_cache_stats. */
+        fun fromArray(values: LongArray) = DnsCacheStats(
+            hits = values[0],
+            misses = values[1],
+            stored = values[2],
+            evicted = values[3],
+            entries = values[4],
+            bytes = values[5]
+        )
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2025 Vexzure
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+package com.kin.athena.service.vpn.service
+
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+
+/**
+ * Packets for the tun, written into native memory the event loop drains
+ * (session/inject.c). A record is a length in native byte order and the
+ * packet, padded to four bytes; a zero length wraps to the start.
+ * Positions are byte counts that overflow like the native uint32_t ones.
+ * [publish] hands the native side the new head and returns how far it got.
+ */
+class InjectionRing(
+    buffer: ByteBuffer,
+    private val publish: (head: Int) -> Int
+) {
+    private val buffer = buffer.order(ByteOrder.nativeOrder())
+    private val capacity = buffer.capacity()
+    private var head = 0
+    private var tail = 0
+    private var closed = false
+
+    /** Writes the packets and publishes them with one call, returns how many fit. */
+    @Synchronized
+    fun send(packets: List<ByteArray>): Int {
+        if (closed) return 0
+        var sent = 0
+        for (packet in packets) {
+            if (!write(packet)) break
+            sent++
+        }
+        if (sent > 0) tail = publish(head)
+        return sent
+    }
+
+    /** The native memory is freed after this. */
+    @Synchronized
+    fun close() {
+        closed = true
+    }
+
+    private fun write(packet: ByteArray): Boolean {
+        if (packet.isEmpty()) return false
+        val size = (RECORD_HEADER + packet.size + 3) and 3.inv()
+        val pos = head and (capacity - 1)
+        val padding = if (pos + size > capacity) capacity - pos else 0
+        if (size + padding > capacity - (head - tail)) {
+            // What the loop drained since the last publish
+            tail = publish(head)
+            if (size + padding > capacity - (head - tail)) return false
+        }
+
+        if (padding > 0) {
+            buffer.putInt(pos, 0)
+            head += padding
+        }
+        val start = head and (capacity - 1)
+        buffer.putInt(start, packet.size)
+        buffer.position(start + RECORD_HEADER)
+        buffer.put(packet)
+        head += size
+        return true
+    }
+
+    private companion object {
+        const val RECORD_HEADER = 4
+    }
+}
@@ -17,12 +17,17 @@
 
 package com.kin.athena.service.vpn.service
 
+import android.net.ConnectivityManager
 import android.os.Build
+import android.os.Process
 import android.util.Log
 import com.kin.athena.core.logging.Logger
 import com.kin.athena.service.firewall.handler.RuleHandler
 import com.kin.athena.service.firewall.handler.filterPacket
 import com.kin.athena.service.firewall.model.FirewallResult
+import com.kin.athena.service.firewall.model.NativeFlow
+import com.kin.athena.service.firewall.model.NativeRuleSet
+import com.kin.athena.service.firewall.model.NativeRuleSink
 import com.kin.athena.service.vpn.network.transport.tcp.TCPHeader
 import com.kin.athena.service.vpn.network.transport.udp.UDPModel
 import com.kin.athena.service.vpn.network.transport.udp.toUDPHeader
@@ -35,19 +40,28 @@ import com.kin.athena.service.vpn.network.transport.ipv4.toIPv4Header
 import com.kin.athena.service.vpn.network.transport.dns.DNSModel
 import com.kin.athena.service.vpn.network.transport.dns.toDNSModel
 import com.kin.athena.service.vpn.network.transport.udp.soarResponse
+import java.net.InetAddress
+import java.net.InetSocketAddress
 import java.nio.ByteBuffer
 import java.nio.ByteOrder
 
 class TunnelManager(
     private val ruleHandler: RuleHandler? = null,
     private val dnsServerV4: String = "9.9.9.9",
-    private val dnsServerV6: String = "2620:fe::fe"
+    private val dnsServerV6: String = "2620:fe::fe",
+    private val connectivityManager: ConnectivityManager? = null
 ) {
 
     private var contextPtr: Long = 0
     private val lock = Any()
     private var isReleased = false
 
+    // Packets handed to the filter callbacks are copied here by native code
+    private val packetBuffer: ByteBuffer = ByteBuffer.allocateDirect(PACKET_BUFFER_SIZE)
+
+    // Packets built here for the tun, in native memory the event loop drains
+    @Volatile
+    private var injectionRing: InjectionRing? = null
 
 
     fun initialize(): Boolean {
@@ -55,13 +69,20 @@ class TunnelManager(
         if (contextPtr != 0L) {
             // Set DNS servers in native code
             jni_set_dns_servers(contextPtr, dnsServerV4, dnsServerV6)
+            jni_set_packet_buffer(contextPtr, packetBuffer)
+            val contextPtrSnapshot = contextPtr
+            injectionRing = jni_get_inject_buffer(contextPtrSnapshot)?.let { buffer ->
+                InjectionRing(buffer) { head -> jni_inject(contextPtrSnapshot, head) }
+            }
+            ruleHandler?.attachNativeRules(nativeRuleSink)
         }
         return contextPtr != 0L
     }
     
-    fun start(logLevel: Int) {
+    // Flows are sharded over this many native event loops, one reads the tun when there are several
+    fun start(logLevel: Int, workers: Int = defaultWorkers()) {
         if (contextPtr != 0L) {
-            jni_start(contextPtr, logLevel)
+            jni_start(contextPtr, logLevel, workers)
         }
     }
     
@@ -79,6 +100,8 @@ class TunnelManager(
     
     fun done() {
         if (contextPtr != 0L) {
+            injectionRing?.close()
+            injectionRing = null
             jni_done(contextPtr)
             contextPtr = 0L
         }
@@ -92,12 +115,54 @@ class TunnelManager(
         return jni_getprop(name)
     }
     
+    /**
+     * Sends complete IP packets to the apps, one native call for the batch.
+     * Packets that do not fit in the ring are queued one by one instead.
+     */
+    fun injectPackets(packets: List<ByteArray>) {
+        val contextPtrSnapshot = contextPtr
+        if (contextPtrSnapshot == 0L) return
+        val sent = injectionRing?.send(packets) ?: 0
+        for (i in sent until packets.size)
+            jni_send_complete_packet(contextPtrSnapshot, packets[i])
+    }
+
     fun setDnsServers(dnsV4: String, dnsV6: String) {
         if (contextPtr != 0L) {
             jni_set_dns_servers(contextPtr, dnsV4, dnsV6)
         }
     }
     
+    private val nativeRuleSink = object : NativeRuleSink {
+        override fun setRules(rules: NativeRuleSet) {
+            synchronized(lock) {
+                val contextPtrSnapshot = contextPtr
+                if (!isReleased && contextPtrSnapshot != 0L) {
+                    jni_set_rules(contextPtrSnapshot, rules.toIntArray(), rules.flags)
+                    jni_set_rule_state(contextPtrSnapshot, rules.state)
+                }
+            }
+        }
+
+        override fun invalidateVerdicts() {
+            synchronized(lock) {
+                val contextPtrSnapshot = contextPtr
+                if (!isReleased && contextPtrSnapshot != 0L) {
+                    jni_invalidate_verdicts(contextPtrSnapshot)
+                }
+            }
+        }
+
+        override fun setDomains(list: Int, path: String?) {
+            synchronized(lock) {
+                val contextPtrSnapshot = contextPtr
+                if (!isReleased && contextPtrSnapshot != 0L) {
+                    jni_set_domains(contextPtrSnapshot, list, path)
+                }
+            }
+        }
+    }
+
     fun clearSessions() {
         synchronized(lock) {
             try {
@@ -119,10 +184,67 @@ class TunnelManager(
         }
     }
 
-    private fun onTcpPacketReceived(data: ByteArray, length: Int, direction: String): Boolean {
+    fun getDnsCacheStats(): DnsCacheStats? {
+        synchronized(lock) {
+            val contextPtrSnapshot = contextPtr
+            if (isReleased || contextPtrSnapshot == 0L) {
+                return null
+            }
+            return try {
+                jni_get_dns_cache_stats(contextPtrSnapshot)?.let(DnsCacheStats::fromArray)
+            } catch (e: UnsatisfiedLinkError) {
+                Logger.error("Native library unavailable for getDnsCacheStats: ${e.message}")
+                null
+            }
+        }
+    }
+
+    fun getTrafficStats(): List<AppTrafficStats>? {
+        synchronized(lock) {
+            val contextPtrSnapshot = contextPtr
+            if (isReleased || contextPtrSnapshot == 0L) {
+                return null
+            }
+            return try {
+                jni_get_traffic_stats(contextPtrSnapshot)?.let(AppTrafficStats::fromArray)
+            } catch (e: UnsatisfiedLinkError) {
+                Logger.error("Native library unavailable for getTrafficStats: ${e.message}")
+                null
+            }
+        }
+    }
+
+    private fun packetView(length: Int): ByteBuffer {
+        val buffer = packetBuffer.duplicate()
+        buffer.limit(length)
+        buffer.order(ByteOrder.BIG_ENDIAN)
+        return buffer
+    }
+
+    private fun directionName(direction: Int): String {
+        return if (direction == DIRECTION_TUN_IN) "TUN_IN" else "TUN_OUT"
+    }
+
+    // Called by native code once per new flow, sock_diag and /proc/net are closed to apps since Android 10
+    private fun getUidQ(version: Int, protocol: Int, saddr: String, sport: Int, daddr: String, dport: Int): Int {
+        if (Build.VERSION.SDK_INT < Build.VERSION_CODES.Q) return Process.INVALID_UID
+        val manager = connectivityManager ?: return Process.INVALID_UID
+        return try {
+            // Literals only, InetAddress does not resolve them
+            val local = InetSocketAddress(InetAddress.getByName(saddr), sport)
+            val remote = InetSocketAddress(InetAddress.getByName(daddr), dport)
+            manager.getConnectionOwnerUid(protocol, local, remote)
+        } catch (e: Exception) {
+            Log.w("PacketFilter", "getConnectionOwnerUid IPv$version failed: ${e.message}")
+            Process.INVALID_UID
+        }
+    }
+
+    // The name is the one the app looked the destination up by, or its TLS server name, null when unknown
+    private fun onTcpPacketReceived(length: Int, directionCode: Int, name: String?): Boolean {
+        val direction = directionName(directionCode)
         return try {
-            val buffer = ByteBuffer.wrap(data, 0, length)
-            buffer.order(ByteOrder.BIG_ENDIAN)
+            val buffer = packetView(length)
             
             // Check IP version - first 4 bits
             val firstByte = buffer.get(0).toInt() and 0xFF
@@ -144,7 +266,7 @@ class TunnelManager(
             ruleHandler?.let { ruleHandler ->
                 val isSynPacket = tcpHeader.flags.contains(com.kin.athena.service.vpn.network.transport.tcp.TCPFlag.SYN) && 
                                  !tcpHeader.flags.contains(com.kin.athena.service.vpn.network.transport.tcp.TCPFlag.ACK)
-                val filterResult = filterPacket(tcpHeader, ipHeader, ruleHandler, bypassCheck = !isSynPacket)
+                val filterResult = filterPacket(tcpHeader, ipHeader, ruleHandler, bypassCheck = !isSynPacket, domain = name)
                 
                 val allowed = filterResult.first
                 
@@ -157,7 +279,7 @@ class TunnelManager(
             // For malformed packets (like Data Offset 0), block them for security
             if (e.message?.contains("Malformed TCP packet") == true) {
                 // Log full packet data for debugging
-                val packetHex = data.take(minOf(length, 100)).joinToString(" ") { "%02x".format(it) }
+                val packetHex = (0 until minOf(length, 100)).joinToString(" ") { "%02x".format(packetBuffer.get(it)) }
                 Log.d("PacketFilter", "[$direction] TCP: Blocking malformed packet: ${e.message}")
                 Log.d("PacketFilter", "[$direction] TCP: Full packet hex (first 100 bytes): $packetHex")
                 false // Block malformed packets
@@ -168,10 +290,10 @@ class TunnelManager(
         }
     }
 
-    private fun onUdpPacketReceived(data: ByteArray, length: Int, direction: String): Boolean {
+    private fun onUdpPacketReceived(length: Int, directionCode: Int, name: String?): Boolean {
+        val direction = directionName(directionCode)
         return try {
-            val buffer = ByteBuffer.wrap(data, 0, length)
-            buffer.order(ByteOrder.BIG_ENDIAN)
+            val buffer = packetView(length)
             
             val ipHeader = buffer.toIPv4Header()
             val udpStartPosition = buffer.position()
@@ -192,7 +314,7 @@ class TunnelManager(
                     }
                 } else null
 
-                val filterResult = filterPacket(udpHeader, ipHeader, ruleHandler, dnsModel)
+                val filterResult = filterPacket(udpHeader, ipHeader, ruleHandler, dnsModel, domain = name)
                 val allowed = filterResult.first
                 val firewallResult = filterResult.third
                 
@@ -200,8 +322,8 @@ class TunnelManager(
                 if (isDnsPacket && firewallResult == FirewallResult.DNS_BLOCKED) {
                     try {
                         // Create a buffer with UDP header and data for soarResponse
-                        val udpPacketData = ByteBuffer.wrap(data, udpStartPosition, length - udpStartPosition)
-                        udpPacketData.order(ByteOrder.BIG_ENDIAN)
+                        val udpPacketData = packetView(length)
+                        udpPacketData.position(udpStartPosition)
                         
                         Log.d("PacketFilter", "[$direction] DNS: Creating SOAR response for blocked domain, UDP data size: ${udpPacketData.remaining()}")
                         val soarResponsePayload = soarResponse(udpPacketData, ipHeader)
@@ -212,9 +334,7 @@ class TunnelManager(
                         Log.d("PacketFilter", "[$direction] DNS: Complete response packet created, size: ${completeResponsePacket.size}")
                         
                         // Send complete packet through VPN interface
-                        if (contextPtr != 0L) {
-                            jni_send_complete_packet(contextPtr, completeResponsePacket)
-                        }
+                        injectPackets(listOf(completeResponsePacket))
                         
                         Log.d("PacketFilter", "[$direction] DNS: Sent SOAR response for blocked domain")
                         false // Block original packet
@@ -233,10 +353,22 @@ class TunnelManager(
         }
     }
 
-    private fun onIcmpPacketReceived(data: ByteArray, length: Int, direction: String): Boolean {
+    // Called by native code with the flows opened since its previous call, FLOW_STRIDE ints each,
+    // instead of a packet callback per flow. DNS queries still come one at a time.
+    private fun onFlowsReceived(count: Int, flows: IntArray, names: Array<String?>, verdicts: BooleanArray) {
+        val handler = ruleHandler
+        if (handler == null) {
+            verdicts.fill(true, 0, count)
+            return
+        }
+        val models = List(count) { index -> NativeFlow.toModel(flows, index, names[index]) }
+        handler.handleFlows(models).copyInto(verdicts)
+    }
+
+    private fun onIcmpPacketReceived(length: Int, directionCode: Int): Boolean {
+        val direction = directionName(directionCode)
         return try {
-            val buffer = ByteBuffer.wrap(data, 0, length)
-            buffer.order(ByteOrder.BIG_ENDIAN)
+            val buffer = packetView(length)
             
             val ipHeader = buffer.toIPv4Header()
             val icmpPacket = buffer.slice().toICMPPacket()
@@ -258,6 +390,8 @@ class TunnelManager(
     }
 
     fun release() {
+        // Detach outside of the lock, publishing rules takes the handler lock first
+        ruleHandler?.attachNativeRules(null)
         synchronized(lock) {
             if (!isReleased) {
                 isReleased = true
@@ -283,7 +417,7 @@ class TunnelManager(
 
 
     private external fun jni_init(sdk: Int): Long
-    private external fun jni_start(context: Long, loglevel: Int)
+    private external fun jni_start(context: Long, loglevel: Int, workers: Int)
     private external fun jni_run(context: Long, tun: Int, fwd53: Boolean, rcode: Int)
     private external fun jni_stop(context: Long)
     private external fun jni_done(context: Long)
@@ -291,9 +425,26 @@ class TunnelManager(
     private external fun jni_get_mtu(): Int
     private external fun jni_clear_sessions(context: Long)
     private external fun jni_set_dns_servers(context: Long, dnsV4: String, dnsV6: String)
+    private external fun jni_set_packet_buffer(context: Long, buffer: ByteBuffer)
+    private external fun jni_set_rules(context: Long, rules: IntArray, flags: Int)
+    private external fun jni_set_rule_state(context: Long, state: Int)
+    private external fun jni_invalidate_verdicts(context: Long)
+    private external fun jni_set_domains(context: Long, list: Int, path: String?)
     private external fun jni_send_complete_packet(context: Long, packetData: ByteArray)
+    private external fun jni_get_dns_cache_stats(context: Long): LongArray?
+    private external fun jni_get_traffic_stats(context: Long): LongArray?
+    private external fun jni_get_inject_buffer(context: Long): ByteBuffer?
+    private external fun jni_inject(context: Long, head: Int): Int
 
     companion object {
+        private const val PACKET_BUFFER_SIZE = 65535
+        private const val DIRECTION_TUN_IN = 0
+
+        // Half the cores, the other half is left to the apps generating the traffic.
+        // jni_start clamps this to WORKERS_MAX of the engine.
+        fun defaultWorkers(): Int =
+            (Runtime.getRuntime().availableProcessors() / 2).coerceAtLeast(1)
+
         init {
             System.loadLibrary("athena")
         }
@@ -21,6 +21,7 @@ import android.annotation.SuppressLint
 import android.app.Service
 import android.content.Context
 import android.content.Intent
+import android.net.ConnectivityManager
 import android.os.Binder
 import android.os.Build
 import android.os.IBinder
@@ -112,6 +113,14 @@ class VpnConnectionServer : Service(), CoroutineScope by MainScope(), AppChangeC
         return ruleManager.isDnsBlockingEnabled()
     }
 
+    override fun getTrafficStats(): List<AppTrafficStats> {
+        return activeTunnel?.getTrafficStats() ?: emptyList()
+    }
+
+    override fun getDnsCacheStats(): DnsCacheStats? {
+        return activeTunnel?.getDnsCacheStats()
+    }
+
 
     override fun updateRules(application: Application?) {
         Logger.info("Updating firewall rules${if (application != null) " for ${application.packageID}" else ""}")
@@ -270,7 +279,12 @@ class VpnConnectionServer : Service(), CoroutineScope by MainScope(), AppChangeC
         }
 
         // Initialize TunnelManager with the injected RuleHandler and user's DNS servers
-        tunnelManager = TunnelManager(ruleManager, dnsServerV4, dnsServerV6)
+        tunnelManager = TunnelManager(
+            ruleManager,
+            dnsServerV4,
+            dnsServerV6,
+            appContext.getSystemService(ConnectivityManager::class.java)
+        )
         
         if (!tunnelManager.initialize()) {
             Logger.error("Failed to initialize Tunnel Manager")
@@ -278,6 +292,7 @@ class VpnConnectionServer : Service(), CoroutineScope by MainScope(), AppChangeC
             return
         }
 
+        activeTunnel = tunnelManager
         Logger.info("Tunnel Manager initialized successfully")
     }
 
@@ -307,6 +322,9 @@ class VpnConnectionServer : Service(), CoroutineScope by MainScope(), AppChangeC
         isShuttingDown = true
         netGuardJob?.cancel()
         if (::tunnelManager.isInitialized) {
+            if (activeTunnel === tunnelManager) {
+                activeTunnel = null
+            }
             tunnelManager.stop()
             tunnelManager.release()
         }
@@ -346,6 +364,12 @@ class VpnConnectionServer : Service(), CoroutineScope by MainScope(), AppChangeC
             Logger.warn("Vpn server is not running")
         }
     }
+
+    companion object {
+        // The instance Android runs, the one injected into FirewallManager does not own the tunnel
+        @Volatile
+        private var activeTunnel: TunnelManager? = null
+    }
 }
 
 